@@ -0,0 +1,24 @@
+#ifndef SCALABLE_SERVER_COMPARE_H
+#define SCALABLE_SERVER_COMPARE_H
+
+#include "scenario.h"
+
+#include <stdio.h>
+
+/**
+ * compare_backends
+ * <p>
+ * Run a scenario against every backend library found in a directory and print a table.
+ * For each library, the server is started on the scenario's host and port, given time to
+ * listen, loaded, and stopped with SIGTERM before the next one starts.
+ * </p>
+ * @param scenario the scenario
+ * @param server_path the server executable
+ * @param directory where to look for lib*-server libraries: the directory itself and, for a
+ * build tree, its subdirectories
+ * @param out where to print the table
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int compare_backends(const struct bench_scenario *scenario, const char *server_path, const char *directory, FILE *out);
+
+#endif //SCALABLE_SERVER_COMPARE_H
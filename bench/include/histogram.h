@@ -0,0 +1,75 @@
+#ifndef SCALABLE_SERVER_HISTOGRAM_H
+#define SCALABLE_SERVER_HISTOGRAM_H
+
+#include <stdint.h>
+
+/**
+ * Values below 2^HISTOGRAM_SUB_BUCKET_BITS are counted exactly; above that, each power of two
+ * is split into 2^(HISTOGRAM_SUB_BUCKET_BITS - 1) buckets, so any value is off by less than 1/64.
+ * Values up to 2^HISTOGRAM_MAX_BITS (about 18 minutes in nanoseconds) are counted.
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 7
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_SUB_BUCKETS (1U << (HISTOGRAM_SUB_BUCKET_BITS - 1))
+#define HISTOGRAM_NUM_COUNTS ((1U << HISTOGRAM_SUB_BUCKET_BITS) + \
+                              (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * histogram
+ * <p>
+ * A log-linear histogram in the manner of HdrHistogram: recording is O(1) and the memory
+ * is fixed, whatever the number of values. Each load thread records into its own and they
+ * are merged at the end.
+ * </p>
+ */
+struct histogram
+{
+    uint64_t counts[HISTOGRAM_NUM_COUNTS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+};
+
+/**
+ * histogram_init
+ * <p>
+ * Empty a histogram.
+ * </p>
+ * @param histogram the histogram
+ */
+void histogram_init(struct histogram *histogram);
+
+/**
+ * histogram_record
+ * <p>
+ * Count one value. Values past the range are counted in the last bucket; max stays exact.
+ * </p>
+ * @param histogram the histogram
+ * @param value the value
+ */
+void histogram_record(struct histogram *histogram, uint64_t value);
+
+/**
+ * histogram_merge
+ * <p>
+ * Add the values of one histogram to another.
+ * </p>
+ * @param histogram the histogram to add to
+ * @param other the histogram to add
+ */
+void histogram_merge(struct histogram *histogram, const struct histogram *other);
+
+/**
+ * histogram_quantile
+ * <p>
+ * Get the value at a quantile given as a fraction, e.g. 999/1000 for p99.9: the highest value
+ * that counts the same as it.
+ * </p>
+ * @param histogram the histogram
+ * @param numerator the numerator of the fraction
+ * @param denominator the denominator of the fraction
+ * @return the value, or 0 if the histogram is empty.
+ */
+uint64_t histogram_quantile(const struct histogram *histogram, uint64_t numerator, uint64_t denominator);
+
+#endif //SCALABLE_SERVER_HISTOGRAM_H
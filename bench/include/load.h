@@ -0,0 +1,36 @@
+#ifndef SCALABLE_SERVER_LOAD_H
+#define SCALABLE_SERVER_LOAD_H
+
+#include "histogram.h"
+#include "scenario.h"
+
+/**
+ * bench_result
+ * <p>
+ * What a run measured. Latency is in nanoseconds.
+ * </p>
+ */
+struct bench_result
+{
+    uint64_t         responses;
+    uint64_t         non_2xx;
+    uint64_t         errors; // connections that failed, were reset or sent garbage
+    uint64_t         reconnects; // connections closed by the server as announced, and opened again
+    uint64_t         bytes; // bytes of responses, headers included
+    uint64_t         backlog; // open-loop: requests due but never answered when the run ended
+    double           elapsed; // seconds
+    struct histogram latency;
+};
+
+/**
+ * run_load
+ * <p>
+ * Put the load of a scenario on a running server, with one event loop per thread.
+ * </p>
+ * @param scenario the scenario
+ * @param result filled with the measurements of all threads
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int run_load(const struct bench_scenario *scenario, struct bench_result *result);
+
+#endif //SCALABLE_SERVER_LOAD_H
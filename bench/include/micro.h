@@ -0,0 +1,114 @@
+#ifndef SCALABLE_SERVER_MICRO_H
+#define SCALABLE_SERVER_MICRO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * micro_measure
+ * <p>
+ * What the timed sections of a benchmark added up to. Only the time between micro_begin and
+ * micro_end is measured, so a batch can fill or drain its sockets outside of it.
+ * </p>
+ */
+struct micro_measure
+{
+    uint64_t nanoseconds;
+    uint64_t syscalls;
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t started_ns;
+    uint64_t started_syscalls;
+};
+
+/**
+ * micro_benchmark
+ * <p>
+ * A benchmark: setup runs once, batch runs until enough time was measured, teardown runs once.
+ * Every function gets the same state, which setup may fill in.
+ * </p>
+ */
+struct micro_benchmark
+{
+    const char *name;
+    const void *arg;
+    int (*setup)(void **state, const void *arg);
+    int (*batch)(void *state, const void *arg, struct micro_measure *measure);
+    void (*teardown)(void *state);
+};
+
+/**
+ * micro_syscalls
+ * <p>
+ * Get the number of system calls made so far by the code under test. The calls are counted
+ * by wrappers the linker puts in front of them, as /proc/self/io does not count socket calls.
+ * </p>
+ * @return the number of system calls
+ */
+uint64_t micro_syscalls(void);
+
+/**
+ * micro_begin
+ * <p>
+ * Start a timed section.
+ * </p>
+ * @param measure the measurements
+ */
+void micro_begin(struct micro_measure *measure);
+
+/**
+ * micro_end
+ * <p>
+ * End a timed section.
+ * </p>
+ * @param measure the measurements
+ * @param ops the operations done in the section
+ * @param bytes the bytes those operations moved
+ */
+void micro_end(struct micro_measure *measure, uint64_t ops, uint64_t bytes);
+
+/**
+ * micro_run
+ * <p>
+ * Run a benchmark for at least <min_ns> nanoseconds of measured time.
+ * </p>
+ * @param benchmark the benchmark
+ * @param min_ns the measured time to reach
+ * @param measure filled with the measurements
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int micro_run(const struct micro_benchmark *benchmark, uint64_t min_ns, struct micro_measure *measure);
+
+/**
+ * micro_print_begin
+ * <p>
+ * Start the JSON report.
+ * </p>
+ * @param out where to print
+ * @param implementation the delimiter scanning implementation in use
+ */
+void micro_print_begin(FILE *out, const char *implementation);
+
+/**
+ * micro_print_result
+ * <p>
+ * Add a benchmark to the JSON report, per operation.
+ * </p>
+ * @param out where to print
+ * @param name the name of the benchmark
+ * @param measure the measurements
+ * @param first whether it is the first benchmark of the report
+ */
+void micro_print_result(FILE *out, const char *name, const struct micro_measure *measure, bool first);
+
+/**
+ * micro_print_end
+ * <p>
+ * End the JSON report.
+ * </p>
+ * @param out where to print
+ */
+void micro_print_end(FILE *out);
+
+#endif //SCALABLE_SERVER_MICRO_H
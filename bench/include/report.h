@@ -0,0 +1,38 @@
+#ifndef SCALABLE_SERVER_REPORT_H
+#define SCALABLE_SERVER_REPORT_H
+
+#include "load.h"
+
+#include <stdio.h>
+
+/**
+ * print_result
+ * <p>
+ * Print the measurements of one run.
+ * </p>
+ * @param out where to print
+ * @param result the measurements
+ */
+void print_result(FILE *out, const struct bench_result *result);
+
+/**
+ * print_table_header
+ * <p>
+ * Print the header of a comparison table.
+ * </p>
+ * @param out where to print
+ */
+void print_table_header(FILE *out);
+
+/**
+ * print_table_row
+ * <p>
+ * Print the measurements of one run as a row of a comparison table.
+ * </p>
+ * @param out where to print
+ * @param name the name of the row
+ * @param result the measurements
+ */
+void print_table_row(FILE *out, const char *name, const struct bench_result *result);
+
+#endif //SCALABLE_SERVER_REPORT_H
@@ -0,0 +1,96 @@
+#ifndef SCALABLE_SERVER_SCENARIO_H
+#define SCALABLE_SERVER_SCENARIO_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * bench_request
+ * <p>
+ * A ready-made request of the URI mix, and how often it is picked.
+ * </p>
+ */
+struct bench_request
+{
+    char     *text;
+    size_t   length;
+    uint64_t cumulative_weight; // sum of the weights up to and including this one
+};
+
+/**
+ * bench_scenario
+ * <p>
+ * What load to put on the server. With rate 0 the load is closed-loop: every connection keeps
+ * pipeline_depth requests in flight. Otherwise it is open-loop: requests are due at a fixed
+ * rate whether or not the server keeps up, and latency is measured from when a request was
+ * due, not from when it was sent, so a stalled server is not hidden by a stalled client.
+ * </p>
+ * <p>
+ * A slow client sends slow_bytes of its requests every slow_interval_ms; 0 sends at once.
+ * </p>
+ */
+struct bench_scenario
+{
+    const char           *host;
+    in_port_t            port;
+    uint32_t             threads;
+    uint32_t             connections;
+    uint32_t             duration; // seconds
+    uint32_t             rate; // requests per second, 0 for closed-loop
+    bool                 keep_alive;
+    uint32_t             pipeline_depth;
+    uint32_t             slow_bytes;
+    uint32_t             slow_interval_ms;
+    struct bench_request *requests;
+    size_t               num_requests;
+    size_t               max_request_length;
+};
+
+/**
+ * scenario_add_uri
+ * <p>
+ * Add a URI to the mix. The request text follows the keep_alive and host of the scenario,
+ * so set those first.
+ * </p>
+ * @param scenario the scenario
+ * @param uri the request URI
+ * @param weight how often it is picked relative to the others
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int scenario_add_uri(struct bench_scenario *scenario, const char *uri, uint64_t weight);
+
+/**
+ * scenario_load_uris
+ * <p>
+ * Add the URIs of a file to the mix. Each line is a URI, optionally preceded by a weight
+ * ("5 /index.html"); blank lines and lines starting with # are skipped.
+ * </p>
+ * @param scenario the scenario
+ * @param file_name the file
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int scenario_load_uris(struct bench_scenario *scenario, const char *file_name);
+
+/**
+ * scenario_pick
+ * <p>
+ * Pick a request of the mix.
+ * </p>
+ * @param scenario the scenario
+ * @param random a random number
+ * @return the index of the request.
+ */
+size_t scenario_pick(const struct bench_scenario *scenario, uint64_t random);
+
+/**
+ * scenario_destroy
+ * <p>
+ * Free the URI mix.
+ * </p>
+ * @param scenario the scenario
+ */
+void scenario_destroy(struct bench_scenario *scenario);
+
+#endif //SCALABLE_SERVER_SCENARIO_H
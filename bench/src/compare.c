@@ -0,0 +1,263 @@
+#include "compare.h"
+#include "load.h"
+#include "report.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#define LIB_SUFFIX "-server.dylib"
+#else
+#define LIB_SUFFIX "-server.so"
+#endif
+
+#define MAX_BACKENDS 32
+#define STARTUP_ATTEMPTS 100 // tries to connect, 50 ms apart
+#define STARTUP_DELAY_NS 50000000L
+#define SHUTDOWN_ATTEMPTS 100 // checks for exit after SIGTERM, 50 ms apart
+
+/**
+ * find_backends
+ * <p>
+ * Collect the paths of the backend libraries in a directory and its subdirectories, sorted.
+ * </p>
+ * @param directory the directory
+ * @param paths filled with allocated paths
+ * @return the number of paths.
+ */
+static size_t find_backends(const char *directory, char *paths[MAX_BACKENDS]);
+
+/**
+ * scan_directory
+ * <p>
+ * Add the backend libraries of one directory.
+ * </p>
+ * @param directory the directory
+ * @param depth how many levels of subdirectories to look in
+ * @param paths the paths found so far
+ * @param count the number of paths found so far
+ * @return the new number of paths.
+ */
+static size_t scan_directory(const char *directory, int depth, char *paths[MAX_BACKENDS], size_t count);
+
+/**
+ * start_server
+ * <p>
+ * Start the server with a library, its output discarded, and wait until it accepts connections.
+ * </p>
+ * @param scenario the scenario, for the address
+ * @param server_path the server executable
+ * @param library the library
+ * @return the pid of the server. -1 on failure.
+ */
+static pid_t start_server(const struct bench_scenario *scenario, const char *server_path, const char *library);
+
+/**
+ * stop_server
+ * <p>
+ * Stop the server with SIGTERM, or SIGKILL if it does not exit in time.
+ * </p>
+ * @param pid the pid of the server
+ */
+static void stop_server(pid_t pid);
+
+/**
+ * compare_names
+ * <p>
+ * qsort comparison of two paths.
+ * </p>
+ */
+static int compare_names(const void *a, const void *b);
+
+int compare_backends(const struct bench_scenario *scenario, const char *server_path, const char *directory, FILE *out)
+{
+    char   *paths[MAX_BACKENDS];
+    size_t count;
+
+    count = find_backends(directory, paths);
+    if (count == 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    print_table_header(out);
+    for (size_t i = 0; i < count; i++)
+    {
+        struct bench_result *result;
+        const char          *name;
+        pid_t               pid;
+
+        name = strrchr(paths[i], '/');
+        name = name ? name + 1 : paths[i];
+
+        result = malloc(sizeof(struct bench_result));
+        pid    = result ? start_server(scenario, server_path, paths[i]) : -1;
+        if (pid == -1)
+        {
+            (void) fprintf(out, "%-24s did not start\n", name);
+        }
+        else
+        {
+            if (run_load(scenario, result) == -1)
+            {
+                (void) fprintf(out, "%-24s load failed: %s\n", name, strerror(errno));
+            }
+            else
+            {
+                print_table_row(out, name, result);
+            }
+            stop_server(pid);
+        }
+        free(result);
+        free(paths[i]);
+    }
+
+    return 0;
+}
+
+static size_t find_backends(const char *directory, char *paths[MAX_BACKENDS])
+{
+    size_t count;
+
+    count = scan_directory(directory, 1, paths, 0);
+    qsort(paths, count, sizeof(char *), compare_names);
+
+    return count;
+}
+
+static size_t scan_directory(const char *directory, int depth, char *paths[MAX_BACKENDS], size_t count)
+{
+    DIR           *dir;
+    struct dirent *entry;
+
+    dir = opendir(directory);
+    if (!dir)
+    {
+        return count;
+    }
+    while ((entry = readdir(dir)) != NULL && count < MAX_BACKENDS)
+    {
+        char        path[PATH_MAX];
+        struct stat path_stat;
+        size_t      length = strlen(entry->d_name);
+
+        if (entry->d_name[0] == '.' ||
+            snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name) >= (int) sizeof(path) ||
+            stat(path, &path_stat) == -1)
+        {
+            continue;
+        }
+        if (S_ISDIR(path_stat.st_mode))
+        {
+            if (depth > 0)
+            {
+                count = scan_directory(path, depth - 1, paths, count);
+            }
+        }
+        else if (strncmp(entry->d_name, "lib", 3) == 0 && length > sizeof(LIB_SUFFIX) - 1 &&
+                 strcmp(entry->d_name + length - (sizeof(LIB_SUFFIX) - 1), LIB_SUFFIX) == 0)
+        {
+            paths[count] = strdup(path);
+            if (paths[count])
+            {
+                count++;
+            }
+        }
+    }
+    (void) closedir(dir);
+
+    return count;
+}
+
+static pid_t start_server(const struct bench_scenario *scenario, const char *server_path, const char *library)
+{
+    struct sockaddr_in addr;
+    char               port[8];
+    pid_t              pid;
+
+    (void) snprintf(port, sizeof(port), "%u", (unsigned) scenario->port);
+    pid = fork();
+    if (pid == -1)
+    {
+        return -1;
+    }
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1)
+        {
+            (void) dup2(null_fd, STDOUT_FILENO);
+            (void) dup2(null_fd, STDERR_FILENO);
+        }
+        execl(server_path, server_path, "-l", library, "-p", port, "-i", scenario->host, (char *) NULL);
+        _exit(127);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(scenario->port);
+    if (inet_pton(AF_INET, scenario->host, &addr.sin_addr) != 1)
+    {
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    for (int attempt = 0; attempt < STARTUP_ATTEMPTS; attempt++)
+    {
+        struct timespec delay = {0, STARTUP_DELAY_NS};
+        int             fd;
+        int             connected;
+
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+        {
+            return -1;
+        }
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1)
+        {
+            break;
+        }
+        connected = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+        (void) close(fd);
+        if (connected == 0)
+        {
+            return pid;
+        }
+        (void) nanosleep(&delay, NULL);
+    }
+
+    stop_server(pid);
+    return -1;
+}
+
+static void stop_server(pid_t pid)
+{
+    (void) kill(pid, SIGTERM);
+    for (int attempt = 0; attempt < SHUTDOWN_ATTEMPTS; attempt++)
+    {
+        struct timespec delay = {0, STARTUP_DELAY_NS};
+
+        if (waitpid(pid, NULL, WNOHANG) != 0)
+        {
+            return;
+        }
+        (void) nanosleep(&delay, NULL);
+    }
+    (void) kill(pid, SIGKILL);
+    (void) waitpid(pid, NULL, 0);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
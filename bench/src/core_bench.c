@@ -0,0 +1,937 @@
+#include "micro.h"
+
+#include <core-lib/arena.h>
+#include <core-lib/output_queue.h>
+#include <core-lib/receiver.h>
+#include <core-lib/scan.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <http/file_cache.h>
+#include <http/request.h>
+#include <http/response.h>
+#include <mem_manager/manager.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define NS_PER_MS 1000000ULL
+#define DEFAULT_MIN_MS 500
+
+// Bytes queued in a socket ahead of a timed section; well under the default socket buffer
+#define BATCH_BYTES 32768
+
+// Operations per timed section when the operations do not read, so nothing has to be queued
+#define BATCH_OPS 256
+
+// Enough to keep every file of the serve_file benchmarks cached
+#define FILE_CACHE_BYTES (64 * 1024 * 1024)
+
+#define LONG_URI_LENGTH 8000
+#define PIPELINE_DEPTH 16
+
+// The files of the serve_file benchmarks, each served with the file cache on and off
+#define NUM_FILE_SIZES 4
+
+/**
+ * request_corpus
+ * <p>
+ * Request heads sent <per_send> at a time, as one read of the server would see them.
+ * </p>
+ */
+struct request_corpus
+{
+    const char *text;
+    size_t length;
+    uint32_t per_send;
+    bool malformed;
+};
+
+/**
+ * receiver_state
+ * <p>
+ * A receiver reading fixed-length messages, or newline terminated lines, from a socket pair.
+ * </p>
+ */
+struct receiver_state
+{
+    int fds[2];
+    uint32_t messages;
+    size_t length;
+    struct receiver receiver;
+    char batch[BATCH_BYTES];
+    char out[BATCH_BYTES];
+};
+
+/**
+ * request_state
+ * <p>
+ * A connection parsing requests from a non-blocking socket pair.
+ * </p>
+ */
+struct request_state
+{
+    int fds[2];
+    struct http_connection conn;
+    struct http_request req;
+    char batch[BATCH_BYTES];
+    size_t length;
+};
+
+/**
+ * response_state
+ * <p>
+ * A response builder writing into a socket pair, the other end of which a child process drains,
+ * with the output queue it spills into.
+ * </p>
+ */
+struct response_state
+{
+    int fd;
+    pid_t drain;
+    struct memory_manager *mm;
+    struct arena_pool pool;
+    struct output_queue out;
+    struct response_builder res;
+    struct http_request req;
+};
+
+/**
+ * response_kind
+ * <p>
+ * The responses of the response writer benchmarks.
+ * </p>
+ */
+enum response_kind
+{
+    RESPONSE_KIND_CANNED,
+    RESPONSE_KIND_HEADERS,
+    RESPONSE_KIND_PIPELINED,
+};
+
+/**
+ * file_arg
+ * <p>
+ * A file of the serve_file benchmarks.
+ * </p>
+ */
+struct file_arg
+{
+    const char *uri;
+    size_t size;
+    bool cached;
+};
+
+/**
+ * usage
+ * <p>
+ * Print how to run the benchmarks.
+ * </p>
+ * @param program the name of the program
+ */
+static void usage(const char *program);
+
+/**
+ * receiver_setup
+ * <p>
+ * Set up a receiver benchmark. The arg is a message length; 0 reads lines.
+ * </p>
+ * @param state filled with the state
+ * @param arg the message length
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+static int receiver_setup(void **state, const void *arg);
+
+/**
+ * receiver_batch
+ * <p>
+ * Queue a batch of messages and time reading them with the receiver.
+ * </p>
+ * @param state the state
+ * @param arg the message length
+ * @param measure the measurements
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+static int receiver_batch(void *state, const void *arg, struct micro_measure *measure);
+
+/**
+ * request_setup
+ * <p>
+ * Set up a request parser benchmark.
+ * </p>
+ * @param state filled with the state
+ * @param arg the corpus
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+static int request_setup(void **state, const void *arg);
+
+/**
+ * request_batch
+ * <p>
+ * Time parsing requests until the socket is empty, one send at a time.
+ * </p>
+ * @param state the state
+ * @param arg the corpus
+ * @param measure the measurements
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+static int request_batch(void *state, const void *arg, struct micro_measure *measure);
+
+/**
+ * response_setup
+ * <p>
+ * Set up a response writer or serve_file benchmark.
+ * </p>
+ * @param state filled with the state
+ * @param arg the response kind or the file
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+static int response_setup(void **state, const void *arg);
+
+/**
+ * response_batch
+ * <p>
+ * Time writing responses with the response builder.
+ * </p>
+ * @param state the state
+ * @param arg the response kind
+ * @param measure the measurements
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+static int response_batch(void *state, const void *arg, struct micro_measure *measure);
+
+/**
+ * flush_response
+ * <p>
+ * Flush a response builder, then send whatever it left in the output queue.
+ * </p>
+ * @param response the state
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+static int flush_response(struct response_state *response);
+
+/**
+ * file_setup
+ * <p>
+ * Set up a serve_file benchmark, with the file cache on or off.
+ * </p>
+ * @param state filled with the state
+ * @param arg the file
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+static int file_setup(void **state, const void *arg);
+
+/**
+ * file_batch
+ * <p>
+ * Time serving a file.
+ * </p>
+ * @param state the state
+ * @param arg the file
+ * @param measure the measurements
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+static int file_batch(void *state, const void *arg, struct micro_measure *measure);
+
+/**
+ * socket_teardown
+ * <p>
+ * Close the socket pair of a receiver or request parser benchmark and free the state.
+ * </p>
+ * @param state the state, starting with the socket pair
+ */
+static void socket_teardown(void *state);
+
+/**
+ * response_teardown
+ * <p>
+ * Close the socket, wait for the drain process and free the state and its output queue.
+ * </p>
+ * @param state the state
+ */
+static void response_teardown(void *state);
+
+/**
+ * file_teardown
+ * <p>
+ * Empty the file cache and tear down the response state.
+ * </p>
+ * @param state the state
+ */
+static void file_teardown(void *state);
+
+/**
+ * send_all
+ * <p>
+ * Write a whole buffer to a socket.
+ * </p>
+ * @param fd the socket
+ * @param data the buffer
+ * @param length the length of the buffer
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+static int send_all(int fd, const char *data, size_t length);
+
+/**
+ * queued_bytes
+ * <p>
+ * Get the number of bytes a response builder has queued.
+ * </p>
+ * @param res the response builder
+ * @return the number of bytes
+ */
+static size_t queued_bytes(const struct response_builder *res);
+
+/**
+ * make_docroot
+ * <p>
+ * Create a temporary directory holding the files of the serve_file benchmarks and move into it.
+ * </p>
+ * @param files_to_make the files
+ * @param num_files the number of files
+ * @param path filled with the path of the directory
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+static int make_docroot(const struct file_arg *files_to_make, size_t num_files, char *path);
+
+/**
+ * remove_docroot
+ * <p>
+ * Remove the directory made by make_docroot.
+ * </p>
+ * @param files_to_remove the files
+ * @param num_files the number of files
+ * @param path the path of the directory
+ */
+static void remove_docroot(const struct file_arg *files_to_remove, size_t num_files, const char *path);
+
+static const char short_request[] = "GET /index.html HTTP/1.1\r\n"
+                                    "Host: localhost:8080\r\n"
+                                    "User-Agent: core-bench\r\n"
+                                    "Accept: */*\r\n"
+                                    "\r\n";
+
+static const char browser_request[] = "GET /css/site.css?v=3 HTTP/1.1\r\n"
+                                      "Host: www.example.com\r\n"
+                                      "Connection: keep-alive\r\n"
+                                      "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:124.0) Gecko/20100101 Firefox/124.0\r\n"
+                                      "Accept: text/css,*/*;q=0.1\r\n"
+                                      "Accept-Language: en-CA,en;q=0.5\r\n"
+                                      "Accept-Encoding: gzip, deflate, br\r\n"
+                                      "Referer: https://www.example.com/index.html\r\n"
+                                      "If-Modified-Since: Tue, 02 Apr 2024 17:21:05 GMT\r\n"
+                                      "Sec-Fetch-Dest: style\r\n"
+                                      "Sec-Fetch-Mode: no-cors\r\n"
+                                      "Sec-Fetch-Site: same-origin\r\n"
+                                      "\r\n";
+
+static const char long_request_tail[] = " HTTP/1.1\r\n"
+                                        "Host: localhost:8080\r\n"
+                                        "\r\n";
+
+static const char malformed_request[] = "GET /index.html HTTP/2.0\r\n"
+                                        "Host: localhost:8080\r\n"
+                                        "\r\n";
+
+static const char headers_body[] = "<html><body><p>Hello from core-bench</p></body></html>\n";
+
+static const struct file_arg files[] = {
+        {"/file-1k",   1024,            true},
+        {"/file-16k",  16 * 1024,       true},
+        {"/file-256k", 256 * 1024,      true},
+        {"/file-4m",   4 * 1024 * 1024, true},
+        {"/file-1k",   1024,            false},
+        {"/file-16k",  16 * 1024,       false},
+        {"/file-256k", 256 * 1024,      false},
+        {"/file-4m",   4 * 1024 * 1024, false},
+};
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] = {
+            {"filter", required_argument, NULL, 'f'},
+            {"min-ms", required_argument, NULL, 'm'},
+            {"help",   no_argument,       NULL, 'h'},
+            {NULL, 0,                     NULL, 0},
+    };
+    static const uint32_t message_lengths[] = {64, 1024, 4096, 0};
+    static const enum response_kind response_kinds[] = {
+            RESPONSE_KIND_CANNED, RESPONSE_KIND_HEADERS, RESPONSE_KIND_PIPELINED
+    };
+    struct request_corpus corpora[5];
+    struct micro_benchmark benchmarks[32];
+    struct micro_measure measure;
+    size_t num_benchmarks;
+    char *long_request;
+    char *pipelined_request;
+    char docroot[sizeof("/tmp/core-bench-XXXXXX")];
+    const char *filter;
+    unsigned long min_ms;
+    int option;
+    int ret_val;
+    bool first;
+
+    filter = NULL;
+    min_ms = DEFAULT_MIN_MS;
+    while ((option = getopt_long(argc, argv, "f:m:h", options, NULL)) != -1)
+    {
+        switch (option)
+        {
+            case 'f':
+                filter = optarg;
+                break;
+            case 'm':
+                min_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    // The drain processes may exit first
+    signal(SIGPIPE, SIG_IGN);
+
+    long_request      = malloc(sizeof("GET ") - 1 + LONG_URI_LENGTH + sizeof(long_request_tail));
+    pipelined_request = malloc(PIPELINE_DEPTH * (sizeof(short_request) - 1));
+    if (!long_request || !pipelined_request)
+    {
+        (void) fprintf(stderr, "Could not allocate the corpus: %s\n", strerror(errno));
+        free(long_request);
+        free(pipelined_request);
+        return EXIT_FAILURE;
+    }
+    memcpy(long_request, "GET /", sizeof("GET /") - 1);
+    memset(long_request + sizeof("GET /") - 1, 'a', LONG_URI_LENGTH - 1);
+    memcpy(long_request + sizeof("GET ") - 1 + LONG_URI_LENGTH, long_request_tail, sizeof(long_request_tail));
+    for (size_t i = 0; i < PIPELINE_DEPTH; i++)
+    {
+        memcpy(pipelined_request + i * (sizeof(short_request) - 1), short_request, sizeof(short_request) - 1);
+    }
+    corpora[0] = (struct request_corpus) {short_request, sizeof(short_request) - 1, 1, false};
+    corpora[1] = (struct request_corpus) {browser_request, sizeof(browser_request) - 1, 1, false};
+    corpora[2] = (struct request_corpus) {long_request, strlen(long_request), 1, false};
+    corpora[3] = (struct request_corpus) {pipelined_request, PIPELINE_DEPTH * (sizeof(short_request) - 1),
+                                          PIPELINE_DEPTH, false};
+    corpora[4] = (struct request_corpus) {malformed_request, sizeof(malformed_request) - 1, 1, true};
+
+    num_benchmarks = 0;
+    benchmarks[num_benchmarks++] = (struct micro_benchmark) {"receiver_read/64", &message_lengths[0],
+                                                             receiver_setup, receiver_batch, socket_teardown};
+    benchmarks[num_benchmarks++] = (struct micro_benchmark) {"receiver_read/1024", &message_lengths[1],
+                                                             receiver_setup, receiver_batch, socket_teardown};
+    benchmarks[num_benchmarks++] = (struct micro_benchmark) {"receiver_read/4096", &message_lengths[2],
+                                                             receiver_setup, receiver_batch, socket_teardown};
+    benchmarks[num_benchmarks++] = (struct micro_benchmark) {"receiver_read_until/line", &message_lengths[3],
+                                                             receiver_setup, receiver_batch, socket_teardown};
+    benchmarks[num_benchmarks++] = (struct micro_benchmark) {"read_request/short", &corpora[0],
+                                                             request_setup, request_batch, socket_teardown};
+    benchmarks[num_benchmarks++] = (struct micro_benchmark) {"read_request/browser", &corpora[1],
+                                                             request_setup, request_batch, socket_teardown};
+    benchmarks[num_benchmarks++] = (struct micro_benchmark) {"read_request/long_uri", &corpora[2],
+                                                             request_setup, request_batch, socket_teardown};
+    benchmarks[num_benchmarks++] = (struct micro_benchmark) {"read_request/pipelined", &corpora[3],
+                                                             request_setup, request_batch, socket_teardown};
+    benchmarks[num_benchmarks++] = (struct micro_benchmark) {"read_request/malformed", &corpora[4],
+                                                             request_setup, request_batch, socket_teardown};
+    benchmarks[num_benchmarks++] = (struct micro_benchmark) {"response/canned", &response_kinds[0],
+                                                             response_setup, response_batch, response_teardown};
+    benchmarks[num_benchmarks++] = (struct micro_benchmark) {"response/headers", &response_kinds[1],
+                                                             response_setup, response_batch, response_teardown};
+    benchmarks[num_benchmarks++] = (struct micro_benchmark) {"response/pipelined", &response_kinds[2],
+                                                             response_setup, response_batch, response_teardown};
+    for (const struct file_arg *file = files; file < files + sizeof(files) / sizeof(files[0]); file++)
+    {
+        static char names[sizeof(files) / sizeof(files[0])][sizeof("serve_file/uncached/file-256k")];
+
+        (void) snprintf(names[file - files], sizeof(names[0]), "serve_file/%s%s", file->cached ? "cached" : "uncached",
+                        file->uri);
+        benchmarks[num_benchmarks++] = (struct micro_benchmark) {names[file - files], file, file_setup, file_batch,
+                                                                 file_teardown};
+    }
+
+    if (make_docroot(files, NUM_FILE_SIZES, docroot) == -1)
+    {
+        (void) fprintf(stderr, "Could not create the files to serve: %s\n", strerror(errno));
+        free(long_request);
+        free(pipelined_request);
+        return EXIT_FAILURE;
+    }
+
+    ret_val = EXIT_SUCCESS;
+    first   = true;
+    micro_print_begin(stdout, scan_implementation());
+    for (size_t i = 0; i < num_benchmarks; i++)
+    {
+        if (filter && !strstr(benchmarks[i].name, filter))
+        {
+            continue;
+        }
+        if (micro_run(&benchmarks[i], min_ms * NS_PER_MS, &measure) == -1)
+        {
+            (void) fprintf(stderr, "%s failed: %s\n", benchmarks[i].name, strerror(errno));
+            ret_val = EXIT_FAILURE;
+            continue;
+        }
+        micro_print_result(stdout, benchmarks[i].name, &measure, first);
+        (void) fflush(stdout);
+        first = false;
+    }
+    micro_print_end(stdout);
+
+    remove_docroot(files, NUM_FILE_SIZES, docroot);
+    free(long_request);
+    free(pipelined_request);
+    return ret_val;
+}
+
+static void usage(const char *program)
+{
+    (void) printf("Usage: %s [options]\n"
+                  "  -f, --filter TEXT    only run the benchmarks whose name contains TEXT\n"
+                  "  -m, --min-ms N       measure each benchmark for at least N milliseconds (default %d)\n"
+                  "Prints ns/op, bytes/op and syscalls/op of each benchmark as JSON.\n",
+                  program, DEFAULT_MIN_MS);
+}
+
+static int receiver_setup(void **state, const void *arg)
+{
+    struct receiver_state *receiver;
+    uint32_t length;
+
+    length   = *(const uint32_t *) arg;
+    receiver = malloc(sizeof(struct receiver_state));
+    if (!receiver)
+    {
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, receiver->fds) == -1)
+    {
+        free(receiver);
+        return -1;
+    }
+    receiver_init(&receiver->receiver, receiver->fds[0]);
+
+    if (length)
+    {
+        receiver->length = length;
+        for (size_t i = 0; i < sizeof(receiver->batch); i++)
+        {
+            receiver->batch[i] = (char) ('a' + i % 26);
+        }
+    }
+    else
+    {
+        // Lines of a chunked body or a header block, 48 bytes with the newline
+        receiver->length = 48;
+        for (size_t i = 0; i < sizeof(receiver->batch); i++)
+        {
+            receiver->batch[i] = i % receiver->length == receiver->length - 1 ? '\n' : (char) ('a' + i % 26);
+        }
+    }
+    receiver->messages = (uint32_t) (sizeof(receiver->batch) / receiver->length);
+    *state = receiver;
+
+    return 0;
+}
+
+static int receiver_batch(void *state, const void *arg, struct micro_measure *measure)
+{
+    struct receiver_state *receiver;
+    bool until;
+
+    receiver = state;
+    until    = *(const uint32_t *) arg == 0;
+    if (send_all(receiver->fds[1], receiver->batch, receiver->messages * receiver->length) == -1)
+    {
+        return -1;
+    }
+
+    micro_begin(measure);
+    for (uint32_t i = 0; i < receiver->messages; i++)
+    {
+        enum read_fully_result result;
+
+        if (until)
+        {
+            uint32_t size = sizeof(receiver->out);
+
+            // The newline stays buffered, so it is read on its own
+            result = receiver_read_until(&receiver->receiver, receiver->out, &size, '\n');
+            if (result == READ_FULLY_SUCCESS)
+            {
+                result = receiver_read(&receiver->receiver, receiver->out + size, 1);
+            }
+        }
+        else
+        {
+            result = receiver_read(&receiver->receiver, receiver->out, (uint32_t) receiver->length);
+        }
+        if (result != READ_FULLY_SUCCESS)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+    }
+    micro_end(measure, receiver->messages, receiver->messages * receiver->length);
+
+    return 0;
+}
+
+static int request_setup(void **state, const void *arg)
+{
+    const struct request_corpus *corpus;
+    struct request_state *request;
+
+    corpus  = arg;
+    request = malloc(sizeof(struct request_state));
+    if (!request)
+    {
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, request->fds) == -1)
+    {
+        free(request);
+        return -1;
+    }
+    // read_request stops when the socket is empty, as it would on a pollin event
+    if (fcntl(request->fds[0], F_SETFL, O_NONBLOCK) == -1)
+    {
+        socket_teardown(request);
+        return -1;
+    }
+    http_connection_init(&request->conn);
+
+    memcpy(request->batch, corpus->text, corpus->length);
+    request->length = corpus->length;
+    *state = request;
+
+    return 0;
+}
+
+static int request_batch(void *state, const void *arg, struct micro_measure *measure)
+{
+    const struct request_corpus *corpus;
+    struct request_state *request;
+
+    corpus  = arg;
+    request = state;
+    for (size_t sends = 0; sends < BATCH_BYTES / request->length + 1; sends++)
+    {
+        enum read_request_result result;
+        uint32_t parsed;
+
+        if (send_all(request->fds[1], request->batch, request->length) == -1)
+        {
+            return -1;
+        }
+
+        parsed = 0;
+        micro_begin(measure);
+        while ((result = read_request(request->fds[0], &request->conn, &request->req)) != READ_REQUEST_NEED_MORE)
+        {
+            if (result != (corpus->malformed ? READ_REQUEST_BAD_REQUEST : READ_REQUEST_SUCCESS))
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            parsed++;
+        }
+        micro_end(measure, parsed, request->length);
+
+        if (parsed != corpus->per_send)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        if (corpus->malformed)
+        {
+            // The server closes the connection after a bad request
+            http_connection_init(&request->conn);
+        }
+    }
+
+    return 0;
+}
+
+static int response_setup(void **state, const void *arg)
+{
+    struct response_state *response;
+    int fds[2];
+
+    (void) arg;
+    response = malloc(sizeof(struct response_state));
+    if (!response)
+    {
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    {
+        free(response);
+        return -1;
+    }
+
+    // A process of its own drains the responses, so its reads are not counted
+    response->drain = fork();
+    if (response->drain == -1)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        free(response);
+        return -1;
+    }
+    if (response->drain == 0)
+    {
+        static char sink[BATCH_BYTES];
+
+        close(fds[0]);
+        while (read(fds[1], sink, sizeof(sink)) > 0)
+        {
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    close(fds[1]);
+    response->fd = fds[0];
+
+    response->mm = init_mem_manager();
+    if (!response->mm || arena_pool_init(&response->pool, response->mm) == -1)
+    {
+        if (response->mm)
+        {
+            free_mem_manager(response->mm);
+        }
+        // The drain process reads EOF and exits
+        close(response->fd);
+        waitpid(response->drain, NULL, 0);
+        free(response);
+        return -1;
+    }
+    output_queue_init(&response->out, &response->pool);
+    *state = response;
+
+    return 0;
+}
+
+static int response_batch(void *state, const void *arg, struct micro_measure *measure)
+{
+    struct response_state *response;
+    enum response_kind kind;
+    size_t bytes;
+
+    response = state;
+    kind     = *(const enum response_kind *) arg;
+    bytes    = 0;
+
+    micro_begin(measure);
+    for (uint32_t i = 0; i < BATCH_OPS; i++)
+    {
+        if (i % PIPELINE_DEPTH == 0 || kind != RESPONSE_KIND_PIPELINED)
+        {
+            response_init(&response->res, response->fd, &response->out);
+        }
+        if (kind == RESPONSE_KIND_CANNED)
+        {
+            response_canned(&response->res, RESPONSE_RESULT_NOT_FOUND, true);
+        }
+        else
+        {
+            response_status(&response->res, RESPONSE_RESULT_SUCCESS);
+            response_header(&response->res, "Content-Type", "%s", "text/html");
+            response_end_headers(&response->res, sizeof(headers_body) - 1, true);
+            response_append(&response->res, headers_body, sizeof(headers_body) - 1);
+        }
+        if (i % PIPELINE_DEPTH == PIPELINE_DEPTH - 1 || kind != RESPONSE_KIND_PIPELINED)
+        {
+            bytes += queued_bytes(&response->res);
+            if (flush_response(response) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    micro_end(measure, BATCH_OPS, bytes);
+
+    return 0;
+}
+
+static int flush_response(struct response_state *response)
+{
+    bool flushed = response_flush(&response->res);
+
+    // The socket blocks, so each send leaves the queue empty unless it fails
+    while (flushed && !output_queue_empty(&response->out))
+    {
+        size_t sent;
+
+        flushed = output_queue_send(&response->out, response->fd, &sent) == 0;
+    }
+
+    return flushed ? 0 : -1;
+}
+
+static int file_setup(void **state, const void *arg)
+{
+    const struct file_arg *file;
+    struct response_state *response;
+
+    file = arg;
+    if (file_cache_init(file->cached ? FILE_CACHE_BYTES : 0) == -1 || response_setup(state, arg) == -1)
+    {
+        return -1;
+    }
+
+    response = *state;
+    memset(&response->req, 0, sizeof(response->req));
+    response->req.method     = HTTP_METHOD_GET;
+    response->req.version    = HTTP_VERSION_1_1;
+    response->req.keep_alive = true;
+    response->req.uri        = (struct http_string) {file->uri, (uint32_t) strlen(file->uri)};
+
+    return 0;
+}
+
+static int file_batch(void *state, const void *arg, struct micro_measure *measure)
+{
+    const struct file_arg *file;
+    struct response_state *response;
+    uint32_t ops;
+
+    file     = arg;
+    response = state;
+    ops      = (uint32_t) (BATCH_BYTES / file->size + 1);
+
+    micro_begin(measure);
+    for (uint32_t i = 0; i < ops; i++)
+    {
+        bool served;
+
+        response_init(&response->res, response->fd, &response->out);
+        served = serve_file(&response->req, &response->res);
+        // Flushed even after a failure, to release the cache entry
+        if (flush_response(response) == -1 || !served)
+        {
+            return -1;
+        }
+    }
+    micro_end(measure, ops, ops * file->size);
+
+    return 0;
+}
+
+static void socket_teardown(void *state)
+{
+    int *fds = state;
+
+    close(fds[0]);
+    close(fds[1]);
+    free(state);
+}
+
+static void response_teardown(void *state)
+{
+    struct response_state *response = state;
+
+    output_queue_clear(&response->out);
+    arena_pool_destroy(&response->pool);
+    free_mem_manager(response->mm);
+    close(response->fd);
+    waitpid(response->drain, NULL, 0);
+    free(response);
+}
+
+static void file_teardown(void *state)
+{
+    file_cache_destroy();
+    response_teardown(state);
+}
+
+static int send_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        length -= (size_t) sent;
+    }
+
+    return 0;
+}
+
+static size_t queued_bytes(const struct response_builder *res)
+{
+    size_t bytes = res->headers_length - res->text_start;
+
+    // Headers formatted since the last append have no iovec yet
+    for (int i = 0; i < res->iov_count; i++)
+    {
+        bytes += res->iov[i].iov_len;
+    }
+
+    return bytes;
+}
+
+static int make_docroot(const struct file_arg *files_to_make, size_t num_files, char *path)
+{
+    static char contents[64 * 1024];
+
+    strcpy(path, "/tmp/core-bench-XXXXXX");
+    if (!mkdtemp(path) || chdir(path) == -1)
+    {
+        return -1;
+    }
+    memset(contents, 'x', sizeof(contents));
+
+    for (size_t i = 0; i < num_files; i++)
+    {
+        int fd = open(files_to_make[i].uri + 1, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+        if (fd == -1)
+        {
+            remove_docroot(files_to_make, i, path);
+            return -1;
+        }
+        for (size_t written = 0; written < files_to_make[i].size; written += sizeof(contents))
+        {
+            size_t length = files_to_make[i].size - written < sizeof(contents) ? files_to_make[i].size - written
+                                                                               : sizeof(contents);
+
+            if (write(fd, contents, length) != (ssize_t) length)
+            {
+                close(fd);
+                remove_docroot(files_to_make, i + 1, path);
+                return -1;
+            }
+        }
+        close(fd);
+    }
+
+    return 0;
+}
+
+static void remove_docroot(const struct file_arg *files_to_remove, size_t num_files, const char *path)
+{
+    for (size_t i = 0; i < num_files; i++)
+    {
+        unlink(files_to_remove[i].uri + 1);
+    }
+    if (chdir("/") == 0)
+    {
+        rmdir(path);
+    }
+}
@@ -0,0 +1,130 @@
+#include "histogram.h"
+
+#include <string.h>
+
+/**
+ * bucket_index
+ * <p>
+ * Get the index of the count of a value.
+ * </p>
+ * @param value the value
+ * @return the index
+ */
+static uint32_t bucket_index(uint64_t value);
+
+/**
+ * highest_equivalent
+ * <p>
+ * Get the highest value counted at an index.
+ * </p>
+ * @param index the index
+ * @return the value
+ */
+static uint64_t highest_equivalent(uint32_t index);
+
+void histogram_init(struct histogram *histogram)
+{
+    memset(histogram, 0, sizeof(struct histogram));
+    histogram->min = UINT64_MAX;
+}
+
+void histogram_record(struct histogram *histogram, uint64_t value)
+{
+    histogram->counts[bucket_index(value)]++;
+    histogram->total++;
+    if (value < histogram->min)
+    {
+        histogram->min = value;
+    }
+    if (value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+void histogram_merge(struct histogram *histogram, const struct histogram *other)
+{
+    for (uint32_t i = 0; i < HISTOGRAM_NUM_COUNTS; i++)
+    {
+        histogram->counts[i] += other->counts[i];
+    }
+    histogram->total += other->total;
+    if (other->min < histogram->min)
+    {
+        histogram->min = other->min;
+    }
+    if (other->max > histogram->max)
+    {
+        histogram->max = other->max;
+    }
+}
+
+uint64_t histogram_quantile(const struct histogram *histogram, uint64_t numerator, uint64_t denominator)
+{
+    uint64_t rank;
+    uint64_t seen;
+
+    if (histogram->total == 0)
+    {
+        return 0;
+    }
+
+    // The rank of the value, counting from 1
+    rank = (histogram->total * numerator + denominator - 1) / denominator;
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    if (rank > histogram->total)
+    {
+        rank = histogram->total;
+    }
+
+    seen = 0;
+    for (uint32_t i = 0; i < HISTOGRAM_NUM_COUNTS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= rank)
+        {
+            uint64_t value = highest_equivalent(i);
+            // The bucket may reach past the values actually seen.
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+static uint32_t bucket_index(uint64_t value)
+{
+    uint32_t shift;
+    uint32_t index;
+
+    if (value < (1U << HISTOGRAM_SUB_BUCKET_BITS))
+    {
+        return (uint32_t) value;
+    }
+
+    // value >> shift is in [SUB_BUCKETS, 2 * SUB_BUCKETS)
+    shift = (uint32_t) (63 - __builtin_clzll(value)) - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+    index = (1U << HISTOGRAM_SUB_BUCKET_BITS) + (shift - 1) * HISTOGRAM_SUB_BUCKETS +
+            (uint32_t) ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+
+    return index < HISTOGRAM_NUM_COUNTS ? index : HISTOGRAM_NUM_COUNTS - 1;
+}
+
+static uint64_t highest_equivalent(uint32_t index)
+{
+    uint32_t shift;
+    uint64_t sub_bucket;
+
+    if (index < (1U << HISTOGRAM_SUB_BUCKET_BITS))
+    {
+        return index;
+    }
+
+    shift      = (index - (1U << HISTOGRAM_SUB_BUCKET_BITS)) / HISTOGRAM_SUB_BUCKETS + 1;
+    sub_bucket = (index - (1U << HISTOGRAM_SUB_BUCKET_BITS)) % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+
+    return ((sub_bucket + 1) << shift) - 1;
+}
@@ -0,0 +1,811 @@
+#define _GNU_SOURCE // memmem
+#include "load.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NS_PER_SECOND 1000000000ULL
+#define NS_PER_MS 1000000ULL
+#define IN_BUFFER_SIZE 65536
+#define MAX_WRITE_IOV 64
+#define RETRY_DELAY_NS (100 * NS_PER_MS) // after a failed connection, so a dead server is not hammered
+
+enum bench_connection_state
+{
+    BENCH_CLOSED,
+    BENCH_CONNECTING,
+    BENCH_OPEN,
+};
+
+/**
+ * in_flight
+ * <p>
+ * A request given to a connection: when it was due, and which request of the mix it is.
+ * </p>
+ */
+struct in_flight
+{
+    uint64_t due;
+    size_t   request;
+};
+
+/**
+ * bench_connection
+ * <p>
+ * A client connection. in_flight is a ring of up to pipeline_depth requests, oldest first;
+ * the last unsent of them are not fully written yet, the first of those up to offset.
+ * Requests stay in the ring until answered, so after a reconnect they are sent again.
+ * </p>
+ */
+struct bench_connection
+{
+    int                         fd;
+    enum bench_connection_state state;
+    uint64_t                    retry_at;
+    struct in_flight            *in_flight;
+    uint32_t                    head;
+    uint32_t                    count;
+    uint32_t                    unsent;
+    size_t                      offset;
+    uint64_t                    next_write; // slow clients
+    char                        *in;
+    size_t                      in_start;
+    size_t                      in_end;
+    bool                        in_body;
+    uint64_t                    body_left;
+    bool                        response_close;
+};
+
+/**
+ * bench_thread
+ * <p>
+ * The state of one load thread. Open-loop requests that are due but not given to a connection
+ * yet are counted in backlog; being evenly spaced, their due times follow from next_due.
+ * </p>
+ */
+struct bench_thread
+{
+    const struct bench_scenario *scenario;
+    struct sockaddr_in          addr;
+    struct bench_connection     *connections;
+    struct pollfd               *pollfds;
+    uint32_t                    num_connections;
+    uint32_t                    cursor;
+    uint64_t                    random;
+    uint64_t                    end;
+    uint64_t                    interval;
+    uint64_t                    next_due;
+    uint64_t                    backlog;
+    struct bench_result         result;
+    pthread_t                   thread;
+};
+
+/**
+ * now_ns
+ * <p>
+ * Read the monotonic clock.
+ * </p>
+ * @return the time in nanoseconds.
+ */
+static uint64_t now_ns(void);
+
+/**
+ * next_random
+ * <p>
+ * Step the xorshift generator of a thread.
+ * </p>
+ * @param thread the thread
+ * @return a random number.
+ */
+static uint64_t next_random(struct bench_thread *thread);
+
+/**
+ * run_thread
+ * <p>
+ * The event loop of a load thread.
+ * </p>
+ * @param arg the bench_thread
+ * @return NULL.
+ */
+static void *run_thread(void *arg);
+
+/**
+ * connection_open
+ * <p>
+ * Start connecting. Requests still in flight are sent again once connected.
+ * </p>
+ * @param thread the thread
+ * @param conn the connection
+ * @param now the current time
+ */
+static void connection_open(struct bench_thread *thread, struct bench_connection *conn, uint64_t now);
+
+/**
+ * connection_close
+ * <p>
+ * Close a connection, to be opened again now if the server closed it as announced,
+ * or after a delay if it failed.
+ * </p>
+ * @param thread the thread
+ * @param conn the connection
+ * @param now the current time
+ * @param expected whether the server announced the close
+ */
+static void connection_close(struct bench_thread *thread, struct bench_connection *conn, uint64_t now, bool expected);
+
+/**
+ * dispatch
+ * <p>
+ * Give requests to connections that have room for them: all they can take in closed-loop,
+ * the ones that are due in open-loop.
+ * </p>
+ * @param thread the thread
+ * @param now the current time
+ */
+static void dispatch(struct bench_thread *thread, uint64_t now);
+
+/**
+ * connection_write
+ * <p>
+ * Write the unsent requests, as far as the socket and the slow client profile allow.
+ * </p>
+ * @param thread the thread
+ * @param conn the connection
+ * @param now the current time
+ */
+static void connection_write(struct bench_thread *thread, struct bench_connection *conn, uint64_t now);
+
+/**
+ * connection_read
+ * <p>
+ * Read and count the responses that have arrived.
+ * </p>
+ * @param thread the thread
+ * @param conn the connection
+ */
+static void connection_read(struct bench_thread *thread, struct bench_connection *conn);
+
+/**
+ * parse_responses
+ * <p>
+ * Consume the complete responses in the input buffer.
+ * </p>
+ * @param thread the thread
+ * @param conn the connection
+ * @param now the current time
+ * @return false if the connection was closed.
+ */
+static bool parse_responses(struct bench_thread *thread, struct bench_connection *conn, uint64_t now);
+
+/**
+ * poll_timeout
+ * <p>
+ * Get how long to wait for events: until the end of the run, the next due request,
+ * the next reconnect or the next slow write, whichever comes first.
+ * </p>
+ * @param thread the thread
+ * @param now the current time
+ * @return the timeout in milliseconds.
+ */
+static int poll_timeout(const struct bench_thread *thread, uint64_t now);
+
+/**
+ * resolve
+ * <p>
+ * Resolve the IPv4 address of the server.
+ * </p>
+ * @param host the host name or address
+ * @param port the port
+ * @param addr filled with the address
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+static int resolve(const char *host, in_port_t port, struct sockaddr_in *addr);
+
+int run_load(const struct bench_scenario *scenario, struct bench_result *result)
+{
+    struct bench_thread *threads;
+    struct sockaddr_in  addr;
+    uint64_t            start;
+    uint32_t            started;
+    int                 ret_val;
+
+    if (scenario->threads == 0 || scenario->connections < scenario->threads || scenario->pipeline_depth == 0 ||
+        scenario->num_requests == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (resolve(scenario->host, scenario->port, &addr) == -1)
+    {
+        return -1;
+    }
+
+    threads = calloc(scenario->threads, sizeof(struct bench_thread));
+    if (!threads)
+    {
+        return -1;
+    }
+
+    ret_val = 0;
+    start   = now_ns();
+    for (started = 0; started < scenario->threads; started++)
+    {
+        struct bench_thread *thread = &threads[started];
+
+        thread->scenario        = scenario;
+        thread->addr            = addr;
+        thread->num_connections = scenario->connections / scenario->threads +
+                                  (started < scenario->connections % scenario->threads ? 1 : 0);
+        thread->random          = 0x9E3779B97F4A7C15ULL * (started + 1);
+        thread->end             = start + (uint64_t) scenario->duration * NS_PER_SECOND;
+        if (scenario->rate)
+        {
+            // Each thread takes an even share of the rate; their schedules are staggered.
+            thread->interval = NS_PER_SECOND * scenario->threads / scenario->rate;
+            thread->next_due = start + thread->interval * started / scenario->threads;
+        }
+        histogram_init(&thread->result.latency);
+
+        thread->connections = calloc(thread->num_connections, sizeof(struct bench_connection));
+        thread->pollfds     = calloc(thread->num_connections, sizeof(struct pollfd));
+        if (!thread->connections || !thread->pollfds)
+        {
+            ret_val = -1;
+            break;
+        }
+        for (uint32_t i = 0; i < thread->num_connections; i++)
+        {
+            thread->connections[i].fd        = -1;
+            thread->connections[i].in_flight = calloc(scenario->pipeline_depth, sizeof(struct in_flight));
+            thread->connections[i].in        = malloc(IN_BUFFER_SIZE);
+            if (!thread->connections[i].in_flight || !thread->connections[i].in)
+            {
+                ret_val = -1;
+            }
+        }
+        if (ret_val == -1)
+        {
+            break;
+        }
+
+        errno = pthread_create(&thread->thread, NULL, run_thread, thread);
+        if (errno != 0)
+        {
+            ret_val = -1;
+            break;
+        }
+    }
+
+    memset(result, 0, sizeof(struct bench_result));
+    histogram_init(&result->latency);
+    for (uint32_t i = 0; i < scenario->threads; i++)
+    {
+        struct bench_thread *thread = &threads[i];
+
+        if (i < started)
+        {
+            pthread_join(thread->thread, NULL);
+            result->responses  += thread->result.responses;
+            result->non_2xx    += thread->result.non_2xx;
+            result->errors     += thread->result.errors;
+            result->reconnects += thread->result.reconnects;
+            result->bytes      += thread->result.bytes;
+            result->backlog    += thread->result.backlog;
+            histogram_merge(&result->latency, &thread->result.latency);
+        }
+        for (uint32_t j = 0; thread->connections && j < thread->num_connections; j++)
+        {
+            free(thread->connections[j].in_flight);
+            free(thread->connections[j].in);
+        }
+        free(thread->connections);
+        free(thread->pollfds);
+    }
+    result->elapsed = (double) (now_ns() - start) / (double) NS_PER_SECOND;
+    free(threads);
+
+    return ret_val;
+}
+
+static void *run_thread(void *arg)
+{
+    struct bench_thread *thread = (struct bench_thread *) arg;
+    uint64_t            now;
+
+    while ((now = now_ns()) < thread->end)
+    {
+        for (uint32_t i = 0; i < thread->num_connections; i++)
+        {
+            struct bench_connection *conn = &thread->connections[i];
+            if (conn->state == BENCH_CLOSED && conn->retry_at <= now)
+            {
+                connection_open(thread, conn, now);
+            }
+        }
+        dispatch(thread, now);
+
+        for (uint32_t i = 0; i < thread->num_connections; i++)
+        {
+            struct bench_connection *conn   = &thread->connections[i];
+            struct pollfd           *pollfd = &thread->pollfds[i];
+
+            pollfd->fd      = conn->fd;
+            pollfd->events  = 0;
+            pollfd->revents = 0;
+            if (conn->state == BENCH_CONNECTING)
+            {
+                pollfd->events = POLLOUT;
+            }
+            else if (conn->state == BENCH_OPEN)
+            {
+                pollfd->events = POLLIN;
+                if (conn->unsent && (thread->scenario->slow_bytes == 0 || conn->next_write <= now))
+                {
+                    pollfd->events |= POLLOUT;
+                }
+            }
+        }
+
+        if (poll(thread->pollfds, thread->num_connections, poll_timeout(thread, now)) == -1 && errno != EINTR)
+        {
+            thread->result.errors++;
+            break;
+        }
+
+        now = now_ns();
+        for (uint32_t i = 0; i < thread->num_connections; i++)
+        {
+            struct bench_connection *conn    = &thread->connections[i];
+            short                   revents = thread->pollfds[i].revents;
+
+            if (!revents || conn->fd != thread->pollfds[i].fd)
+            {
+                continue;
+            }
+            if (conn->state == BENCH_CONNECTING)
+            {
+                int       error = 0;
+                socklen_t length = sizeof(error);
+
+                if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0)
+                {
+                    connection_close(thread, conn, now, false);
+                    continue;
+                }
+                conn->state = BENCH_OPEN;
+            }
+            if (revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                connection_read(thread, conn);
+            }
+            if (conn->state == BENCH_OPEN)
+            {
+                connection_write(thread, conn, now);
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < thread->num_connections; i++)
+    {
+        struct bench_connection *conn = &thread->connections[i];
+
+        // What is still in flight was due but not answered in time.
+        if (thread->scenario->rate)
+        {
+            thread->result.backlog += conn->count;
+        }
+        if (conn->fd != -1)
+        {
+            close(conn->fd);
+        }
+    }
+    thread->result.backlog += thread->backlog;
+
+    return NULL;
+}
+
+static void connection_open(struct bench_thread *thread, struct bench_connection *conn, uint64_t now)
+{
+    int fd;
+    int one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        thread->result.errors++;
+        conn->retry_at = now + RETRY_DELAY_NS;
+        return;
+    }
+    (void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn->fd             = fd;
+    conn->unsent         = conn->count;
+    conn->offset         = 0;
+    conn->next_write     = now;
+    conn->in_start       = 0;
+    conn->in_end         = 0;
+    conn->in_body        = false;
+    conn->response_close = false;
+    if (connect(fd, (struct sockaddr *) &thread->addr, sizeof(thread->addr)) == 0)
+    {
+        conn->state = BENCH_OPEN;
+    }
+    else if (errno == EINPROGRESS)
+    {
+        conn->state = BENCH_CONNECTING;
+    }
+    else
+    {
+        conn->state = BENCH_CONNECTING;
+        connection_close(thread, conn, now, false);
+    }
+}
+
+static void connection_close(struct bench_thread *thread, struct bench_connection *conn, uint64_t now, bool expected)
+{
+    close(conn->fd);
+    conn->fd    = -1;
+    conn->state = BENCH_CLOSED;
+    if (expected)
+    {
+        thread->result.reconnects++;
+        conn->retry_at = now;
+    }
+    else
+    {
+        thread->result.errors++;
+        conn->retry_at = now + RETRY_DELAY_NS;
+    }
+}
+
+static void dispatch(struct bench_thread *thread, uint64_t now)
+{
+    const struct bench_scenario *scenario = thread->scenario;
+
+    if (scenario->rate)
+    {
+        while (thread->next_due <= now)
+        {
+            thread->backlog++;
+            thread->next_due += thread->interval;
+        }
+    }
+
+    // Round robin, so that no connection is always served first
+    for (uint32_t n = 0; n < thread->num_connections; n++)
+    {
+        struct bench_connection *conn = &thread->connections[thread->cursor];
+        bool                    added = false;
+
+        thread->cursor = (thread->cursor + 1) % thread->num_connections;
+        if (conn->state == BENCH_CLOSED)
+        {
+            continue;
+        }
+        while (conn->count < scenario->pipeline_depth && (!scenario->rate || thread->backlog > 0))
+        {
+            struct in_flight *request = &conn->in_flight[(conn->head + conn->count) % scenario->pipeline_depth];
+
+            if (scenario->rate)
+            {
+                request->due = thread->next_due - thread->backlog * thread->interval;
+                thread->backlog--;
+            }
+            else
+            {
+                request->due = now;
+            }
+            request->request = scenario_pick(scenario, next_random(thread));
+            conn->count++;
+            conn->unsent++;
+            added = true;
+        }
+        if (added && conn->state == BENCH_OPEN)
+        {
+            connection_write(thread, conn, now);
+        }
+    }
+}
+
+static void connection_write(struct bench_thread *thread, struct bench_connection *conn, uint64_t now)
+{
+    const struct bench_scenario *scenario = thread->scenario;
+
+    while (conn->unsent > 0)
+    {
+        struct iovec  iov[MAX_WRITE_IOV];
+        struct msghdr msg;
+        size_t        limit;
+        int           iovcnt;
+        ssize_t       written;
+
+        if (scenario->slow_bytes && now < conn->next_write)
+        {
+            return;
+        }
+
+        limit = scenario->slow_bytes ? scenario->slow_bytes : SIZE_MAX;
+        for (iovcnt = 0; iovcnt < MAX_WRITE_IOV && (uint32_t) iovcnt < conn->unsent && limit > 0; iovcnt++)
+        {
+            uint32_t                    index   = (conn->head + conn->count - conn->unsent + (uint32_t) iovcnt) %
+                                                  scenario->pipeline_depth;
+            const struct bench_request *request = &scenario->requests[conn->in_flight[index].request];
+            size_t                      skip    = iovcnt == 0 ? conn->offset : 0;
+
+            iov[iovcnt].iov_base = request->text + skip;
+            iov[iovcnt].iov_len  = request->length - skip;
+            if (iov[iovcnt].iov_len > limit)
+            {
+                iov[iovcnt].iov_len = limit;
+            }
+            limit -= iov[iovcnt].iov_len;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = (size_t) iovcnt;
+        written        = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                connection_close(thread, conn, now, false);
+            }
+            return;
+        }
+
+        conn->offset += (size_t) written;
+        while (conn->unsent > 0)
+        {
+            uint32_t index  = (conn->head + conn->count - conn->unsent) % scenario->pipeline_depth;
+            size_t   length = scenario->requests[conn->in_flight[index].request].length;
+
+            if (conn->offset < length)
+            {
+                break;
+            }
+            conn->offset -= length;
+            conn->unsent--;
+        }
+        if (scenario->slow_bytes)
+        {
+            conn->next_write = now + (uint64_t) scenario->slow_interval_ms * NS_PER_MS;
+        }
+    }
+}
+
+static void connection_read(struct bench_thread *thread, struct bench_connection *conn)
+{
+    for (;;)
+    {
+        ssize_t received;
+
+        if (conn->in_end == IN_BUFFER_SIZE)
+        {
+            if (conn->in_start == 0)
+            {
+                // A response head that does not fit
+                connection_close(thread, conn, now_ns(), false);
+                return;
+            }
+            memmove(conn->in, &conn->in[conn->in_start], conn->in_end - conn->in_start);
+            conn->in_end  -= conn->in_start;
+            conn->in_start = 0;
+        }
+
+        received = recv(conn->fd, &conn->in[conn->in_end], IN_BUFFER_SIZE - conn->in_end, 0);
+        if (received > 0)
+        {
+            conn->in_end += (size_t) received;
+            thread->result.bytes += (uint64_t) received;
+            if (!parse_responses(thread, conn, now_ns()))
+            {
+                return;
+            }
+            continue;
+        }
+        if (received == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        // The server may close an idle connection; with requests in flight, it is a failure.
+        connection_close(thread, conn, now_ns(), conn->count == 0 && received == 0);
+        return;
+    }
+}
+
+static bool parse_responses(struct bench_thread *thread, struct bench_connection *conn, uint64_t now)
+{
+    const struct bench_scenario *scenario = thread->scenario;
+
+    while (conn->in_start < conn->in_end)
+    {
+        size_t take;
+
+        if (!conn->in_body)
+        {
+            const char *head = &conn->in[conn->in_start];
+            const char *head_end;
+            const char *line;
+            bool       has_length = false;
+            int        status;
+
+            head_end = memmem(head, conn->in_end - conn->in_start, "\r\n\r\n", 4);
+            if (!head_end)
+            {
+                break;
+            }
+            if (head_end - head < 12 || strncmp(head, "HTTP/1.", 7) != 0 || conn->count == 0)
+            {
+                connection_close(thread, conn, now, false);
+                return false;
+            }
+            status = atoi(head + 9);
+
+            conn->body_left      = 0;
+            conn->response_close = false;
+            for (line = memchr(head, '\n', (size_t) (head_end - head)); line && line < head_end;
+                 line = memchr(line, '\n', (size_t) (head_end - line)))
+            {
+                line++;
+                if (strncasecmp(line, "Content-Length:", 15) == 0)
+                {
+                    conn->body_left = strtoull(line + 15, NULL, 10);
+                    has_length      = true;
+                }
+                else if (strncasecmp(line, "Connection:", 11) == 0)
+                {
+                    const char *value = line + 11;
+                    while (*value == ' ')
+                    {
+                        value++;
+                    }
+                    conn->response_close = strncasecmp(value, "close", 5) == 0;
+                }
+            }
+            if (!has_length)
+            {
+                // Bodies that end with the connection are not supported
+                connection_close(thread, conn, now, false);
+                return false;
+            }
+            if (status < 200 || status > 299)
+            {
+                thread->result.non_2xx++;
+            }
+            conn->in_start = (size_t) (head_end + 4 - conn->in);
+            conn->in_body  = true;
+        }
+
+        take = conn->in_end - conn->in_start;
+        if (take > conn->body_left)
+        {
+            take = (size_t) conn->body_left;
+        }
+        conn->in_start  += take;
+        conn->body_left -= take;
+        if (conn->body_left > 0)
+        {
+            break;
+        }
+
+        // A whole response: it answers the oldest request in flight
+        conn->in_body = false;
+        if (now < thread->end)
+        {
+            thread->result.responses++;
+            histogram_record(&thread->result.latency, now - conn->in_flight[conn->head].due);
+        }
+        conn->head = (conn->head + 1) % scenario->pipeline_depth;
+        conn->count--;
+        if (conn->unsent > conn->count)
+        {
+            // Answered before it was fully sent, which only a server that gave up on it does
+            conn->unsent = conn->count;
+            conn->offset = 0;
+        }
+        if (conn->response_close)
+        {
+            // Requests pipelined behind this one are sent again on the next connection.
+            connection_close(thread, conn, now, true);
+            return false;
+        }
+    }
+    if (conn->in_start == conn->in_end)
+    {
+        conn->in_start = 0;
+        conn->in_end   = 0;
+    }
+
+    return true;
+}
+
+static int poll_timeout(const struct bench_thread *thread, uint64_t now)
+{
+    uint64_t wake = thread->end;
+
+    if (thread->scenario->rate && thread->next_due < wake)
+    {
+        wake = thread->next_due;
+    }
+    for (uint32_t i = 0; i < thread->num_connections; i++)
+    {
+        const struct bench_connection *conn = &thread->connections[i];
+
+        if (conn->state == BENCH_CLOSED && conn->retry_at < wake)
+        {
+            wake = conn->retry_at;
+        }
+        if (conn->state == BENCH_OPEN && conn->unsent && thread->scenario->slow_bytes && conn->next_write < wake)
+        {
+            wake = conn->next_write;
+        }
+    }
+    if (wake <= now)
+    {
+        return 0;
+    }
+
+    return (int) ((wake - now + NS_PER_MS - 1) / NS_PER_MS);
+}
+
+static int resolve(const char *host, in_port_t port, struct sockaddr_in *addr)
+{
+    struct addrinfo hints;
+    struct addrinfo *info;
+    int             result;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    result            = getaddrinfo(host, NULL, &hints, &info);
+    if (result != 0)
+    {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    memcpy(addr, info->ai_addr, sizeof(struct sockaddr_in));
+    addr->sin_port = htons(port);
+    freeaddrinfo(info);
+
+    return 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * NS_PER_SECOND + (uint64_t) now.tv_nsec;
+}
+
+static uint64_t next_random(struct bench_thread *thread)
+{
+    uint64_t x = thread->random;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    thread->random = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
@@ -0,0 +1,280 @@
+#include "compare.h"
+#include "load.h"
+#include "report.h"
+#include "scenario.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 8080
+#define DEFAULT_THREADS 2
+#define DEFAULT_CONNECTIONS 64
+#define DEFAULT_DURATION 10
+#define DEFAULT_URI "/index.html"
+#define DEFAULT_SERVER "../core/core"
+
+/**
+ * usage
+ * <p>
+ * Print how to run the benchmark.
+ * </p>
+ * @param program the name of the program
+ */
+static void usage(const char *program);
+
+/**
+ * parse_uint32
+ * <p>
+ * Parse an option value.
+ * </p>
+ * @param value the value
+ * @param name the name of the option, for the error message
+ * @param result filled with the number
+ * @return 0 on success, -1 on failure.
+ */
+static int parse_uint32(const char *value, const char *name, uint32_t *result);
+
+/**
+ * parse_slow
+ * <p>
+ * Parse a slow client profile "BYTES:MILLISECONDS".
+ * </p>
+ * @param value the value
+ * @param scenario filled with the profile
+ * @return 0 on success, -1 on failure.
+ */
+static int parse_slow(const char *value, struct bench_scenario *scenario);
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] = {
+            {"host",          required_argument, NULL, 'H'},
+            {"port",          required_argument, NULL, 'p'},
+            {"threads",       required_argument, NULL, 't'},
+            {"connections",   required_argument, NULL, 'c'},
+            {"duration",      required_argument, NULL, 'd'},
+            {"rate",          required_argument, NULL, 'R'},
+            {"no-keep-alive", no_argument,       NULL, 'K'},
+            {"pipeline",      required_argument, NULL, 'P'},
+            {"uri",           required_argument, NULL, 'u'},
+            {"uri-file",      required_argument, NULL, 'f'},
+            {"slow",          required_argument, NULL, 's'},
+            {"compare",       required_argument, NULL, 'C'},
+            {"server",        required_argument, NULL, 'S'},
+            {"help",          no_argument,       NULL, 'h'},
+            {NULL, 0,                            NULL, 0},
+    };
+    struct bench_scenario scenario;
+    struct bench_result   *result;
+    const char            *uri;
+    const char            *uri_file;
+    const char            *compare_directory;
+    const char            *server_path;
+    uint32_t              port;
+    int                   option;
+    int                   ret_val;
+
+    memset(&scenario, 0, sizeof(scenario));
+    scenario.host           = DEFAULT_HOST;
+    scenario.threads        = DEFAULT_THREADS;
+    scenario.connections    = DEFAULT_CONNECTIONS;
+    scenario.duration       = DEFAULT_DURATION;
+    scenario.keep_alive     = true;
+    scenario.pipeline_depth = 1;
+    port                    = DEFAULT_PORT;
+    uri                     = DEFAULT_URI;
+    uri_file                = NULL;
+    compare_directory       = NULL;
+    server_path             = DEFAULT_SERVER;
+
+    while ((option = getopt_long(argc, argv, "H:p:t:c:d:R:KP:u:f:s:C:S:h", options, NULL)) != -1)
+    {
+        int parsed = 0;
+
+        switch (option)
+        {
+            case 'H':
+                scenario.host = optarg;
+                break;
+            case 'p':
+                parsed = parse_uint32(optarg, "port", &port);
+                break;
+            case 't':
+                parsed = parse_uint32(optarg, "threads", &scenario.threads);
+                break;
+            case 'c':
+                parsed = parse_uint32(optarg, "connections", &scenario.connections);
+                break;
+            case 'd':
+                parsed = parse_uint32(optarg, "duration", &scenario.duration);
+                break;
+            case 'R':
+                parsed = parse_uint32(optarg, "rate", &scenario.rate);
+                break;
+            case 'K':
+                scenario.keep_alive = false;
+                break;
+            case 'P':
+                parsed = parse_uint32(optarg, "pipeline", &scenario.pipeline_depth);
+                break;
+            case 'u':
+                uri = optarg;
+                break;
+            case 'f':
+                uri_file = optarg;
+                break;
+            case 's':
+                parsed = parse_slow(optarg, &scenario);
+                break;
+            case 'C':
+                compare_directory = optarg;
+                break;
+            case 'S':
+                server_path = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+        if (parsed == -1)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (port == 0 || port > UINT16_MAX || scenario.threads == 0 || scenario.connections < scenario.threads ||
+        scenario.pipeline_depth == 0 || scenario.duration == 0)
+    {
+        (void) fprintf(stderr, "Need a port, at least one thread, a connection per thread, a pipeline depth "
+                               "and a duration\n");
+        return EXIT_FAILURE;
+    }
+    scenario.port = (in_port_t) port;
+    if (!scenario.keep_alive && scenario.pipeline_depth > 1)
+    {
+        // Every connection carries a single request
+        (void) fprintf(stderr, "Pipelining needs keep-alive; using a depth of 1\n");
+        scenario.pipeline_depth = 1;
+    }
+
+    if ((uri_file ? scenario_load_uris(&scenario, uri_file) : scenario_add_uri(&scenario, uri, 1)) == -1)
+    {
+        (void) fprintf(stderr, "Could not load the URIs: %s\n", strerror(errno));
+        scenario_destroy(&scenario);
+        return EXIT_FAILURE;
+    }
+
+    (void) printf("%s %u connections on %u threads for %us, %s, %s, pipeline depth %u, %zu URIs",
+                  scenario.rate ? "open-loop" : "closed-loop", scenario.connections, scenario.threads,
+                  scenario.duration, scenario.rate ? "fixed rate" : "fixed concurrency",
+                  scenario.keep_alive ? "keep-alive" : "no keep-alive", scenario.pipeline_depth,
+                  scenario.num_requests);
+    if (scenario.rate)
+    {
+        (void) printf(", %u requests/s", scenario.rate);
+    }
+    if (scenario.slow_bytes)
+    {
+        (void) printf(", slow clients sending %u bytes every %ums", scenario.slow_bytes, scenario.slow_interval_ms);
+    }
+    (void) printf("\n");
+
+    ret_val = EXIT_SUCCESS;
+    if (compare_directory)
+    {
+        if (compare_backends(&scenario, server_path, compare_directory, stdout) == -1)
+        {
+            (void) fprintf(stderr, "Could not compare the backends in %s: %s\n", compare_directory, strerror(errno));
+            ret_val = EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        // The histograms are too large for the stack
+        result = malloc(sizeof(struct bench_result));
+        if (!result || run_load(&scenario, result) == -1)
+        {
+            (void) fprintf(stderr, "Could not run the load: %s\n", strerror(errno));
+            ret_val = EXIT_FAILURE;
+        }
+        else
+        {
+            print_result(stdout, result);
+        }
+        free(result);
+    }
+
+    scenario_destroy(&scenario);
+    return ret_val;
+}
+
+static void usage(const char *program)
+{
+    (void) printf("Usage: %s [options]\n"
+                  "  -H, --host HOST         server address (default " DEFAULT_HOST ")\n"
+                  "  -p, --port PORT         server port (default %d)\n"
+                  "  -t, --threads N         load threads (default %d)\n"
+                  "  -c, --connections N     connections, shared between the threads (default %d)\n"
+                  "  -d, --duration SECONDS  length of the run (default %d)\n"
+                  "  -R, --rate N            open-loop: N requests per second in total; 0 is closed-loop\n"
+                  "  -K, --no-keep-alive     one request per connection\n"
+                  "  -P, --pipeline N        requests in flight per connection (default 1)\n"
+                  "  -u, --uri URI           the URI to request (default " DEFAULT_URI ")\n"
+                  "  -f, --uri-file FILE     a mix of URIs, one per line, each optionally after a weight\n"
+                  "  -s, --slow BYTES:MS     slow clients: send BYTES of the requests every MS milliseconds\n"
+                  "  -C, --compare DIR       start the server with every lib*-server library in DIR and its\n"
+                  "                          subdirectories in turn, and compare them\n"
+                  "  -S, --server PATH       the server to start for --compare (default " DEFAULT_SERVER ")\n",
+                  program, DEFAULT_PORT, DEFAULT_THREADS, DEFAULT_CONNECTIONS, DEFAULT_DURATION);
+}
+
+static int parse_uint32(const char *value, const char *name, uint32_t *result)
+{
+    char          *end;
+    unsigned long number;
+
+    errno  = 0;
+    number = strtoul(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || number > UINT32_MAX)
+    {
+        (void) fprintf(stderr, "Invalid %s: %s\n", name, value);
+        return -1;
+    }
+    *result = (uint32_t) number;
+
+    return 0;
+}
+
+static int parse_slow(const char *value, struct bench_scenario *scenario)
+{
+    char          *end;
+    unsigned long bytes;
+    unsigned long interval;
+
+    errno = 0;
+    bytes = strtoul(value, &end, 10);
+    if (errno != 0 || end == value || *end != ':' || bytes == 0 || bytes > UINT32_MAX)
+    {
+        (void) fprintf(stderr, "Invalid slow client profile: %s\n", value);
+        return -1;
+    }
+    value    = end + 1;
+    interval = strtoul(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || interval > UINT32_MAX)
+    {
+        (void) fprintf(stderr, "Invalid slow client profile: %s\n", value);
+        return -1;
+    }
+    scenario->slow_bytes       = (uint32_t) bytes;
+    scenario->slow_interval_ms = (uint32_t) interval;
+
+    return 0;
+}
@@ -0,0 +1,278 @@
+#include "micro.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NS_PER_SECOND 1000000000ULL
+
+// Hundredths, so that per operation figures are printed without floating point
+#define FIXED_POINT_SCALE 100
+
+/**
+ * The system calls made by the receiver, the request parser, the response writer and the file
+ * cache. The linker sends every call to them through these wrappers (-Wl,--wrap in CMakeLists.txt).
+ */
+ssize_t __real_recv(int fd, void *buf, size_t len, int flags);
+ssize_t __real_send(int fd, const void *buf, size_t len, int flags);
+ssize_t __real_sendmsg(int fd, const struct msghdr *msg, int flags);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t __real_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+int __real_open(const char *path, int flags, ...);
+int __real_close(int fd);
+int __real_fstat(int fd, struct stat *buf);
+int __real_setsockopt(int fd, int level, int name, const void *value, socklen_t length);
+void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int __real_munmap(void *addr, size_t length);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int __real_inotify_add_watch(int fd, const char *path, uint32_t mask);
+
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags);
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags);
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags);
+ssize_t __wrap_read(int fd, void *buf, size_t count);
+ssize_t __wrap_write(int fd, const void *buf, size_t count);
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t __wrap_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+int __wrap_open(const char *path, int flags, ...);
+int __wrap_close(int fd);
+int __wrap_fstat(int fd, struct stat *buf);
+int __wrap_setsockopt(int fd, int level, int name, const void *value, socklen_t length);
+void *__wrap_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int __wrap_munmap(void *addr, size_t length);
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int __wrap_inotify_add_watch(int fd, const char *path, uint32_t mask);
+
+/**
+ * now_ns
+ * <p>
+ * Get the monotonic time.
+ * </p>
+ * @return the time in nanoseconds
+ */
+static uint64_t now_ns(void);
+
+/**
+ * count_syscall
+ * <p>
+ * Count a system call.
+ * </p>
+ */
+static void count_syscall(void);
+
+/**
+ * print_per_op
+ * <p>
+ * Print <total> / <ops> as a JSON number with two decimals.
+ * </p>
+ * @param out where to print
+ * @param total the total
+ * @param ops the number of operations
+ */
+static void print_per_op(FILE *out, uint64_t total, uint64_t ops);
+
+// The file cache watcher thread makes system calls too, so the counter is atomic
+static atomic_uint_fast64_t syscalls = 0;
+
+uint64_t micro_syscalls(void)
+{
+    return atomic_load_explicit(&syscalls, memory_order_relaxed);
+}
+
+void micro_begin(struct micro_measure *measure)
+{
+    measure->started_syscalls = micro_syscalls();
+    measure->started_ns       = now_ns();
+}
+
+void micro_end(struct micro_measure *measure, uint64_t ops, uint64_t bytes)
+{
+    measure->nanoseconds += now_ns() - measure->started_ns;
+    measure->syscalls += micro_syscalls() - measure->started_syscalls;
+    measure->ops += ops;
+    measure->bytes += bytes;
+}
+
+int micro_run(const struct micro_benchmark *benchmark, uint64_t min_ns, struct micro_measure *measure)
+{
+    void *state;
+    int  ret_val;
+
+    state = NULL;
+    if (benchmark->setup && benchmark->setup(&state, benchmark->arg) == -1)
+    {
+        return -1;
+    }
+
+    // One unmeasured batch first, to warm the caches and fault in the buffers
+    *measure = (struct micro_measure) {0};
+    ret_val  = benchmark->batch(state, benchmark->arg, measure);
+
+    *measure = (struct micro_measure) {0};
+    while (ret_val == 0 && measure->nanoseconds < min_ns)
+    {
+        ret_val = benchmark->batch(state, benchmark->arg, measure);
+    }
+
+    if (benchmark->teardown)
+    {
+        benchmark->teardown(state);
+    }
+
+    return ret_val;
+}
+
+void micro_print_begin(FILE *out, const char *implementation)
+{
+    (void) fprintf(out, "{\n  \"scan_implementation\": \"%s\",\n  \"benchmarks\": [", implementation);
+}
+
+void micro_print_result(FILE *out, const char *name, const struct micro_measure *measure, bool first)
+{
+    (void) fprintf(out, "%s\n    {\"name\": \"%s\", \"ops\": %" PRIu64 ", \"ns_per_op\": ", first ? "" : ",", name,
+                   measure->ops);
+    print_per_op(out, measure->nanoseconds, measure->ops);
+    (void) fprintf(out, ", \"bytes_per_op\": ");
+    print_per_op(out, measure->bytes, measure->ops);
+    (void) fprintf(out, ", \"syscalls_per_op\": ");
+    print_per_op(out, measure->syscalls, measure->ops);
+    (void) fprintf(out, "}");
+}
+
+void micro_print_end(FILE *out)
+{
+    (void) fprintf(out, "\n  ]\n}\n");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * NS_PER_SECOND + (uint64_t) now.tv_nsec;
+}
+
+static void count_syscall(void)
+{
+    atomic_fetch_add_explicit(&syscalls, 1, memory_order_relaxed);
+}
+
+static void print_per_op(FILE *out, uint64_t total, uint64_t ops)
+{
+    uint64_t scaled;
+
+    scaled = ops ? total * FIXED_POINT_SCALE / ops : 0;
+    (void) fprintf(out, "%" PRIu64 ".%02" PRIu64, scaled / FIXED_POINT_SCALE, scaled % FIXED_POINT_SCALE);
+}
+
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags)
+{
+    count_syscall();
+    return __real_recv(fd, buf, len, flags);
+}
+
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags)
+{
+    count_syscall();
+    return __real_send(fd, buf, len, flags);
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    count_syscall();
+    return __real_sendmsg(fd, msg, flags);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count)
+{
+    count_syscall();
+    return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count)
+{
+    count_syscall();
+    return __real_write(fd, buf, count);
+}
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset)
+{
+    count_syscall();
+    return __real_pread(fd, buf, count, offset);
+}
+
+ssize_t __wrap_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    count_syscall();
+    return __real_sendfile(out_fd, in_fd, offset, count);
+}
+
+int __wrap_open(const char *path, int flags, ...)
+{
+    va_list args;
+    mode_t  mode;
+
+    // The mode is only passed when a file may be created
+    mode = 0;
+    if (flags & O_CREAT)
+    {
+        va_start(args, flags);
+        mode = (mode_t) va_arg(args, unsigned int);
+        va_end(args);
+    }
+    count_syscall();
+    return __real_open(path, flags, mode);
+}
+
+int __wrap_close(int fd)
+{
+    count_syscall();
+    return __real_close(fd);
+}
+
+int __wrap_fstat(int fd, struct stat *buf)
+{
+    count_syscall();
+    return __real_fstat(fd, buf);
+}
+
+int __wrap_setsockopt(int fd, int level, int name, const void *value, socklen_t length)
+{
+    count_syscall();
+    return __real_setsockopt(fd, level, name, value, length);
+}
+
+void *__wrap_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    count_syscall();
+    return __real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+int __wrap_munmap(void *addr, size_t length)
+{
+    count_syscall();
+    return __real_munmap(addr, length);
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    count_syscall();
+    return __real_poll(fds, nfds, timeout);
+}
+
+int __wrap_inotify_add_watch(int fd, const char *path, uint32_t mask)
+{
+    count_syscall();
+    return __real_inotify_add_watch(fd, path, mask);
+}
@@ -0,0 +1,99 @@
+#include "report.h"
+
+#include <inttypes.h>
+
+#define LATENCY_LENGTH 32
+#define BYTES_PER_MEBIBYTE (1024 * 1024)
+
+/**
+ * format_latency
+ * <p>
+ * Format nanoseconds in the unit that suits them.
+ * </p>
+ * @param ns the latency
+ * @param buffer where to format, LATENCY_LENGTH bytes
+ * @return buffer.
+ */
+static const char *format_latency(uint64_t ns, char *buffer);
+
+/**
+ * per_second
+ * <p>
+ * Divide by the elapsed time of a run.
+ * </p>
+ * @param value the value
+ * @param result the run
+ * @return the rate.
+ */
+static double per_second(double value, const struct bench_result *result);
+
+void print_result(FILE *out, const struct bench_result *result)
+{
+    char p50[LATENCY_LENGTH];
+    char p99[LATENCY_LENGTH];
+    char p999[LATENCY_LENGTH];
+    char max[LATENCY_LENGTH];
+
+    (void) fprintf(out, "responses  %" PRIu64 " in %.2fs: %.1f/s, %.2f MiB/s\n", result->responses, result->elapsed,
+                   per_second((double) result->responses, result),
+                   per_second((double) result->bytes / (double) BYTES_PER_MEBIBYTE, result));
+    (void) fprintf(out, "errors     %" PRIu64 " connection, %" PRIu64 " non-2xx, %" PRIu64 " reconnects, %" PRIu64
+                   " unanswered\n", result->errors, result->non_2xx, result->reconnects, result->backlog);
+    (void) fprintf(out, "latency    p50 %s  p99 %s  p99.9 %s  max %s\n",
+                   format_latency(histogram_quantile(&result->latency, 50, 100), p50),
+                   format_latency(histogram_quantile(&result->latency, 99, 100), p99),
+                   format_latency(histogram_quantile(&result->latency, 999, 1000), p999),
+                   format_latency(result->latency.max, max));
+}
+
+void print_table_header(FILE *out)
+{
+    (void) fprintf(out, "%-24s %12s %10s %10s %10s %10s %10s %8s\n", "backend", "responses/s", "MiB/s", "p50", "p99",
+                   "p99.9", "max", "errors");
+}
+
+void print_table_row(FILE *out, const char *name, const struct bench_result *result)
+{
+    char p50[LATENCY_LENGTH];
+    char p99[LATENCY_LENGTH];
+    char p999[LATENCY_LENGTH];
+    char max[LATENCY_LENGTH];
+
+    (void) fprintf(out, "%-24s %12.1f %10.2f %10s %10s %10s %10s %8" PRIu64 "\n", name,
+                   per_second((double) result->responses, result),
+                   per_second((double) result->bytes / (double) BYTES_PER_MEBIBYTE, result),
+                   format_latency(histogram_quantile(&result->latency, 50, 100), p50),
+                   format_latency(histogram_quantile(&result->latency, 99, 100), p99),
+                   format_latency(histogram_quantile(&result->latency, 999, 1000), p999),
+                   format_latency(result->latency.max, max),
+                   result->errors + result->backlog);
+    (void) fflush(out);
+}
+
+static const char *format_latency(uint64_t ns, char *buffer)
+{
+    if (ns < 1000)
+    {
+        (void) snprintf(buffer, LATENCY_LENGTH, "%" PRIu64 "ns", ns);
+    }
+    else if (ns < 1000000)
+    {
+        (void) snprintf(buffer, LATENCY_LENGTH, "%" PRIu64 ".%01" PRIu64 "us", ns / 1000, ns % 1000 / 100);
+    }
+    else if (ns < 1000000000)
+    {
+        (void) snprintf(buffer, LATENCY_LENGTH, "%" PRIu64 ".%02" PRIu64 "ms", ns / 1000000, ns % 1000000 / 10000);
+    }
+    else
+    {
+        (void) snprintf(buffer, LATENCY_LENGTH, "%" PRIu64 ".%02" PRIu64 "s", ns / 1000000000,
+                        ns % 1000000000 / 10000000);
+    }
+
+    return buffer;
+}
+
+static double per_second(double value, const struct bench_result *result)
+{
+    return result->elapsed > 0 ? value / result->elapsed : 0;
+}
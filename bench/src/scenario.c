@@ -0,0 +1,163 @@
+#include "scenario.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONNECTION_CLOSE "Connection: close\r\n"
+
+int scenario_add_uri(struct bench_scenario *scenario, const char *uri, uint64_t weight)
+{
+    const char           *parts[] = {"GET ", uri, " HTTP/1.1\r\nHost: ", scenario->host, "\r\n",
+                                     scenario->keep_alive ? "" : CONNECTION_CLOSE, "\r\n"};
+    struct bench_request *requests;
+    struct bench_request *request;
+    size_t               length;
+    uint64_t             cumulative;
+
+    length = 0;
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+    {
+        length += strlen(parts[i]);
+    }
+
+    requests = realloc(scenario->requests, (scenario->num_requests + 1) * sizeof(struct bench_request));
+    if (!requests)
+    {
+        return -1;
+    }
+    scenario->requests = requests;
+
+    request       = &requests[scenario->num_requests];
+    request->text = malloc(length + 1);
+    if (!request->text)
+    {
+        return -1;
+    }
+    request->length = 0;
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+    {
+        size_t part_length = strlen(parts[i]);
+        memcpy(request->text + request->length, parts[i], part_length);
+        request->length += part_length;
+    }
+    request->text[length] = '\0';
+
+    cumulative = scenario->num_requests ? requests[scenario->num_requests - 1].cumulative_weight : 0;
+    request->cumulative_weight = cumulative + weight;
+    scenario->num_requests++;
+    if (request->length > scenario->max_request_length)
+    {
+        scenario->max_request_length = request->length;
+    }
+
+    return 0;
+}
+
+int scenario_load_uris(struct bench_scenario *scenario, const char *file_name)
+{
+    FILE    *file;
+    char    *line;
+    size_t  size;
+    ssize_t length;
+    int     result;
+
+    file = fopen(file_name, "r");
+    if (!file)
+    {
+        return -1;
+    }
+
+    line   = NULL;
+    size   = 0;
+    result = 0;
+    while (result == 0 && (length = getline(&line, &size, file)) != -1)
+    {
+        char     *ptr = line;
+        uint64_t weight = 1;
+
+        while (length > 0 && isspace((unsigned char) line[length - 1]))
+        {
+            line[--length] = '\0';
+        }
+        while (isspace((unsigned char) *ptr))
+        {
+            ptr++;
+        }
+        if (*ptr == '\0' || *ptr == '#')
+        {
+            continue;
+        }
+        if (isdigit((unsigned char) *ptr))
+        {
+            char *end;
+
+            weight = strtoull(ptr, &end, 10);
+            ptr    = end;
+            while (isspace((unsigned char) *ptr))
+            {
+                ptr++;
+            }
+        }
+        if (*ptr == '\0' || weight == 0)
+        {
+            (void) fprintf(stderr, "%s: skipping \"%s\"\n", file_name, line);
+            continue;
+        }
+        result = scenario_add_uri(scenario, ptr, weight);
+    }
+    if (result == 0 && ferror(file))
+    {
+        result = -1;
+    }
+
+    free(line);
+    (void) fclose(file);
+    if (result == 0 && scenario->num_requests == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return result;
+}
+
+size_t scenario_pick(const struct bench_scenario *scenario, uint64_t random)
+{
+    uint64_t target;
+    size_t   low;
+    size_t   high;
+
+    target = random % scenario->requests[scenario->num_requests - 1].cumulative_weight;
+    low    = 0;
+    high   = scenario->num_requests - 1;
+    // The first request whose cumulative weight is past the target
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (scenario->requests[middle].cumulative_weight > target)
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+
+    return low;
+}
+
+void scenario_destroy(struct bench_scenario *scenario)
+{
+    for (size_t i = 0; i < scenario->num_requests; i++)
+    {
+        free(scenario->requests[i].text);
+    }
+    free(scenario->requests);
+    scenario->requests     = NULL;
+    scenario->num_requests = 0;
+}
@@ -0,0 +1,177 @@
+#ifndef SCALABLE_SERVER_ACCESS_LOG_H
+#define SCALABLE_SERVER_ACCESS_LOG_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * Records per ring; a power of two. At 48 bytes a record, a ring is under 200 KiB.
+ */
+#define ACCESS_LOG_RING_SIZE 4096
+
+/**
+ * The most event loops that can log at once. Rings are not given back, so a loop
+ * started after this many were registered runs without logging.
+ */
+#define ACCESS_LOG_MAX_RINGS 256
+
+/**
+ * Bytes the writer formats rows into before writing them out with one write.
+ */
+#define ACCESS_LOG_BUFFER_SIZE 65536
+
+/**
+ * How long the writer sleeps when the rings are empty.
+ */
+#define ACCESS_LOG_FLUSH_INTERVAL_MS 100
+
+#define ACCESS_LOG_CACHE_LINE 64
+
+struct memory_manager;
+struct connection;
+
+/**
+ * access_log_record
+ * <p>
+ * One row of the access log: a connection, from accept to close. Times are nanoseconds
+ * of the coarse monotonic clock.
+ * </p>
+ */
+struct access_log_record
+{
+    uint64_t connection_index;
+    uint64_t bytes_read;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    struct in_addr addr;
+    in_port_t port;
+    int32_t fd;
+};
+
+/**
+ * access_log_ring
+ * <p>
+ * A single-producer, single-consumer ring between one event loop and the writer. The producer
+ * owns head and cached_tail, the writer owns tail; each sits on a cache line of its own
+ * so neither side's writes invalidate the other's line.
+ * </p>
+ */
+struct access_log_ring
+{
+    _Alignas(ACCESS_LOG_CACHE_LINE) atomic_uint_fast64_t head;
+    uint64_t cached_tail; // a tail seen by the producer; no newer than tail
+    atomic_uint_fast64_t dropped;
+    _Alignas(ACCESS_LOG_CACHE_LINE) atomic_uint_fast64_t tail;
+    _Alignas(ACCESS_LOG_CACHE_LINE) struct access_log_record records[ACCESS_LOG_RING_SIZE];
+};
+
+/**
+ * access_log
+ * <p>
+ * Connection records pushed by the event loops into their own rings, and a writer thread
+ * that formats them as CSV rows and writes them out in large batches. The event loops never
+ * block on the log: a record that finds its ring full is dropped and counted.
+ * </p>
+ * <p>
+ * Timestamps are taken with the coarse monotonic clock, which is read without a system call,
+ * and turned into wall-clock time by the writer, from the two clocks read once at start.
+ * </p>
+ */
+struct access_log
+{
+    struct memory_manager *mm;
+    FILE *file;
+    pthread_t writer;
+    bool started;
+    atomic_bool running;
+    pthread_mutex_t lock; // serializes registrations
+    atomic_size_t num_rings;
+    struct access_log_ring *rings[ACCESS_LOG_MAX_RINGS];
+    atomic_uint_fast64_t next_index;
+    struct timespec wall_anchor;
+    uint64_t monotonic_anchor_ns;
+    uint64_t rows_written;
+    size_t buffer_length;
+    char buffer[ACCESS_LOG_BUFFER_SIZE];
+};
+
+/**
+ * access_log_init
+ * <p>
+ * Set up a log that is not started yet.
+ * </p>
+ * @param log the log
+ * @param mm the memory manager the rings are allocated with
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int access_log_init(struct access_log *log, struct memory_manager *mm);
+
+/**
+ * access_log_start
+ * <p>
+ * Write the CSV header to <file> and start the writer thread. Call it in the process that
+ * serves the connections, after any fork: the writer thread does not survive a fork.
+ * </p>
+ * @param log the log
+ * @param file the file to write to
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int access_log_start(struct access_log *log, FILE *file);
+
+/**
+ * access_log_register
+ * <p>
+ * Give the calling event loop a ring of its own. Only that loop may push to the ring.
+ * </p>
+ * @param log the log
+ * @return the ring. NULL and set errno if the log is not started or has no room for another ring;
+ * the loop then runs without logging.
+ */
+struct access_log_ring *access_log_register(struct access_log *log);
+
+/**
+ * access_log_now
+ * <p>
+ * Read the clock the records are timed with.
+ * </p>
+ * @return nanoseconds of the coarse monotonic clock
+ */
+uint64_t access_log_now(void);
+
+/**
+ * access_log_accept
+ * <p>
+ * Number a newly accepted connection and note when it was opened.
+ * </p>
+ * @param log the log
+ * @param conn the connection
+ */
+void access_log_accept(struct access_log *log, struct connection *conn);
+
+/**
+ * access_log_close
+ * <p>
+ * Push the record of a connection that is being closed. Never blocks.
+ * </p>
+ * @param ring the ring of the calling event loop, may be NULL
+ * @param conn the connection
+ * @return false if the record was dropped
+ */
+bool access_log_close(struct access_log_ring *ring, const struct connection *conn);
+
+/**
+ * access_log_stop
+ * <p>
+ * Stop the writer thread once it has written every record pushed so far, and report
+ * the records that were dropped. Does nothing if the log was not started.
+ * </p>
+ * @param log the log
+ */
+void access_log_stop(struct access_log *log);
+
+#endif //SCALABLE_SERVER_ACCESS_LOG_H
@@ -0,0 +1,146 @@
+#ifndef SCALABLE_SERVER_ARENA_H
+#define SCALABLE_SERVER_ARENA_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * Block sizes of the pool, from ARENA_MIN_BLOCK_SIZE up, each ARENA_CLASS_FACTOR times the last.
+ */
+#define ARENA_MIN_BLOCK_SIZE 32768
+#define ARENA_CLASS_FACTOR 4
+#define ARENA_NUM_CLASSES 4
+
+struct memory_manager;
+
+/**
+ * arena_block
+ * <p>
+ * A block of a size class. The block is allocated with the memory manager, so it is freed
+ * when the memory manager is; it moves between the pool and arenas until then.
+ * </p>
+ */
+struct arena_block
+{
+    struct arena_block *next;
+    size_t capacity;
+    size_t size_class;
+    max_align_t data[];
+};
+
+/**
+ * arena_pool
+ * <p>
+ * Size-classed free lists of blocks shared by the arenas of a process. Blocks are taken from
+ * the memory manager only when a free list is empty, so once the server has seen its peak
+ * number of connections it allocates nothing.
+ * </p>
+ */
+struct arena_pool
+{
+    struct memory_manager *mm;
+    pthread_mutex_t lock;
+    struct arena_block *free_blocks[ARENA_NUM_CLASSES];
+    size_t blocks_allocated;
+};
+
+/**
+ * arena
+ * <p>
+ * A bump-pointer allocator. Nothing is freed on its own; the arena is reset to a mark,
+ * which keeps its blocks for the next allocations, or released, which gives them back to the pool.
+ * </p>
+ */
+struct arena
+{
+    struct arena_pool *pool;
+    struct arena_block *first;
+    struct arena_block *current;
+    size_t used; // bytes used in current
+};
+
+/**
+ * arena_mark
+ * <p>
+ * A position in an arena to reset to.
+ * </p>
+ */
+struct arena_mark
+{
+    struct arena_block *block;
+    size_t used;
+};
+
+/**
+ * arena_pool_init
+ * <p>
+ * Set up an empty pool.
+ * </p>
+ * @param pool the pool
+ * @param mm the memory manager the blocks are allocated with
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int arena_pool_init(struct arena_pool *pool, struct memory_manager *mm);
+
+/**
+ * arena_pool_destroy
+ * <p>
+ * Destroy the pool. The blocks are freed with the memory manager.
+ * </p>
+ * @param pool the pool
+ */
+void arena_pool_destroy(struct arena_pool *pool);
+
+/**
+ * arena_init
+ * <p>
+ * Set up an empty arena. No block is taken until the first allocation.
+ * </p>
+ * @param arena the arena
+ * @param pool the pool the blocks come from
+ */
+void arena_init(struct arena *arena, struct arena_pool *pool);
+
+/**
+ * arena_alloc
+ * <p>
+ * Allocate <size> bytes aligned for any type. The memory is not zeroed.
+ * </p>
+ * @param arena the arena
+ * @param size the number of bytes
+ * @return the memory. NULL and set errno on failure.
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/**
+ * arena_get_mark
+ * <p>
+ * Get the current position of an arena.
+ * </p>
+ * @param arena the arena
+ * @return the mark
+ */
+struct arena_mark arena_get_mark(const struct arena *arena);
+
+/**
+ * arena_reset
+ * <p>
+ * Free everything allocated after <mark> in O(1). The blocks stay with the arena.
+ * </p>
+ * @param arena the arena
+ * @param mark a mark of this arena
+ */
+void arena_reset(struct arena *arena, struct arena_mark mark);
+
+/**
+ * arena_release
+ * <p>
+ * Give every block of the arena back to the pool and leave the arena empty.
+ * Memory allocated from the arena must not be used afterwards; the arena structure itself
+ * may live in that memory as long as it was copied out first.
+ * </p>
+ * @param arena the arena
+ */
+void arena_release(struct arena *arena);
+
+#endif //SCALABLE_SERVER_ARENA_H
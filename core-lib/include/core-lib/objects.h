@@ -1,12 +1,21 @@
 #ifndef SCALABLE_SERVER_OBJECTS_H
 #define SCALABLE_SERVER_OBJECTS_H
 
+#include "timer_wheel.h"
+
 #include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 struct core_object;
 struct state_object;
 struct pollfd;
+struct arena_pool;
+struct access_log;
+struct trace_log;
+struct wakeup;
 
 enum pollin_handle_result {
     POLLIN_HANDLE_RESULT_OK, // Wait for another request from the same client
@@ -14,8 +23,73 @@ enum pollin_handle_result {
     POLLIN_HANDLE_RESULT_FATAL, // Something terrible happened, the server will terminate
 };
 
+enum connection_deadline {
+    CONNECTION_DEADLINE_NONE,
+    CONNECTION_DEADLINE_REQUEST, // The client has until then to send a whole request head
+    CONNECTION_DEADLINE_IDLE, // The client has until then to start its next request
+    CONNECTION_DEADLINE_SEND, // The client has until then to take more of the queued output
+};
+
+/**
+ * connection
+ * <p>
+ * A client connection as seen by the handlers. The loaded library owns the struct and
+ * the socket, which is non-blocking. data belongs to the handler: it starts out NULL,
+ * survives between pollin events, and is released by the close handler.
+ * </p>
+ * <p>
+ * timer runs on the wheel of the event loop that owns the connection, and deadline says
+ * what it is waiting for. The library rearms it after each pollin and pollout event, from
+ * want_write and head_pending: the handler sets want_write when it has output queued that the
+ * socket would not take, and head_pending when it holds part of a request head that it is
+ * still waiting on.
+ * </p>
+ * <p>
+ * While want_write is set the library waits for the socket to become writable instead of
+ * readable, and calls the pollout handler, so a client that reads slowly only holds up itself.
+ * </p>
+ * <p>
+ * wakeup is set by the library on accept when it can be woken from other threads and the core
+ * has a wake handler, NULL otherwise. While the handler sets parked the library waits for neither
+ * reading nor writing, until another thread posts the connection to wakeup and the wake handler
+ * runs on its event loop. wake_next and woken belong to the wakeup.
+ * </p>
+ * <p>
+ * index and opened_ns are set by the library on accept for the access log; bytes_read
+ * is kept up to date by the handler.
+ * </p>
+ */
+struct connection {
+    int fd;
+    struct sockaddr_in addr;
+    void *data;
+    struct timer timer;
+    enum connection_deadline deadline;
+    bool want_write;
+    bool head_pending;
+    bool parked;
+    struct wakeup *wakeup;
+    struct connection *wake_next;
+    bool woken;
+    uint64_t index;
+    uint64_t opened_ns;
+    uint64_t bytes_read;
+};
+
 // returns pollin_handle_result
-typedef enum pollin_handle_result (*pollin_handler)(struct core_object *co, struct state_object *so, int fd);
+typedef enum pollin_handle_result (*pollin_handler)(struct core_object *co, struct state_object *so, struct connection *conn);
+
+// called when a connection that wants to write becomes writable, returns pollin_handle_result
+typedef enum pollin_handle_result (*pollout_handler)(struct core_object *co, struct state_object *so, struct connection *conn);
+
+// called on the event loop of a connection after another thread posted it to its wakeup, returns pollin_handle_result
+typedef enum pollin_handle_result (*wake_handler)(struct core_object *co, struct state_object *so, struct connection *conn);
+
+// called once per connection, before the library closes the socket
+typedef void (*close_handler)(struct core_object *co, struct connection *conn);
+
+// called when a deadline of the connection passes, before the library closes it; it must not block
+typedef void (*timeout_handler)(struct core_object *co, struct connection *conn);
 
 /**
  * core_object
@@ -25,13 +99,66 @@ typedef enum pollin_handle_result (*pollin_handler)(struct core_object *co, stru
  * and state_object. state_object contains library-dependent data, and will be
  * assigned and handled by the loaded library.
  * </p>
+ * <p>
+ * num_workers is the number of event loops the library should run. 0 means one
+ * per CPU the process may run on. Libraries that only support a single event loop ignore it.
+ * </p>
+ * <p>
+ * max_connections is the most connections the library keeps open at once. 0 means as
+ * many as RLIMIT_NOFILE allows.
+ * </p>
+ * <p>
+ * idle_timeout is how many seconds a connection may stay open between requests before
+ * the library closes it, 0 for no limit. header_timeout is how many seconds a client has
+ * to send a whole request head, from the connection or from the first bytes of the head,
+ * 0 for no limit. send_timeout is how many seconds a client may go without taking
+ * any of the output queued for it, 0 for no limit. max_requests is how many requests the handler serves on one
+ * connection before closing it, 0 for no limit.
+ * </p>
+ * <p>
+ * listen_backlog is the length of the accept queue of each listening socket, 0 for SOMAXCONN;
+ * the kernel caps it at net.core.somaxconn. defer_accept is how many seconds the kernel may
+ * hold a new connection back until its first data arrives (TCP_DEFER_ACCEPT), and fast_open
+ * the length of the TCP Fast Open queue, both 0 for off.
+ * </p>
+ * <p>
+ * arena_pool holds the blocks of the per-connection arenas; handlers allocate request
+ * memory from it instead of malloc.
+ * </p>
+ * <p>
+ * access_log collects a row per connection for the log file. The library starts it,
+ * and each of its event loops registers a ring to push to.
+ * </p>
+ * <p>
+ * wake_handler may be NULL, when no handler ever parks a connection.
+ * </p>
+ * <p>
+ * trace holds the trace rings of the threads when the server is built with SCALABLE_SERVER_TRACE.
+ * The library starts it, so that the copy of core-lib in the library shares it with the core's.
+ * </p>
  */
 struct core_object {
     struct memory_manager *mm;
+    struct arena_pool *arena_pool;
+    struct access_log *access_log;
+    struct trace_log *trace;
     FILE *log_file;
     struct sockaddr_in listen_addr;
     struct state_object *so;
     pollin_handler pollin_handler;
+    pollout_handler pollout_handler;
+    close_handler close_handler;
+    timeout_handler timeout_handler;
+    wake_handler wake_handler;
+    uint16_t num_workers;
+    uint32_t max_connections;
+    uint32_t idle_timeout;
+    uint32_t header_timeout;
+    uint32_t send_timeout;
+    uint32_t max_requests;
+    uint32_t listen_backlog;
+    uint32_t defer_accept;
+    uint32_t fast_open;
 };
 
 #endif //SCALABLE_SERVER_OBJECTS_H
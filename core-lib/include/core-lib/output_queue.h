@@ -0,0 +1,134 @@
+#ifndef SCALABLE_SERVER_OUTPUT_QUEUE_H
+#define SCALABLE_SERVER_OUTPUT_QUEUE_H
+
+#include "arena.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * The most memory segments sent with one sendmsg.
+ */
+#define OUTPUT_QUEUE_MAX_IOV 64
+
+/**
+ * output_release
+ * <p>
+ * Called once everything queued before it has been sent, or when the queue is cleared.
+ * </p>
+ */
+typedef void (*output_release)(void *owner);
+
+/**
+ * output_segment
+ * <p>
+ * One piece of a queue: bytes in memory, a range of a file, or only a release. A file range
+ * owns its file descriptor and closes it once the range is sent.
+ * </p>
+ */
+struct output_segment
+{
+    struct output_segment *next;
+    const char *data; // NULL unless the segment is bytes in memory
+    size_t length; // bytes of data left to send
+    int file_fd; // -1 unless the segment is a file range
+    off_t offset; // next byte of the file to send
+    off_t end;
+    output_release release; // NULL unless the segment is a release
+    void *owner;
+};
+
+/**
+ * output_queue
+ * <p>
+ * What a connection still has to send once its socket would block, in order. Segments and the
+ * bytes copied into the queue live in an arena of the queue's own, which goes back to the pool
+ * as soon as the queue drains, so a connection that keeps up costs no memory here.
+ * </p>
+ */
+struct output_queue
+{
+    struct arena arena;
+    struct output_segment *head;
+    struct output_segment *tail;
+};
+
+/**
+ * output_queue_init
+ * <p>
+ * Set up an empty queue.
+ * </p>
+ * @param queue the queue
+ * @param pool the pool the arena of the queue takes blocks from
+ */
+void output_queue_init(struct output_queue *queue, struct arena_pool *pool);
+
+/**
+ * output_queue_empty
+ * @param queue the queue
+ * @return whether everything queued has been sent
+ */
+bool output_queue_empty(const struct output_queue *queue);
+
+/**
+ * output_queue_push
+ * <p>
+ * Queue bytes in memory.
+ * </p>
+ * @param queue the queue
+ * @param data the bytes
+ * @param length the number of bytes
+ * @param copy true to copy the bytes into the queue, false to reference them; referenced
+ * bytes must stay valid until a release queued after them is called
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int output_queue_push(struct output_queue *queue, const void *data, size_t length, bool copy);
+
+/**
+ * output_queue_push_file
+ * <p>
+ * Queue a range of a file. The queue takes the file descriptor over, even on failure.
+ * </p>
+ * @param queue the queue
+ * @param file_fd the file
+ * @param offset the first byte to send
+ * @param end the byte after the last one to send
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int output_queue_push_file(struct output_queue *queue, int file_fd, off_t offset, off_t end);
+
+/**
+ * output_queue_push_release
+ * <p>
+ * Queue a call to release, made once everything queued before it has been sent.
+ * </p>
+ * @param queue the queue
+ * @param release the function to call
+ * @param owner passed to release
+ * @return 0 on success. On failure, -1 and set errno, and release is not called.
+ */
+int output_queue_push_release(struct output_queue *queue, output_release release, void *owner);
+
+/**
+ * output_queue_send
+ * <p>
+ * Send as much of the queue as the non-blocking socket takes without blocking.
+ * </p>
+ * @param queue the queue
+ * @param fd the socket
+ * @param sent set to the number of bytes sent
+ * @return 0 when the queue is empty or the socket would block. On failure, -1 and set errno.
+ */
+int output_queue_send(struct output_queue *queue, int fd, size_t *sent);
+
+/**
+ * output_queue_clear
+ * <p>
+ * Drop everything queued, calling the releases and closing the files.
+ * </p>
+ * @param queue the queue
+ */
+void output_queue_clear(struct output_queue *queue);
+
+#endif //SCALABLE_SERVER_OUTPUT_QUEUE_H
@@ -4,7 +4,12 @@
 #include <stdint.h>
 #include <core-lib/util.h>
 
-#define RECEIVER_BUFFER_LENGTH 16
+// Set with the RECEIVER_BUFFER_LENGTH cache variable in CMake. A page or more,
+// so that a whole request head usually arrives with one recv
+#ifndef RECEIVER_BUFFER_LENGTH
+#define RECEIVER_BUFFER_LENGTH 16384
+#endif
+_Static_assert(RECEIVER_BUFFER_LENGTH >= 4096, "RECEIVER_BUFFER_LENGTH must be at least a page");
 
 struct receiver {
     int fd;
@@ -23,7 +28,7 @@ enum read_fully_result receiver_read(struct receiver *, void * data, uint32_t si
 // Blocks until reads <delimiter> or until failure/eof is encountered
 // Doesn't include <delimiter> in the output <data>
 // Tries to read past the <delimiter> if available, but keeps extra data
-// in the internal buffer until requested
+// in the internal buffer until requested. The <delimiter> itself stays buffered
 // Size must originally contain the <data> buffer size
 enum read_fully_result receiver_read_until(struct receiver *, void * data, uint32_t* size, char delimiter);
 
@@ -0,0 +1,23 @@
+#ifndef HTTPSERVER_SCAN_H
+#define HTTPSERVER_SCAN_H
+
+#include <stddef.h>
+
+// Delimiter search over buffered bytes. On x86 the AVX2 or SSE2 version is picked
+// at startup from what the CPU supports; elsewhere a scalar version is used.
+
+// Returns the first <byte> in <data>, or NULL
+const char * scan_byte(const char * data, size_t length, char byte);
+
+// Returns the first "\r\n" in <data>, or NULL
+const char * scan_crlf(const char * data, size_t length);
+
+// Finds the end of a request head in one pass: returns the first "\r\n\r\n" in <data>, or NULL.
+// If <line_end> points to NULL, it is set to the first "\r\n" seen, which ends the request line,
+// so the request line and the headers are split without scanning the head again.
+const char * scan_head(const char * data, size_t length, const char ** line_end);
+
+// Name of the version in use: "avx2", "sse2" or "scalar"
+const char * scan_implementation(void);
+
+#endif //HTTPSERVER_SCAN_H
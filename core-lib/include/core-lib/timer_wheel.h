@@ -0,0 +1,124 @@
+#ifndef SCALABLE_SERVER_TIMER_WHEEL_H
+#define SCALABLE_SERVER_TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Milliseconds per tick. Timers fire on the first tick at or after their deadline.
+ */
+#define TIMER_WHEEL_TICK_MS 100
+
+/**
+ * Slots per level, as a power of two, and the number of levels. With 100 ms ticks the levels
+ * span 6.4 s, 6.8 min, 7.3 h and 19 days; a timer set further out fires after 19 days.
+ */
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+/**
+ * timer
+ * <p>
+ * A timer, embedded in whatever it times. It is linked into one slot of the wheel while
+ * it is pending; next is NULL when it is not, so a zeroed timer is a stopped one.
+ * </p>
+ */
+struct timer
+{
+    struct timer *next;
+    struct timer *prev;
+    uint64_t expires; // in ticks
+};
+
+/**
+ * timer_wheel
+ * <p>
+ * A hierarchical timing wheel: adding, cancelling and firing a timer are O(1). Level 0 holds
+ * the timers that expire within its current turn, one slot per tick; each level above holds
+ * the timers of its own next turns, one slot per turn of the level below, and hands a slot
+ * down a level when the level below starts that turn. A wheel belongs to one event loop and
+ * is not thread-safe.
+ * </p>
+ */
+struct timer_wheel
+{
+    uint64_t now; // the last tick processed
+    size_t num_pending;
+    struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // list heads
+};
+
+/**
+ * timer_expired
+ * <p>
+ * Called for each timer that fires. The timer is no longer pending; the callback may add it
+ * again, and may add or cancel any other timer.
+ * </p>
+ */
+typedef void (*timer_expired)(struct timer *timer, void *arg);
+
+/**
+ * timer_wheel_init
+ * <p>
+ * Set up an empty wheel.
+ * </p>
+ * @param wheel the wheel
+ * @param now_ms the current time in milliseconds of the clock the deadlines are in
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms);
+
+/**
+ * timer_wheel_add
+ * <p>
+ * Start a timer, or move it if it is already pending.
+ * </p>
+ * @param wheel the wheel
+ * @param timer the timer
+ * @param deadline_ms when the timer fires; a time already past fires on the next tick
+ */
+void timer_wheel_add(struct timer_wheel *wheel, struct timer *timer, uint64_t deadline_ms);
+
+/**
+ * timer_wheel_cancel
+ * <p>
+ * Stop a timer. Does nothing if it is not pending.
+ * </p>
+ * @param wheel the wheel
+ * @param timer the timer
+ */
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+/**
+ * timer_pending
+ * @param timer the timer
+ * @return whether the timer is pending
+ */
+bool timer_pending(const struct timer *timer);
+
+/**
+ * timer_wheel_advance
+ * <p>
+ * Fire every timer whose deadline has passed.
+ * </p>
+ * @param wheel the wheel
+ * @param now_ms the current time in milliseconds
+ * @param expired called for each timer that fires
+ * @param arg passed to expired
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ms, timer_expired expired, void *arg);
+
+/**
+ * timer_wheel_timeout
+ * <p>
+ * How long an event loop may wait before calling timer_wheel_advance. It is never later
+ * than the next deadline, but may be earlier: when the next deadline is in a later turn of
+ * level 0, it is the start of the next turn, where the wheel moves timers down.
+ * </p>
+ * @param wheel the wheel
+ * @param now_ms the current time in milliseconds
+ * @return milliseconds to wait, or -1 when no timer is pending
+ */
+int timer_wheel_timeout(const struct timer_wheel *wheel, uint64_t now_ms);
+
+#endif //SCALABLE_SERVER_TIMER_WHEEL_H
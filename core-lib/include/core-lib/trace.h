@@ -0,0 +1,204 @@
+#ifndef SCALABLE_SERVER_TRACE_H
+#define SCALABLE_SERVER_TRACE_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Events per thread ring; a power of two. At 24 bytes an event, the default ring is 384 KiB.
+ */
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 16384
+#endif
+
+/**
+ * The most threads that can trace at once; a thread started after this many were
+ * registered runs without tracing.
+ */
+#define TRACE_MAX_RINGS 512
+
+/**
+ * The signal that makes a traced process write its rings out. SIGUSR1 wakes the reactors.
+ */
+#define TRACE_DUMP_SIGNAL SIGUSR2
+
+#define TRACE_CACHE_LINE 64
+
+#define TRACE_PHASE_BEGIN 'B'
+#define TRACE_PHASE_END 'E'
+
+/**
+ * TRACE_BEGIN and TRACE_END mark the start and the end of a span on the calling thread; arg,
+ * usually a file descriptor, shows up in the span's details. Built without SCALABLE_SERVER_TRACE
+ * (the CMake option of the same name), they compile to nothing and their arguments are not
+ * evaluated. name must be a string literal, or at least outlive the process.
+ */
+#ifdef SCALABLE_SERVER_TRACE
+#define TRACE_BEGIN(name, arg) trace_record((name), (arg), TRACE_PHASE_BEGIN)
+#define TRACE_END(name, arg) trace_record((name), (arg), TRACE_PHASE_END)
+#else
+#define TRACE_BEGIN(name, arg) ((void) 0)
+#define TRACE_END(name, arg) ((void) 0)
+#endif
+
+struct memory_manager;
+
+/**
+ * trace_event
+ * <p>
+ * One begin or end of a span. The timestamp is in ticks of the trace clock.
+ * </p>
+ */
+struct trace_event
+{
+    uint64_t timestamp;
+    const char *name;
+    int32_t arg;
+    char phase;
+};
+
+/**
+ * trace_ring
+ * <p>
+ * The last TRACE_RING_SIZE events of one thread. Only that thread writes to it; the dumper
+ * copies it while it is being written and keeps the events that were not overwritten during the copy.
+ * </p>
+ */
+struct trace_ring
+{
+    _Alignas(TRACE_CACHE_LINE) atomic_uint_fast64_t head;
+    int32_t thread_id;
+    struct trace_event events[TRACE_RING_SIZE];
+};
+
+/**
+ * trace_log
+ * <p>
+ * The rings of every traced thread, and a thread that writes them out as a Chrome trace
+ * (chrome://tracing or ui.perfetto.dev) to trace-<pid>-<n>.json each time the process gets
+ * TRACE_DUMP_SIGNAL.
+ * </p>
+ * <p>
+ * The backends and the core each have a copy of this library, so the rings are registered
+ * here rather than in a global of one copy: each copy is pointed at the same log.
+ * </p>
+ */
+struct trace_log
+{
+    struct memory_manager *mm;
+    pthread_t dumper;
+    int wake_fds[2]; // the signal handler wakes the dumper through this pipe
+    bool started;
+    atomic_bool running;
+    pthread_mutex_t lock; // serializes registrations
+    atomic_size_t num_rings;
+    struct trace_ring *rings[TRACE_MAX_RINGS];
+    uint64_t clock_anchor; // the trace clock and CLOCK_MONOTONIC, read when the log was set up
+    struct timespec monotonic_anchor;
+    unsigned dumps;
+    struct trace_event *copy; // where the dumper copies a ring to
+};
+
+extern _Thread_local struct trace_ring *trace_thread_ring;
+
+/**
+ * trace_init
+ * <p>
+ * Set up a log that is not started yet, and point this copy of the library at it.
+ * </p>
+ * @param log the log
+ * @param mm the memory manager the rings are allocated with
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int trace_init(struct trace_log *log, struct memory_manager *mm);
+
+/**
+ * trace_start
+ * <p>
+ * Point this copy of the library at the log, catch TRACE_DUMP_SIGNAL and start the dumper thread.
+ * Blocks the signal in the calling thread, so call it before the event loop threads are created:
+ * they inherit the mask and are never interrupted by it. Like the access log, it is started in
+ * the process that serves the connections, after any fork. Does nothing when built without tracing.
+ * </p>
+ * @param log the log
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int trace_start(struct trace_log *log);
+
+/**
+ * trace_stop
+ * <p>
+ * Stop the dumper thread. Does nothing if the log was not started.
+ * </p>
+ * @param log the log
+ */
+void trace_stop(struct trace_log *log);
+
+/**
+ * trace_register_thread
+ * <p>
+ * Give the calling thread a ring of its own; called by trace_record the first time a thread traces.
+ * </p>
+ * @return the ring, or NULL if there is no log or it has no room for another ring
+ */
+struct trace_ring *trace_register_thread(void);
+
+/**
+ * trace_clock
+ * <p>
+ * Read the trace clock: the time stamp counter where there is one, as it is read without
+ * a system call or a vDSO call in a few cycles.
+ * </p>
+ * @return ticks of the trace clock
+ */
+static inline uint64_t trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * UINT64_C(1000000000) + (uint64_t) now.tv_nsec;
+#endif
+}
+
+/**
+ * trace_record
+ * <p>
+ * Push an event to the ring of the calling thread, overwriting the oldest one. Use it
+ * through TRACE_BEGIN and TRACE_END.
+ * </p>
+ * @param name the name of the span
+ * @param arg shown with the span
+ * @param phase TRACE_PHASE_BEGIN or TRACE_PHASE_END
+ */
+static inline void trace_record(const char *name, int32_t arg, char phase)
+{
+    struct trace_ring  *ring = trace_thread_ring;
+    struct trace_event *event;
+    uint64_t           head;
+
+    if (!ring && !(ring = trace_register_thread()))
+    {
+        return;
+    }
+
+    head             = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    event            = &ring->events[head & (TRACE_RING_SIZE - 1)];
+    event->timestamp = trace_clock();
+    event->name      = name;
+    event->arg       = arg;
+    event->phase     = phase;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#endif //SCALABLE_SERVER_TRACE_H
@@ -4,7 +4,9 @@
 #include "api_functions.h"
 #include "objects.h"
 
+#include <stdbool.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #define DEFAULT_LIBRARY "../../one-to-one/cmake-build-debug/libone-to-one.dylib" // TODO: relative path should be changed to absolute.
 #define DEFAULT_IP "123.123.123.123" // TODO: will need to get the IP address by default
@@ -47,6 +49,31 @@ void trace_reporter(const char *file_name, const char *function_name, size_t lin
 int setup_core_object(struct core_object *co, in_port_t port_num,
                       const char *ip_addr);
 
+/**
+ * open_worker_log
+ * <p>
+ * Replace the log file with one private to a worker process, so workers do not
+ * write over each other. Call it in the worker after fork.
+ * </p>
+ * @param co the core object
+ * @param worker_index the index of the worker, used in the file name
+ * @param truncate true to truncate the file, false to append to it (e.g. for a respawned worker)
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int open_worker_log(struct core_object *co, size_t worker_index, bool truncate);
+
+/**
+ * listen_with_options
+ * <p>
+ * Turn a bound socket into a listening socket with the backlog, TCP Fast Open and
+ * TCP_DEFER_ACCEPT settings of the core object. Options the platform lacks are skipped.
+ * </p>
+ * @param co the core object
+ * @param fd the bound socket
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+int listen_with_options(const struct core_object *co, int fd);
+
 /**
  * get_api
  * <p>
@@ -81,16 +108,43 @@ void destroy_core_object(struct core_object *co);
 
 
 /**
- * write_fully
+ * monotonic_ms
  * <p>
- * writes data fully to a file descriptor.
+ * reads the monotonic clock, for timestamps and deadlines that must not jump with the wall clock.
  * </p>
- * @param fd file descriptor to write to.
- * @param data data to write.
- * @param size size of data.
- * @return 0 on success. On failure -1 and set errno.
+ * @return the monotonic time in milliseconds.
+ */
+uint64_t monotonic_ms(void);
+
+/**
+ * connection_deadline_start
+ * <p>
+ * arms the timer of a connection the library has just accepted: the client has header_timeout
+ * to send its first request head.
+ * </p>
+ * @param wheel the wheel of the event loop that owns the connection.
+ * @param co the core object.
+ * @param conn the connection.
+ * @param now_ms the current monotonic time in milliseconds.
+ */
+void connection_deadline_start(struct timer_wheel *wheel, const struct core_object *co, struct connection *conn,
+                               uint64_t now_ms);
+
+/**
+ * connection_deadline_update
+ * <p>
+ * rearms the timer of a connection after the handler is done with a pollin or pollout event.
+ * While output is queued the client gets send_timeout to take more of it. While a request head
+ * is pending, the deadline set when it began stands, so trickling bytes does not extend it;
+ * otherwise the connection is idle and gets idle_timeout.
+ * </p>
+ * @param wheel the wheel of the event loop that owns the connection.
+ * @param co the core object.
+ * @param conn the connection.
+ * @param now_ms the current monotonic time in milliseconds.
  */
-int write_fully(int fd, void * data, size_t size);
+void connection_deadline_update(struct timer_wheel *wheel, const struct core_object *co, struct connection *conn,
+                                uint64_t now_ms);
 
 
 enum read_fully_result{
@@ -0,0 +1,84 @@
+#ifndef SCALABLE_SERVER_WAKEUP_H
+#define SCALABLE_SERVER_WAKEUP_H
+
+#include <pthread.h>
+
+struct connection;
+
+/**
+ * wakeup
+ * <p>
+ * Hands connections back to the event loop that owns them from other threads. The loop polls
+ * fd for reading; a post links the connection into posted and makes fd readable, and the loop
+ * takes the posted connections one by one and calls the wake handler on each, on its own thread.
+ * </p>
+ */
+struct wakeup
+{
+    int fd; // an eventfd, or the read end of a pipe where there is none
+    int write_fd; // the same as fd for an eventfd
+    pthread_mutex_t lock; // guards posted, and wake_next and woken in the connections
+    struct connection *posted;
+};
+
+/**
+ * wakeup_init
+ * <p>
+ * Set up a wakeup with nothing posted.
+ * </p>
+ * @param wakeup the wakeup
+ * @return 0 on success. On failure, -1 and set errno, and fd is -1.
+ */
+int wakeup_init(struct wakeup *wakeup);
+
+/**
+ * wakeup_post
+ * <p>
+ * Ask the loop of a connection to call the wake handler on it. Safe from any thread; posting
+ * a connection that is already posted does nothing more.
+ * </p>
+ * @param wakeup the wakeup of the loop that owns the connection
+ * @param conn the connection
+ */
+void wakeup_post(struct wakeup *wakeup, struct connection *conn);
+
+/**
+ * wakeup_clear
+ * <p>
+ * Consume the readiness of fd. The loop calls it before taking the posted connections, so that
+ * a post made meanwhile makes fd readable again.
+ * </p>
+ * @param wakeup the wakeup
+ */
+void wakeup_clear(struct wakeup *wakeup);
+
+/**
+ * wakeup_take
+ * <p>
+ * Take the next posted connection.
+ * </p>
+ * @param wakeup the wakeup
+ * @return the connection, or NULL when none is posted
+ */
+struct connection *wakeup_take(struct wakeup *wakeup);
+
+/**
+ * wakeup_cancel
+ * <p>
+ * Take back the post of a connection about to be closed, if it has not been taken yet.
+ * </p>
+ * @param wakeup the wakeup
+ * @param conn the connection
+ */
+void wakeup_cancel(struct wakeup *wakeup, struct connection *conn);
+
+/**
+ * wakeup_destroy
+ * <p>
+ * Close the file descriptors of a wakeup. Nothing may post to it afterwards.
+ * </p>
+ * @param wakeup the wakeup
+ */
+void wakeup_destroy(struct wakeup *wakeup);
+
+#endif //SCALABLE_SERVER_WAKEUP_H
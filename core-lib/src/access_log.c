@@ -0,0 +1,350 @@
+#include <access_log.h>
+#include <objects.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <mem_manager/manager.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NS_PER_SECOND UINT64_C(1000000000)
+#define NS_PER_MS UINT64_C(1000000)
+
+#define ACCESS_LOG_RING_MASK (ACCESS_LOG_RING_SIZE - 1)
+
+#define ACCESS_LOG_HEADER "connection index,file descriptor,ipv4 address,port number,bytes read,start timestamp," \
+                          "end timestamp,elapsed time (s)\n"
+
+/**
+ * The longest row: 20 digits for each 64-bit number, a dotted quad, a port, and three times with
+ * milliseconds.
+ */
+#define ACCESS_LOG_MAX_ROW 160
+
+#if (ACCESS_LOG_RING_SIZE & ACCESS_LOG_RING_MASK) != 0
+#error "ACCESS_LOG_RING_SIZE must be a power of two"
+#endif
+
+/**
+ * writer_thread
+ * <p>
+ * Drain the rings into the file until the log is stopped, then drain them one last time.
+ * </p>
+ * @param arg the log
+ * @return NULL
+ */
+static void *writer_thread(void *arg);
+
+/**
+ * drain_ring
+ * <p>
+ * Format every record of a ring into the buffer, writing the buffer out whenever it fills up.
+ * </p>
+ * @param log the log
+ * @param ring the ring
+ * @return the number of records taken from the ring
+ */
+static uint64_t drain_ring(struct access_log *log, struct access_log_ring *ring);
+
+/**
+ * format_record
+ * <p>
+ * Append the CSV row of a record to the buffer.
+ * </p>
+ * @param log the log
+ * @param record the record
+ */
+static void format_record(struct access_log *log, const struct access_log_record *record);
+
+/**
+ * flush_buffer
+ * <p>
+ * Write the buffer to the file with as few writes as the file takes.
+ * </p>
+ * @param log the log
+ */
+static void flush_buffer(struct access_log *log);
+
+/**
+ * read_clock
+ * <p>
+ * Read a clock in nanoseconds.
+ * </p>
+ * @param clock the clock
+ * @return the time in nanoseconds
+ */
+static uint64_t read_clock(clockid_t clock);
+
+int access_log_init(struct access_log *log, struct memory_manager *mm)
+{
+    int status;
+
+    memset(log, 0, sizeof(struct access_log));
+    log->mm = mm;
+    atomic_init(&log->running, false);
+    atomic_init(&log->num_rings, 0);
+    atomic_init(&log->next_index, 0);
+
+    status = pthread_mutex_init(&log->lock, NULL);
+    if (status != 0)
+    {
+        errno = status;
+        return -1;
+    }
+
+    return 0;
+}
+
+int access_log_start(struct access_log *log, FILE *file)
+{
+    int status;
+
+    if (fputs(ACCESS_LOG_HEADER, file) == EOF || fflush(file) == EOF)
+    {
+        return -1;
+    }
+    log->file = file;
+
+    // The anchors are read back to back, so a monotonic time maps onto the wall clock within a tick
+    clock_gettime(CLOCK_REALTIME, &log->wall_anchor);
+    log->monotonic_anchor_ns = access_log_now();
+
+    atomic_store(&log->running, true);
+    status = pthread_create(&log->writer, NULL, writer_thread, log);
+    if (status != 0)
+    {
+        atomic_store(&log->running, false);
+        errno = status;
+        return -1;
+    }
+    log->started = true;
+
+    return 0;
+}
+
+struct access_log_ring *access_log_register(struct access_log *log)
+{
+    struct access_log_ring *ring;
+    size_t                 num_rings;
+
+    if (!log->started)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&log->lock);
+    num_rings = atomic_load_explicit(&log->num_rings, memory_order_relaxed);
+    if (num_rings == ACCESS_LOG_MAX_RINGS)
+    {
+        pthread_mutex_unlock(&log->lock);
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    ring = (struct access_log_ring *) Mmm_calloc(1, sizeof(struct access_log_ring), log->mm);
+    if (!ring)
+    {
+        pthread_mutex_unlock(&log->lock);
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+
+    // Published after it is set up; the writer only looks at rings below num_rings
+    log->rings[num_rings] = ring;
+    atomic_store_explicit(&log->num_rings, num_rings + 1, memory_order_release);
+    pthread_mutex_unlock(&log->lock);
+
+    return ring;
+}
+
+uint64_t access_log_now(void)
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+    return read_clock(CLOCK_MONOTONIC_COARSE);
+#else
+    return read_clock(CLOCK_MONOTONIC);
+#endif
+}
+
+void access_log_accept(struct access_log *log, struct connection *conn)
+{
+    conn->index      = atomic_fetch_add_explicit(&log->next_index, 1, memory_order_relaxed);
+    conn->opened_ns  = access_log_now();
+    conn->bytes_read = 0;
+}
+
+bool access_log_close(struct access_log_ring *ring, const struct connection *conn)
+{
+    struct access_log_record *record;
+    uint64_t                 head;
+
+    if (!ring)
+    {
+        return false;
+    }
+
+    // Only this thread moves head, so it is read relaxed; tail is read only when the ring looks full
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->cached_tail == ACCESS_LOG_RING_SIZE)
+    {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->cached_tail == ACCESS_LOG_RING_SIZE)
+        {
+            atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                                  memory_order_relaxed);
+            return false;
+        }
+    }
+
+    record                   = &ring->records[head & ACCESS_LOG_RING_MASK];
+    record->connection_index = conn->index;
+    record->bytes_read       = conn->bytes_read;
+    record->start_ns         = conn->opened_ns;
+    record->end_ns           = access_log_now();
+    record->addr             = conn->addr.sin_addr;
+    record->port             = ntohs(conn->addr.sin_port);
+    record->fd               = conn->fd;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    return true;
+}
+
+void access_log_stop(struct access_log *log)
+{
+    uint64_t dropped;
+    size_t   num_rings;
+
+    if (!log->started)
+    {
+        return;
+    }
+    atomic_store(&log->running, false);
+    (void) pthread_join(log->writer, NULL);
+    log->started = false;
+
+    dropped   = 0;
+    num_rings = atomic_load(&log->num_rings);
+    for (size_t i = 0; i < num_rings; ++i)
+    {
+        dropped += atomic_load(&log->rings[i]->dropped);
+    }
+    if (dropped > 0)
+    {
+        (void) fprintf(stderr, "Access log: %" PRIu64 " rows written, %" PRIu64 " dropped because a ring was full\n",
+                       log->rows_written, dropped);
+    }
+}
+
+static void *writer_thread(void *arg)
+{
+    struct access_log     *log = (struct access_log *) arg;
+    const struct timespec interval = {0, (long) (ACCESS_LOG_FLUSH_INTERVAL_MS * NS_PER_MS)};
+    bool                  running;
+    uint64_t              drained;
+
+    do
+    {
+        // Read before draining, so the last pass sees everything pushed before the stop
+        running = atomic_load(&log->running);
+        drained = 0;
+        for (size_t i = 0; i < atomic_load_explicit(&log->num_rings, memory_order_acquire); ++i)
+        {
+            drained += drain_ring(log, log->rings[i]);
+        }
+        flush_buffer(log);
+
+        if (running && drained == 0)
+        {
+            (void) nanosleep(&interval, NULL);
+        }
+    } while (running);
+
+    return NULL;
+}
+
+static uint64_t drain_ring(struct access_log *log, struct access_log_ring *ring)
+{
+    uint64_t tail;
+    uint64_t head;
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    for (uint64_t i = tail; i != head; ++i)
+    {
+        if (log->buffer_length + ACCESS_LOG_MAX_ROW > sizeof(log->buffer))
+        {
+            flush_buffer(log);
+        }
+        format_record(log, &ring->records[i & ACCESS_LOG_RING_MASK]);
+    }
+    // The slots are free for the producer once the rows are formatted
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+
+    return head - tail;
+}
+
+static void format_record(struct access_log *log, const struct access_log_record *record)
+{
+    char     addr_str[INET_ADDRSTRLEN];
+    uint64_t wall_anchor_ns;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t elapsed_ns;
+    int      length;
+
+    wall_anchor_ns = (uint64_t) log->wall_anchor.tv_sec * NS_PER_SECOND + (uint64_t) log->wall_anchor.tv_nsec;
+    start_ns       = wall_anchor_ns + (record->start_ns - log->monotonic_anchor_ns);
+    end_ns         = wall_anchor_ns + (record->end_ns - log->monotonic_anchor_ns);
+    elapsed_ns     = record->end_ns - record->start_ns;
+
+    length = snprintf(&log->buffer[log->buffer_length], sizeof(log->buffer) - log->buffer_length,
+                      "%" PRIu64 ",%" PRId32 ",%s,%u,%" PRIu64 ",%" PRIu64 ".%03" PRIu64 ",%" PRIu64 ".%03" PRIu64
+                      ",%" PRIu64 ".%03" PRIu64 "\n",
+                      record->connection_index, record->fd,
+                      inet_ntop(AF_INET, &record->addr, addr_str, sizeof(addr_str)), (unsigned) record->port,
+                      record->bytes_read,
+                      start_ns / NS_PER_SECOND, start_ns % NS_PER_SECOND / NS_PER_MS,
+                      end_ns / NS_PER_SECOND, end_ns % NS_PER_SECOND / NS_PER_MS,
+                      elapsed_ns / NS_PER_SECOND, elapsed_ns % NS_PER_SECOND / NS_PER_MS);
+    if (length > 0 && (size_t) length < sizeof(log->buffer) - log->buffer_length)
+    {
+        log->buffer_length += (size_t) length;
+        ++log->rows_written;
+    }
+}
+
+static void flush_buffer(struct access_log *log)
+{
+    size_t written;
+
+    written = 0;
+    while (written < log->buffer_length)
+    {
+        ssize_t result = write(fileno(log->file), &log->buffer[written], log->buffer_length - written);
+
+        if (result == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // NOLINTNEXTLINE(concurrency-mt-unsafe) : only the writer thread reports here
+            (void) fprintf(stderr, "Access log: could not write: %s\n", strerror(errno));
+            break;
+        }
+        written += (size_t) result;
+    }
+    log->buffer_length = 0;
+}
+
+static uint64_t read_clock(clockid_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+    return (uint64_t) now.tv_sec * NS_PER_SECOND + (uint64_t) now.tv_nsec;
+}
@@ -0,0 +1,201 @@
+#include "arena.h"
+
+#include <errno.h>
+#include <mem_manager/manager.h>
+#include <stdalign.h>
+#include <stdint.h>
+
+/**
+ * block_size
+ * <p>
+ * Get the size of the blocks of a size class, header included.
+ * </p>
+ * @param size_class the size class
+ * @return the size in bytes
+ */
+static size_t block_size(size_t size_class);
+
+/**
+ * pool_take
+ * <p>
+ * Take a block with room for <size> bytes from the pool, allocating it if its free list is empty.
+ * </p>
+ * @param pool the pool
+ * @param size the number of bytes needed
+ * @return the block. NULL and set errno on failure.
+ */
+static struct arena_block *pool_take(struct arena_pool *pool, size_t size);
+
+int arena_pool_init(struct arena_pool *pool, struct memory_manager *mm)
+{
+    int result;
+
+    pool->mm               = mm;
+    pool->blocks_allocated = 0;
+    for (size_t i = 0; i < ARENA_NUM_CLASSES; i++)
+    {
+        pool->free_blocks[i] = NULL;
+    }
+    result = pthread_mutex_init(&pool->lock, NULL);
+    if (result != 0)
+    {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
+
+void arena_pool_destroy(struct arena_pool *pool)
+{
+    pthread_mutex_destroy(&pool->lock);
+}
+
+void arena_init(struct arena *arena, struct arena_pool *pool)
+{
+    arena->pool    = pool;
+    arena->first   = NULL;
+    arena->current = NULL;
+    arena->used    = 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_block *block;
+    size_t              aligned;
+
+    aligned = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    if (aligned < size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Bump within the current block.
+    if (arena->current && aligned <= arena->current->capacity - arena->used)
+    {
+        void *ptr = (char *) arena->current->data + arena->used;
+        arena->used += aligned;
+        return ptr;
+    }
+
+    // Move on to a block kept from before the last reset, or put a new one in its place.
+    block = arena->current ? arena->current->next : arena->first;
+    if (!block || block->capacity < aligned)
+    {
+        block = pool_take(arena->pool, aligned);
+        if (!block)
+        {
+            return NULL;
+        }
+        if (arena->current)
+        {
+            block->next          = arena->current->next;
+            arena->current->next = block;
+        }
+        else
+        {
+            block->next  = arena->first;
+            arena->first = block;
+        }
+    }
+    arena->current = block;
+    arena->used    = aligned;
+
+    return block->data;
+}
+
+struct arena_mark arena_get_mark(const struct arena *arena)
+{
+    struct arena_mark mark = {arena->current, arena->used};
+    return mark;
+}
+
+void arena_reset(struct arena *arena, struct arena_mark mark)
+{
+    arena->current = mark.block;
+    arena->used    = mark.used;
+}
+
+void arena_release(struct arena *arena)
+{
+    struct arena_block *block;
+    struct arena_pool  *pool = arena->pool;
+
+    // An arena that never allocated a block is already empty; keep the shared lock out of it
+    if (arena->first == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    block = arena->first;
+    while (block)
+    {
+        struct arena_block *next = block->next;
+
+        block->next = pool->free_blocks[block->size_class];
+        pool->free_blocks[block->size_class] = block;
+        block = next;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    arena_init(arena, pool);
+}
+
+static size_t block_size(size_t size_class)
+{
+    size_t size = ARENA_MIN_BLOCK_SIZE;
+    for (size_t i = 0; i < size_class; i++)
+    {
+        size *= ARENA_CLASS_FACTOR;
+    }
+    return size;
+}
+
+static struct arena_block *pool_take(struct arena_pool *pool, size_t size)
+{
+    struct arena_block *block;
+    size_t              size_class;
+
+    for (size_class = 0; size_class < ARENA_NUM_CLASSES; size_class++)
+    {
+        if (size <= block_size(size_class) - sizeof(struct arena_block))
+        {
+            break;
+        }
+    }
+    if (size_class == ARENA_NUM_CLASSES)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    block = pool->free_blocks[size_class];
+    if (block)
+    {
+        pool->free_blocks[size_class] = block->next;
+    }
+    else
+    {
+        // The memory manager is not thread safe; the lock covers it too.
+        block = (struct arena_block *) Mmm_calloc(1, block_size(size_class), pool->mm);
+        if (block)
+        {
+            block->capacity   = block_size(size_class) - sizeof(struct arena_block);
+            block->size_class = size_class;
+            pool->blocks_allocated++;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!block)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    block->next = NULL;
+
+    return block;
+}
@@ -0,0 +1,349 @@
+#include <output_queue.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+/**
+ * The most bytes copied into one segment, well under the largest arena block.
+ */
+#define COPY_CHUNK_SIZE 16384
+
+/**
+ * The most bytes of a file sent with one call.
+ */
+#define FILE_CHUNK_SIZE (1 << 30)
+
+/**
+ * The buffer a file goes through when it cannot be sent straight from the page cache.
+ */
+#define FILE_COPY_BUFFER_SIZE 16384
+
+/**
+ * new_segment
+ * <p>
+ * Allocate a segment with room for some bytes after it and append it to the queue.
+ * </p>
+ * @param queue the queue
+ * @param extra the number of bytes after the segment
+ * @return the segment, with every field but next unset. NULL and set errno on failure.
+ */
+static struct output_segment *new_segment(struct output_queue *queue, size_t extra);
+
+/**
+ * pop_segment
+ * <p>
+ * Take the first segment off the queue, closing its file or calling its release.
+ * </p>
+ * @param queue the queue
+ */
+static void pop_segment(struct output_queue *queue);
+
+/**
+ * send_memory
+ * <p>
+ * Send the run of memory segments at the start of the queue with one sendmsg.
+ * </p>
+ * @param queue the queue
+ * @param fd the socket
+ * @return the number of bytes sent. On failure, -1 and set errno.
+ */
+static ssize_t send_memory(struct output_queue *queue, int fd);
+
+/**
+ * send_file
+ * <p>
+ * Send the file range at the start of the queue, from the page cache when the file allows it.
+ * </p>
+ * @param segment the file range
+ * @param fd the socket
+ * @return the number of bytes sent. On failure, -1 and set errno.
+ */
+static ssize_t send_file(struct output_segment *segment, int fd);
+
+/**
+ * copy_file
+ * <p>
+ * Send part of a file range through a userspace buffer.
+ * </p>
+ * @param segment the file range
+ * @param fd the socket
+ * @return the number of bytes sent. On failure, -1 and set errno.
+ */
+static ssize_t copy_file(struct output_segment *segment, int fd);
+
+void output_queue_init(struct output_queue *queue, struct arena_pool *pool)
+{
+    arena_init(&queue->arena, pool);
+    queue->head = NULL;
+    queue->tail = NULL;
+}
+
+bool output_queue_empty(const struct output_queue *queue)
+{
+    return queue->head == NULL;
+}
+
+int output_queue_push(struct output_queue *queue, const void *data, size_t length, bool copy)
+{
+    struct output_segment *segment;
+
+    if (!copy)
+    {
+        segment = new_segment(queue, 0);
+        if (!segment)
+        {
+            return -1;
+        }
+        segment->data   = (const char *) data;
+        segment->length = length;
+        return 0;
+    }
+
+    while (length > 0)
+    {
+        const size_t chunk = (length > COPY_CHUNK_SIZE) ? COPY_CHUNK_SIZE : length;
+
+        segment = new_segment(queue, chunk);
+        if (!segment)
+        {
+            return -1;
+        }
+        memcpy(segment + 1, data, chunk);
+        segment->data   = (const char *) (segment + 1);
+        segment->length = chunk;
+        data = (const char *) data + chunk;
+        length -= chunk;
+    }
+
+    return 0;
+}
+
+int output_queue_push_file(struct output_queue *queue, int file_fd, off_t offset, off_t end)
+{
+    struct output_segment *segment;
+
+    segment = new_segment(queue, 0);
+    if (!segment)
+    {
+        (void) close(file_fd);
+        return -1;
+    }
+    segment->file_fd = file_fd;
+    segment->offset  = offset;
+    segment->end     = end;
+
+    return 0;
+}
+
+int output_queue_push_release(struct output_queue *queue, output_release release, void *owner)
+{
+    struct output_segment *segment;
+
+    segment = new_segment(queue, 0);
+    if (!segment)
+    {
+        return -1;
+    }
+    segment->release = release;
+    segment->owner   = owner;
+
+    return 0;
+}
+
+int output_queue_send(struct output_queue *queue, int fd, size_t *sent)
+{
+    ssize_t result;
+
+    *sent = 0;
+    while (queue->head)
+    {
+        struct output_segment *segment = queue->head;
+
+        if (segment->data)
+        {
+            result = send_memory(queue, fd);
+        } else if (segment->file_fd != -1)
+        {
+            result = send_file(segment, fd);
+            if (result > 0 && segment->offset >= segment->end)
+            {
+                pop_segment(queue);
+            }
+        } else
+        {
+            pop_segment(queue);
+            continue;
+        }
+
+        if (result == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                errno = 0;
+                return 0;
+            }
+            return -1;
+        }
+        *sent += (size_t) result;
+    }
+
+    // Drained: the blocks go back to the pool until the connection falls behind again
+    arena_release(&queue->arena);
+    queue->tail = NULL;
+
+    return 0;
+}
+
+void output_queue_clear(struct output_queue *queue)
+{
+    while (queue->head)
+    {
+        pop_segment(queue);
+    }
+    arena_release(&queue->arena);
+    queue->tail = NULL;
+}
+
+static struct output_segment *new_segment(struct output_queue *queue, size_t extra)
+{
+    struct output_segment *segment;
+
+    segment = (struct output_segment *) arena_alloc(&queue->arena, sizeof(struct output_segment) + extra);
+    if (!segment)
+    {
+        return NULL;
+    }
+    memset(segment, 0, sizeof(struct output_segment));
+    segment->file_fd = -1;
+
+    if (queue->tail)
+    {
+        queue->tail->next = segment;
+    } else
+    {
+        queue->head = segment;
+    }
+    queue->tail = segment;
+
+    return segment;
+}
+
+static void pop_segment(struct output_queue *queue)
+{
+    struct output_segment *segment = queue->head;
+
+    queue->head = segment->next;
+    if (!queue->head)
+    {
+        queue->tail = NULL;
+    }
+    if (segment->file_fd != -1)
+    {
+        (void) close(segment->file_fd);
+    }
+    if (segment->release)
+    {
+        segment->release(segment->owner);
+    }
+}
+
+static ssize_t send_memory(struct output_queue *queue, int fd)
+{
+    struct iovec          iov[OUTPUT_QUEUE_MAX_IOV];
+    struct msghdr         msg;
+    struct output_segment *segment;
+    int                   iov_count = 0;
+    ssize_t               result;
+    size_t                left;
+
+    for (segment = queue->head; segment && segment->data && iov_count < OUTPUT_QUEUE_MAX_IOV; segment = segment->next)
+    {
+        iov[iov_count].iov_base = (void *) (uintptr_t) segment->data; // only ever read
+        iov[iov_count].iov_len  = segment->length;
+        ++iov_count;
+    }
+
+    // sendmsg rather than writev, for MSG_NOSIGNAL
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = (size_t) iov_count;
+    result = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (result == -1)
+    {
+        return -1;
+    }
+
+    // Drop the segments that went out whole, then trim the one that went out in part
+    left = (size_t) result;
+    while (queue->head && queue->head->data && left >= queue->head->length)
+    {
+        left -= queue->head->length;
+        pop_segment(queue);
+    }
+    if (left > 0)
+    {
+        queue->head->data += left;
+        queue->head->length -= left;
+    }
+
+    return result;
+}
+
+static ssize_t send_file(struct output_segment *segment, int fd)
+{
+#ifdef __linux__
+    const off_t left = segment->end - segment->offset;
+    ssize_t     result;
+
+    result = sendfile(fd, segment->file_fd, &segment->offset, (left > FILE_CHUNK_SIZE) ? FILE_CHUNK_SIZE : (size_t) left);
+    if (result == 0)
+    {
+        errno = EIO; // the file shrank under us
+        return -1;
+    }
+    if (result == -1 && (errno == EINVAL || errno == ENOSYS))
+    {
+        return copy_file(segment, fd);
+    }
+    return result;
+#else
+    return copy_file(segment, fd);
+#endif
+}
+
+static ssize_t copy_file(struct output_segment *segment, int fd)
+{
+    char    buffer[FILE_COPY_BUFFER_SIZE];
+    const off_t left = segment->end - segment->offset;
+    ssize_t bytes_read;
+    ssize_t result;
+
+    bytes_read = pread(segment->file_fd, buffer, (left > FILE_COPY_BUFFER_SIZE) ? FILE_COPY_BUFFER_SIZE : (size_t) left,
+                       segment->offset);
+    if (bytes_read <= 0)
+    {
+        if (bytes_read == 0)
+        {
+            errno = EIO;
+        }
+        return -1;
+    }
+
+    // What the socket does not take is read again next time
+    result = send(fd, buffer, (size_t) bytes_read, MSG_NOSIGNAL);
+    if (result > 0)
+    {
+        segment->offset += result;
+    }
+    return result;
+}
@@ -1,9 +1,10 @@
 #include <receiver.h>
+#include <scan.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <string.h>
 #include <stdio.h>
 #include <util.h>
-#include <stdbool.h>
 
 void receiver_init(struct receiver * this, int fd) {
     this->fd = fd;
@@ -63,72 +64,48 @@ enum read_fully_result receiver_read(struct receiver * this, void * data, uint32
     }
 }
 
-// returns whether the delimiter was successfully reached
-static bool receiver_deliver_until(struct receiver * this, void * data, uint32_t* ret_size, char delimiter) {
-    uint32_t ret_buf_size = *ret_size;
-    uint32_t max_ind = this->end - this->start;
-    if (max_ind > ret_buf_size) {
-        max_ind = ret_buf_size;
-    }
-    max_ind += this->start;
-    // First deliver preexisting data, if any
-    for (uint32_t ind = this->start; ind < max_ind; ++ind) {
-        if (this->buffer[ind] != delimiter) {
-            *(char*)(data++) = this->buffer[ind];
-        } else {
-            *ret_size = ind - this->start;
-            this->start = ind;
-            return true;
-        }
-    }
-    if (ret_buf_size < this->end - this->start) { // <data> buffer was not enough
-        // Invalid request
-        // ret_size remains unchanged as the whole buffer was used
-        this->start = max_ind;
-        // Check for an edge case. There's a chance the delimiter is in preexisting data
-        return this->buffer[max_ind] == delimiter;
-    }
-    // else if (ret_buf_size == this->end - this->start) {
-    // Still can check what goes after, but it's not in preexisting data. Need to read more from the socket.
-    // So doing nothing here.
-    // }
-    // Not reached delimiter yet, resetting the buffer
-    *ret_size = this->end - this->start;
-    this->start = this->end = 0;
-
-    return false;
-}
-
-
 enum read_fully_result receiver_read_until(struct receiver * this, void * data, uint32_t* ret_size, char delimiter) {
-    uint32_t ret_buf_size = *ret_size; // Indicates how much space is left in the output buffer
-    bool reached; // reached the delimiter
-    do {
-        uint32_t delivered_size = ret_buf_size;
-        reached = receiver_deliver_until(this, data, &delivered_size, delimiter);
-        data += delivered_size;
-        ret_buf_size -= delivered_size;
-        if (reached) {
-            *ret_size -= ret_buf_size;
-            return READ_FULLY_SUCCESS;
-        } else {
-            if (ret_buf_size != 0) {
-                // The buffer is empty at this point
-                ssize_t result = recv(this->fd, this->buffer, RECEIVER_BUFFER_LENGTH, MSG_NOSIGNAL);
-                if (result == -1) {
-                    perror("receiver_read_until");
-                    return READ_FULLY_FAILURE;
-                }
-                if (result == 0) {
-                    // If it came to this, there was not enough data in the socket
-                    return READ_FULLY_EOF;
-                }
-                this->end = result;
+    char * out = data;
+    uint32_t room = *ret_size; // Indicates how much space is left in the output buffer
+    for (;;) {
+        uint32_t searched = this->end - this->start;
+        if (searched > room) {
+            searched = room;
+        }
+        const char * found = scan_byte(&this->buffer[this->start], searched, delimiter);
+        uint32_t deliver = found ? (uint32_t)(found - &this->buffer[this->start]) : searched;
+        memcpy(out, &this->buffer[this->start], deliver);
+        out += deliver;
+        room -= deliver;
+        this->start += deliver;
+        if (found) {
+            break;
+        }
+        if (room == 0) {
+            // Ran out of space in the output buffer. Still fine if the delimiter is right after,
+            // otherwise it is an invalid request
+            if (this->start < this->end && this->buffer[this->start] == delimiter) {
+                break;
             }
+            return READ_FULLY_UNEXPECTED_RESULT;
         }
-    } while (ret_buf_size);
 
-    // Ran out of space in the output buffer yet not reached the delimiter yet
-    // Invalid request
-    return READ_FULLY_UNEXPECTED_RESULT;
+        // Not reached delimiter yet and the buffer is empty at this point
+        this->start = this->end = 0;
+        ssize_t result;
+        do {
+            result = recv(this->fd, this->buffer, RECEIVER_BUFFER_LENGTH, MSG_NOSIGNAL);
+        } while (result == -1 && errno == EINTR);
+        if (result == -1) {
+            perror("receiver_read_until");
+            return READ_FULLY_FAILURE;
+        }
+        if (result == 0) {
+            // If it came to this, there was not enough data in the socket
+            return READ_FULLY_EOF;
+        }
+        this->end = result;
+    }
+    *ret_size -= room;
+    return READ_FULLY_SUCCESS;
 }
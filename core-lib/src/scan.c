@@ -0,0 +1,203 @@
+#include <scan.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#else
+#define SCAN_X86 0
+#endif
+
+struct scan_functions {
+    const char * name;
+    const char * (*byte)(const char *, size_t, char);
+    const char * (*crlf)(const char *, size_t);
+    const char * (*head)(const char *, size_t, const char **);
+};
+
+static const char * scan_byte_scalar(const char * data, size_t length, char byte) {
+    return memchr(data, byte, length);
+}
+
+static const char * scan_crlf_scalar(const char * data, size_t length) {
+    const char * end = data + length;
+    while (end - data >= 2) {
+        const char * cr = memchr(data, '\r', end - data - 1);
+        if (!cr) {
+            return NULL;
+        }
+        if (cr[1] == '\n') {
+            return cr;
+        }
+        data = cr + 1;
+    }
+    return NULL;
+}
+
+static const char * scan_head_scalar(const char * data, size_t length, const char ** line_end) {
+    const char * end = data + length;
+    while (end - data >= 2) {
+        const char * crlf = scan_crlf_scalar(data, end - data);
+        if (!crlf) {
+            return NULL;
+        }
+        if (!*line_end) {
+            *line_end = crlf;
+        }
+        if (end - crlf >= 4 && crlf[2] == '\r' && crlf[3] == '\n') {
+            return crlf;
+        }
+        data = crlf + 1;
+    }
+    return NULL;
+}
+
+#if SCAN_X86
+
+// Each loop compares a vector of bytes at every offset the pattern needs and ANDs the masks.
+// Loads are unaligned; the bytes left past the last whole vector go to the scalar version.
+
+__attribute__((target("sse2")))
+static const char * scan_byte_sse2(const char * data, size_t length, char byte) {
+    const __m128i needle = _mm_set1_epi8(byte);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const void *) &data[i]);
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask) {
+            return &data[i + __builtin_ctz(mask)];
+        }
+    }
+    return scan_byte_scalar(&data[i], length - i, byte);
+}
+
+__attribute__((target("sse2")))
+static const char * scan_crlf_sse2(const char * data, size_t length) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 17 <= length; i += 16) {
+        __m128i at_cr = _mm_cmpeq_epi8(_mm_loadu_si128((const void *) &data[i]), cr);
+        __m128i at_lf = _mm_cmpeq_epi8(_mm_loadu_si128((const void *) &data[i + 1]), lf);
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_and_si128(at_cr, at_lf));
+        if (mask) {
+            return &data[i + __builtin_ctz(mask)];
+        }
+    }
+    return scan_crlf_scalar(&data[i], length - i);
+}
+
+__attribute__((target("sse2")))
+static const char * scan_head_sse2(const char * data, size_t length, const char ** line_end) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 19 <= length; i += 16) {
+        __m128i crlf = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const void *) &data[i]), cr),
+                                     _mm_cmpeq_epi8(_mm_loadu_si128((const void *) &data[i + 1]), lf));
+        unsigned crlf_mask = (unsigned) _mm_movemask_epi8(crlf);
+        if (!crlf_mask) {
+            continue;
+        }
+        if (!*line_end) {
+            *line_end = &data[i + __builtin_ctz(crlf_mask)];
+        }
+        __m128i next_crlf = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const void *) &data[i + 2]), cr),
+                                          _mm_cmpeq_epi8(_mm_loadu_si128((const void *) &data[i + 3]), lf));
+        unsigned head_mask = crlf_mask & (unsigned) _mm_movemask_epi8(next_crlf);
+        if (head_mask) {
+            return &data[i + __builtin_ctz(head_mask)];
+        }
+    }
+    return scan_head_scalar(&data[i], length - i, line_end);
+}
+
+__attribute__((target("avx2")))
+static const char * scan_byte_avx2(const char * data, size_t length, char byte) {
+    const __m256i needle = _mm256_set1_epi8(byte);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const void *) &data[i]);
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask) {
+            return &data[i + __builtin_ctz(mask)];
+        }
+    }
+    return scan_byte_sse2(&data[i], length - i, byte);
+}
+
+__attribute__((target("avx2")))
+static const char * scan_crlf_avx2(const char * data, size_t length) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 33 <= length; i += 32) {
+        __m256i at_cr = _mm256_cmpeq_epi8(_mm256_loadu_si256((const void *) &data[i]), cr);
+        __m256i at_lf = _mm256_cmpeq_epi8(_mm256_loadu_si256((const void *) &data[i + 1]), lf);
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_and_si256(at_cr, at_lf));
+        if (mask) {
+            return &data[i + __builtin_ctz(mask)];
+        }
+    }
+    return scan_crlf_sse2(&data[i], length - i);
+}
+
+__attribute__((target("avx2")))
+static const char * scan_head_avx2(const char * data, size_t length, const char ** line_end) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 35 <= length; i += 32) {
+        __m256i crlf = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const void *) &data[i]), cr),
+                                        _mm256_cmpeq_epi8(_mm256_loadu_si256((const void *) &data[i + 1]), lf));
+        unsigned crlf_mask = (unsigned) _mm256_movemask_epi8(crlf);
+        if (!crlf_mask) {
+            continue;
+        }
+        if (!*line_end) {
+            *line_end = &data[i + __builtin_ctz(crlf_mask)];
+        }
+        __m256i next_crlf = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const void *) &data[i + 2]), cr),
+                                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const void *) &data[i + 3]), lf));
+        unsigned head_mask = crlf_mask & (unsigned) _mm256_movemask_epi8(next_crlf);
+        if (head_mask) {
+            return &data[i + __builtin_ctz(head_mask)];
+        }
+    }
+    return scan_head_sse2(&data[i], length - i, line_end);
+}
+
+#endif
+
+static struct scan_functions scan_functions = {
+        "scalar", scan_byte_scalar, scan_crlf_scalar, scan_head_scalar
+};
+
+// Runs before main, so the choice is made once and never races with the reactor threads
+__attribute__((constructor))
+static void scan_select(void) {
+#if SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_functions = (struct scan_functions) {"avx2", scan_byte_avx2, scan_crlf_avx2, scan_head_avx2};
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_functions = (struct scan_functions) {"sse2", scan_byte_sse2, scan_crlf_sse2, scan_head_sse2};
+    }
+#endif
+}
+
+const char * scan_byte(const char * data, size_t length, char byte) {
+    return scan_functions.byte(data, length, byte);
+}
+
+const char * scan_crlf(const char * data, size_t length) {
+    return scan_functions.crlf(data, length);
+}
+
+const char * scan_head(const char * data, size_t length, const char ** line_end) {
+    return scan_functions.head(data, length, line_end);
+}
+
+const char * scan_implementation(void) {
+    return scan_functions.name;
+}
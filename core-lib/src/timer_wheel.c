@@ -0,0 +1,256 @@
+#include <timer_wheel.h>
+
+#include <limits.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/**
+ * The furthest deadline the wheel holds, in ticks from now.
+ */
+#define MAX_DELTA ((UINT64_C(1) << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+/**
+ * list_init
+ * <p>
+ * Make an empty list.
+ * </p>
+ * @param head the head of the list
+ */
+static void list_init(struct timer *head);
+
+/**
+ * list_empty
+ * @param head the head of a list
+ * @return whether the list is empty
+ */
+static bool list_empty(const struct timer *head);
+
+/**
+ * list_link
+ * <p>
+ * Append a timer to a list.
+ * </p>
+ * @param head the head of the list
+ * @param timer the timer
+ */
+static void list_link(struct timer *head, struct timer *timer);
+
+/**
+ * list_unlink
+ * <p>
+ * Take a timer off its list and mark it as not pending.
+ * </p>
+ * @param timer the timer
+ */
+static void list_unlink(struct timer *timer);
+
+/**
+ * list_move
+ * <p>
+ * Move every timer of a list to another, empty, list.
+ * </p>
+ * @param from the head of the list to empty
+ * @param to the head of the empty list
+ */
+static void list_move(struct timer *from, struct timer *to);
+
+/**
+ * place
+ * <p>
+ * Link a timer into the slot its deadline falls in, seen from the current tick: the lowest
+ * level whose current turn contains the deadline. The deadline is no earlier than the current
+ * tick; a timer cascaded on the tick it expires lands in the level 0 slot about to fire.
+ * </p>
+ * @param wheel the wheel
+ * @param timer the timer, with its deadline in ticks set
+ */
+static void place(struct timer_wheel *wheel, struct timer *timer);
+
+/**
+ * cascade
+ * <p>
+ * Move the timers of the slot of a level that the wheel has just reached down to the levels below.
+ * </p>
+ * @param wheel the wheel
+ * @param level the level, at least 1
+ */
+static void cascade(struct timer_wheel *wheel, unsigned level);
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms)
+{
+    wheel->now         = now_ms / TIMER_WHEEL_TICK_MS;
+    wheel->num_pending = 0;
+    for (size_t level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+    {
+        for (size_t slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot)
+        {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+void timer_wheel_add(struct timer_wheel *wheel, struct timer *timer, uint64_t deadline_ms)
+{
+    timer_wheel_cancel(wheel, timer);
+    // Rounded up, so a timer never fires before its deadline
+    timer->expires = (deadline_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+
+    // The current tick has been processed already, and the top level only spans so far
+    if (timer->expires <= wheel->now)
+    {
+        timer->expires = wheel->now + 1;
+    } else if (timer->expires - wheel->now > MAX_DELTA)
+    {
+        timer->expires = wheel->now + MAX_DELTA;
+    }
+    place(wheel, timer);
+    ++wheel->num_pending;
+}
+
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+    if (timer_pending(timer))
+    {
+        list_unlink(timer);
+        --wheel->num_pending;
+    }
+}
+
+bool timer_pending(const struct timer *timer)
+{
+    return timer->next != NULL;
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ms, timer_expired expired, void *arg)
+{
+    const uint64_t target = now_ms / TIMER_WHEEL_TICK_MS;
+    struct timer   expiring;
+
+    while (wheel->now < target)
+    {
+        // Nothing to cascade or fire, however far the clock has moved
+        if (wheel->num_pending == 0)
+        {
+            wheel->now = target;
+            break;
+        }
+        ++wheel->now;
+
+        // From the top, as a slot moved down may land in the slot the level below starts on this tick
+        for (unsigned level = TIMER_WHEEL_LEVELS - 1; level > 0; --level)
+        {
+            if ((wheel->now & ((UINT64_C(1) << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) == 0)
+            {
+                cascade(wheel, level);
+            }
+        }
+
+        // Off the wheel first, so the callbacks can add and cancel timers freely
+        list_init(&expiring);
+        list_move(&wheel->slots[0][wheel->now & SLOT_MASK], &expiring);
+        while (!list_empty(&expiring))
+        {
+            struct timer *timer = expiring.next;
+
+            list_unlink(timer);
+            --wheel->num_pending;
+            expired(timer, arg);
+        }
+    }
+}
+
+int timer_wheel_timeout(const struct timer_wheel *wheel, uint64_t now_ms)
+{
+    uint64_t tick;
+    uint64_t deadline_ms;
+
+    if (wheel->num_pending == 0)
+    {
+        return -1;
+    }
+
+    // The rest of level 0's turn, then the start of the next turn
+    tick = wheel->now + 1;
+    while ((tick & SLOT_MASK) != 0 && list_empty(&wheel->slots[0][tick & SLOT_MASK]))
+    {
+        ++tick;
+    }
+
+    deadline_ms = tick * TIMER_WHEEL_TICK_MS;
+    if (deadline_ms <= now_ms)
+    {
+        return 0;
+    }
+    return (deadline_ms - now_ms > INT_MAX) ? INT_MAX : (int) (deadline_ms - now_ms);
+}
+
+static void list_init(struct timer *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static bool list_empty(const struct timer *head)
+{
+    return head->next == head;
+}
+
+static void list_link(struct timer *head, struct timer *timer)
+{
+    timer->next       = head;
+    timer->prev       = head->prev;
+    head->prev->next  = timer;
+    head->prev        = timer;
+}
+
+static void list_unlink(struct timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next       = NULL;
+    timer->prev       = NULL;
+}
+
+static void list_move(struct timer *from, struct timer *to)
+{
+    if (list_empty(from))
+    {
+        return;
+    }
+    to->next         = from->next;
+    to->prev         = from->prev;
+    to->next->prev   = to;
+    to->prev->next   = to;
+    list_init(from);
+}
+
+static void place(struct timer_wheel *wheel, struct timer *timer)
+{
+    unsigned level;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; ++level)
+    {
+        const unsigned turn_bits = TIMER_WHEEL_SLOT_BITS * (level + 1);
+
+        if ((timer->expires >> turn_bits) == (wheel->now >> turn_bits))
+        {
+            break;
+        }
+    }
+    list_link(&wheel->slots[level][(timer->expires >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK], timer);
+}
+
+static void cascade(struct timer_wheel *wheel, unsigned level)
+{
+    struct timer moving;
+
+    list_init(&moving);
+    list_move(&wheel->slots[level][(wheel->now >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK], &moving);
+    while (!list_empty(&moving))
+    {
+        struct timer *timer = moving.next;
+
+        list_unlink(timer);
+        place(wheel, timer);
+    }
+}
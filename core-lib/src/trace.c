@@ -0,0 +1,374 @@
+#define _GNU_SOURCE // syscall
+#include <trace.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <mem_manager/manager.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define NS_PER_SECOND UINT64_C(1000000000)
+#define NS_PER_US 1000.0
+
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+#define TRACE_FILE_NAME "trace-%ld-%u.json"
+
+#if (TRACE_RING_SIZE & TRACE_RING_MASK) != 0
+#error "TRACE_RING_SIZE must be a power of two"
+#endif
+
+/**
+ * dumper_thread
+ * <p>
+ * Write the rings out each time the process gets TRACE_DUMP_SIGNAL, until the log is stopped.
+ * </p>
+ * @param arg the log
+ * @return NULL
+ */
+static void *dumper_thread(void *arg);
+
+/**
+ * dump_signal_handler
+ * <p>
+ * Wake the dumper.
+ * </p>
+ * @param signal TRACE_DUMP_SIGNAL
+ */
+static void dump_signal_handler(int signal);
+
+/**
+ * dump
+ * <p>
+ * Write every ring to a new trace file.
+ * </p>
+ * @param log the log
+ */
+static void dump(struct trace_log *log);
+
+/**
+ * dump_ring
+ * <p>
+ * Copy a ring and write the events that were not overwritten while it was copied.
+ * </p>
+ * @param log the log
+ * @param ring the ring
+ * @param file the trace file
+ * @param ns_per_tick nanoseconds per tick of the trace clock
+ * @param first whether no event was written to the file yet
+ * @return whether no event was written to the file yet
+ */
+static bool dump_ring(struct trace_log *log, struct trace_ring *ring, FILE *file, double ns_per_tick, bool first);
+
+/**
+ * monotonic_ns
+ * <p>
+ * Read CLOCK_MONOTONIC.
+ * </p>
+ * @return the time in nanoseconds
+ */
+static uint64_t monotonic_ns(void);
+
+/**
+ * thread_id
+ * <p>
+ * Get an id of the calling thread that is unique in the process.
+ * </p>
+ * @param index the number of rings registered before this one
+ * @return the id
+ */
+static int32_t thread_id(size_t index);
+
+_Thread_local struct trace_ring *trace_thread_ring = NULL;
+
+// The log of the process, seen from this copy of the library
+static struct trace_log *current_log = NULL;
+
+// The end of the pipe the signal handler writes to
+static int wake_fd = -1;
+
+int trace_init(struct trace_log *log, struct memory_manager *mm)
+{
+    int status;
+
+    memset(log, 0, sizeof(struct trace_log));
+    log->mm = mm;
+    atomic_init(&log->running, false);
+    atomic_init(&log->num_rings, 0);
+
+    status = pthread_mutex_init(&log->lock, NULL);
+    if (status != 0)
+    {
+        errno = status;
+        return -1;
+    }
+
+    // Read back to back, so a trace clock tick maps onto the monotonic clock within a few nanoseconds
+    log->clock_anchor = trace_clock();
+    clock_gettime(CLOCK_MONOTONIC, &log->monotonic_anchor);
+    current_log = log;
+
+    return 0;
+}
+
+int trace_start(struct trace_log *log)
+{
+    struct sigaction sa;
+    sigset_t         set;
+    int              status;
+
+#ifndef SCALABLE_SERVER_TRACE
+    // Nothing records events, so the signal keeps its default action
+    return 0;
+#endif
+
+    current_log = log;
+    if (!log->copy)
+    {
+        log->copy = (struct trace_event *) Mmm_calloc(TRACE_RING_SIZE, sizeof(struct trace_event), log->mm);
+        if (!log->copy)
+        {
+            return -1;
+        }
+    }
+
+    if (pipe(log->wake_fds) == -1)
+    {
+        return -1;
+    }
+    wake_fd = log->wake_fds[1];
+
+    /* The event loops must not see the signal: poll is not restarted after a handler, even with SA_RESTART.
+     * They are created after this and inherit the mask; the dumper unblocks it, and so does any thread
+     * started earlier, such as the file cache watcher, which retries its interrupted reads. */
+    sigemptyset(&set);
+    sigaddset(&set, TRACE_DUMP_SIGNAL);
+    status = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (status != 0)
+    {
+        errno = status;
+        return -1;
+    }
+
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags   = SA_RESTART;
+    sa.sa_handler = dump_signal_handler;
+    if (sigaction(TRACE_DUMP_SIGNAL, &sa, NULL) == -1)
+    {
+        return -1;
+    }
+
+    atomic_store(&log->running, true);
+    status = pthread_create(&log->dumper, NULL, dumper_thread, log);
+    if (status != 0)
+    {
+        atomic_store(&log->running, false);
+        errno = status;
+        return -1;
+    }
+    log->started = true;
+
+    // NOLINTNEXTLINE(concurrency-mt-unsafe) : only reports
+    (void) fprintf(stderr, "Tracing: kill -USR2 %ld writes trace-%ld-<n>.json\n", (long) getpid(), (long) getpid());
+
+    return 0;
+}
+
+void trace_stop(struct trace_log *log)
+{
+    char byte = 0;
+
+    if (!log->started)
+    {
+        return;
+    }
+    atomic_store(&log->running, false);
+    (void) write(log->wake_fds[1], &byte, sizeof(byte));
+    (void) pthread_join(log->dumper, NULL);
+    log->started = false;
+    (void) close(log->wake_fds[0]);
+    (void) close(log->wake_fds[1]);
+}
+
+struct trace_ring *trace_register_thread(void)
+{
+    struct trace_log  *log = current_log;
+    struct trace_ring *ring;
+    size_t            num_rings;
+
+    // Checked before taking the lock, so a thread that cannot get a ring does not contend for it on every event
+    if (!log || atomic_load_explicit(&log->num_rings, memory_order_relaxed) == TRACE_MAX_RINGS)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&log->lock);
+    num_rings = atomic_load_explicit(&log->num_rings, memory_order_relaxed);
+    if (num_rings == TRACE_MAX_RINGS)
+    {
+        pthread_mutex_unlock(&log->lock);
+        return NULL;
+    }
+
+    ring = (struct trace_ring *) Mmm_calloc(1, sizeof(struct trace_ring), log->mm);
+    if (!ring)
+    {
+        pthread_mutex_unlock(&log->lock);
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    ring->thread_id = thread_id(num_rings);
+
+    // Published after it is set up; the dumper only looks at rings below num_rings
+    log->rings[num_rings] = ring;
+    atomic_store_explicit(&log->num_rings, num_rings + 1, memory_order_release);
+    pthread_mutex_unlock(&log->lock);
+
+    trace_thread_ring = ring;
+    return ring;
+}
+
+static void *dumper_thread(void *arg)
+{
+    struct trace_log *log = (struct trace_log *) arg;
+    sigset_t         set;
+    char             byte;
+    ssize_t          result;
+
+    // So there is always a thread to take the signal, even when every other one blocks it
+    sigemptyset(&set);
+    sigaddset(&set, TRACE_DUMP_SIGNAL);
+    (void) pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    while (atomic_load(&log->running))
+    {
+        result = read(log->wake_fds[0], &byte, sizeof(byte));
+        if (result == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result != 1)
+        {
+            break;
+        }
+        if (atomic_load(&log->running))
+        {
+            dump(log);
+        }
+    }
+
+    return NULL;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+static void dump_signal_handler(int signal)
+{
+    int  saved_errno = errno;
+    char byte        = 0;
+
+    // Formatting the trace is not async-signal-safe, so the handler only wakes the dumper
+    (void) write(wake_fd, &byte, sizeof(byte));
+    errno = saved_errno;
+}
+
+#pragma GCC diagnostic pop
+
+static void dump(struct trace_log *log)
+{
+    char     path[64];
+    FILE     *file;
+    uint64_t anchor_ns;
+    uint64_t elapsed_ticks;
+    double   ns_per_tick;
+    bool     first;
+
+    (void) snprintf(path, sizeof(path), TRACE_FILE_NAME, (long) getpid(), log->dumps++);
+    file = fopen(path, "w");
+    if (!file)
+    {
+        // NOLINTNEXTLINE(concurrency-mt-unsafe) : only the dumper thread reports here
+        (void) fprintf(stderr, "Tracing: could not open %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    // The clock rate is measured over the whole run, so it gets more precise with every dump
+    anchor_ns     = (uint64_t) log->monotonic_anchor.tv_sec * NS_PER_SECOND + (uint64_t) log->monotonic_anchor.tv_nsec;
+    elapsed_ticks = trace_clock() - log->clock_anchor;
+    ns_per_tick   = (elapsed_ticks > 0) ? (double) (monotonic_ns() - anchor_ns) / (double) elapsed_ticks : 1.0;
+
+    (void) fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    first = true;
+    for (size_t i = 0; i < atomic_load_explicit(&log->num_rings, memory_order_acquire); ++i)
+    {
+        first = dump_ring(log, log->rings[i], file, ns_per_tick, first);
+    }
+    (void) fprintf(file, "\n]}\n");
+
+    if (fclose(file) == EOF)
+    {
+        // NOLINTNEXTLINE(concurrency-mt-unsafe) : only the dumper thread reports here
+        (void) fprintf(stderr, "Tracing: could not write %s: %s\n", path, strerror(errno));
+        return;
+    }
+    // NOLINTNEXTLINE(concurrency-mt-unsafe) : only the dumper thread reports here
+    (void) fprintf(stderr, "Tracing: wrote %s\n", path);
+}
+
+static bool dump_ring(struct trace_log *log, struct trace_ring *ring, FILE *file, double ns_per_tick, bool first)
+{
+    uint64_t head;
+    uint64_t oldest;
+    uint64_t overwritten;
+
+    head   = atomic_load_explicit(&ring->head, memory_order_acquire);
+    oldest = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+    for (uint64_t i = oldest; i != head; ++i)
+    {
+        log->copy[i & TRACE_RING_MASK] = ring->events[i & TRACE_RING_MASK];
+    }
+
+    // While event n is being written, event n - TRACE_RING_SIZE is gone; the copies of those are dropped
+    overwritten = atomic_load_explicit(&ring->head, memory_order_acquire) + 1;
+    if (overwritten > TRACE_RING_SIZE && overwritten - TRACE_RING_SIZE > oldest)
+    {
+        oldest = overwritten - TRACE_RING_SIZE;
+    }
+
+    for (uint64_t i = oldest; i < head; ++i)
+    {
+        const struct trace_event *event = &log->copy[i & TRACE_RING_MASK];
+
+        (void) fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%ld,\"tid\":%" PRId32
+                             ",\"args\":{\"arg\":%" PRId32 "}}",
+                       first ? "" : ",", event->name, event->phase,
+                       (double) (int64_t) (event->timestamp - log->clock_anchor) * ns_per_tick / NS_PER_US, (long) getpid(),
+                       ring->thread_id, event->arg);
+        first = false;
+    }
+
+    return first;
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * NS_PER_SECOND + (uint64_t) now.tv_nsec;
+}
+
+static int32_t thread_id(size_t index)
+{
+#ifdef __linux__
+    (void) index;
+    return (int32_t) syscall(SYS_gettid);
+#else
+    return (int32_t) index;
+#endif
+}
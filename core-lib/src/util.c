@@ -1,4 +1,7 @@
+#include <access_log.h>
+#include <arena.h>
 #include <objects.h>
+#include <trace.h>
 #include <util.h>
 
 #include <arpa/inet.h>
@@ -9,14 +12,24 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 
 #define LOG_FILE_NAME "log.csv"
 #define LOG_OPEN_MODE "w" // Mode is set to truncate for independent results from each experiment.
+#define WORKER_LOG_FILE_NAME "log.%zu.csv"
+#define WORKER_LOG_APPEND_MODE "a"
 
 #define API_INIT "initialize_server"
 #define API_RUN "run_server"
 #define API_CLOSE "close_server"
 
+#define MS_PER_SECOND 1000
+#define NS_PER_MS 1000000
+
 /**
  * open_file
  * <p>
@@ -80,6 +93,30 @@ int setup_core_object(struct core_object *co, const in_port_t port_num,
         (void) fprintf(stderr, "Fatal: could not initialize memory manager: %s\n", strerror(errno));
         return -1;
     }
+    co->arena_pool = (struct arena_pool *) Mmm_calloc(1, sizeof(struct arena_pool), co->mm);
+    if (!co->arena_pool || arena_pool_init(co->arena_pool, co->mm) == -1)
+    {
+        co->arena_pool = NULL;
+        // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+        (void) fprintf(stderr, "Fatal: could not initialize arena pool: %s\n", strerror(errno));
+        return -1;
+    }
+    co->access_log = (struct access_log *) Mmm_calloc(1, sizeof(struct access_log), co->mm);
+    if (!co->access_log || access_log_init(co->access_log, co->mm) == -1)
+    {
+        co->access_log = NULL;
+        // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+        (void) fprintf(stderr, "Fatal: could not initialize access log: %s\n", strerror(errno));
+        return -1;
+    }
+    co->trace = (struct trace_log *) Mmm_calloc(1, sizeof(struct trace_log), co->mm);
+    if (!co->trace || trace_init(co->trace, co->mm) == -1)
+    {
+        co->trace = NULL;
+        // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+        (void) fprintf(stderr, "Fatal: could not initialize trace: %s\n", strerror(errno));
+        return -1;
+    }
     co->log_file = open_file(LOG_FILE_NAME, LOG_OPEN_MODE);
     if (!co->log_file)
     {
@@ -98,6 +135,29 @@ int setup_core_object(struct core_object *co, const in_port_t port_num,
     return 0;
 }
 
+int open_worker_log(struct core_object *co, size_t worker_index, bool truncate)
+{
+    char file_name[sizeof(WORKER_LOG_FILE_NAME) + 20]; // 20 digits for SIZE_MAX
+    FILE *log_file;
+
+    (void) snprintf(file_name, sizeof(file_name), WORKER_LOG_FILE_NAME, worker_index);
+    log_file = open_file(file_name, truncate ? LOG_OPEN_MODE : WORKER_LOG_APPEND_MODE);
+    if (!log_file)
+    {
+        (void) fprintf(stderr, "Fatal: could not open %s: %s\n", file_name, strerror(errno));
+        return -1;
+    }
+
+    // The inherited stream was flushed by the parent before fork, so closing it loses nothing.
+    if (co->log_file)
+    {
+        (void) fclose(co->log_file);
+    }
+    co->log_file = log_file;
+
+    return 0;
+}
+
 static FILE *open_file(const char *file_name, const char *mode)
 {
     FILE *file;
@@ -164,6 +224,43 @@ int close_lib(void *lib, const char *lib_name)
     // If an error occurs will return -1.
 }
 
+int listen_with_options(const struct core_object *co, int fd)
+{
+    const int backlog = (co->listen_backlog == 0 || co->listen_backlog > INT_MAX) ? SOMAXCONN : (int) co->listen_backlog;
+
+#ifdef TCP_FASTOPEN
+    // Must be set before listen
+    if (co->fast_open > 0)
+    {
+        const int queue_length = (co->fast_open > INT_MAX) ? INT_MAX : (int) co->fast_open;
+
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &queue_length, sizeof(queue_length)) == -1)
+        {
+            return -1;
+        }
+    }
+#endif
+
+    if (listen(fd, backlog) == -1)
+    {
+        return -1;
+    }
+
+#ifdef TCP_DEFER_ACCEPT
+    if (co->defer_accept > 0)
+    {
+        const int seconds = (co->defer_accept > INT_MAX) ? INT_MAX : (int) co->defer_accept;
+
+        if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) == -1)
+        {
+            return -1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
 void *get_api(struct api_functions *api, const char *lib_name)
 {
     void *lib;
@@ -219,28 +316,71 @@ static void *get_func(void *lib, const char *func_name)
 
 void destroy_core_object(struct core_object *co)
 {
+    // The writer thread writes to the log file until it stops
+    if (co->access_log)
+    {
+        access_log_stop(co->access_log);
+    }
+    if (co->trace)
+    {
+        trace_stop(co->trace);
+    }
     if (co->log_file)
     {
         (void) fclose(co->log_file);
     }
+    if (co->arena_pool)
+    {
+        arena_pool_destroy(co->arena_pool);
+    }
     free_mem_manager(co->mm);
 }
 
 
-int write_fully(int fd, void * data, size_t size) {
-    ssize_t result;
-    ssize_t nwrote = 0;
+uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * MS_PER_SECOND + (uint64_t)now.tv_nsec / NS_PER_MS;
+}
 
-    while (nwrote < (ssize_t)size) {
-        result = send(fd, ((char*)data)+nwrote, size - nwrote, MSG_NOSIGNAL);
-        if (result == -1) {
-            perror("writing fully");
-            return -1;
+void connection_deadline_start(struct timer_wheel *wheel, const struct core_object *co, struct connection *conn,
+                               uint64_t now_ms) {
+    conn->want_write   = false;
+    conn->head_pending = false;
+    if (co->header_timeout == 0) {
+        conn->deadline = CONNECTION_DEADLINE_NONE;
+        timer_wheel_cancel(wheel, &conn->timer);
+        return;
+    }
+    conn->deadline = CONNECTION_DEADLINE_REQUEST;
+    timer_wheel_add(wheel, &conn->timer, now_ms + (uint64_t)co->header_timeout * MS_PER_SECOND);
+}
+
+void connection_deadline_update(struct timer_wheel *wheel, const struct core_object *co, struct connection *conn,
+                                uint64_t now_ms) {
+    uint32_t timeout;
+
+    // Each writable event took some output, so a client that keeps reading keeps its connection
+    if (conn->want_write) {
+        conn->deadline = CONNECTION_DEADLINE_SEND;
+        timeout = co->send_timeout;
+    } else if (conn->head_pending) {
+        if (conn->deadline == CONNECTION_DEADLINE_REQUEST) {
+            return;
         }
-        nwrote += result;
+        conn->deadline = CONNECTION_DEADLINE_REQUEST;
+        timeout = co->header_timeout;
+    } else {
+        conn->deadline = CONNECTION_DEADLINE_IDLE;
+        timeout = co->idle_timeout;
     }
 
-    return 0;
+    if (timeout == 0) {
+        conn->deadline = CONNECTION_DEADLINE_NONE;
+        timer_wheel_cancel(wheel, &conn->timer);
+        return;
+    }
+    timer_wheel_add(wheel, &conn->timer, now_ms + (uint64_t)timeout * MS_PER_SECOND);
 }
 
 enum read_fully_result read_fully(int fd, void * data, size_t size) {
@@ -0,0 +1,161 @@
+#include <wakeup.h>
+#include <objects.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+/**
+ * open_fds
+ * <p>
+ * Open the descriptor the loop polls and the one posts write to, both non-blocking.
+ * </p>
+ * @param wakeup the wakeup
+ * @return 0 on success. On failure, -1 and set errno.
+ */
+static int open_fds(struct wakeup *wakeup);
+
+int wakeup_init(struct wakeup *wakeup)
+{
+    int status;
+
+    wakeup->posted   = NULL;
+    wakeup->fd       = -1;
+    wakeup->write_fd = -1;
+    if (open_fds(wakeup) == -1)
+    {
+        return -1;
+    }
+
+    status = pthread_mutex_init(&wakeup->lock, NULL);
+    if (status != 0)
+    {
+        if (wakeup->write_fd != wakeup->fd)
+        {
+            close(wakeup->write_fd);
+        }
+        close(wakeup->fd);
+        wakeup->fd       = -1;
+        wakeup->write_fd = -1;
+        errno            = status;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int open_fds(struct wakeup *wakeup)
+{
+#ifdef __linux__
+    wakeup->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup->fd == -1)
+    {
+        return -1;
+    }
+    wakeup->write_fd = wakeup->fd;
+#else
+    int fds[2];
+
+    if (pipe(fds) == -1)
+    {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (fcntl(fds[i], F_SETFL, O_NONBLOCK) == -1 || fcntl(fds[i], F_SETFD, FD_CLOEXEC) == -1)
+        {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+    }
+    wakeup->fd       = fds[0];
+    wakeup->write_fd = fds[1];
+#endif
+
+    return 0;
+}
+
+void wakeup_post(struct wakeup *wakeup, struct connection *conn)
+{
+    const uint64_t one = 1;
+    bool           notify;
+
+    pthread_mutex_lock(&wakeup->lock);
+    notify = !conn->woken;
+    if (notify)
+    {
+        conn->woken     = true;
+        conn->wake_next = wakeup->posted;
+        wakeup->posted  = conn;
+    }
+    pthread_mutex_unlock(&wakeup->lock);
+
+    // A full counter or pipe is already readable, so a failed write loses nothing
+    if (notify && write(wakeup->write_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    {
+        (void) fprintf(stderr, "wakeup: write: %s\n", strerror(errno));
+    }
+}
+
+void wakeup_clear(struct wakeup *wakeup)
+{
+    uint64_t buffer[8];
+
+    while (read(wakeup->fd, buffer, sizeof(buffer)) > 0)
+    {
+    }
+}
+
+struct connection *wakeup_take(struct wakeup *wakeup)
+{
+    struct connection *conn;
+
+    pthread_mutex_lock(&wakeup->lock);
+    conn = wakeup->posted;
+    if (conn != NULL)
+    {
+        wakeup->posted  = conn->wake_next;
+        conn->wake_next = NULL;
+        conn->woken     = false;
+    }
+    pthread_mutex_unlock(&wakeup->lock);
+
+    return conn;
+}
+
+void wakeup_cancel(struct wakeup *wakeup, struct connection *conn)
+{
+    pthread_mutex_lock(&wakeup->lock);
+    if (conn->woken)
+    {
+        for (struct connection **link = &wakeup->posted; *link != NULL; link = &(*link)->wake_next)
+        {
+            if (*link == conn)
+            {
+                *link = conn->wake_next;
+                break;
+            }
+        }
+        conn->wake_next = NULL;
+        conn->woken     = false;
+    }
+    pthread_mutex_unlock(&wakeup->lock);
+}
+
+void wakeup_destroy(struct wakeup *wakeup)
+{
+    pthread_mutex_destroy(&wakeup->lock);
+    if (wakeup->write_fd != wakeup->fd)
+    {
+        close(wakeup->write_fd);
+    }
+    close(wakeup->fd);
+}
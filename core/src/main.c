@@ -6,9 +6,14 @@
 #include <mem_manager/manager.h>
 
 #include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
 #include <string.h>
 
+#include <http/file_cache.h>
 #include <http/handlers.h>
+#include <http/stats.h>
+#include <http/store.h>
 
 #define LOG_FILE_NAME "log.csv"
 #define LOG_OPEN_MODE "w" // Mode is set to truncate for independent results from each experiment.
@@ -21,12 +26,27 @@
 #endif
 
 #define DEFAULT_LIBRARY "../poll-server/libpoll-server." LIB_EXTENSION
+#define DEFAULT_STORE "resources" // gdbm adds .pag and .dir
 
 #define API_INIT "initialize_server"
 #define API_RUN "run_server"
 #define API_CLOSE "close_server"
 
 static in_port_t g_default_port = 80;
+static uint16_t  g_default_workers = 1; // 0 runs one event loop per CPU the process may run on
+static uint32_t  g_default_max_connections = 0; // 0 is bounded by RLIMIT_NOFILE only
+static uint32_t  g_default_cache_size = 64; // MiB of file contents cached in memory, 0 disables the cache
+static uint32_t  g_default_idle_timeout = 5; // seconds a keep-alive connection may sit idle, 0 for no limit
+static uint32_t  g_default_header_timeout = 10; // seconds a client has to send a request head, 0 for no limit
+static uint32_t  g_default_send_timeout = 30; // seconds a client may go without reading queued output, 0 for no limit
+static uint32_t  g_default_max_requests = 100; // requests served per connection, 0 for no limit
+static uint32_t  g_default_backlog = 1024; // accept queue length per listening socket, 0 for SOMAXCONN
+static uint32_t  g_default_defer_accept = 0; // seconds to hold a connection until its first data, 0 to accept at once
+static uint32_t  g_default_fast_open = 0; // TCP Fast Open queue length, 0 to disable
+static bool      g_default_stats = false; // serve counters and latency histograms at /_stats
+static uint32_t  g_default_commit_window = 500; // microseconds a commit waits for more POSTs to join it, 0 to sync at once
+
+#define BYTES_PER_MEBIBYTE (1024 * 1024)
 
 /**
  * application_settings
@@ -39,7 +59,20 @@ struct application_settings
     struct dc_opt_settings      opts;
     struct dc_setting_string    *library;
     struct dc_setting_in_port_t *port_num;
+    struct dc_setting_uint16    *workers;
+    struct dc_setting_uint32    *max_connections;
+    struct dc_setting_uint32    *cache_size;
+    struct dc_setting_uint32    *idle_timeout;
+    struct dc_setting_uint32    *header_timeout;
+    struct dc_setting_uint32    *send_timeout;
+    struct dc_setting_uint32    *max_requests;
+    struct dc_setting_uint32    *backlog;
+    struct dc_setting_uint32    *defer_accept;
+    struct dc_setting_uint32    *fast_open;
     struct dc_setting_string    *ip_addr;
+    struct dc_setting_bool      *stats;
+    struct dc_setting_string    *store;
+    struct dc_setting_uint32    *commit_window;
     // storing a struct is not possible, only use as app settings for now
 };
 
@@ -89,6 +122,14 @@ static int destroy_settings(const struct dc_env *env, struct dc_error *err, stru
  */
 static int run_core(struct core_object *co, const char *lib_name);
 
+/**
+ * print_cache_stats
+ * <p>
+ * Print the hit ratio and memory use of the file cache, to help size it.
+ * </p>
+ */
+static void print_cache_stats(void);
+
 int main(int argc, char *argv[])
 {
     int                        ret_val;
@@ -125,7 +166,20 @@ static struct dc_application_settings *create_settings(const struct dc_env *env,
     settings->opts.parent.config_path = dc_setting_path_create(env, err);
     settings->library                 = dc_setting_string_create(env, err);
     settings->port_num                = dc_setting_in_port_t_create(env, err);
+    settings->workers                 = dc_setting_uint16_create(env, err);
+    settings->max_connections         = dc_setting_uint32_create(env, err);
+    settings->cache_size              = dc_setting_uint32_create(env, err);
+    settings->idle_timeout            = dc_setting_uint32_create(env, err);
+    settings->header_timeout          = dc_setting_uint32_create(env, err);
+    settings->send_timeout            = dc_setting_uint32_create(env, err);
+    settings->max_requests            = dc_setting_uint32_create(env, err);
+    settings->backlog                 = dc_setting_uint32_create(env, err);
+    settings->defer_accept            = dc_setting_uint32_create(env, err);
+    settings->fast_open               = dc_setting_uint32_create(env, err);
     settings->ip_addr                 = dc_setting_string_create(env, err);
+    settings->stats                   = dc_setting_bool_create(env, err);
+    settings->store                   = dc_setting_string_create(env, err);
+    settings->commit_window           = dc_setting_uint32_create(env, err);
     
     struct options opts[] = {
             {(struct dc_setting *) settings->opts.parent.config_path,
@@ -158,6 +212,106 @@ static struct dc_application_settings *create_settings(const struct dc_env *env,
                     "port",
                     dc_in_port_t_from_config,
                     &g_default_port},
+            {(struct dc_setting *) settings->workers,
+                    dc_options_set_uint16,
+                    "workers",
+                    required_argument,
+                    'w',
+                    "WORKERS",
+                    dc_uint16_from_string,
+                    "workers",
+                    dc_uint16_from_config,
+                    &g_default_workers},
+            {(struct dc_setting *) settings->max_connections,
+                    dc_options_set_uint32,
+                    "max-connections",
+                    required_argument,
+                    'm',
+                    "MAX_CONNECTIONS",
+                    dc_uint32_from_string,
+                    "max-connections",
+                    dc_uint32_from_config,
+                    &g_default_max_connections},
+            {(struct dc_setting *) settings->cache_size,
+                    dc_options_set_uint32,
+                    "cache-size",
+                    required_argument,
+                    's',
+                    "CACHE_SIZE",
+                    dc_uint32_from_string,
+                    "cache-size",
+                    dc_uint32_from_config,
+                    &g_default_cache_size},
+            {(struct dc_setting *) settings->idle_timeout,
+                    dc_options_set_uint32,
+                    "keep-alive-timeout",
+                    required_argument,
+                    't',
+                    "KEEP_ALIVE_TIMEOUT",
+                    dc_uint32_from_string,
+                    "keep-alive-timeout",
+                    dc_uint32_from_config,
+                    &g_default_idle_timeout},
+            {(struct dc_setting *) settings->header_timeout,
+                    dc_options_set_uint32,
+                    "header-timeout",
+                    required_argument,
+                    'H',
+                    "HEADER_TIMEOUT",
+                    dc_uint32_from_string,
+                    "header-timeout",
+                    dc_uint32_from_config,
+                    &g_default_header_timeout},
+            {(struct dc_setting *) settings->send_timeout,
+                    dc_options_set_uint32,
+                    "send-timeout",
+                    required_argument,
+                    'W',
+                    "SEND_TIMEOUT",
+                    dc_uint32_from_string,
+                    "send-timeout",
+                    dc_uint32_from_config,
+                    &g_default_send_timeout},
+            {(struct dc_setting *) settings->max_requests,
+                    dc_options_set_uint32,
+                    "max-requests",
+                    required_argument,
+                    'r',
+                    "MAX_REQUESTS",
+                    dc_uint32_from_string,
+                    "max-requests",
+                    dc_uint32_from_config,
+                    &g_default_max_requests},
+            {(struct dc_setting *) settings->backlog,
+                    dc_options_set_uint32,
+                    "backlog",
+                    required_argument,
+                    'b',
+                    "BACKLOG",
+                    dc_uint32_from_string,
+                    "backlog",
+                    dc_uint32_from_config,
+                    &g_default_backlog},
+            {(struct dc_setting *) settings->defer_accept,
+                    dc_options_set_uint32,
+                    "defer-accept",
+                    required_argument,
+                    'd',
+                    "DEFER_ACCEPT",
+                    dc_uint32_from_string,
+                    "defer-accept",
+                    dc_uint32_from_config,
+                    &g_default_defer_accept},
+            {(struct dc_setting *) settings->fast_open,
+                    dc_options_set_uint32,
+                    "fast-open",
+                    required_argument,
+                    'f',
+                    "FAST_OPEN",
+                    dc_uint32_from_string,
+                    "fast-open",
+                    dc_uint32_from_config,
+                    &g_default_fast_open},
             {(struct dc_setting *) settings->ip_addr,
                     dc_options_set_string,
                     "ip-addr",
@@ -168,13 +322,43 @@ static struct dc_application_settings *create_settings(const struct dc_env *env,
                     "ip-addr",
                     dc_string_from_config,
                     DEFAULT_IP},
+            {(struct dc_setting *) settings->stats,
+                    dc_options_set_bool,
+                    "stats",
+                    no_argument,
+                    'S',
+                    "STATS",
+                    dc_flag_from_string,
+                    "stats",
+                    dc_flag_from_config,
+                    &g_default_stats},
+            {(struct dc_setting *) settings->store,
+                    dc_options_set_string,
+                    "store",
+                    required_argument,
+                    'D',
+                    "STORE",
+                    dc_string_from_string,
+                    "store",
+                    dc_string_from_config,
+                    DEFAULT_STORE},
+            {(struct dc_setting *) settings->commit_window,
+                    dc_options_set_uint32,
+                    "commit-window",
+                    required_argument,
+                    'C',
+                    "COMMIT_WINDOW",
+                    dc_uint32_from_string,
+                    "commit-window",
+                    dc_uint32_from_config,
+                    &g_default_commit_window},
     };
     
     settings->opts.opts_count = (sizeof(opts) / sizeof(struct options)) + 1;
     settings->opts.opts_size  = sizeof(struct options);
     settings->opts.opts       = dc_calloc(env, err, settings->opts.opts_count, settings->opts.opts_size);
     dc_memcpy(env, settings->opts.opts, opts, sizeof(opts));
-    settings->opts.flags      = "l:p:i:";
+    settings->opts.flags      = "l:p:w:m:s:t:H:W:r:b:d:f:i:SD:C:";
     settings->opts.env_prefix = "SCALABLE_SERVER_";
     
     return (struct dc_application_settings *) settings;
@@ -187,25 +371,83 @@ static int run(const struct dc_env *env, struct dc_error *err, struct dc_applica
     struct core_object          co;
     const char                  *lib_name;
     in_port_t                   port_num;
+    uint16_t                    num_workers;
+    uint32_t                    max_connections;
+    uint32_t                    cache_size;
+    uint32_t                    idle_timeout;
+    uint32_t                    header_timeout;
+    uint32_t                    send_timeout;
+    uint32_t                    max_requests;
+    uint32_t                    backlog;
+    uint32_t                    defer_accept;
+    uint32_t                    fast_open;
     const char                  *ip_addr;
+    bool                        stats;
+    const char                  *store;
+    uint32_t                    commit_window;
     
     int ret_val;
     
     app_settings = (struct application_settings *) settings;
     lib_name     = dc_setting_string_get(env, app_settings->library);
     port_num     = dc_setting_in_port_t_get(env, app_settings->port_num);
+    num_workers  = dc_setting_uint16_get(env, app_settings->workers);
+    max_connections = dc_setting_uint32_get(env, app_settings->max_connections);
+    cache_size   = dc_setting_uint32_get(env, app_settings->cache_size);
+    idle_timeout = dc_setting_uint32_get(env, app_settings->idle_timeout);
+    header_timeout = dc_setting_uint32_get(env, app_settings->header_timeout);
+    send_timeout = dc_setting_uint32_get(env, app_settings->send_timeout);
+    max_requests = dc_setting_uint32_get(env, app_settings->max_requests);
+    backlog      = dc_setting_uint32_get(env, app_settings->backlog);
+    defer_accept = dc_setting_uint32_get(env, app_settings->defer_accept);
+    fast_open    = dc_setting_uint32_get(env, app_settings->fast_open);
     ip_addr      = dc_setting_string_get(env, app_settings->ip_addr);
+    stats        = dc_setting_bool_get(env, app_settings->stats);
+    store        = dc_setting_string_get(env, app_settings->store);
+    commit_window = dc_setting_uint32_get(env, app_settings->commit_window);
     
     // create core object
     ret_val = setup_core_object(&co, port_num, ip_addr);
     co.pollin_handler = pollin_handle_http;
+    co.pollout_handler = pollout_handle_http;
+    co.close_handler  = close_handle_http;
+    co.timeout_handler = timeout_handle_http;
+    co.wake_handler    = wake_handle_http;
+    co.num_workers    = num_workers;
+    co.max_connections = max_connections;
+    co.idle_timeout    = idle_timeout;
+    co.header_timeout  = header_timeout;
+    co.send_timeout    = send_timeout;
+    co.max_requests    = max_requests;
+    co.listen_backlog  = backlog;
+    co.defer_accept    = defer_accept;
+    co.fast_open       = fast_open;
     if (ret_val == -1)
     {
         return EXIT_FAILURE;
     }
     
+    // sendfile cannot take MSG_NOSIGNAL; a client that hangs up mid-body must not kill the server.
+    (void) signal(SIGPIPE, SIG_IGN);
+    
+    if (file_cache_init((size_t) cache_size * BYTES_PER_MEBIBYTE) == -1)
+    {
+        destroy_core_object(&co);
+        return EXIT_FAILURE;
+    }
+    http_stats_enable(stats);
+    if (store_init(store, commit_window) == -1)
+    {
+        file_cache_destroy();
+        destroy_core_object(&co);
+        return EXIT_FAILURE;
+    }
+    
     ret_val = run_core(&co, lib_name);
     
+    print_cache_stats();
+    store_destroy();
+    file_cache_destroy();
     destroy_core_object(&co);
     return ret_val;
 }
@@ -273,6 +515,25 @@ static int run_core(struct core_object *co, const char *lib_name)
     return exit_status;
 }
 
+static void print_cache_stats(void)
+{
+    struct file_cache_stats stats;
+    uint64_t                lookups;
+    
+    file_cache_get_stats(&stats);
+    if (stats.max_bytes == 0)
+    {
+        return;
+    }
+    
+    lookups = stats.hits + stats.misses;
+    (void) fprintf(stdout,
+                   "File cache: %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit ratio), %" PRIu64 " evictions, %" PRIu64
+                   " invalidations, %zu entries, %zu of %zu bytes resident\n",
+                   stats.hits, stats.misses, (lookups > 0) ? 100.0 * (double) stats.hits / (double) lookups : 0.0,
+                   stats.evictions, stats.invalidations, stats.entries, stats.bytes_resident, stats.max_bytes);
+}
+
 static int destroy_settings(const struct dc_env *env, struct dc_error *err, struct dc_application_settings **psettings)
 {
     struct application_settings *app_settings;
@@ -280,6 +541,19 @@ static int destroy_settings(const struct dc_env *env, struct dc_error *err, stru
     DC_TRACE(env);
     app_settings = (struct application_settings *) *psettings;
     dc_setting_string_destroy(env, &app_settings->library);
+    dc_setting_uint16_destroy(env, &app_settings->workers);
+    dc_setting_uint32_destroy(env, &app_settings->max_connections);
+    dc_setting_uint32_destroy(env, &app_settings->cache_size);
+    dc_setting_uint32_destroy(env, &app_settings->idle_timeout);
+    dc_setting_uint32_destroy(env, &app_settings->header_timeout);
+    dc_setting_uint32_destroy(env, &app_settings->send_timeout);
+    dc_setting_uint32_destroy(env, &app_settings->max_requests);
+    dc_setting_uint32_destroy(env, &app_settings->backlog);
+    dc_setting_uint32_destroy(env, &app_settings->defer_accept);
+    dc_setting_uint32_destroy(env, &app_settings->fast_open);
+    dc_setting_bool_destroy(env, &app_settings->stats);
+    dc_setting_string_destroy(env, &app_settings->store);
+    dc_setting_uint32_destroy(env, &app_settings->commit_window);
     dc_free(env, app_settings->opts.opts);
     dc_free(env, *psettings);
     
@@ -0,0 +1,52 @@
+#ifndef SCALABLE_SERVER_EPOLL_SERVER_H
+#define SCALABLE_SERVER_EPOLL_SERVER_H
+
+#include "objects.h"
+#include <core-lib/objects.h>
+
+/**
+ * setup_epoll_state
+ * <p>
+ * Set up the state object for the epoll server. Add it to the memory manager.
+ * </p>
+ * @param mm the memory manager to which the state object will be added
+ * @return the state object, or NULL and set errno on failure
+ */
+struct state_object *setup_epoll_state(struct memory_manager *mm);
+
+/**
+ * open_epoll_server_for_listen
+ * <p>
+ * Create a non-blocking socket, bind, and begin listening for connections. Create the
+ * epoll instance and register the listening socket with it.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param listen_addr the address on which to listen
+ * @return 0 on success, -1 and set errno on failure
+ */
+int open_epoll_server_for_listen(struct core_object *co, struct state_object *so, struct sockaddr_in *listen_addr);
+
+/**
+ * run_epoll_server
+ * <p>
+ * Run the epoll server. Wait for a batch of ready events; if the listen socket is ready,
+ * accept every pending connection. Otherwise, handle the message on each ready socket.
+ * Only the sockets reported by epoll_wait are visited.
+ * </p>
+ * @param co the core object
+ * @return 0 on success, -1 and set errno on failure
+ */
+int run_epoll_server(struct core_object *co);
+
+/**
+ * destroy_epoll_state
+ * <p>
+ * Close all connections, the listen socket and the epoll instance.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ */
+void destroy_epoll_state(struct core_object *co, struct state_object *so);
+
+#endif //SCALABLE_SERVER_EPOLL_SERVER_H
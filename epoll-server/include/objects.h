@@ -0,0 +1,35 @@
+#ifndef SCALABLE_SERVER_EPOLL_OBJECTS_H
+#define SCALABLE_SERVER_EPOLL_OBJECTS_H
+
+#include <core-lib/objects.h>
+#include <core-lib/timer_wheel.h>
+#include <core-lib/wakeup.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+
+/**
+ * The maximum number of ready events fetched by a single epoll_wait call.
+ */
+#define EPOLL_MAX_EVENTS 256
+
+/**
+ * The number of fds tracked when RLIMIT_NOFILE is unlimited.
+ */
+#define EPOLL_DEFAULT_MAX_FDS 65536
+
+struct access_log_ring;
+
+struct state_object {
+    int listen_fd;
+    int epoll_fd;
+    struct connection *connections; // indexed by fd, fd == -1 marks a free slot
+    size_t max_fds;
+    size_t num_connections;
+    uint64_t now_ms; // monotonic milliseconds at the last wakeup
+    struct timer_wheel timers; // the deadlines of the connections
+    struct timer accept_retry; // pending while accepting is paused for lack of fds
+    struct wakeup wakeup; // where other threads post parked connections; fd is -1 until set up
+    struct access_log_ring *log_ring; // NULL when the server does not log
+};
+
+#endif //SCALABLE_SERVER_EPOLL_OBJECTS_H
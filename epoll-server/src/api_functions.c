@@ -0,0 +1,43 @@
+#include <core-lib/api_functions.h>
+#include "epoll_server.h"
+
+#include <stdio.h>
+
+int initialize_server(struct core_object *co)
+{
+    printf("INIT EPOLL SERVER\n");
+    
+    co->so = setup_epoll_state(co->mm);
+    if (!co->so)
+    {
+        return ERROR;
+    }
+
+    if (open_epoll_server_for_listen(co, co->so, &co->listen_addr) == -1)
+    {
+        return ERROR;
+    }
+    
+    return RUN_SERVER;
+}
+
+int run_server(struct core_object *co)
+{
+    printf("RUN EPOLL SERVER\n");
+    
+    if (run_epoll_server(co) == -1)
+    {
+        return ERROR;
+    }
+    
+    return CLOSE_SERVER;
+}
+
+int close_server(struct core_object *co)
+{
+    printf("CLOSE EPOLL SERVER\n");
+
+    destroy_epoll_state(co, co->so);
+    
+    return EXIT;
+}
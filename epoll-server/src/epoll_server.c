@@ -0,0 +1,602 @@
+#define _GNU_SOURCE // accept4
+#include "epoll_server.h"
+#include "objects.h"
+#include <core-lib/access_log.h>
+#include <core-lib/trace.h>
+#include <core-lib/objects.h>
+#include <core-lib/util.h>
+#include <core-lib/wakeup.h>
+
+#include <stdbool.h>
+#include <errno.h>
+#include <mem_manager/manager.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables): must be non-const
+/**
+ * Whether the epoll loop should be running.
+ */
+volatile int GOGO_EPOLL = 1;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+/**
+ * execute_epoll
+ * <p>
+ * Wait for batches of ready events. Readiness on the listen fd drains the accept
+ * queue, readiness on the wakeup wakes the connections posted to it, and readiness on
+ * a client fd calls the pollin handler for that fd only.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int execute_epoll(struct core_object *co, struct state_object *so);
+
+/**
+ * setup_signal_handler
+ * @param sa sigaction struct to fill
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int setup_signal_handler(struct sigaction *sa, int signal);
+
+/**
+ * end_gogo_handler
+ * <p>
+ * Handler for signal. Set the running loop conditional to 0.
+ * </p>
+ * @param signal the signal received
+ */
+static void end_gogo_handler(int signal);
+
+/**
+ * epoll_accept
+ * <p>
+ * Accept every connection pending on the listen socket. The listen socket is
+ * edge-triggered, so accept is repeated until it reports EAGAIN.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int epoll_accept(struct core_object *co, struct state_object *so);
+
+/**
+ * epoll_comm
+ * <p>
+ * Handle a single ready client event. Call the pollin handler if the fd is readable, or
+ * the pollout handler if it is writable, and remove the connection on EOF, hang up or error.
+ * Switch the interest of the fd between the two when the handler changes want_write.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param event the ready event
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int epoll_comm(struct core_object *co, struct state_object *so, const struct epoll_event *event);
+
+/**
+ * epoll_wake
+ * <p>
+ * Call the wake handler on every connection posted to the wakeup, and remove it on EOF.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int epoll_wake(struct core_object *co, struct state_object *so);
+
+/**
+ * epoll_interest
+ * @param conn the connection
+ * @return the events to wait for on the connection: no reading or writing while parked, only one
+ * of the two otherwise
+ */
+static uint32_t epoll_interest(const struct connection *conn);
+
+/**
+ * epoll_update_interest
+ * <p>
+ * Change the registration of a connection after a handler ran, if its interest changed, and
+ * rearm its deadline. Remove the connection if the registration cannot be changed.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param conn the connection
+ * @param interest the interest the connection was registered with
+ */
+static void epoll_update_interest(struct core_object *co, struct state_object *so, struct connection *conn,
+                                  uint32_t interest);
+
+/**
+ * epoll_remove_connection
+ * <p>
+ * Close a connection. Closing the fd also removes it from the epoll interest list.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param fd the client fd to close
+ */
+static void epoll_remove_connection(struct core_object *co, struct state_object *so, int fd);
+
+/**
+ * epoll_connection_expired
+ * <p>
+ * Let the handler answer a connection whose deadline has passed, then close it. The accept
+ * retry expires here too, and re-arms the listen socket.
+ * </p>
+ * @param timer the timer of the connection
+ * @param arg the core object
+ */
+static void epoll_connection_expired(struct timer *timer, void *arg);
+
+/**
+ * close_fd_report_undefined_error
+ * <p>
+ * Close a file descriptor and report an error which would make the file descriptor undefined.
+ * </p>
+ * @param fd the fd to close
+ * @param err_msg the error message to print
+ */
+static void close_fd_report_undefined_error(int fd, const char *err_msg);
+
+/**
+ * How long the server waits to accept again after running out of fds. The listen socket is
+ * edge-triggered, so the connections still queued would otherwise wait for the next one to arrive.
+ */
+#define ACCEPT_RETRY_MS TIMER_WHEEL_TICK_MS
+
+struct state_object *setup_epoll_state(struct memory_manager *mm)
+{
+    struct state_object *so;
+    struct rlimit       limit;
+
+    so = (struct state_object *) Mmm_calloc(1, sizeof(struct state_object), mm);
+    if (!so)
+    {
+        return NULL;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+    {
+        return NULL;
+    }
+
+    // One slot per possible fd, so a connection is found from its fd in O(1).
+    so->max_fds   = (limit.rlim_cur == RLIM_INFINITY) ? EPOLL_DEFAULT_MAX_FDS : (size_t) limit.rlim_cur;
+    so->connections = (struct connection *) Mmm_calloc(so->max_fds, sizeof(struct connection), mm);
+    if (!so->connections)
+    {
+        return NULL;
+    }
+    for (size_t fd = 0; fd < so->max_fds; ++fd)
+    {
+        so->connections[fd].fd = -1;
+    }
+    so->listen_fd = -1;
+    so->epoll_fd  = -1;
+    so->wakeup.fd = -1;
+
+    return so;
+}
+
+int open_epoll_server_for_listen(struct core_object *co, struct state_object *so, struct sockaddr_in *listen_addr)
+{
+    struct epoll_event event;
+    int                fd;
+    int                epoll_fd;
+
+    // Non-blocking, so accept can drain the queue
+    fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *) listen_addr, sizeof(struct sockaddr_in)) == -1)
+    {
+        (void) close(fd);
+        return -1;
+    }
+
+    if (listen_with_options(co, fd) == -1)
+    {
+        (void) close(fd);
+        return -1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+    {
+        (void) close(fd);
+        return -1;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events  = EPOLLIN | EPOLLET;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        (void) close(epoll_fd);
+        (void) close(fd);
+        return -1;
+    }
+
+    // Level-triggered, so a post made while the connections are woken is not lost
+    if (wakeup_init(&so->wakeup) == -1)
+    {
+        (void) close(epoll_fd);
+        (void) close(fd);
+        return -1;
+    }
+    memset(&event, 0, sizeof(event));
+    event.events  = EPOLLIN;
+    event.data.fd = so->wakeup.fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, so->wakeup.fd, &event) == -1)
+    {
+        wakeup_destroy(&so->wakeup);
+        so->wakeup.fd = -1;
+        (void) close(epoll_fd);
+        (void) close(fd);
+        return -1;
+    }
+
+    // Only assign if absolute success. -1 is used during teardown to determine whether there is a socket to close.
+    so->listen_fd = fd;
+    so->epoll_fd  = epoll_fd;
+
+    return 0;
+}
+
+int run_epoll_server(struct core_object *co)
+{
+    if (access_log_start(co->access_log, co->log_file) == -1 || trace_start(co->trace) == -1)
+    {
+        return -1;
+    }
+    co->so->log_ring = access_log_register(co->access_log);
+
+    if (execute_epoll(co, co->so) == -1)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int execute_epoll(struct core_object *co, struct state_object *so)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int                num_ready;
+    struct sigaction   sigint;
+
+    if (setup_signal_handler(&sigint, SIGINT) == -1)
+    {
+        return -1;
+    }
+    if (setup_signal_handler(&sigint, SIGTERM) == -1)
+    {
+        return -1;
+    }
+
+    so->now_ms = monotonic_ms();
+    timer_wheel_init(&so->timers, so->now_ms);
+
+    while (GOGO_EPOLL)
+    {
+        // Without a pending deadline there is nothing to do until a socket is ready.
+        num_ready = epoll_wait(so->epoll_fd, events, EPOLL_MAX_EVENTS, timer_wheel_timeout(&so->timers, so->now_ms));
+        if (num_ready == -1)
+        {
+            return (errno == EINTR) ? 0 : -1;
+        }
+        so->now_ms = monotonic_ms();
+
+        for (int i = 0; i < num_ready; ++i)
+        {
+            if (events[i].data.fd == so->listen_fd)
+            {
+                if (epoll_accept(co, so) == -1)
+                {
+                    return -1;
+                }
+            } else if (events[i].data.fd == so->wakeup.fd)
+            {
+                if (epoll_wake(co, so) == -1)
+                {
+                    return -1;
+                }
+            } else if (epoll_comm(co, so, &events[i]) == -1)
+            {
+                return -1;
+            }
+        }
+
+        // After the events, so a connection that just became active has had its deadline moved.
+        timer_wheel_advance(&so->timers, so->now_ms, epoll_connection_expired, co);
+    }
+
+    return 0;
+}
+
+static int setup_signal_handler(struct sigaction *sa, int signal)
+{
+    sigemptyset(&sa->sa_mask);
+    sa->sa_flags   = 0;
+    sa->sa_handler = end_gogo_handler;
+    if (sigaction(signal, sa, 0) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+static void end_gogo_handler(int signal)
+{
+    GOGO_EPOLL = 0;
+}
+
+#pragma GCC diagnostic pop
+
+static int epoll_accept(struct core_object *co, struct state_object *so)
+{
+    struct epoll_event event;
+    struct sockaddr_in client_addr;
+    socklen_t          sockaddr_size;
+    int                new_cfd;
+
+    for (;;)
+    {
+        // Handlers never block on a client socket.
+        sockaddr_size = sizeof(struct sockaddr_in);
+        new_cfd = accept4(so->listen_fd, (struct sockaddr *) &client_addr, &sockaddr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_cfd == -1)
+        {
+            switch (errno)
+            {
+                case EAGAIN: // Accept queue drained.
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                {
+                    errno = 0;
+                    return 0;
+                }
+                case ECONNABORTED: // The client gave up while queued.
+                case EINTR:
+                {
+                    continue;
+                }
+                case EMFILE: // Out of fds; leave the rest queued until the retry.
+                case ENFILE:
+                {
+                    timer_wheel_add(&so->timers, &so->accept_retry, so->now_ms + ACCEPT_RETRY_MS);
+                    return 0;
+                }
+                default:
+                {
+                    return -1;
+                }
+            }
+        }
+
+        if ((size_t) new_cfd >= so->max_fds)
+        {
+            close_fd_report_undefined_error(new_cfd, "state of client socket is undefined.");
+            continue;
+        }
+
+        memset(&event, 0, sizeof(event));
+        event.events  = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        event.data.fd = new_cfd;
+        if (epoll_ctl(so->epoll_fd, EPOLL_CTL_ADD, new_cfd, &event) == -1)
+        {
+            close_fd_report_undefined_error(new_cfd, "state of client socket is undefined.");
+            return -1;
+        }
+
+        so->connections[new_cfd].fd     = new_cfd;
+        so->connections[new_cfd].addr   = client_addr;
+        so->connections[new_cfd].data   = NULL;
+        so->connections[new_cfd].parked = false;
+        so->connections[new_cfd].wakeup = co->wake_handler ? &so->wakeup : NULL;
+        connection_deadline_start(&so->timers, co, &so->connections[new_cfd], so->now_ms);
+        access_log_accept(co->access_log, &so->connections[new_cfd]);
+        ++so->num_connections;
+    }
+}
+
+static int epoll_comm(struct core_object *co, struct state_object *so, const struct epoll_event *event)
+{
+    struct connection *conn             = &so->connections[event->data.fd];
+    const uint32_t    interest          = epoll_interest(conn);
+    bool              remove_connection = false;
+
+    if (event->events & (EPOLLIN | EPOLLOUT))
+    {
+        const enum pollin_handle_result result = (event->events & EPOLLOUT) ? co->pollout_handler(co, so, conn)
+                                                                            : co->pollin_handler(co, so, conn);
+        if (result == POLLIN_HANDLE_RESULT_FATAL)
+        {
+            return -1;
+        }
+        remove_connection = result == POLLIN_HANDLE_RESULT_EOF;
+    }
+    // A peer that only shut down its side still reads what is queued for it: the handler sees
+    // the end of the requests and closes once the rest is sent, so EPOLLRDHUP alone is not fatal.
+    if (remove_connection || (event->events & (EPOLLHUP | EPOLLERR)))
+    {
+        epoll_remove_connection(co, so, event->data.fd);
+        return 0;
+    }
+
+    epoll_update_interest(co, so, conn, interest);
+
+    return 0;
+}
+
+static int epoll_wake(struct core_object *co, struct state_object *so)
+{
+    struct connection *conn;
+
+    // Cleared first, so a post made while the connections are handled is seen on the next wait
+    wakeup_clear(&so->wakeup);
+    while ((conn = wakeup_take(&so->wakeup)) != NULL)
+    {
+        const uint32_t                  interest = epoll_interest(conn);
+        const enum pollin_handle_result result   = co->wake_handler(co, so, conn);
+
+        if (result == POLLIN_HANDLE_RESULT_FATAL)
+        {
+            return -1;
+        }
+        if (result == POLLIN_HANDLE_RESULT_EOF)
+        {
+            epoll_remove_connection(co, so, conn->fd);
+        } else
+        {
+            epoll_update_interest(co, so, conn, interest);
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t epoll_interest(const struct connection *conn)
+{
+    if (conn->parked)
+    {
+        return EPOLLRDHUP | EPOLLET; // EPOLLHUP and EPOLLERR are reported all the same
+    }
+
+    // Only one of the two at a time: a connection with output queued reads no more requests
+    return (conn->want_write ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP | EPOLLET;
+}
+
+static void epoll_update_interest(struct core_object *co, struct state_object *so, struct connection *conn,
+                                  uint32_t interest)
+{
+    const uint32_t wanted = epoll_interest(conn);
+
+    // Readiness is checked again on the change, so nothing that arrived meanwhile is missed
+    if (wanted != interest)
+    {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events  = wanted;
+        event.data.fd = conn->fd;
+        if (epoll_ctl(so->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == -1)
+        {
+            epoll_remove_connection(co, so, conn->fd);
+            return;
+        }
+    }
+    connection_deadline_update(&so->timers, co, conn, so->now_ms);
+}
+
+static void epoll_remove_connection(struct core_object *co, struct state_object *so, int fd)
+{
+    // Let the handler release its per-connection state, then close the fd
+    if (co->close_handler)
+    {
+        co->close_handler(co, &so->connections[fd]);
+    }
+    if (so->connections[fd].wakeup)
+    {
+        wakeup_cancel(so->connections[fd].wakeup, &so->connections[fd]);
+    }
+    close_fd_report_undefined_error(fd, "state of client socket is undefined.");
+    (void) access_log_close(so->log_ring, &so->connections[fd]);
+    timer_wheel_cancel(&so->timers, &so->connections[fd].timer);
+
+    so->connections[fd].fd   = -1;
+    so->connections[fd].data = NULL;
+    --so->num_connections;
+}
+
+static void epoll_connection_expired(struct timer *timer, void *arg)
+{
+    struct core_object  *co = (struct core_object *) arg;
+    struct state_object *so = co->so;
+    struct connection   *conn;
+
+    if (timer == &so->accept_retry)
+    {
+        struct epoll_event interest;
+
+        // Modifying the registration checks readiness again, which raises a new edge if connections are queued
+        memset(&interest, 0, sizeof(interest));
+        interest.events  = EPOLLIN | EPOLLET;
+        interest.data.fd = so->listen_fd;
+        if (epoll_ctl(so->epoll_fd, EPOLL_CTL_MOD, so->listen_fd, &interest) == -1)
+        {
+            timer_wheel_add(&so->timers, &so->accept_retry, so->now_ms + ACCEPT_RETRY_MS);
+        }
+        return;
+    }
+
+    conn = (struct connection *) (void *) ((char *) timer - offsetof(struct connection, timer));
+    if (co->timeout_handler)
+    {
+        co->timeout_handler(co, conn);
+    }
+    epoll_remove_connection(co, so, conn->fd);
+}
+
+void destroy_epoll_state(struct core_object *co, struct state_object *so)
+{
+    if (so->listen_fd != -1)
+    {
+        close_fd_report_undefined_error(so->listen_fd, "state of listen socket is undefined.");
+    }
+    if (so->epoll_fd != -1)
+    {
+        close_fd_report_undefined_error(so->epoll_fd, "state of epoll instance is undefined.");
+    }
+
+    for (size_t fd = 0; fd < so->max_fds && so->num_connections > 0; ++fd)
+    {
+        if (so->connections[fd].fd != -1)
+        {
+            epoll_remove_connection(co, so, (int) fd);
+        }
+    }
+
+    // After the close handler, which stops other threads from posting the connections
+    if (so->wakeup.fd != -1)
+    {
+        wakeup_destroy(&so->wakeup);
+        so->wakeup.fd = -1;
+    }
+}
+
+static void close_fd_report_undefined_error(int fd, const char *err_msg)
+{
+    if (close(fd) == -1)
+    {
+        switch (errno)
+        {
+            case EBADF: // Not a problem.
+            {
+                errno = 0;
+                break;
+            }
+            default:
+            {
+                // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                (void) fprintf(stderr, "Error: %s; %s\n", strerror(errno), err_msg);
+            }
+        }
+    }
+}
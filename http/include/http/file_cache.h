@@ -0,0 +1,104 @@
+#ifndef HTTPSERVER_FILE_CACHE_H
+#define HTTPSERVER_FILE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/**
+ * Files larger than this are mapped instead of copied into the cache
+ */
+#define FILE_CACHE_MMAP_THRESHOLD (64 * 1024)
+
+#define FILE_CACHE_ETAG_LENGTH 64 // room for an entity tag and its NUL
+#define FILE_CACHE_VALIDATORS_LENGTH 128 // room for the Last-Modified and ETag lines and a NUL
+
+/**
+ * A cached file together with its ready-made response header, which ends with the
+ * validators and stops short of the Connection header. For copied files the body follows
+ * the header in one allocation. A file too large to keep only has its metadata cached,
+ * which is enough to answer HEAD and conditional requests. Entries are reference counted; an evicted or invalidated entry stays valid
+ * until its last user releases it.
+ */
+struct file_cache_entry {
+    char * key; // normalized request URI, also the path relative to the docroot
+    char * header;
+    size_t header_length;
+    const char * validators; // the Last-Modified and ETag lines at the end of header
+    size_t validators_length;
+    const char * body; // NULL when only the metadata is cached
+    size_t body_length;
+    bool mapped; // body is an mmap of the file
+    struct stat stat; // metadata of the file when it was cached
+    uint32_t refcount;
+    bool cached; // still reachable from the cache
+    struct file_cache_entry * hash_next;
+    struct file_cache_entry * lru_prev;
+    struct file_cache_entry * lru_next;
+};
+
+struct file_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions; // entries dropped to stay under the memory cap
+    uint64_t invalidations; // entries dropped because the file changed
+    size_t entries;
+    size_t bytes_resident;
+    size_t max_bytes;
+};
+
+/**
+ * Set up the cache. Files are watched with inotify once the first one is cached,
+ * so a process that forks workers before serving only watches in the workers.
+ * @param max_bytes memory cap for cached bodies and headers, 0 disables the cache
+ * @return 0 on success, -1 and set errno on failure
+ */
+int file_cache_init(size_t max_bytes);
+
+/**
+ * Stop the watcher and free every entry that is not in use
+ */
+void file_cache_destroy(void);
+
+/**
+ * Turn a request URI of <uri_length> bytes into a NUL terminated cache key: drop the query
+ * and fragment, collapse repeated slashes and "." segments, resolve ".." segments against the
+ * segment before them, and drop the leading slash
+ * @return false if a ".." would climb above the document root, or the key does not fit in <size> bytes
+ */
+bool file_cache_normalize(const char * uri, size_t uri_length, char * key, size_t size);
+
+/**
+ * Look up a cached file
+ * @param key a normalized request URI
+ * @return the entry, to be released with file_cache_release, or NULL on a miss
+ */
+struct file_cache_entry * file_cache_acquire(const char * key);
+
+/**
+ * Cache an opened file, or only its metadata if the file is too large to keep
+ * @param key a normalized request URI
+ * @param file_fd the opened file, not closed by the cache
+ * @param file_stat the metadata of the opened file
+ * @return the entry, to be released with file_cache_release, or NULL if the file was not cached
+ */
+struct file_cache_entry * file_cache_insert(const char * key, int file_fd, const struct stat * file_stat);
+
+void file_cache_release(struct file_cache_entry * entry);
+
+/**
+ * Format the strong entity tag of a file, quotes included, from its inode, size and modification time
+ * @return the length of the tag, or 0 if it does not fit in <size> bytes
+ */
+size_t file_cache_etag(const struct stat * file_stat, char * etag, size_t size);
+
+/**
+ * Format the Last-Modified and ETag header lines of a file
+ * @return the length of the lines, or 0 if they do not fit in <size> bytes
+ */
+size_t file_cache_validators(const struct stat * file_stat, char * lines, size_t size);
+
+void file_cache_get_stats(struct file_cache_stats * stats);
+
+#endif //HTTPSERVER_FILE_CACHE_H
@@ -3,6 +3,18 @@
 
 #include <core-lib/objects.h>
 
-enum pollin_handle_result pollin_handle_http(struct core_object *co, struct state_object *so, int fd);
+enum pollin_handle_result pollin_handle_http(struct core_object *co, struct state_object *so, struct connection *conn);
+
+// Sends the output queued for a connection and, once it drains, serves the requests that waited
+enum pollin_handle_result pollout_handle_http(struct core_object *co, struct state_object *so, struct connection *conn);
+
+// Sends the output that waited for a commit, once the committer has woken the connection
+enum pollin_handle_result wake_handle_http(struct core_object *co, struct state_object *so, struct connection *conn);
+
+// Releases the per-connection parse state and drops any output still queued
+void close_handle_http(struct core_object *co, struct connection *conn);
+
+// Answers a request head that did not arrive in time with a 504, without blocking
+void timeout_handle_http(struct core_object *co, struct connection *conn);
 
 #endif //HTTPSERVER_HANDLERS_H
@@ -2,8 +2,18 @@
 #define HTTPSERVER_REQUEST_H
 
 #define MAX_REQUEST_URI_LENGTH 8192
+#define MAX_REQUEST_HEADERS_LENGTH 8192
+#define MAX_REQUEST_HEADERS 32
+
+/**
+ * Room for the longest accepted request head: the request line and the header lines.
+ * A request body has to fit in the same buffer, next to its head.
+ */
+#define REQUEST_BUFFER_LENGTH (MAX_REQUEST_URI_LENGTH + MAX_REQUEST_HEADERS_LENGTH)
 
 #include <core-lib/objects.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 /**
  * Provide the type of request: GET, POST, or HEAD
@@ -14,31 +24,102 @@ enum http_method {
     HTTP_METHOD_HEAD,
 };
 
+enum http_version {
+    HTTP_VERSION_1_0,
+    HTTP_VERSION_1_1,
+};
+
+/**
+ * A view of bytes in the receive buffer; not NUL terminated
+ */
+struct http_string {
+    const char * data;
+    uint32_t length;
+};
+
+struct http_header {
+    struct http_string name;
+    struct http_string value; // without the surrounding spaces
+};
+
 /**
- * By the documentation, we are supposed to provide a method and uri that is array of chars
+ * Headers that handlers look up, indexed while parsing
+ */
+enum http_known_header {
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_KNOWN_HEADER_COUNT,
+};
+
+/**
+ * A parsed request head, and its body when it has a Content-Length. Every view points into
+ * the buffer of the http_connection it was read from and stays valid until the next
+ * read_request on that connection.
  */
 struct http_request {
     enum http_method method;
-    char request_uri[MAX_REQUEST_URI_LENGTH];
+    enum http_version version;
+    bool keep_alive; // the client wants the connection kept open after the response
+    struct http_string uri;
+    uint32_t num_headers;
+    struct http_header headers[MAX_REQUEST_HEADERS];
+    const struct http_header * known[HTTP_KNOWN_HEADER_COUNT]; // first header of each kind, or NULL
+    struct http_string body; // empty without a Content-Length
+};
+
+/**
+ * Per-connection parse state. Bytes are kept between pollin events until a whole
+ * request head has arrived, so a client that sends part of a request never blocks the server.
+ * buffer[start, end) is not parsed yet; bytes before start belong to the last request
+ * returned, which is dropped on the next call. buffer[start, scanned) is known not to
+ * contain the end of the request head. Once a head has arrived whose body has not,
+ * head_end and body_end say where each ends, and nothing is scanned until the body is in.
+ */
+struct http_connection {
+    uint32_t start;
+    uint32_t end; // number of bytes in buffer
+    uint32_t scanned;
+    uint32_t line_end; // offset just past the CRLF that ends the request line, 0 until it arrives
+    uint32_t head_end; // offset just past the request head, 0 unless its body is still arriving
+    uint32_t body_end;
+    uint32_t requests; // requests handled on this connection
+    uint64_t bytes_read; // bytes received on this connection
+    char buffer[REQUEST_BUFFER_LENGTH];
 };
 
 /**
  * Provide the code of success
  */
 enum read_request_result {
-    READ_REQUEST_SUCCESS,
+    READ_REQUEST_SUCCESS, // A complete request was parsed
+    READ_REQUEST_NEED_MORE, // The socket has no more data for now; call again on the next pollin event
     READ_REQUEST_INTERNAL_ERROR,
     READ_REQUEST_EOF,
     READ_REQUEST_BAD_REQUEST,
+    READ_REQUEST_TOO_LARGE, // The body does not fit in the buffer
 };
 
 /**
- * returns read_request_result
- * @param fd
- * @param so
- * @param req
- * @return
+ * Reset the parse state of a connection
+ * @param conn the connection
+ */
+void http_connection_init(struct http_connection * conn);
+
+/**
+ * Parse the next request if its head is already buffered; otherwise consume whatever bytes
+ * are available on the non-blocking socket and try again. Never blocks.
+ * @param fd the client socket
+ * @param conn the parse state of the connection
+ * @param req filled on READ_REQUEST_SUCCESS
+ * @return read_request_result
  */
-enum read_request_result read_request(int fd, struct state_object * so, struct http_request * req);
+enum read_request_result read_request(int fd, struct http_connection * conn, struct http_request * req);
 
 #endif //HTTPSERVER_REQUEST_H
@@ -3,14 +3,30 @@
 
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define RESPONSE_MAX_IOV 64
+#define RESPONSE_HEADER_BUFFER_SIZE 4096
+#define RESPONSE_MAX_HELD 32
+#define RESPONSE_MAX_OWNED 16
+
+struct file_cache_entry;
+struct http_request;
+struct output_queue;
 
 enum res_result_code{
     RESPONSE_RESULT_SUCCESS = 200,
     RESPONSE_RESULT_CREATED = 201,
+    RESPONSE_RESULT_PARTIAL_CONTENT = 206,
+    RESPONSE_RESULT_NOT_MODIFIED = 304,
     RESPONSE_RESULT_BAD_REQUEST = 400,
     RESPONSE_RESULT_NOT_FOUND = 404,
     RESPONSE_RESULT_INVALID = 405,
     RESPONSE_RESULT_CONFLICT = 409, // not defined in the protocol
+    RESPONSE_RESULT_PAYLOAD_TOO_LARGE = 413,
+    RESPONSE_RESULT_RANGE_NOT_SATISFIABLE = 416,
     RESPONSE_RESULT_INT_SERV_ERR = 500,
     RESPONSE_RESULT_METHOD_NOT_IMPLEMENTED = 501,
     RESPONSE_RESULT_CANNOT_HANDLE = 503,
@@ -18,9 +34,81 @@ enum res_result_code{
     RESPONSE_RESULT_WRONG_VERSION = 505
 };
 
-bool write_status_line(enum res_result_code res_code, int fd);
-bool write_content_length(size_t length, int fd);
+/**
+ * Queues responses so that they go out in as few system calls as possible: all the responses
+ * to the requests read in one pollin event are flushed together with one sendmsg, in order.
+ * Status lines and headers are formatted into headers; bodies are referenced, not copied,
+ * and must stay valid until they are flushed. When the queue fills up, it is flushed early.
+ * Nothing blocks: what the socket does not take moves to the connection's output queue,
+ * which keeps referencing held cache entries and copies everything else. With hold_for_commit,
+ * output behind a stored write that is not durable yet moves there too, and commit is left set
+ * for the caller to send the queue once it is.
+ */
+struct response_builder {
+    int fd;
+    int iov_count;
+    size_t headers_length;
+    size_t text_start; // headers[text_start, headers_length) has no iovec yet
+    size_t num_held;
+    size_t num_owned;
+    bool failed; // a write failed or something did not fit; flushing will fail
+    bool corked; // a file was appended since the last flush, with TCP_CORK set until then
+    uint64_t commit; // stored writes the queued responses confirm, made durable before anything is sent
+    bool hold_for_commit; // queue output behind a pending commit instead of waiting for it
+    struct output_queue * out; // sent from by the pollout handler
+    struct iovec iov[RESPONSE_MAX_IOV];
+    struct file_cache_entry * held[RESPONSE_MAX_HELD]; // released once their bytes are sent
+    struct iovec owned[RESPONSE_MAX_OWNED]; // malloc'd buffers, freed once they are sent
+    char headers[RESPONSE_HEADER_BUFFER_SIZE];
+};
+
+void response_init(struct response_builder * res, int fd, struct output_queue * out);
+
+// Append the status line
+void response_status(struct response_builder * res, enum res_result_code res_code);
+
+// Append a header line; value is a printf format
+void response_header(struct response_builder * res, const char * name, const char * format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Append the Content-Length and Connection headers and the blank line that ends the headers
+void response_end_headers(struct response_builder * res, size_t content_length, bool keep_alive);
+
+// Append a buffer, either ready-made headers or body
+void response_append(struct response_builder * res, const void * data, size_t length);
+
+// Append a malloc'd buffer, which the builder frees once it has been sent, even on error
+void response_append_owned(struct response_builder * res, void * data, size_t length);
+
+// Keep a cache entry acquired until the next flush has sent everything appended up to then;
+// held before its bytes are appended, so that they are referenced rather than copied if queued
+void response_hold(struct response_builder * res, struct file_cache_entry * entry);
+
+/**
+ * Send everything queued with one sendmsg, and any files appended with sendfile, leaving the
+ * rest in the output queue. Must be called before the builder goes away, even after an error,
+ * so held entries are released.
+ * @return false in case of error
+ */
+bool response_flush(struct response_builder * res);
+
+/**
+ * Append the bytes of <file_fd> from <offset> up to <end>, sent with sendfile on the next flush.
+ * The socket is corked until then so that the headers share packets with the start of the body.
+ * The output queue takes <file_fd> over and closes it once it is sent, even on error.
+ * @return false in case of error
+ */
+bool response_append_file(struct response_builder * res, int file_fd, off_t offset, off_t end);
+
+/**
+ * Queue a bodiless response for <res_code>. The responses are formatted once, up front.
+ * @return false in case of error
+ */
+bool response_canned(struct response_builder * res, enum res_result_code res_code, bool keep_alive);
 
-// return -1 in case of error
-bool serve_file(const char* file_name, int fd, bool get);
+/**
+ * Queue the response for a GET or HEAD of a file, or for byte ranges of it
+ * @return false in case of error
+ */
+bool serve_file(const struct http_request * req, struct response_builder * res);
 #endif //HTTPSERVER_RESPONSE_H
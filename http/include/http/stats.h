@@ -0,0 +1,115 @@
+#ifndef HTTPSERVER_STATS_H
+#define HTTPSERVER_STATS_H
+
+#include "request.h"
+#include "response.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Request paths of the metrics, answered only when stats are enabled
+#define HTTP_STATS_PATH "/_stats"
+#define HTTP_STATS_JSON_PATH "/_stats?format=json"
+
+#define HTTP_STATS_CACHE_LINE 64
+
+/**
+ * Latency buckets are powers of two: bucket i counts durations up to 2^(i + HTTP_STATS_FIRST_BUCKET_BITS)
+ * nanoseconds, from 256ns to about 2s; the last one counts everything slower
+ */
+#define HTTP_STATS_FIRST_BUCKET_BITS 8
+#define HTTP_STATS_NUM_BUCKETS 24
+
+enum http_stats_phase {
+    HTTP_STATS_PHASE_PARSE, // a complete request head into a struct http_request
+    HTTP_STATS_PHASE_OPEN, // the file lookup: the cache, or open and fstat on a miss
+    HTTP_STATS_PHASE_SEND, // one sendmsg of the responses, or one drain of the output queue
+    HTTP_STATS_PHASE_COMMIT, // the wait for the group commit that makes stored resources durable
+    HTTP_STATS_PHASE_COUNT,
+};
+
+// Every code of enum res_result_code, in the same order
+enum http_stats_status {
+    HTTP_STATS_STATUS_200,
+    HTTP_STATS_STATUS_201,
+    HTTP_STATS_STATUS_206,
+    HTTP_STATS_STATUS_304,
+    HTTP_STATS_STATUS_400,
+    HTTP_STATS_STATUS_404,
+    HTTP_STATS_STATUS_405,
+    HTTP_STATS_STATUS_409,
+    HTTP_STATS_STATUS_413,
+    HTTP_STATS_STATUS_416,
+    HTTP_STATS_STATUS_500,
+    HTTP_STATS_STATUS_501,
+    HTTP_STATS_STATUS_503,
+    HTTP_STATS_STATUS_504,
+    HTTP_STATS_STATUS_505,
+    HTTP_STATS_STATUS_COUNT,
+};
+
+enum http_stats_counter {
+    HTTP_STATS_CONNECTIONS_ACCEPTED, // counted on the first read, when the connection gets its session
+    HTTP_STATS_CONNECTIONS_CLOSED,
+    HTTP_STATS_BYTES_IN,
+    HTTP_STATS_BYTES_OUT,
+    HTTP_STATS_CACHE_HITS,
+    HTTP_STATS_CACHE_MISSES,
+    HTTP_STATS_COUNTER_COUNT,
+};
+
+// Requests counted by method, and the ones that could not be parsed
+#define HTTP_STATS_NUM_METHODS (HTTP_METHOD_HEAD + 2)
+
+struct http_stats_histogram {
+    atomic_uint_fast64_t buckets[HTTP_STATS_NUM_BUCKETS + 1];
+    atomic_uint_fast64_t sum_ns;
+};
+
+/**
+ * The counters of one thread. Only that thread writes them, with plain loads and stores,
+ * so counting never takes a lock or a locked instruction and never shares a cache line
+ * with another thread. Readers add up every shard.
+ */
+struct http_stats_shard {
+    _Alignas(HTTP_STATS_CACHE_LINE) atomic_uint_fast64_t counters[HTTP_STATS_COUNTER_COUNT];
+    atomic_uint_fast64_t requests[HTTP_STATS_NUM_METHODS];
+    atomic_uint_fast64_t responses[HTTP_STATS_STATUS_COUNT];
+    struct http_stats_histogram latency[HTTP_STATS_PHASE_COUNT];
+    struct http_stats_shard * next; // every shard is on one list, which readers walk
+};
+
+/**
+ * Turn the counters and the /_stats endpoint on or off. Off, every counting call returns at once.
+ * Call it before the event loops start.
+ */
+void http_stats_enable(bool on);
+
+bool http_stats_enabled(void);
+
+// Nanoseconds of the monotonic clock, for timing a phase; 0 when stats are disabled
+uint64_t http_stats_start(void);
+
+// Count the time since <started> in the histogram of <phase>
+void http_stats_phase(enum http_stats_phase phase, uint64_t started);
+
+void http_stats_add(enum http_stats_counter counter, uint64_t amount);
+
+// Count a request by method; <bad> for one that could not be parsed
+void http_stats_request(const struct http_request * req, bool bad);
+
+void http_stats_response(enum res_result_code res_code);
+
+/**
+ * Whether <req> asks for the stats, to be answered with http_stats_serve
+ */
+bool http_stats_requested(const struct http_request * req);
+
+/**
+ * Queue the stats, in Prometheus text format or as JSON depending on the path, and send
+ * them along with everything queued before
+ * @return false in case of error
+ */
+bool http_stats_serve(const struct http_request * req, struct response_builder * res);
+
+#endif //HTTPSERVER_STATS_H
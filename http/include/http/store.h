@@ -0,0 +1,83 @@
+#ifndef HTTPSERVER_STORE_H
+#define HTTPSERVER_STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Resources are created with a POST to the prefix and read back below it, at the key
+ * the Location header of the 201 names
+ */
+#define STORE_URI_PREFIX "/resources/"
+#define STORE_KEY_LENGTH 36 // a UUID in its text form
+
+struct http_request;
+struct response_builder;
+
+enum store_commit_state {
+    STORE_COMMIT_PENDING, // the sync covering the commit has not finished
+    STORE_COMMIT_DURABLE,
+    STORE_COMMIT_FAILED,
+};
+
+/**
+ * Told once the sync covering <commit> finishes. notify runs on the committer thread with the
+ * store locked, so it must only hand the news on, and not call back into the store.
+ */
+struct store_waiter {
+    uint64_t commit;
+    void (*notify)(struct store_waiter * waiter);
+    struct store_waiter * next;
+    bool queued; // watching; starts out false
+};
+
+/**
+ * Set up the store of posted resources, a gdbm database through its ndbm interface. The
+ * database is opened on first use and kept open, and a thread of its own syncs the writes. gdbm lets only one process open it for
+ * writing, so processes forked after this call, such as prefork workers, open it for each
+ * operation under a lock file instead, and sync each write before releasing it.
+ * @param path the database, without the .pag and .dir that gdbm adds
+ * @param commit_window_us how long a commit waits for more writes to join it, 0 to sync at once
+ * @return 0 on success, -1 and set errno on failure
+ */
+int store_init(const char * path, uint32_t commit_window_us);
+
+/**
+ * Sync what is left, stop the committer, close the database and drop the read cache
+ */
+void store_destroy(void);
+
+// Whether the request is for the store: a POST to STORE_URI_PREFIX, or a GET or HEAD below it
+bool store_requested(const struct http_request * req);
+
+/**
+ * Queue the response to a store request. A POST stores the body under a new key, and its 201
+ * is only sent once the write is durable: the builder holds it until the commit.
+ * @return false in case of error
+ */
+bool store_serve(const struct http_request * req, struct response_builder * res);
+
+/**
+ * Where the sync covering <commit> stands. Writes that arrive while a sync runs, or within the
+ * commit window before it, share one sync.
+ * @param commit a value of res->commit set by store_serve
+ */
+enum store_commit_state store_commit_state(uint64_t commit);
+
+/**
+ * Have <waiter> told when the sync covering <commit> finishes, unless it already has
+ * @return false if the sync has finished, and the waiter will not be told
+ */
+bool store_watch(struct store_waiter * waiter, uint64_t commit);
+
+// Stop watching, before the waiter goes away
+void store_unwatch(struct store_waiter * waiter);
+
+/**
+ * Block until every write up to <commit> is on disk, for callers that cannot be told
+ * @param commit a value of res->commit set by store_serve
+ * @return false if the sync failed
+ */
+bool store_wait(uint64_t commit);
+
+#endif //HTTPSERVER_STORE_H
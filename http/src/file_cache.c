@@ -0,0 +1,583 @@
+#include "file_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#define FILE_CACHE_BUCKETS 4096 // power of two
+#define HEADER_MAX_LENGTH (64 + FILE_CACHE_VALIDATORS_LENGTH)
+#define MAX_WATCHES 1024
+
+/**
+ * A file is only cached if it takes at most this fraction of the memory cap,
+ * so one large asset cannot flush everything else
+ */
+#define MAX_FILE_FRACTION 8
+
+struct watch {
+    int wd;
+    char * dir; // "" for the docroot itself
+};
+
+static struct {
+    pthread_mutex_t lock;
+    bool enabled;
+    size_t max_bytes;
+    size_t bytes_resident;
+    size_t entries;
+    struct file_cache_entry * buckets[FILE_CACHE_BUCKETS];
+    struct file_cache_entry * lru_head; // most recently used
+    struct file_cache_entry * lru_tail;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t generation; // bumped on every invalidation, so a racing insert can tell it read a stale file
+    pid_t owner; // process that started the watcher
+    bool watching;
+    int inotify_fd;
+    int stop_pipe[2];
+    pthread_t watcher;
+    struct watch watches[MAX_WATCHES];
+    size_t num_watches;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER, .inotify_fd = -1, .stop_pipe = {-1, -1}};
+
+static uint32_t hash_key(const char * key) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *key; key++) {
+        hash = (hash ^ (unsigned char)*key) * 16777619u;
+    }
+    return hash;
+}
+
+static size_t entry_bytes(const struct file_cache_entry * entry) {
+    return entry->header_length + entry->body_length;
+}
+
+static void free_entry(struct file_cache_entry * entry) {
+    if (entry->mapped) {
+        munmap((void *)(uintptr_t)entry->body, entry->body_length);
+        free(entry->header);
+    } else {
+        free(entry->header); // the body lives in the same allocation
+    }
+    free(entry->key);
+    free(entry);
+}
+
+static void lru_unlink(struct file_cache_entry * entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache.lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache.lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct file_cache_entry * entry) {
+    entry->lru_next = cache.lru_head;
+    if (cache.lru_head) {
+        cache.lru_head->lru_prev = entry;
+    } else {
+        cache.lru_tail = entry;
+    }
+    cache.lru_head = entry;
+}
+
+static struct file_cache_entry ** find_slot(const char * key) {
+    struct file_cache_entry ** slot = &cache.buckets[hash_key(key) & (FILE_CACHE_BUCKETS - 1)];
+    while (*slot && strcmp((*slot)->key, key) != 0) {
+        slot = &(*slot)->hash_next;
+    }
+    return slot;
+}
+
+/**
+ * Drop an entry from the cache. Must hold the lock.
+ * The entry is freed now if nobody is sending it, otherwise by its last release.
+ */
+static void remove_entry(struct file_cache_entry * entry) {
+    struct file_cache_entry ** slot = find_slot(entry->key);
+    if (*slot == entry) {
+        *slot = entry->hash_next;
+    }
+    lru_unlink(entry);
+    cache.bytes_resident -= entry_bytes(entry);
+    cache.entries--;
+    entry->cached = false;
+    if (entry->refcount == 0) {
+        free_entry(entry);
+    }
+}
+
+static void remove_all_entries(void) {
+    while (cache.lru_tail) {
+        remove_entry(cache.lru_tail);
+        cache.invalidations++;
+    }
+    cache.generation++;
+}
+
+static void invalidate_key(const char * key) {
+    struct file_cache_entry * entry = *find_slot(key);
+    if (entry) {
+        remove_entry(entry);
+        cache.invalidations++;
+    }
+    cache.generation++;
+}
+
+#ifdef __linux__
+static const char * watch_dir(int wd) {
+    for (size_t i = 0; i < cache.num_watches; i++) {
+        if (cache.watches[i].wd == wd) {
+            return cache.watches[i].dir;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Invalidate whatever one inotify event may have changed. Must hold the lock.
+ */
+static void handle_event(const struct inotify_event * event) {
+    if ((event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_ISDIR)) || event->len == 0) {
+        // Lost events, or a whole directory changed: anything cached may be stale
+        remove_all_entries();
+        return;
+    }
+    const char * dir = watch_dir(event->wd);
+    if (!dir) {
+        return;
+    }
+    char key[PATH_MAX];
+    int length = dir[0] ? snprintf(key, sizeof(key), "%s/%s", dir, event->name)
+                        : snprintf(key, sizeof(key), "%s", event->name);
+    if (length > 0 && (size_t)length < sizeof(key)) {
+        invalidate_key(key);
+    }
+}
+
+static void * watch_docroot(void * arg) {
+    (void)arg;
+    // Aligned for struct inotify_event, big enough for several events per read
+    char buffer[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pollfds[2] = {
+        {.fd = cache.inotify_fd, .events = POLLIN, .revents = 0},
+        {.fd = cache.stop_pipe[0], .events = POLLIN, .revents = 0},
+    };
+
+    for (;;) {
+        if (poll(pollfds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("file cache watcher");
+            break;
+        }
+        if (pollfds[1].revents) {
+            break;
+        }
+        ssize_t length = read(cache.inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            if (length == -1 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            perror("file cache watcher");
+            break;
+        }
+
+        pthread_mutex_lock(&cache.lock);
+        for (char * ptr = buffer; ptr < buffer + length;) {
+            const struct inotify_event * event = (const struct inotify_event *)(void *)ptr;
+            handle_event(event);
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+        pthread_mutex_unlock(&cache.lock);
+    }
+
+    // Without a watcher nothing can be invalidated, so stop caching
+    pthread_mutex_lock(&cache.lock);
+    remove_all_entries();
+    cache.enabled = false;
+    pthread_mutex_unlock(&cache.lock);
+    return NULL;
+}
+
+/**
+ * Start the watcher in this process. Must hold the lock.
+ * @return false if files cannot be watched, in which case nothing should be cached
+ */
+static bool start_watcher(void) {
+    cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache.inotify_fd == -1) {
+        perror("file cache inotify_init1");
+        return false;
+    }
+    if (pipe(cache.stop_pipe) == -1) {
+        perror("file cache pipe");
+        close(cache.inotify_fd);
+        cache.inotify_fd = -1;
+        return false;
+    }
+    int status = pthread_create(&cache.watcher, NULL, watch_docroot, NULL);
+    if (status != 0) {
+        fprintf(stderr, "file cache watcher: %s\n", strerror(status));
+        close(cache.inotify_fd);
+        close(cache.stop_pipe[0]);
+        close(cache.stop_pipe[1]);
+        cache.inotify_fd = -1;
+        cache.stop_pipe[0] = cache.stop_pipe[1] = -1;
+        return false;
+    }
+    cache.watching = true;
+    return true;
+}
+
+/**
+ * Watch the directory holding <key> for changes. Must hold the lock.
+ * @return false if the directory cannot be watched
+ */
+static bool watch_key(const char * key) {
+    const char * slash = strrchr(key, '/');
+    size_t dir_length = slash ? (size_t)(slash - key) : 0;
+
+    for (size_t i = 0; i < cache.num_watches; i++) {
+        if (strlen(cache.watches[i].dir) == dir_length && memcmp(cache.watches[i].dir, key, dir_length) == 0) {
+            return true;
+        }
+    }
+    if (cache.num_watches == MAX_WATCHES) {
+        return false;
+    }
+
+    char * dir = strndup(key, dir_length);
+    if (!dir) {
+        return false;
+    }
+    int wd = inotify_add_watch(cache.inotify_fd, dir[0] ? dir : ".",
+                               IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                               IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd == -1) {
+        free(dir);
+        return false;
+    }
+    cache.watches[cache.num_watches].wd = wd;
+    cache.watches[cache.num_watches].dir = dir;
+    cache.num_watches++;
+    return true;
+}
+
+static void stop_watcher(void) {
+    if (!cache.watching) {
+        return;
+    }
+    if (cache.owner == getpid()) {
+        ssize_t ignored = write(cache.stop_pipe[1], "", 1);
+        (void)ignored;
+        pthread_join(cache.watcher, NULL);
+    }
+    // In a forked child the watcher thread does not exist; just drop the inherited descriptors
+    close(cache.inotify_fd);
+    close(cache.stop_pipe[0]);
+    close(cache.stop_pipe[1]);
+    cache.inotify_fd = -1;
+    cache.stop_pipe[0] = cache.stop_pipe[1] = -1;
+    for (size_t i = 0; i < cache.num_watches; i++) {
+        free(cache.watches[i].dir);
+    }
+    cache.num_watches = 0;
+    cache.watching = false;
+}
+#endif
+
+/**
+ * Make sure this process can watch files. Must hold the lock.
+ * @return false if nothing should be cached
+ */
+static bool ensure_watcher(void) {
+#ifdef __linux__
+    if (cache.watching && cache.owner != getpid()) {
+        // Forked after the parent started watching; the parent's watcher does not exist here
+        remove_all_entries();
+        stop_watcher();
+    }
+    if (!cache.watching) {
+        cache.owner = getpid();
+        if (!start_watcher()) {
+            cache.enabled = false;
+            return false;
+        }
+    }
+    return true;
+#else
+    // No inotify: only cache if the file can be revalidated, which is not implemented
+    return false;
+#endif
+}
+
+int file_cache_init(size_t max_bytes) {
+    pthread_mutex_lock(&cache.lock);
+    cache.max_bytes = max_bytes;
+    cache.enabled = max_bytes > 0;
+    pthread_mutex_unlock(&cache.lock);
+    return 0;
+}
+
+void file_cache_destroy(void) {
+    pthread_mutex_lock(&cache.lock);
+    cache.enabled = false;
+    pthread_mutex_unlock(&cache.lock);
+
+#ifdef __linux__
+    // Join without the lock; the watcher takes it while handling events
+    stop_watcher();
+#endif
+
+    pthread_mutex_lock(&cache.lock);
+    remove_all_entries();
+    pthread_mutex_unlock(&cache.lock);
+}
+
+bool file_cache_normalize(const char * uri, size_t uri_length, char * key, size_t size) {
+    size_t length = 0;
+    const char * ptr = uri;
+    const char * end = uri + uri_length;
+
+    while (ptr < end && *ptr != '?' && *ptr != '#') {
+        // At the start of a segment
+        while (ptr < end && *ptr == '/') {
+            ptr++;
+        }
+        const char * segment = ptr;
+        while (ptr < end && *ptr != '/' && *ptr != '?' && *ptr != '#') {
+            ptr++;
+        }
+        size_t segment_length = ptr - segment;
+        if (segment_length == 0 || (segment_length == 1 && segment[0] == '.')) {
+            continue;
+        }
+        if (segment_length == 2 && segment[0] == '.' && segment[1] == '.') {
+            // Back up over the previous segment, but never above the document root
+            if (length == 0) {
+                return false;
+            }
+            while (length > 0 && key[length - 1] != '/') {
+                length--;
+            }
+            if (length > 0) {
+                length--; // and its separator
+            }
+            continue;
+        }
+        if (length + (length ? 1 : 0) + segment_length >= size) {
+            return false;
+        }
+        if (length) {
+            key[length++] = '/';
+        }
+        memcpy(&key[length], segment, segment_length);
+        length += segment_length;
+    }
+    if (size == 0) {
+        return false;
+    }
+    key[length] = '\0';
+    return true;
+}
+
+struct file_cache_entry * file_cache_acquire(const char * key) {
+    pthread_mutex_lock(&cache.lock);
+    struct file_cache_entry * entry = NULL;
+    if (cache.enabled) {
+        entry = *find_slot(key);
+        if (entry) {
+            entry->refcount++;
+            lru_unlink(entry);
+            lru_push_front(entry);
+            cache.hits++;
+        } else {
+            cache.misses++;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return entry;
+}
+
+size_t file_cache_etag(const struct stat * file_stat, char * etag, size_t size) {
+    int length = snprintf(etag, size, "\"%jx-%jx-%jx.%lx\"", (uintmax_t)file_stat->st_ino,
+                          (uintmax_t)file_stat->st_size, (uintmax_t)file_stat->st_mtim.tv_sec,
+                          (unsigned long)file_stat->st_mtim.tv_nsec);
+    return length > 0 && (size_t)length < size ? (size_t)length : 0;
+}
+
+size_t file_cache_validators(const struct stat * file_stat, char * lines, size_t size) {
+    struct tm modified;
+    char date[32];
+    char etag[FILE_CACHE_ETAG_LENGTH];
+    if (!gmtime_r(&file_stat->st_mtime, &modified) ||
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &modified) == 0 ||
+        file_cache_etag(file_stat, etag, sizeof(etag)) == 0) {
+        return 0;
+    }
+    int length = snprintf(lines, size, "Last-Modified: %s\r\nETag: %s\r\n", date, etag);
+    return length > 0 && (size_t)length < size ? (size_t)length : 0;
+}
+
+/**
+ * Read the file, or with <metadata_only> just describe it, into a new entry, without touching the cache
+ */
+static struct file_cache_entry * load_entry(const char * key, int file_fd, const struct stat * file_stat, bool metadata_only) {
+    size_t size = (size_t)file_stat->st_size;
+    char header[HEADER_MAX_LENGTH];
+    int status_length = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nAccept-Ranges: bytes\r\nContent-Length: %zu\r\n", size);
+    if (status_length < 0 || (size_t)status_length >= sizeof(header)) {
+        return NULL;
+    }
+    size_t validators_length = file_cache_validators(file_stat, header + status_length, sizeof(header) - status_length);
+    if (validators_length == 0) {
+        return NULL;
+    }
+    size_t header_length = status_length + validators_length;
+
+    struct file_cache_entry * entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+        return NULL;
+    }
+    entry->key = strdup(key);
+    entry->header_length = header_length;
+    entry->body_length = metadata_only ? 0 : size;
+    entry->stat = *file_stat;
+    entry->mapped = !metadata_only && size > FILE_CACHE_MMAP_THRESHOLD;
+
+    if (metadata_only) {
+        entry->header = malloc(header_length);
+        if (!entry->key || !entry->header) {
+            free_entry(entry);
+            return NULL;
+        }
+    } else if (entry->mapped) {
+        entry->header = malloc(header_length);
+        void * body = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+        if (body == MAP_FAILED) {
+            entry->mapped = false; // nothing to unmap
+        } else {
+            entry->body = body;
+        }
+        if (!entry->key || !entry->header || !entry->body) {
+            free_entry(entry);
+            return NULL;
+        }
+    } else {
+        entry->header = malloc(header_length + size);
+        if (!entry->key || !entry->header) {
+            free_entry(entry);
+            return NULL;
+        }
+        entry->body = entry->header + header_length;
+        size_t nread = 0;
+        while (nread < size) {
+            ssize_t result = pread(file_fd, entry->header + header_length + nread, size - nread, (off_t)nread);
+            if (result <= 0) {
+                if (result == -1 && errno == EINTR) {
+                    continue;
+                }
+                free_entry(entry); // read error, or the file shrank under us
+                return NULL;
+            }
+            nread += result;
+        }
+    }
+    memcpy(entry->header, header, header_length);
+    entry->validators = entry->header + status_length;
+    entry->validators_length = validators_length;
+    return entry;
+}
+
+struct file_cache_entry * file_cache_insert(const char * key, int file_fd, const struct stat * file_stat) {
+    if (!S_ISREG(file_stat->st_mode)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    size_t needed = (size_t)file_stat->st_size + HEADER_MAX_LENGTH;
+    // A file too large to keep still gets its metadata cached, so HEAD and revalidation never open it
+    bool metadata_only = needed > cache.max_bytes / MAX_FILE_FRACTION;
+    // Watch before reading, so a change made while reading is never missed
+    if (!cache.enabled || HEADER_MAX_LENGTH > cache.max_bytes / MAX_FILE_FRACTION || !ensure_watcher()
+#ifdef __linux__
+        || !watch_key(key)
+#endif
+        ) {
+        pthread_mutex_unlock(&cache.lock);
+        return NULL;
+    }
+    uint64_t generation = cache.generation;
+    pthread_mutex_unlock(&cache.lock);
+
+    // Read without the lock; other threads keep hitting the cache meanwhile
+    struct file_cache_entry * entry = load_entry(key, file_fd, file_stat, metadata_only);
+    if (!entry) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    if (!cache.enabled || cache.generation != generation || *find_slot(key)) {
+        // Something changed while reading, or another thread got here first: serve this copy once
+        pthread_mutex_unlock(&cache.lock);
+        entry->refcount = 1;
+        return entry;
+    }
+    while (cache.lru_tail && cache.bytes_resident + entry_bytes(entry) > cache.max_bytes) {
+        remove_entry(cache.lru_tail);
+        cache.evictions++;
+    }
+    uint32_t bucket = hash_key(key) & (FILE_CACHE_BUCKETS - 1);
+    entry->hash_next = cache.buckets[bucket];
+    cache.buckets[bucket] = entry;
+    lru_push_front(entry);
+    cache.bytes_resident += entry_bytes(entry);
+    cache.entries++;
+    entry->cached = true;
+    entry->refcount = 1;
+    pthread_mutex_unlock(&cache.lock);
+    return entry;
+}
+
+void file_cache_release(struct file_cache_entry * entry) {
+    pthread_mutex_lock(&cache.lock);
+    bool last = --entry->refcount == 0 && !entry->cached;
+    pthread_mutex_unlock(&cache.lock);
+    if (last) {
+        free_entry(entry);
+    }
+}
+
+void file_cache_get_stats(struct file_cache_stats * stats) {
+    pthread_mutex_lock(&cache.lock);
+    stats->hits = cache.hits;
+    stats->misses = cache.misses;
+    stats->evictions = cache.evictions;
+    stats->invalidations = cache.invalidations;
+    stats->entries = cache.entries;
+    stats->bytes_resident = cache.bytes_resident;
+    stats->max_bytes = cache.max_bytes;
+    pthread_mutex_unlock(&cache.lock);
+}
@@ -1,35 +1,268 @@
 #include "handlers.h"
 #include "response.h"
 #include "request.h"
+#include "stats.h"
+#include "store.h"
+#include <core-lib/arena.h>
+#include <core-lib/output_queue.h>
+#include <core-lib/trace.h>
+#include <core-lib/wakeup.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 
-bool handle_request(enum read_request_result read_request_result, struct http_request * req, int fd) {
-    // TODO handle EOF in serve and write
+/**
+ * Everything a connection needs, in an arena of its own: the parse state lives at the start
+ * and stays, the request and the response builder of an event go after base and are
+ * dropped once the responses are flushed. What the socket does not take waits in out, and
+ * so does everything behind a stored write until its commit is durable.
+ */
+struct http_session {
+    struct arena arena; // also owns this structure
+    struct arena_mark base;
+    struct http_connection parser;
+    struct output_queue out;
+    bool close_when_sent; // the connection closes once out drains
+    uint64_t commit; // the commit out waits for, 0 for none
+    uint64_t commit_started; // when the wait for commit began, for the stats
+    struct store_waiter waiter; // wakes the connection once commit is durable
+    struct connection * conn;
+};
+
+/**
+ * Hand the connection back to its event loop once its commit is durable. Runs on the committer thread.
+ */
+static void commit_done(struct store_waiter * waiter) {
+    struct http_session * session = (struct http_session *)(void *)((char *)waiter - offsetof(struct http_session, waiter));
+    wakeup_post(session->conn->wakeup, session->conn);
+}
+
+static struct http_session * new_session(struct arena_pool * pool, struct connection * conn) {
+    struct arena arena;
+    arena_init(&arena, pool);
+    struct http_session * session = arena_alloc(&arena, sizeof(*session));
+    if (!session) {
+        return NULL;
+    }
+    session->arena = arena;
+    session->base = arena_get_mark(&session->arena);
+    http_connection_init(&session->parser);
+    output_queue_init(&session->out, pool);
+    session->close_when_sent = false;
+    session->commit = 0;
+    session->waiter.notify = commit_done;
+    session->waiter.queued = false;
+    session->conn = conn;
+    http_stats_add(HTTP_STATS_CONNECTIONS_ACCEPTED, 1);
+    return session;
+}
+
+bool handle_request(enum read_request_result read_request_result, struct http_request * req, struct response_builder * res) {
     if (read_request_result == READ_REQUEST_SUCCESS) {
-        if (req->method == HTTP_METHOD_GET || req->method == HTTP_METHOD_HEAD) {
-            return (serve_file(req->request_uri, fd, req->method == HTTP_METHOD_GET));
+        if (http_stats_requested(req)) {
+            return http_stats_serve(req, res);
+        } else if (store_requested(req)) {
+            return store_serve(req, res);
+        } else if (req->method == HTTP_METHOD_GET || req->method == HTTP_METHOD_HEAD) {
+            TRACE_BEGIN("serve_file", res->fd);
+            bool served = serve_file(req, res);
+            TRACE_END("serve_file", res->fd);
+            return served;
         } else {
-            return(write_status_line(RESPONSE_RESULT_METHOD_NOT_IMPLEMENTED, fd) && write_content_length(0, fd));
+            return response_canned(res, RESPONSE_RESULT_METHOD_NOT_IMPLEMENTED, req->keep_alive);
         }
     } else if (read_request_result == READ_REQUEST_BAD_REQUEST) {
-        return(write_status_line(RESPONSE_RESULT_BAD_REQUEST, fd) && write_content_length(0, fd) );
+        return response_canned(res, RESPONSE_RESULT_BAD_REQUEST, false);
+    } else if (read_request_result == READ_REQUEST_TOO_LARGE) {
+        return response_canned(res, RESPONSE_RESULT_PAYLOAD_TOO_LARGE, false);
     }
     return false;
 }
 
-enum pollin_handle_result pollin_handle_http(struct core_object *co, struct state_object *so, int fd) {
-    struct http_request req;
-    memset(&req, 0, sizeof(req));
-    enum read_request_result read_request_result = read_request(fd, so, &req);
+/**
+ * Check on the commit the output queue waits for, and park the connection while it is pending:
+ * the library then waits for nothing on it until the committer wakes it
+ * @return 1 when nothing is left to wait for, 0 when parked, -1 when the commit failed
+ */
+static int await_commit(struct connection *conn, struct http_session * session) {
+    while (session->commit > 0) {
+        switch (store_commit_state(session->commit)) {
+            case STORE_COMMIT_PENDING:
+                if (store_watch(&session->waiter, session->commit)) {
+                    conn->parked = true;
+                    conn->want_write = false;
+                    return 0;
+                }
+                break; // settled meanwhile
+            case STORE_COMMIT_DURABLE:
+                http_stats_phase(HTTP_STATS_PHASE_COMMIT, session->commit_started);
+                session->commit = 0;
+                break;
+            case STORE_COMMIT_FAILED:
+            default:
+                return -1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Serve the requests buffered and readable on the connection until the output queue backs up
+ */
+static enum pollin_handle_result serve_requests(struct core_object *co, struct connection *conn, struct http_session * session) {
+    struct http_connection * http_conn = &session->parser;
+
+    struct response_builder * res = arena_alloc(&session->arena, sizeof(*res));
+    struct http_request * req = arena_alloc(&session->arena, sizeof(*req));
+    if (!res || !req) {
+        arena_reset(&session->arena, session->base);
+        return POLLIN_HANDLE_RESULT_FATAL;
+    }
+
+    // Keep going while requests are buffered; a pipelined request gets no pollin event of its own.
+    // The responses are queued in order and leave together once the buffered requests run out,
+    // after a single commit of whatever the POSTs among them stored. A library that can wake the
+    // connection leaves them in the queue meanwhile; otherwise the builder waits for the commit.
+    response_init(res, conn->fd, &session->out);
+    res->hold_for_commit = conn->wakeup != NULL;
+    enum pollin_handle_result result = POLLIN_HANDLE_RESULT_OK;
+    for (;;) {
+        if (!output_queue_empty(&session->out)) {
+            // The client is behind; read no more until it catches up
+            break;
+        }
+        enum read_request_result read_request_result = read_request(conn->fd, http_conn, req);
+
+        if (read_request_result == READ_REQUEST_NEED_MORE) {
+            // Partial request; the rest arrives with a later pollin event
+            break;
+        }
+        if (read_request_result == READ_REQUEST_EOF) {
+            // The client has half-closed its side; it still gets what was read
+            session->close_when_sent = true;
+            break;
+        }
+        if (read_request_result != READ_REQUEST_SUCCESS && read_request_result != READ_REQUEST_BAD_REQUEST &&
+            read_request_result != READ_REQUEST_TOO_LARGE) {
+            result = POLLIN_HANDLE_RESULT_EOF;
+            break;
+        }
+
+        http_conn->requests++;
+        http_stats_request(req, read_request_result == READ_REQUEST_BAD_REQUEST);
+        if (co->max_requests > 0 && http_conn->requests >= co->max_requests) {
+            req->keep_alive = false;
+        }
+        // A failed send means the client went away; the library closes the socket
+        if (!handle_request(read_request_result, req, res)) {
+            result = POLLIN_HANDLE_RESULT_EOF;
+            break;
+        }
+        if (!req->keep_alive) {
+            session->close_when_sent = true;
+            break;
+        }
+    }
+
+    if (!response_flush(res)) {
+        result = POLLIN_HANDLE_RESULT_EOF;
+    }
+    if (session->close_when_sent && output_queue_empty(&session->out)) {
+        result = POLLIN_HANDLE_RESULT_EOF;
+    }
+    conn->bytes_read = http_conn->bytes_read; // for the access log
+    conn->want_write = !output_queue_empty(&session->out); // for the library's pollout events
+    if (res->commit > 0 && result == POLLIN_HANDLE_RESULT_OK) {
+        session->commit = res->commit;
+        session->commit_started = http_stats_start();
+        if (await_commit(conn, session) == -1) {
+            result = POLLIN_HANDLE_RESULT_EOF;
+        }
+    }
+    conn->head_pending = http_conn->end > http_conn->start; // for the library's request deadline
+    arena_reset(&session->arena, session->base);
+    return result;
+}
 
-    if (read_request_result == READ_REQUEST_SUCCESS || read_request_result == READ_REQUEST_BAD_REQUEST) {
-        if (handle_request(read_request_result, &req, fd) == false) {
+enum pollin_handle_result pollin_handle_http(struct core_object *co, struct state_object *so, struct connection *conn) {
+    struct http_session * session = conn->data;
+    if (!session) {
+        // First event on this connection
+        session = new_session(co->arena_pool, conn);
+        if (!session) {
             return POLLIN_HANDLE_RESULT_FATAL;
-        } else {
-            int close_result = close(fd);
-            return close_result == 0 ? POLLIN_HANDLE_RESULT_EOF : POLLIN_HANDLE_RESULT_FATAL;
         }
+        conn->data = session;
+    }
+    return serve_requests(co, conn, session);
+}
+
+enum pollin_handle_result pollout_handle_http(struct core_object *co, struct state_object *so, struct connection *conn) {
+    struct http_session * session = conn->data;
+    if (!session) {
+        conn->want_write = false;
+        return POLLIN_HANDLE_RESULT_OK;
+    }
+    int settled = await_commit(conn, session);
+    if (settled != 1) {
+        return settled == 0 ? POLLIN_HANDLE_RESULT_OK : POLLIN_HANDLE_RESULT_EOF;
+    }
+
+    uint64_t started = http_stats_start();
+    size_t sent;
+    TRACE_BEGIN("output_queue_send", conn->fd);
+    int status = output_queue_send(&session->out, conn->fd, &sent);
+    TRACE_END("output_queue_send", conn->fd);
+    http_stats_phase(HTTP_STATS_PHASE_SEND, started);
+    http_stats_add(HTTP_STATS_BYTES_OUT, sent);
+    if (status == -1) {
+        return POLLIN_HANDLE_RESULT_EOF;
+    }
+    if (!output_queue_empty(&session->out)) {
+        conn->want_write = true;
+        return POLLIN_HANDLE_RESULT_OK;
+    }
+    if (session->close_when_sent) {
+        return POLLIN_HANDLE_RESULT_EOF;
     }
-    return read_request_result == READ_REQUEST_EOF ? POLLIN_HANDLE_RESULT_EOF : POLLIN_HANDLE_RESULT_FATAL;
-}
\ No newline at end of file
+    // Caught up: serve the requests that waited meanwhile
+    return serve_requests(co, conn, session);
+}
+
+enum pollin_handle_result wake_handle_http(struct core_object *co, struct state_object *so, struct connection *conn) {
+    conn->parked = false;
+    return pollout_handle_http(co, so, conn);
+}
+
+void close_handle_http(struct core_object *co, struct connection *conn) {
+    struct http_session * session = conn->data;
+    if (session) {
+        if (session->commit > 0) {
+            store_unwatch(&session->waiter);
+        }
+        output_queue_clear(&session->out);
+        // The arena lives inside the memory it gives back
+        struct arena arena = session->arena;
+        arena_release(&arena);
+        http_stats_add(HTTP_STATS_CONNECTIONS_CLOSED, 1);
+    }
+    conn->data = NULL;
+}
+
+void timeout_handle_http(struct core_object *co, struct connection *conn) {
+    struct http_session * session = conn->data;
+    if (!session || !output_queue_empty(&session->out) || session->parser.end == session->parser.start) {
+        // Nothing was asked, or the client is not reading its answers anyway
+        return;
+    }
+
+    struct response_builder * res = arena_alloc(&session->arena, sizeof(*res));
+    if (!res) {
+        return;
+    }
+    // The library closes the connection next, so whatever does not fit in the send buffer now is dropped
+    response_init(res, conn->fd, &session->out);
+    (void)response_canned(res, RESPONSE_RESULT_TIMEOUT, false);
+    (void)response_flush(res);
+    arena_reset(&session->arena, session->base);
+}
@@ -1,93 +1,366 @@
 #include "request.h"
-#include <core-lib/receiver.h>
+#include "stats.h"
+#include <core-lib/scan.h>
+#include <core-lib/trace.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
 
-#define HTTP_VERSION_1_0 "HTTP/1.0"
-#define HTTP_VERSION_1_1 "HTTP/1.1"
+#define HEAD_TERMINATOR_LENGTH (sizeof("\r\n\r\n") - 1)
 
-static enum read_request_result convert_read_fully_result(enum read_fully_result result) {
-    switch(result) {
-        case READ_FULLY_FAILURE:
-            return READ_REQUEST_INTERNAL_ERROR;
-        case READ_FULLY_UNEXPECTED_RESULT:
-            return READ_REQUEST_BAD_REQUEST;
-        case READ_FULLY_EOF:
-            return READ_REQUEST_EOF;
-        case READ_FULLY_SUCCESS:
-            return READ_REQUEST_SUCCESS;
-    }
+void http_connection_init(struct http_connection * conn) {
+    conn->start = 0;
+    conn->end = 0;
+    conn->scanned = 0;
+    conn->line_end = 0;
+    conn->head_end = 0;
+    conn->body_end = 0;
+    conn->requests = 0;
+    conn->bytes_read = 0;
 }
 
-enum read_request_result read_with_delim(char * buff, struct receiver *receiver, uint32_t buff_size, char delim){
-    uint32_t str_size = buff_size - 1;
-    enum read_fully_result read_fully_result = receiver_read_until(receiver, buff, &str_size, delim);
+/**
+ * Loads 4 or 8 bytes at once, so a token is compared with one integer compare.
+ * Used on literals too, where the compiler folds it into a constant.
+ */
+static uint32_t load32(const char * str) {
+    uint32_t word;
+    memcpy(&word, str, sizeof(word));
+    return word;
+}
 
-    enum read_request_result result = convert_read_fully_result(read_fully_result);
-    if (result != READ_REQUEST_SUCCESS) {
-        return result;
-    }
-    buff[str_size] = '\0';
+static uint64_t load64(const char * str) {
+    uint64_t word;
+    memcpy(&word, str, sizeof(word));
+    return word;
+}
 
-    char ch;
-    read_fully_result = receiver_read(receiver, &ch, 1);
-    // no need to check there is definitely a space. Ensured by receiver_read_until that returns success when it meets delim.
-    return READ_REQUEST_SUCCESS;
+/**
+ * Checks whether <str> of <length> bytes is <expected>, ignoring case
+ */
+static bool token_equals_ignore_case(const char * str, size_t length, const char * expected) {
+    return length == strlen(expected) && strncasecmp(str, expected, length) == 0;
 }
 
 /**
- * Extracts the next character and checks if it's expected
- * @return
+ * Removes the spaces and tabs around <str>
  */
-enum read_fully_result receiver_ensure_char(struct receiver * receiver, char expected) {
-    char ch;
-    enum read_fully_result read_fully_result = receiver_read(receiver, &ch, 1);
-    if (read_fully_result != READ_FULLY_SUCCESS) {
-        return read_fully_result;
+static struct http_string trim(const char * str, const char * end) {
+    while (str < end && (*str == ' ' || *str == '\t')) {
+        str++;
+    }
+    while (end > str && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
     }
-    return ch == expected ? READ_FULLY_SUCCESS : READ_FULLY_UNEXPECTED_RESULT;
+    return (struct http_string) {str, (uint32_t)(end - str)};
 }
 
-enum read_request_result read_request(int fd, struct state_object * so, struct http_request * req) {
-    char method_str[5];
-    struct receiver receiver;
-    receiver_init(&receiver, fd);
+/**
+ * Parses a complete request line "<method> <uri> <version>"
+ * @param line the request line, without the CRLF
+ * @param length the length of the line
+ * @param req filled on success
+ * @return READ_REQUEST_SUCCESS or READ_REQUEST_BAD_REQUEST
+ */
+static enum read_request_result parse_request_line(const char * line, size_t length, struct http_request * req) {
+    const char * end = line + length;
 
-    enum read_request_result read_delim = read_with_delim(method_str, &receiver,
-            sizeof (method_str)/ sizeof (method_str[0]), ' ');
-    if (read_delim != READ_REQUEST_SUCCESS){
-        return read_delim;
+    // The shortest line is "GET / HTTP/1.0"; every method has at most 4 letters and a space
+    if (length < 14) {
+        return READ_REQUEST_BAD_REQUEST;
     }
-    if (strcmp(method_str, "GET") == 0) {
+    const char * uri;
+    uint32_t method = load32(line);
+    if (method == load32("GET ")) {
         req->method = HTTP_METHOD_GET;
-    } else if (strcmp(method_str, "POST") == 0) {
+        uri = line + 4;
+    } else if (method == load32("POST") && line[4] == ' ') {
         req->method = HTTP_METHOD_POST;
-    } else if (strcmp(method_str, "HEAD") == 0) {
+        uri = line + 5;
+    } else if (method == load32("HEAD") && line[4] == ' ') {
         req->method = HTTP_METHOD_HEAD;
+        uri = line + 5;
     } else {
         // unsupported method
         return READ_REQUEST_BAD_REQUEST;
     }
 
-    enum read_request_result read_req_result = read_with_delim(req->request_uri, &receiver, sizeof(req->request_uri), ' ');
-    if (read_req_result != READ_REQUEST_SUCCESS){
-        return read_req_result;
+    // The version is the last 8 bytes, after a space
+    const char * version = end - 8;
+    if (version[-1] != ' ' || version - 1 <= uri) {
+        return READ_REQUEST_BAD_REQUEST;
     }
-
-    char http_version [9]; // 8 + 1 for \0
-    read_req_result = read_with_delim(http_version, &receiver, sizeof(http_version), '\r');
-    if (read_req_result != READ_REQUEST_SUCCESS){
-        return read_req_result;
+    uint64_t version_word = load64(version);
+    if (version_word == load64("HTTP/1.1")) {
+        req->version = HTTP_VERSION_1_1;
+        req->keep_alive = true; // persistent unless the client says otherwise
+    } else if (version_word == load64("HTTP/1.0")) {
+        req->version = HTTP_VERSION_1_0;
+        req->keep_alive = false; // closed unless the client asks for keep-alive
+    } else {
+        return READ_REQUEST_BAD_REQUEST;
     }
-    if (strcmp(http_version, HTTP_VERSION_1_0) != 0 && strcmp(http_version, HTTP_VERSION_1_1) != 0){
+
+    const char * uri_end = version - 1;
+    if (memchr(uri, ' ', uri_end - uri) || (size_t)(uri_end - uri) > MAX_REQUEST_URI_LENGTH) {
         return READ_REQUEST_BAD_REQUEST;
     }
+    req->uri = (struct http_string) {uri, (uint32_t)(uri_end - uri)};
+    return READ_REQUEST_SUCCESS;
+}
+
+/**
+ * Finds which indexed header <name> is, comparing only against names of the same length
+ * @return the header, or HTTP_KNOWN_HEADER_COUNT if it is not indexed
+ */
+static enum http_known_header known_header(const struct http_string * name) {
+    switch (name->length) {
+        case 4:
+            return token_equals_ignore_case(name->data, name->length, "Host") ? HTTP_HEADER_HOST : HTTP_KNOWN_HEADER_COUNT;
+        case 5:
+            return token_equals_ignore_case(name->data, name->length, "Range") ? HTTP_HEADER_RANGE : HTTP_KNOWN_HEADER_COUNT;
+        case 8:
+            return token_equals_ignore_case(name->data, name->length, "If-Range") ? HTTP_HEADER_IF_RANGE : HTTP_KNOWN_HEADER_COUNT;
+        case 10:
+            return token_equals_ignore_case(name->data, name->length, "Connection") ? HTTP_HEADER_CONNECTION : HTTP_KNOWN_HEADER_COUNT;
+        case 13:
+            return token_equals_ignore_case(name->data, name->length, "If-None-Match") ? HTTP_HEADER_IF_NONE_MATCH : HTTP_KNOWN_HEADER_COUNT;
+        case 14:
+            return token_equals_ignore_case(name->data, name->length, "Content-Length") ? HTTP_HEADER_CONTENT_LENGTH : HTTP_KNOWN_HEADER_COUNT;
+        case 15:
+            return token_equals_ignore_case(name->data, name->length, "Accept-Encoding") ? HTTP_HEADER_ACCEPT_ENCODING : HTTP_KNOWN_HEADER_COUNT;
+        case 17:
+            if (token_equals_ignore_case(name->data, name->length, "If-Modified-Since")) {
+                return HTTP_HEADER_IF_MODIFIED_SINCE;
+            }
+            return token_equals_ignore_case(name->data, name->length, "Transfer-Encoding") ? HTTP_HEADER_TRANSFER_ENCODING : HTTP_KNOWN_HEADER_COUNT;
+        default:
+            return HTTP_KNOWN_HEADER_COUNT;
+    }
+}
+
+/**
+ * Applies the comma separated options of a Connection header
+ */
+static void parse_connection_header(const struct http_string * value, struct http_request * req) {
+    const char * option = value->data;
+    const char * end = value->data + value->length;
+    while (option < end) {
+        const char * comma = memchr(option, ',', end - option);
+        const char * option_end = comma ? comma : end;
+        struct http_string token = trim(option, option_end);
+        if (token_equals_ignore_case(token.data, token.length, "close")) {
+            req->keep_alive = false;
+        } else if (token_equals_ignore_case(token.data, token.length, "keep-alive")) {
+            req->keep_alive = true;
+        }
+        option = option_end + 1;
+    }
+}
+
+/**
+ * Records the header lines of a request head, without the final empty line, as views
+ * @return READ_REQUEST_SUCCESS or READ_REQUEST_BAD_REQUEST
+ */
+static enum read_request_result parse_headers(const char * headers, size_t length, struct http_request * req) {
+    const char * end = headers + length;
+    bool wants_close = false;
+
+    req->num_headers = 0;
+    req->body = (struct http_string) {NULL, 0};
+    for (int i = 0; i < HTTP_KNOWN_HEADER_COUNT; i++) {
+        req->known[i] = NULL;
+    }
+
+    while (headers < end) {
+        const char * line_end = scan_crlf(headers, end - headers);
+        if (!line_end) {
+            line_end = end;
+        }
+        const char * colon = memchr(headers, ':', line_end - headers);
+        if (!colon || colon == headers || req->num_headers == MAX_REQUEST_HEADERS) {
+            return READ_REQUEST_BAD_REQUEST;
+        }
+        struct http_header * header = &req->headers[req->num_headers++];
+        header->name = (struct http_string) {headers, (uint32_t)(colon - headers)};
+        header->value = trim(colon + 1, line_end);
 
-    {
-        enum read_fully_result read_fully_result = receiver_ensure_char(&receiver, '\n');
-        if (read_fully_result != READ_FULLY_SUCCESS){
-            return convert_read_fully_result(read_fully_result);
+        enum http_known_header known = known_header(&header->name);
+        if (known != HTTP_KNOWN_HEADER_COUNT && !req->known[known]) {
+            req->known[known] = header;
         }
+        if (known == HTTP_HEADER_CONNECTION) {
+            // Options may be split over several Connection headers
+            parse_connection_header(&header->value, req);
+            wants_close = wants_close || !req->keep_alive;
+        }
+        headers = line_end + 2;
     }
 
+    // Only the length is recorded here; the body is read after the head
+    const struct http_header * content_length = req->known[HTTP_HEADER_CONTENT_LENGTH];
+    if (content_length) {
+        uint64_t body_length = 0;
+        if (content_length->value.length == 0) {
+            return READ_REQUEST_BAD_REQUEST;
+        }
+        for (uint32_t i = 0; i < content_length->value.length; i++) {
+            char digit = content_length->value.data[i];
+            if (digit < '0' || digit > '9' || body_length > UINT32_MAX / 10) {
+                return READ_REQUEST_BAD_REQUEST;
+            }
+            body_length = body_length * 10 + (uint64_t)(digit - '0');
+        }
+        req->body.length = body_length > UINT32_MAX ? UINT32_MAX : (uint32_t)body_length;
+    }
+    // Chunked bodies are not read, so the next request could not be found after one
+    if (req->known[HTTP_HEADER_TRANSFER_ENCODING] || wants_close) {
+        req->keep_alive = false;
+    }
     return READ_REQUEST_SUCCESS;
 }
+
+/**
+ * Parses the request head in buffer[start, head_end) and marks it and its body as consumed.
+ * The bytes stay where they are until the next call, as the request refers to them.
+ * If the body has not all arrived yet, nothing is consumed and the head is parsed again once it has.
+ * @return READ_REQUEST_NEED_MORE while the body is arriving
+ */
+static enum read_request_result consume_request(struct http_connection * conn, uint32_t head_end, struct http_request * req) {
+    // Every line of the head, the request line included, ends with a CRLF; drop the final empty line
+    const char * head = &conn->buffer[conn->start];
+    const char * head_end_ptr = &conn->buffer[head_end - 2];
+    const char * line_end = &conn->buffer[conn->line_end - 2];
+
+    enum read_request_result result = parse_request_line(head, line_end - head, req);
+    if (result == READ_REQUEST_SUCCESS) {
+        const char * headers = line_end + 2;
+        result = parse_headers(headers, head_end_ptr - headers, req);
+    }
+    if (result == READ_REQUEST_SUCCESS && req->body.length > 0) {
+        uint64_t body_end = (uint64_t)head_end + req->body.length;
+        if (body_end - conn->start > sizeof(conn->buffer)) {
+            result = READ_REQUEST_TOO_LARGE;
+        } else if (body_end > conn->end) {
+            conn->head_end = head_end;
+            conn->body_end = (uint32_t)body_end;
+            return READ_REQUEST_NEED_MORE;
+        } else {
+            req->body.data = &conn->buffer[head_end];
+            head_end = (uint32_t)body_end;
+        }
+    }
+    if (result != READ_REQUEST_SUCCESS) {
+        req->keep_alive = false;
+    }
+
+    conn->start = head_end;
+    conn->scanned = head_end;
+    conn->line_end = 0;
+    conn->head_end = 0;
+    conn->body_end = 0;
+    return result;
+}
+
+/**
+ * Parses the head found in buffer[start, head_end) and times it
+ */
+static enum read_request_result parse_request(int fd, struct http_connection * conn, uint32_t head_end, struct http_request * req) {
+    uint64_t started = http_stats_start();
+    TRACE_BEGIN("parse", fd);
+    enum read_request_result parsed = consume_request(conn, head_end, req);
+    TRACE_END("parse", fd);
+    http_stats_phase(HTTP_STATS_PHASE_PARSE, started);
+    return parsed;
+}
+
+/**
+ * Moves the unparsed bytes to the front of the buffer to make room at the end
+ */
+static void compact(struct http_connection * conn) {
+    uint32_t shift = conn->start;
+    memmove(conn->buffer, &conn->buffer[shift], conn->end - shift);
+    conn->start = 0;
+    conn->end -= shift;
+    conn->scanned -= shift;
+    if (conn->line_end) {
+        conn->line_end -= shift;
+    }
+    if (conn->body_end) {
+        conn->head_end -= shift;
+        conn->body_end -= shift;
+    }
+}
+
+enum read_request_result read_request(int fd, struct http_connection * conn, struct http_request * req) {
+    for (;;) {
+        if (conn->body_end) {
+            // The head is in; only the rest of its body is missing
+            if (conn->end >= conn->body_end) {
+                return parse_request(fd, conn, conn->head_end, req);
+            }
+        } else {
+            // Only look at bytes that arrived since the last call, plus enough to catch a terminator split across reads
+            uint32_t from = conn->scanned;
+            if (from >= conn->start + HEAD_TERMINATOR_LENGTH - 1) {
+                from -= HEAD_TERMINATOR_LENGTH - 1;
+            } else {
+                from = conn->start;
+            }
+            // The request line ends at the first CRLF, which is remembered on the way to the end of the head
+            const char * line_end = NULL;
+            const char * terminator = scan_head(&conn->buffer[from], conn->end - from, &line_end);
+            if (line_end && conn->line_end == 0) {
+                conn->line_end = line_end - conn->buffer + 2;
+            }
+            if (terminator) {
+                enum read_request_result parsed = parse_request(fd, conn, terminator - conn->buffer + HEAD_TERMINATOR_LENGTH, req);
+                if (parsed != READ_REQUEST_NEED_MORE) {
+                    return parsed;
+                }
+            }
+            conn->scanned = conn->end;
+        }
+
+        // Nothing refers to the previous requests any more
+        if (conn->start == conn->end) {
+            conn->start = conn->end = conn->scanned = 0;
+        } else if (conn->end == sizeof(conn->buffer)) {
+            if (conn->start == 0) {
+                // The request head does not fit; the URI or the headers are too long
+                req->keep_alive = false;
+                return READ_REQUEST_BAD_REQUEST;
+            }
+            compact(conn);
+        }
+
+        TRACE_BEGIN("recv", fd);
+        ssize_t result = recv(fd, &conn->buffer[conn->end], sizeof(conn->buffer) - conn->end, MSG_NOSIGNAL);
+        TRACE_END("recv", fd);
+        if (result == -1) {
+            switch (errno) {
+                case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                    return READ_REQUEST_NEED_MORE;
+                case EINTR:
+                    continue;
+                case ECONNRESET:
+                    return READ_REQUEST_EOF;
+                default:
+                    perror("read_request");
+                    return READ_REQUEST_INTERNAL_ERROR;
+            }
+        }
+        if (result == 0) {
+            return READ_REQUEST_EOF;
+        }
+        conn->end += result;
+        conn->bytes_read += result;
+        http_stats_add(HTTP_STATS_BYTES_IN, result);
+    }
+}
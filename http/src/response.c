@@ -1,9 +1,24 @@
+#define _GNU_SOURCE // strptime
 #include "response.h"
+#include "file_cache.h"
+#include "request.h"
+#include "stats.h"
+#include "store.h"
+#include <core-lib/output_queue.h>
+#include <core-lib/trace.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
-
-#define BUFFER_SIZE 4096
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
 
 /**
  * Return status message
@@ -13,76 +28,789 @@
 static const char *get_status_message(enum res_result_code res_code) {
     switch (res_code) {
         case RESPONSE_RESULT_SUCCESS: return "OK";
+        case RESPONSE_RESULT_CREATED: return "Created";
+        case RESPONSE_RESULT_PARTIAL_CONTENT: return "Partial Content";
+        case RESPONSE_RESULT_NOT_MODIFIED: return "Not Modified";
         case RESPONSE_RESULT_BAD_REQUEST: return "Bad Request";
         case RESPONSE_RESULT_NOT_FOUND: return "Not Found";
+        case RESPONSE_RESULT_PAYLOAD_TOO_LARGE: return "Payload Too Large";
+        case RESPONSE_RESULT_RANGE_NOT_SATISFIABLE: return "Range Not Satisfiable";
         case RESPONSE_RESULT_INT_SERV_ERR: return "Internal Server Error";
+        case RESPONSE_RESULT_METHOD_NOT_IMPLEMENTED: return "Not Implemented";
+        case RESPONSE_RESULT_CANNOT_HANDLE: return "Service Unavailable";
+        case RESPONSE_RESULT_TIMEOUT: return "Gateway Timeout";
         default: return "Unknown";
     }
 }
 
-bool write_status_line(enum res_result_code res_code, int fd) {
-    int length = dprintf(fd, "HTTP/1.0 %d %s\r\n", res_code, get_status_message(res_code));
-    return length >= 0;
+/**
+ * Bodiless responses that only depend on the status code, so they are built by the
+ * compiler instead of being formatted on every error. The Connection header and the
+ * blank line that ends the headers are appended when sending.
+ */
+#define CANNED_RESPONSE(code, message) "HTTP/1.0 " #code " " message "\r\nContent-Length: 0\r\n"
+
+static const char connection_keep_alive[] = "Connection: keep-alive\r\n\r\n";
+static const char connection_close[] = "Connection: close\r\n\r\n";
+
+static const char canned_bad_request[] = CANNED_RESPONSE(400, "Bad Request");
+static const char canned_not_found[] = CANNED_RESPONSE(404, "Not Found");
+static const char canned_payload_too_large[] = CANNED_RESPONSE(413, "Payload Too Large");
+static const char canned_int_serv_err[] = CANNED_RESPONSE(500, "Internal Server Error");
+static const char canned_not_implemented[] = CANNED_RESPONSE(501, "Not Implemented");
+static const char canned_cannot_handle[] = CANNED_RESPONSE(503, "Service Unavailable");
+static const char canned_timeout[] = CANNED_RESPONSE(504, "Gateway Timeout");
+
+void response_init(struct response_builder * res, int fd, struct output_queue * out) {
+    res->fd = fd;
+    res->iov_count = 0;
+    res->headers_length = 0;
+    res->text_start = 0;
+    res->num_held = 0;
+    res->num_owned = 0;
+    res->failed = false;
+    res->corked = false;
+    res->commit = 0;
+    res->hold_for_commit = false;
+    res->out = out;
 }
 
-bool write_content_length(size_t length, int fd) {
-    int headers_length = dprintf(fd,
-                                 "Content-Length: %zu\r\n"
-                                 "\r\n",
-                                 length);
-    return headers_length > 0;
+/**
+ * Turn the text formatted since the last iovec into an iovec of its own.
+ * There is always room: push_iov keeps the last slot free for this.
+ */
+static void close_text(struct response_builder * res) {
+    if (res->headers_length > res->text_start) {
+        if (res->iov_count >= RESPONSE_MAX_IOV) {
+            res->failed = true; // never reached while the last slot is kept free
+            return;
+        }
+        res->iov[res->iov_count].iov_base = &res->headers[res->text_start];
+        res->iov[res->iov_count].iov_len = res->headers_length - res->text_start;
+        res->iov_count++;
+        res->text_start = res->headers_length;
+    }
 }
 
-// return false in case of error
-bool serve_file(const char* file_name, int fd, bool get) {
-    if (!file_name){
-        return false;
+static void release_entry(void * entry) {
+    file_cache_release(entry);
+}
+
+/**
+ * Whether <length> bytes at <data> lie in the header or body of a held cache entry, or in
+ * an owned buffer, which outlive them in the output queue
+ */
+static bool in_held_entry(const struct response_builder * res, const char * data, size_t length) {
+    for (size_t i = 0; i < res->num_held; i++) {
+        const struct file_cache_entry * entry = res->held[i];
+        if ((data >= entry->header && data + length <= entry->header + entry->header_length) ||
+            (entry->body && data >= entry->body && data + length <= entry->body + entry->body_length)) {
+            return true;
+        }
+    }
+    for (size_t i = 0; i < res->num_owned; i++) {
+        const char * buffer = res->owned[i].iov_base;
+        if (data >= buffer && data + length <= buffer + res->owned[i].iov_len) {
+            return true;
+        }
     }
+    return false;
+}
 
-    enum res_result_code res_code = RESPONSE_RESULT_SUCCESS;
+/**
+ * Move what the socket did not take, from byte <sent> on, to the output queue
+ */
+static void spill(struct response_builder * res, size_t sent) {
+    for (int i = 0; i < res->iov_count && !res->failed; i++) {
+        const char * data = res->iov[i].iov_base;
+        size_t length = res->iov[i].iov_len;
+        if (sent >= length) {
+            sent -= length;
+            continue;
+        }
+        data += sent;
+        length -= sent;
+        sent = 0;
+        if (output_queue_push(res->out, data, length, !in_held_entry(res, data, length)) == -1) {
+            res->failed = true;
+        }
+    }
+}
 
-    // Open the file which is either HTML, CSS, JS
-    int file_fd = open(&file_name[1], O_RDONLY);
-    struct stat file_stat;
-    file_stat.st_size = 0;
-    if (file_fd < 0) {
-        // TODO: there could be other reasons for the error except file not existing
-        res_code = RESPONSE_RESULT_NOT_FOUND;
+/**
+ * Send everything queued so far without blocking and queue the rest. With <release>, the cache
+ * entries and owned buffers it referenced are released once they are no longer needed; without,
+ * as when making room in the middle of a response, they stay held for what is appended next.
+ * @return false in case of error
+ */
+static bool send_queued(struct response_builder * res, bool release) {
+    close_text(res);
+    if (!res->failed && res->commit > 0 && res->hold_for_commit) {
+        // Nothing is sent before the commit; a pending one leaves everything in the output queue
+        switch (store_commit_state(res->commit)) {
+            case STORE_COMMIT_PENDING:
+                break;
+            case STORE_COMMIT_DURABLE:
+                res->commit = 0;
+                break;
+            case STORE_COMMIT_FAILED:
+            default:
+                res->failed = true;
+                break;
+        }
+    } else if (!res->failed && res->commit > 0) {
+        // One wait covers every write the queued responses confirm
+        uint64_t started = http_stats_start();
+        res->failed = !store_wait(res->commit);
+        res->commit = 0;
+        http_stats_phase(HTTP_STATS_PHASE_COMMIT, started);
+    }
+    if (!res->failed && res->iov_count > 0) {
+        uint64_t started = http_stats_start();
+        ssize_t sent = 0;
+        // Behind earlier output or a pending commit, so everything goes to the back of the queue
+        if (output_queue_empty(res->out) && res->commit == 0) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = res->iov;
+            msg.msg_iovlen = res->iov_count;
+            TRACE_BEGIN("sendmsg", res->fd);
+            sent = sendmsg(res->fd, &msg, MSG_NOSIGNAL);
+            TRACE_END("sendmsg", res->fd);
+            if (sent == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    sent = 0;
+                } else {
+                    res->failed = true;
+                }
+            }
+        }
+        if (!res->failed) {
+            http_stats_add(HTTP_STATS_BYTES_OUT, sent);
+            spill(res, sent);
+        }
+        http_stats_phase(HTTP_STATS_PHASE_SEND, started);
+    }
+    res->iov_count = 0;
+    res->headers_length = 0;
+    res->text_start = 0;
+    if (!release) {
+        return !res->failed;
+    }
+    for (size_t i = 0; i < res->num_held; i++) {
+        // A failed connection is closed, and its queue cleared without being read
+        if (res->failed || output_queue_empty(res->out) ||
+            output_queue_push_release(res->out, release_entry, res->held[i]) == -1) {
+            file_cache_release(res->held[i]);
+        }
+    }
+    for (size_t i = 0; i < res->num_owned; i++) {
+        if (res->failed || output_queue_empty(res->out) ||
+            output_queue_push_release(res->out, free, res->owned[i].iov_base) == -1) {
+            free(res->owned[i].iov_base);
+        }
+    }
+    res->num_held = 0;
+    res->num_owned = 0;
+    return !res->failed;
+}
+
+static void push_iov(struct response_builder * res, const void * data, size_t length) {
+    if (res->iov_count >= RESPONSE_MAX_IOV - 1 && !send_queued(res, false)) {
+        return;
+    }
+    res->iov[res->iov_count].iov_base = (void *)(uintptr_t)data; // only ever read
+    res->iov[res->iov_count].iov_len = length;
+    res->iov_count++;
+}
+
+/**
+ * Append formatted text to the headers buffer, sending what is queued first if it is full
+ */
+static void append_formatted(struct response_builder * res, const char * format, va_list args) {
+    for (int attempt = 0; !res->failed; attempt++) {
+        size_t room = sizeof(res->headers) - res->headers_length;
+        va_list copy;
+        va_copy(copy, args);
+        int length = vsnprintf(&res->headers[res->headers_length], room, format, copy);
+        va_end(copy);
+        if (length >= 0 && (size_t)length < room) {
+            res->headers_length += length;
+            return;
+        }
+        if (length < 0 || attempt > 0) {
+            res->failed = true; // does not even fit in an empty buffer
+            return;
+        }
+        send_queued(res, false);
+    }
+}
+
+static void append_text(struct response_builder * res, const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append_text(struct response_builder * res, const char * format, ...) {
+    va_list args;
+    va_start(args, format);
+    append_formatted(res, format, args);
+    va_end(args);
+}
+
+void response_status(struct response_builder * res, enum res_result_code res_code) {
+    http_stats_response(res_code);
+    append_text(res, "HTTP/1.0 %d %s\r\n", res_code, get_status_message(res_code));
+}
+
+void response_header(struct response_builder * res, const char * name, const char * format, ...) {
+    va_list args;
+    append_text(res, "%s: ", name);
+    va_start(args, format);
+    append_formatted(res, format, args);
+    va_end(args);
+    append_text(res, "\r\n");
+}
+
+void response_end_headers(struct response_builder * res, size_t content_length, bool keep_alive) {
+    append_text(res, "Content-Length: %zu\r\nConnection: %s\r\n\r\n", content_length, keep_alive ? "keep-alive" : "close");
+}
+
+/**
+ * Append the Connection header and the blank line after ready-made headers
+ */
+static void append_connection(struct response_builder * res, bool keep_alive) {
+    if (keep_alive) {
+        response_append(res, connection_keep_alive, sizeof(connection_keep_alive) - 1);
     } else {
-        // Obtain the file size
-        if (fstat(file_fd, &file_stat) < 0) {
-            close(file_fd);
-            file_fd = -1;
-            res_code = RESPONSE_RESULT_INT_SERV_ERR;
+        response_append(res, connection_close, sizeof(connection_close) - 1);
+    }
+}
+
+void response_append(struct response_builder * res, const void * data, size_t length) {
+    if (res->failed || length == 0) {
+        return;
+    }
+    // Room for the pending text and the buffer, with the last slot still free afterwards
+    if (res->iov_count >= RESPONSE_MAX_IOV - 2 && !send_queued(res, false)) {
+        return;
+    }
+    close_text(res);
+    push_iov(res, data, length);
+}
+
+void response_append_owned(struct response_builder * res, void * data, size_t length) {
+    if (res->num_owned == RESPONSE_MAX_OWNED) {
+        send_queued(res, true);
+    }
+    res->owned[res->num_owned].iov_base = data;
+    res->owned[res->num_owned].iov_len = length;
+    res->num_owned++;
+    response_append(res, data, length);
+}
+
+void response_hold(struct response_builder * res, struct file_cache_entry * entry) {
+    if (res->num_held == RESPONSE_MAX_HELD) {
+        send_queued(res, true);
+    }
+    res->held[res->num_held++] = entry;
+}
+
+/**
+ * Set or clear TCP_CORK; not every fd is a TCP socket, so failures are ignored
+ */
+static void set_cork(int fd, int on) {
+#if defined(TCP_CORK)
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#elif defined(TCP_NOPUSH)
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on));
+#endif
+}
+
+bool response_flush(struct response_builder * res) {
+    bool result = send_queued(res, true);
+    if (res->corked) {
+        if (result && res->commit == 0) {
+            // Whatever the socket does not take now is sent by the pollout handler
+            uint64_t started = http_stats_start();
+            size_t sent;
+            TRACE_BEGIN("send_file", res->fd);
+            result = output_queue_send(res->out, res->fd, &sent) == 0;
+            TRACE_END("send_file", res->fd);
+            http_stats_phase(HTTP_STATS_PHASE_SEND, started);
+            http_stats_add(HTTP_STATS_BYTES_OUT, sent);
+            res->failed = !result;
         }
+        set_cork(res->fd, 0);
+        res->corked = false;
     }
+    return result;
+}
 
-    // Write the response status line and headers
-    // We cannot send anything if it fails
-    if (!write_status_line(res_code, fd) || !write_content_length(file_stat.st_size, fd)){
+bool response_append_file(struct response_builder * res, int file_fd, off_t offset, off_t end) {
+    if (res->failed || offset == end) {
         close(file_fd);
+        return !res->failed;
+    }
+    if (!res->corked) {
+        // Hold partial frames back so the queued responses leave in the same packets as the start of the body
+        set_cork(res->fd, 1);
+        res->corked = true;
+    }
+    // The file goes behind everything appended before it, which leaves the builder first
+    if (!send_queued(res, false)) {
+        close(file_fd);
+        return false;
+    }
+    if (output_queue_push_file(res->out, file_fd, offset, end) == -1) {
+        res->failed = true;
         return false;
     }
+    return true;
+}
+
+bool response_canned(struct response_builder * res, enum res_result_code res_code, bool keep_alive) {
+    switch (res_code) {
+        case RESPONSE_RESULT_BAD_REQUEST:
+            response_append(res, canned_bad_request, sizeof(canned_bad_request) - 1);
+            break;
+        case RESPONSE_RESULT_NOT_FOUND:
+            response_append(res, canned_not_found, sizeof(canned_not_found) - 1);
+            break;
+        case RESPONSE_RESULT_PAYLOAD_TOO_LARGE:
+            response_append(res, canned_payload_too_large, sizeof(canned_payload_too_large) - 1);
+            break;
+        case RESPONSE_RESULT_METHOD_NOT_IMPLEMENTED:
+            response_append(res, canned_not_implemented, sizeof(canned_not_implemented) - 1);
+            break;
+        case RESPONSE_RESULT_CANNOT_HANDLE:
+            response_append(res, canned_cannot_handle, sizeof(canned_cannot_handle) - 1);
+            break;
+        case RESPONSE_RESULT_TIMEOUT:
+            response_append(res, canned_timeout, sizeof(canned_timeout) - 1);
+            break;
+        case RESPONSE_RESULT_INT_SERV_ERR:
+        default:
+            res_code = RESPONSE_RESULT_INT_SERV_ERR;
+            response_append(res, canned_int_serv_err, sizeof(canned_int_serv_err) - 1);
+            break;
+    }
+    http_stats_response(res_code);
+    append_connection(res, keep_alive);
+    return !res->failed;
+}
+
+/**
+ * Queue a cached response. The entry is released once the response has been sent.
+ */
+static void serve_cached(struct file_cache_entry * entry, struct response_builder * res, bool get, bool keep_alive) {
+    // Held first, so that an early flush queues references to the entry rather than copies
+    response_hold(res, entry);
+    http_stats_response(RESPONSE_RESULT_SUCCESS); // the status line is part of the cached header
+    response_append(res, entry->header, entry->header_length);
+    append_connection(res, keep_alive);
+    if (get) {
+        response_append(res, entry->body, entry->body_length);
+    }
+}
 
-    if (file_fd >= 0) {
-        if (get) {
-            // Send the file in chunks
-            char buffer[BUFFER_SIZE];
-            ssize_t bytes_read;
-            while ((bytes_read = read(file_fd, buffer, BUFFER_SIZE)) > 0) {
-                if (write(fd, buffer, bytes_read) != bytes_read) {
-                    close(file_fd);
-                    return false;
+/**
+ * Whether <tag> is in the comma separated entity tags of an If-None-Match header.
+ * The comparison is weak, as the header asks, so a W/ prefix is ignored.
+ */
+static bool etag_listed(const struct http_string * list, const char * tag, size_t tag_length) {
+    const char * ptr = list->data;
+    const char * end = list->data + list->length;
+    while (ptr < end) {
+        while (ptr < end && (*ptr == ',' || *ptr == ' ' || *ptr == '\t')) {
+            ptr++;
+        }
+        if (ptr < end && *ptr == '*') {
+            return true; // any current representation
+        }
+        if (end - ptr >= 2 && ptr[0] == 'W' && ptr[1] == '/') {
+            ptr += 2;
+        }
+        const char * start = ptr;
+        // A tag is quoted and cannot contain quotes, so it ends at the second one
+        const char * close = ptr < end && *ptr == '"' ? memchr(ptr + 1, '"', end - ptr - 1) : NULL;
+        if (close) {
+            ptr = close + 1;
+        } else {
+            while (ptr < end && *ptr != ',') {
+                ptr++;
+            }
+        }
+        if ((size_t)(ptr - start) == tag_length && memcmp(start, tag, tag_length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Parse an IMF-fixdate, the date format every current client sends
+ * @return false if <value> is not one
+ */
+static bool parse_http_date(const struct http_string * value, time_t * date) {
+    char text[32];
+    if (value->length >= sizeof(text)) {
+        return false;
+    }
+    memcpy(text, value->data, value->length);
+    text[value->length] = '\0';
+    struct tm parsed;
+    memset(&parsed, 0, sizeof(parsed));
+    const char * rest = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &parsed);
+    if (!rest || *rest != '\0') {
+        return false;
+    }
+    *date = timegm(&parsed);
+    return *date != -1;
+}
+
+/**
+ * Whether the client already has the file, so that a 304 answers its request.
+ * If-None-Match takes precedence over If-Modified-Since when both are sent.
+ */
+static bool not_modified(const struct http_request * req, const struct stat * file_stat) {
+    const struct http_header * none_match = req->known[HTTP_HEADER_IF_NONE_MATCH];
+    if (none_match) {
+        char etag[FILE_CACHE_ETAG_LENGTH];
+        size_t etag_length = file_cache_etag(file_stat, etag, sizeof(etag));
+        return etag_length > 0 && etag_listed(&none_match->value, etag, etag_length);
+    }
+    const struct http_header * modified_since = req->known[HTTP_HEADER_IF_MODIFIED_SINCE];
+    time_t since;
+    return modified_since && parse_http_date(&modified_since->value, &since) && file_stat->st_mtime <= since;
+}
+
+/**
+ * Append the validators of a file that is not cached
+ */
+static void append_validators(struct response_builder * res, const struct stat * file_stat) {
+    char validators[FILE_CACHE_VALIDATORS_LENGTH];
+    size_t length = file_cache_validators(file_stat, validators, sizeof(validators));
+    append_text(res, "%.*s", (int)length, validators);
+}
+
+/**
+ * Queue a 304 with the validators of the file, from <entry> if it is cached. The entry is
+ * released once the response has been sent.
+ */
+static void serve_not_modified(struct file_cache_entry * entry, const struct stat * file_stat,
+                               struct response_builder * res, bool keep_alive) {
+    response_status(res, RESPONSE_RESULT_NOT_MODIFIED);
+    if (entry) {
+        response_hold(res, entry);
+        response_append(res, entry->validators, entry->validators_length);
+        append_connection(res, keep_alive);
+    } else {
+        append_validators(res, file_stat);
+        append_connection(res, keep_alive);
+    }
+}
+
+#define MAX_RANGES 16 // a Range header asking for more is ignored
+
+/**
+ * A range of a file, from start up to end
+ */
+struct byte_range {
+    off_t start;
+    off_t end;
+};
+
+/**
+ * Parse the decimal number that starts at <ptr>
+ * @return the first character after it, or NULL if there is no number or it overflows
+ */
+static const char * parse_position(const char * ptr, const char * end, intmax_t * value) {
+    if (ptr == end || *ptr < '0' || *ptr > '9') {
+        return NULL;
+    }
+    intmax_t number = 0;
+    for (; ptr < end && *ptr >= '0' && *ptr <= '9'; ptr++) {
+        int digit = *ptr - '0';
+        if (number > (INTMAX_MAX - digit) / 10) {
+            return NULL;
+        }
+        number = number * 10 + digit;
+    }
+    *value = number;
+    return ptr;
+}
+
+/**
+ * Resolve the byte ranges of a Range header against a file of <size> bytes. Ranges that start
+ * past the end are dropped, and ranges that end past it are cut short.
+ * @return the number of ranges put in <ranges>, 0 if none of them is satisfiable, or -1 if the
+ * header is malformed or asks for more than MAX_RANGES ranges, in which case it is ignored
+ */
+static int parse_ranges(const struct http_string * value, off_t size, struct byte_range * ranges) {
+    static const char unit[] = "bytes=";
+    const char * ptr = value->data;
+    const char * end = value->data + value->length;
+    if (value->length < sizeof(unit) - 1 || strncasecmp(ptr, unit, sizeof(unit) - 1) != 0) {
+        return -1;
+    }
+    ptr += sizeof(unit) - 1;
+
+    int num_ranges = 0;
+    for (int specs = 1;; specs++) {
+        if (specs > MAX_RANGES) {
+            return -1;
+        }
+        while (ptr < end && (*ptr == ' ' || *ptr == '\t')) {
+            ptr++;
+        }
+        intmax_t first;
+        intmax_t last;
+        if (ptr < end && *ptr == '-') {
+            // The last <last> bytes
+            ptr = parse_position(ptr + 1, end, &last);
+            if (!ptr) {
+                return -1;
+            }
+            if (last > 0 && size > 0) {
+                ranges[num_ranges++] = (struct byte_range) {last < size ? size - (off_t)last : 0, size};
+            }
+        } else {
+            ptr = parse_position(ptr, end, &first);
+            if (!ptr || ptr == end || *ptr != '-') {
+                return -1;
+            }
+            ptr++;
+            last = INTMAX_MAX; // up to the end of the file
+            if (ptr < end && *ptr >= '0' && *ptr <= '9') {
+                ptr = parse_position(ptr, end, &last);
+                if (!ptr || last < first) {
+                    return -1;
                 }
             }
+            if (first < size) {
+                ranges[num_ranges++] = (struct byte_range) {(off_t)first, last < size - 1 ? (off_t)last + 1 : size};
+            }
         }
-        close(file_fd);
+        while (ptr < end && (*ptr == ' ' || *ptr == '\t')) {
+            ptr++;
+        }
+        if (ptr == end) {
+            return num_ranges;
+        }
+        if (*ptr != ',') {
+            return -1;
+        }
+        ptr++;
+    }
+}
+
+/**
+ * Whether the Range header applies: always without If-Range, otherwise only if the file is still
+ * the one the client has part of, named by its entity tag or its exact modification date
+ */
+static bool range_applies(const struct http_request * req, const struct stat * file_stat) {
+    const struct http_header * if_range = req->known[HTTP_HEADER_IF_RANGE];
+    if (!if_range) {
         return true;
+    }
+    if (if_range->value.length > 0 && if_range->value.data[0] == '"') {
+        char etag[FILE_CACHE_ETAG_LENGTH];
+        size_t etag_length = file_cache_etag(file_stat, etag, sizeof(etag));
+        return etag_length == if_range->value.length && memcmp(etag, if_range->value.data, etag_length) == 0;
+    }
+    time_t date;
+    return parse_http_date(&if_range->value, &date) && file_stat->st_mtime == date;
+}
+
+/**
+ * The byte ranges a request asks for
+ * @return the number of ranges put in <ranges>, 0 if none of them is satisfiable,
+ * or -1 if the whole file is to be sent
+ */
+static int requested_ranges(const struct http_request * req, const struct stat * file_stat, struct byte_range * ranges) {
+    const struct http_header * range = req->known[HTTP_HEADER_RANGE];
+    if (!range || req->method != HTTP_METHOD_GET || !S_ISREG(file_stat->st_mode) || !range_applies(req, file_stat)) {
+        return -1;
+    }
+    return parse_ranges(&range->value, file_stat->st_size, ranges);
+}
+
+/**
+ * Queue a 416 naming the size of the file
+ */
+static void serve_unsatisfiable(const struct stat * file_stat, struct response_builder * res, bool keep_alive) {
+    response_status(res, RESPONSE_RESULT_RANGE_NOT_SATISFIABLE);
+    response_header(res, "Content-Range", "bytes */%jd", (intmax_t)file_stat->st_size);
+    response_end_headers(res, 0, keep_alive);
+}
+
+#define PART_HEADER_FORMAT "\r\n--%s\r\nContent-Range: bytes %jd-%jd/%jd\r\n\r\n"
+#define PART_TRAILER_FORMAT "\r\n--%s--\r\n"
+
+/**
+ * Queue a 206 for <ranges> of a file, taken from the body of <entry> if it is cached, otherwise
+ * sent from <file_fd> with one sendfile per range and closed once sent. Several ranges make a
+ * multipart/byteranges body, delimited by the entity tag of the file.
+ */
+static bool serve_ranges(struct file_cache_entry * entry, int file_fd, const struct stat * file_stat,
+                         const struct byte_range * ranges, int num_ranges, struct response_builder * res, bool keep_alive) {
+    intmax_t size = file_stat->st_size;
+    char etag[FILE_CACHE_ETAG_LENGTH];
+    size_t etag_length = file_cache_etag(file_stat, etag, sizeof(etag));
+    etag[etag_length > 0 ? etag_length - 1 : 0] = '\0';
+    const char * boundary = etag + 1; // the tag without its quotes
+
+    if (entry) {
+        response_hold(res, entry); // before any of its body is appended, as in serve_cached
+    }
+    response_status(res, RESPONSE_RESULT_PARTIAL_CONTENT);
+    append_validators(res, file_stat);
+    size_t content_length = 0;
+    if (num_ranges == 1) {
+        response_header(res, "Content-Range", "bytes %jd-%jd/%jd", (intmax_t)ranges[0].start, (intmax_t)ranges[0].end - 1, size);
+        content_length = ranges[0].end - ranges[0].start;
     } else {
-        if(dprintf(fd, "\r\n") < 0){
-            return false;
+        response_header(res, "Content-Type", "multipart/byteranges; boundary=%s", boundary);
+        for (int i = 0; i < num_ranges; i++) {
+            content_length += snprintf(NULL, 0, PART_HEADER_FORMAT, boundary, (intmax_t)ranges[i].start,
+                                       (intmax_t)ranges[i].end - 1, size);
+            content_length += ranges[i].end - ranges[i].start;
+        }
+        content_length += snprintf(NULL, 0, PART_TRAILER_FORMAT, boundary);
+    }
+    response_end_headers(res, content_length, keep_alive);
+
+    int i;
+    for (i = 0; i < num_ranges && !res->failed; i++) {
+        if (num_ranges > 1) {
+            append_text(res, PART_HEADER_FORMAT, boundary, (intmax_t)ranges[i].start, (intmax_t)ranges[i].end - 1, size);
+        }
+        if (entry) {
+            response_append(res, entry->body + ranges[i].start, ranges[i].end - ranges[i].start);
+            continue;
+        }
+        // The output queue closes the descriptor of each range, so every range but the last gets its own
+        int range_fd = i == num_ranges - 1 ? file_fd : dup(file_fd);
+        if (range_fd == -1) {
+            res->failed = true;
         } else {
-            return true;
+            response_append_file(res, range_fd, ranges[i].start, ranges[i].end);
+        }
+    }
+    if (num_ranges > 1) {
+        append_text(res, PART_TRAILER_FORMAT, boundary);
+    }
+    if (entry) {
+        return !res->failed;
+    }
+    if (i < num_ranges) {
+        close(file_fd); // stopped before the last range took it over
+    }
+    return response_flush(res);
+}
+
+/**
+ * Open a file and read its metadata
+ * @return the file, or -1 with the response to send instead in <failure>
+ */
+static int open_file(const char * key, struct stat * file_stat, enum res_result_code * failure) {
+    int file_fd = open(key, O_RDONLY);
+    if (file_fd < 0) {
+        // TODO: there could be other reasons for the error except file not existing
+        *failure = RESPONSE_RESULT_NOT_FOUND;
+        return -1;
+    }
+    if (fstat(file_fd, file_stat) < 0) {
+        close(file_fd);
+        *failure = RESPONSE_RESULT_INT_SERV_ERR;
+        return -1;
+    }
+    return file_fd;
+}
+
+// return false in case of error
+bool serve_file(const struct http_request * req, struct response_builder * res) {
+    bool get = req->method == HTTP_METHOD_GET;
+    bool keep_alive = req->keep_alive;
+
+    char key[MAX_REQUEST_URI_LENGTH + 1];
+    if (!file_cache_normalize(req->uri.data, req->uri.length, key, sizeof(key))) {
+        // Nothing outside the document root is served
+        return response_canned(res, RESPONSE_RESULT_NOT_FOUND, keep_alive);
+    }
+    uint64_t started = http_stats_start();
+    TRACE_BEGIN("open", res->fd);
+    int file_fd = -1;
+    struct stat file_stat;
+    enum res_result_code failure = RESPONSE_RESULT_INT_SERV_ERR;
+    struct byte_range ranges[MAX_RANGES];
+    struct file_cache_entry * entry = file_cache_acquire(key);
+    if (entry) {
+        http_stats_add(HTTP_STATS_CACHE_HITS, 1);
+    } else {
+        http_stats_add(HTTP_STATS_CACHE_MISSES, 1);
+        file_fd = open_file(key, &file_stat, &failure);
+        if (file_fd >= 0) {
+            entry = file_cache_insert(key, file_fd, &file_stat);
         }
     }
+
+    bool unchanged = entry && not_modified(req, &entry->stat);
+    int num_ranges = entry && !unchanged ? requested_ranges(req, &entry->stat, ranges) : -1;
+    if (entry && (unchanged || !get || entry->body || num_ranges == 0)) {
+        // The cached metadata is enough for a 304, a 416 or a HEAD, so the file is never opened for them
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        TRACE_END("open", res->fd);
+        http_stats_phase(HTTP_STATS_PHASE_OPEN, started);
+        if (unchanged) {
+            serve_not_modified(entry, NULL, res, keep_alive);
+        } else if (num_ranges == 0) {
+            serve_unsatisfiable(&entry->stat, res, keep_alive);
+            file_cache_release(entry);
+        } else if (num_ranges > 0) {
+            serve_ranges(entry, -1, &entry->stat, ranges, num_ranges, res, keep_alive);
+        } else {
+            serve_cached(entry, res, get, keep_alive);
+        }
+        return !res->failed;
+    }
+    if (entry) {
+        // Only the metadata of this file is cached, and the GET needs its body
+        file_cache_release(entry);
+        if (file_fd < 0) {
+            file_fd = open_file(key, &file_stat, &failure);
+        }
+    }
+    TRACE_END("open", res->fd);
+    http_stats_phase(HTTP_STATS_PHASE_OPEN, started);
+    if (file_fd < 0) {
+        return response_canned(res, failure, keep_alive);
+    }
+    if (not_modified(req, &file_stat)) {
+        close(file_fd);
+        serve_not_modified(NULL, &file_stat, res, keep_alive);
+        return !res->failed;
+    }
+    num_ranges = requested_ranges(req, &file_stat, ranges);
+    if (num_ranges == 0) {
+        close(file_fd);
+        serve_unsatisfiable(&file_stat, res, keep_alive);
+        return !res->failed;
+    }
+    if (num_ranges > 0) {
+        return serve_ranges(NULL, file_fd, &file_stat, ranges, num_ranges, res, keep_alive);
+    }
+
+    response_status(res, RESPONSE_RESULT_SUCCESS);
+    if (S_ISREG(file_stat.st_mode)) {
+        response_header(res, "Accept-Ranges", "bytes");
+    }
+    append_validators(res, &file_stat);
+    response_end_headers(res, file_stat.st_size, keep_alive);
+    if (!get) {
+        close(file_fd);
+        return !res->failed;
+    }
+    // The body goes to the output queue, so everything queued goes there now, ahead of it
+    return response_append_file(res, file_fd, 0, file_stat.st_size) && response_flush(res);
 }
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE // open_memstream
+#include "stats.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NS_PER_SECOND UINT64_C(1000000000)
+
+#define PROMETHEUS_CONTENT_TYPE "text/plain; version=0.0.4"
+#define JSON_CONTENT_TYPE "application/json"
+
+static atomic_bool enabled = false;
+
+// The shards are never freed: a thread that exits keeps its counts in the totals
+static _Atomic(struct http_stats_shard *) shards = NULL;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct http_stats_shard * local_shard = NULL;
+
+static const char * const phase_names[HTTP_STATS_PHASE_COUNT] = {"parse", "open", "send", "commit"};
+static const char * const method_names[HTTP_STATS_NUM_METHODS] = {"GET", "POST", "HEAD", "invalid"};
+static const int status_codes[HTTP_STATS_STATUS_COUNT] = {200, 201, 206, 304, 400, 404, 405, 409, 413, 416, 500, 501, 503, 504, 505};
+
+/**
+ * The sum of every shard, read counter by counter; a snapshot taken while the threads count
+ * may be off by the requests in flight, never more
+ */
+struct totals {
+    uint64_t counters[HTTP_STATS_COUNTER_COUNT];
+    uint64_t requests[HTTP_STATS_NUM_METHODS];
+    uint64_t responses[HTTP_STATS_STATUS_COUNT];
+    uint64_t buckets[HTTP_STATS_PHASE_COUNT][HTTP_STATS_NUM_BUCKETS + 1]; // cumulative, as Prometheus has them
+    uint64_t sum_ns[HTTP_STATS_PHASE_COUNT];
+};
+
+void http_stats_enable(bool on) {
+    atomic_store(&enabled, on);
+}
+
+bool http_stats_enabled(void) {
+    return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+/**
+ * The shard of the calling thread, created the first time the thread counts something
+ * @return NULL if stats are disabled or the shard could not be allocated
+ */
+static struct http_stats_shard * local(void) {
+    if (local_shard || !http_stats_enabled()) {
+        return local_shard;
+    }
+    struct http_stats_shard * shard = aligned_alloc(_Alignof(struct http_stats_shard), sizeof(*shard));
+    if (!shard) {
+        return NULL;
+    }
+    memset(shard, 0, sizeof(*shard));
+    pthread_mutex_lock(&shards_lock);
+    shard->next = atomic_load_explicit(&shards, memory_order_relaxed);
+    atomic_store_explicit(&shards, shard, memory_order_release);
+    pthread_mutex_unlock(&shards_lock);
+    local_shard = shard;
+    return shard;
+}
+
+/**
+ * Add to a counter of the calling thread's shard. No other thread writes it, so a relaxed
+ * load and store do the job of an atomic add without locking the bus.
+ */
+static void add(atomic_uint_fast64_t * counter, uint64_t amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SECOND + (uint64_t)now.tv_nsec;
+}
+
+uint64_t http_stats_start(void) {
+    return http_stats_enabled() ? now_ns() : 0;
+}
+
+// Bucket i holds durations up to 2^(i + HTTP_STATS_FIRST_BUCKET_BITS) ns
+static unsigned bucket_of(uint64_t ns) {
+    uint64_t scaled = (ns > 0 ? ns - 1 : 0) >> HTTP_STATS_FIRST_BUCKET_BITS;
+    unsigned bucket = scaled ? 64 - __builtin_clzll(scaled) : 0;
+    return bucket < HTTP_STATS_NUM_BUCKETS ? bucket : HTTP_STATS_NUM_BUCKETS;
+}
+
+void http_stats_phase(enum http_stats_phase phase, uint64_t started) {
+    struct http_stats_shard * shard;
+    if (started == 0 || !(shard = local())) {
+        return;
+    }
+    uint64_t elapsed = now_ns() - started;
+    add(&shard->latency[phase].buckets[bucket_of(elapsed)], 1);
+    add(&shard->latency[phase].sum_ns, elapsed);
+}
+
+void http_stats_add(enum http_stats_counter counter, uint64_t amount) {
+    struct http_stats_shard * shard = local();
+    if (shard) {
+        add(&shard->counters[counter], amount);
+    }
+}
+
+void http_stats_request(const struct http_request * req, bool bad) {
+    struct http_stats_shard * shard = local();
+    if (shard) {
+        add(&shard->requests[bad ? HTTP_STATS_NUM_METHODS - 1 : req->method], 1);
+    }
+}
+
+static enum http_stats_status status_of(enum res_result_code res_code) {
+    switch (res_code) {
+        case RESPONSE_RESULT_SUCCESS: return HTTP_STATS_STATUS_200;
+        case RESPONSE_RESULT_CREATED: return HTTP_STATS_STATUS_201;
+        case RESPONSE_RESULT_PARTIAL_CONTENT: return HTTP_STATS_STATUS_206;
+        case RESPONSE_RESULT_NOT_MODIFIED: return HTTP_STATS_STATUS_304;
+        case RESPONSE_RESULT_BAD_REQUEST: return HTTP_STATS_STATUS_400;
+        case RESPONSE_RESULT_NOT_FOUND: return HTTP_STATS_STATUS_404;
+        case RESPONSE_RESULT_INVALID: return HTTP_STATS_STATUS_405;
+        case RESPONSE_RESULT_CONFLICT: return HTTP_STATS_STATUS_409;
+        case RESPONSE_RESULT_PAYLOAD_TOO_LARGE: return HTTP_STATS_STATUS_413;
+        case RESPONSE_RESULT_RANGE_NOT_SATISFIABLE: return HTTP_STATS_STATUS_416;
+        case RESPONSE_RESULT_METHOD_NOT_IMPLEMENTED: return HTTP_STATS_STATUS_501;
+        case RESPONSE_RESULT_CANNOT_HANDLE: return HTTP_STATS_STATUS_503;
+        case RESPONSE_RESULT_TIMEOUT: return HTTP_STATS_STATUS_504;
+        case RESPONSE_RESULT_WRONG_VERSION: return HTTP_STATS_STATUS_505;
+        case RESPONSE_RESULT_INT_SERV_ERR:
+        default: return HTTP_STATS_STATUS_500;
+    }
+}
+
+void http_stats_response(enum res_result_code res_code) {
+    struct http_stats_shard * shard = local();
+    if (shard) {
+        add(&shard->responses[status_of(res_code)], 1);
+    }
+}
+
+static void read_totals(struct totals * totals) {
+    memset(totals, 0, sizeof(*totals));
+    for (struct http_stats_shard * shard = atomic_load_explicit(&shards, memory_order_acquire); shard; shard = shard->next) {
+        for (int i = 0; i < HTTP_STATS_COUNTER_COUNT; i++) {
+            totals->counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+        }
+        for (int i = 0; i < HTTP_STATS_NUM_METHODS; i++) {
+            totals->requests[i] += atomic_load_explicit(&shard->requests[i], memory_order_relaxed);
+        }
+        for (int i = 0; i < HTTP_STATS_STATUS_COUNT; i++) {
+            totals->responses[i] += atomic_load_explicit(&shard->responses[i], memory_order_relaxed);
+        }
+        for (int phase = 0; phase < HTTP_STATS_PHASE_COUNT; phase++) {
+            for (int i = 0; i <= HTTP_STATS_NUM_BUCKETS; i++) {
+                totals->buckets[phase][i] += atomic_load_explicit(&shard->latency[phase].buckets[i], memory_order_relaxed);
+            }
+            totals->sum_ns[phase] += atomic_load_explicit(&shard->latency[phase].sum_ns, memory_order_relaxed);
+        }
+    }
+    for (int phase = 0; phase < HTTP_STATS_PHASE_COUNT; phase++) {
+        for (int i = 1; i <= HTTP_STATS_NUM_BUCKETS; i++) {
+            totals->buckets[phase][i] += totals->buckets[phase][i - 1];
+        }
+    }
+}
+
+static uint64_t active_connections(const struct totals * totals) {
+    uint64_t accepted = totals->counters[HTTP_STATS_CONNECTIONS_ACCEPTED];
+    uint64_t closed = totals->counters[HTTP_STATS_CONNECTIONS_CLOSED];
+    return accepted > closed ? accepted - closed : 0; // the shards are not read at one instant
+}
+
+// Print a duration in seconds without going through floating point
+static void print_seconds(FILE * out, uint64_t ns) {
+    fprintf(out, "%" PRIu64 ".%09" PRIu64, ns / NS_PER_SECOND, ns % NS_PER_SECOND);
+}
+
+static void print_prometheus(FILE * out, const struct totals * totals) {
+    fprintf(out, "# TYPE http_connections_accepted_total counter\nhttp_connections_accepted_total %" PRIu64 "\n",
+            totals->counters[HTTP_STATS_CONNECTIONS_ACCEPTED]);
+    fprintf(out, "# TYPE http_connections_closed_total counter\nhttp_connections_closed_total %" PRIu64 "\n",
+            totals->counters[HTTP_STATS_CONNECTIONS_CLOSED]);
+    fprintf(out, "# TYPE http_connections_active gauge\nhttp_connections_active %" PRIu64 "\n", active_connections(totals));
+
+    fprintf(out, "# TYPE http_requests_total counter\n");
+    for (int i = 0; i < HTTP_STATS_NUM_METHODS; i++) {
+        fprintf(out, "http_requests_total{method=\"%s\"} %" PRIu64 "\n", method_names[i], totals->requests[i]);
+    }
+    fprintf(out, "# TYPE http_responses_total counter\n");
+    for (int i = 0; i < HTTP_STATS_STATUS_COUNT; i++) {
+        fprintf(out, "http_responses_total{code=\"%d\"} %" PRIu64 "\n", status_codes[i], totals->responses[i]);
+    }
+
+    fprintf(out, "# TYPE http_bytes_received_total counter\nhttp_bytes_received_total %" PRIu64 "\n",
+            totals->counters[HTTP_STATS_BYTES_IN]);
+    fprintf(out, "# TYPE http_bytes_sent_total counter\nhttp_bytes_sent_total %" PRIu64 "\n",
+            totals->counters[HTTP_STATS_BYTES_OUT]);
+    fprintf(out, "# TYPE http_file_cache_hits_total counter\nhttp_file_cache_hits_total %" PRIu64 "\n",
+            totals->counters[HTTP_STATS_CACHE_HITS]);
+    fprintf(out, "# TYPE http_file_cache_misses_total counter\nhttp_file_cache_misses_total %" PRIu64 "\n",
+            totals->counters[HTTP_STATS_CACHE_MISSES]);
+
+    fprintf(out, "# TYPE http_phase_duration_seconds histogram\n");
+    for (int phase = 0; phase < HTTP_STATS_PHASE_COUNT; phase++) {
+        for (int i = 0; i < HTTP_STATS_NUM_BUCKETS; i++) {
+            fprintf(out, "http_phase_duration_seconds_bucket{phase=\"%s\",le=\"", phase_names[phase]);
+            print_seconds(out, UINT64_C(1) << (i + HTTP_STATS_FIRST_BUCKET_BITS));
+            fprintf(out, "\"} %" PRIu64 "\n", totals->buckets[phase][i]);
+        }
+        uint64_t count = totals->buckets[phase][HTTP_STATS_NUM_BUCKETS];
+        fprintf(out, "http_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", phase_names[phase], count);
+        fprintf(out, "http_phase_duration_seconds_sum{phase=\"%s\"} ", phase_names[phase]);
+        print_seconds(out, totals->sum_ns[phase]);
+        fprintf(out, "\nhttp_phase_duration_seconds_count{phase=\"%s\"} %" PRIu64 "\n", phase_names[phase], count);
+    }
+}
+
+static void print_json(FILE * out, const struct totals * totals) {
+    fprintf(out, "{\"connections\":{\"accepted\":%" PRIu64 ",\"closed\":%" PRIu64 ",\"active\":%" PRIu64 "},",
+            totals->counters[HTTP_STATS_CONNECTIONS_ACCEPTED], totals->counters[HTTP_STATS_CONNECTIONS_CLOSED],
+            active_connections(totals));
+
+    fprintf(out, "\"requests\":{");
+    for (int i = 0; i < HTTP_STATS_NUM_METHODS; i++) {
+        fprintf(out, "%s\"%s\":%" PRIu64, i ? "," : "", method_names[i], totals->requests[i]);
+    }
+    fprintf(out, "},\"responses\":{");
+    for (int i = 0; i < HTTP_STATS_STATUS_COUNT; i++) {
+        fprintf(out, "%s\"%d\":%" PRIu64, i ? "," : "", status_codes[i], totals->responses[i]);
+    }
+
+    fprintf(out, "},\"bytes\":{\"received\":%" PRIu64 ",\"sent\":%" PRIu64 "},",
+            totals->counters[HTTP_STATS_BYTES_IN], totals->counters[HTTP_STATS_BYTES_OUT]);
+    fprintf(out, "\"file_cache\":{\"hits\":%" PRIu64 ",\"misses\":%" PRIu64 "},",
+            totals->counters[HTTP_STATS_CACHE_HITS], totals->counters[HTTP_STATS_CACHE_MISSES]);
+
+    // Cumulative counts by upper bound in nanoseconds; the last bucket, without a bound, is the count
+    fprintf(out, "\"phases\":{");
+    for (int phase = 0; phase < HTTP_STATS_PHASE_COUNT; phase++) {
+        fprintf(out, "%s\"%s\":{\"count\":%" PRIu64 ",\"sum_ns\":%" PRIu64 ",\"buckets\":[", phase ? "," : "",
+                phase_names[phase], totals->buckets[phase][HTTP_STATS_NUM_BUCKETS], totals->sum_ns[phase]);
+        for (int i = 0; i < HTTP_STATS_NUM_BUCKETS; i++) {
+            fprintf(out, "%s{\"le_ns\":%" PRIu64 ",\"count\":%" PRIu64 "}", i ? "," : "",
+                    UINT64_C(1) << (i + HTTP_STATS_FIRST_BUCKET_BITS), totals->buckets[phase][i]);
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "}}\n");
+}
+
+static bool uri_is(const struct http_request * req, const char * path) {
+    size_t length = strlen(path);
+    return req->uri.length == length && memcmp(req->uri.data, path, length) == 0;
+}
+
+bool http_stats_requested(const struct http_request * req) {
+    return http_stats_enabled() && (req->method == HTTP_METHOD_GET || req->method == HTTP_METHOD_HEAD) &&
+           (uri_is(req, HTTP_STATS_PATH) || uri_is(req, HTTP_STATS_JSON_PATH));
+}
+
+bool http_stats_serve(const struct http_request * req, struct response_builder * res) {
+    bool json = uri_is(req, HTTP_STATS_JSON_PATH);
+    struct totals totals;
+    read_totals(&totals);
+
+    char * body = NULL;
+    size_t length = 0;
+    FILE * out = open_memstream(&body, &length);
+    if (!out) {
+        return response_canned(res, RESPONSE_RESULT_INT_SERV_ERR, req->keep_alive);
+    }
+    if (json) {
+        print_json(out, &totals);
+    } else {
+        print_prometheus(out, &totals);
+    }
+    if (fclose(out) != 0) {
+        free(body);
+        return response_canned(res, RESPONSE_RESULT_INT_SERV_ERR, req->keep_alive);
+    }
+
+    response_status(res, RESPONSE_RESULT_SUCCESS);
+    response_header(res, "Content-Type", "%s", json ? JSON_CONTENT_TYPE : PROMETHEUS_CONTENT_TYPE);
+    response_header(res, "Cache-Control", "no-store");
+    response_end_headers(res, length, req->keep_alive);
+    if (req->method == HTTP_METHOD_GET) {
+        response_append_owned(res, body, length);
+    } else {
+        free(body);
+    }
+    return !res->failed;
+}
@@ -0,0 +1,493 @@
+#include "store.h"
+#include "request.h"
+#include "response.h"
+#include "stats.h"
+#include <core-lib/trace.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ndbm.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+
+#define STORE_CACHE_SLOTS 256 // power of two
+#define STORE_PREFIX_LENGTH (sizeof(STORE_URI_PREFIX) - 1)
+#define NS_PER_US 1000
+#define US_PER_SECOND 1000000
+
+static const char content_type[] = "application/octet-stream";
+
+/**
+ * A resource read back recently. Keys are never written twice, so a cached value never goes stale.
+ */
+struct cached_resource {
+    char key[STORE_KEY_LENGTH + 1]; // "" for an empty slot
+    char * value;
+    size_t length;
+};
+
+static struct {
+    pthread_mutex_t lock; // gdbm is not thread safe, so it also guards the database
+    pthread_cond_t synced; // a sync finished
+    pthread_cond_t pending; // there are writes to sync, or the committer should stop
+    char * path;
+    uint32_t commit_window_us;
+    pid_t init_pid; // process that called store_init
+    pid_t owner; // process the fields below belong to
+    bool shared; // owner was forked from init_pid, and may have siblings using the database
+    int lock_fd; // -1 until a shared process first uses the store
+    bool reported; // the last attempt to use the database failed and said why
+    DBM * db; // open for good in a process of its own; in a shared one, only during an operation
+    uint64_t written; // writes stored so far, numbered from 1
+    uint64_t durable; // every write up to this one is on disk
+    uint64_t failed; // a sync that covered the writes up to this one failed
+    pthread_t committer; // syncs for everybody, in a process of its own
+    bool committing; // the committer is running
+    bool stopping; // the committer should exit once every write is synced
+    struct store_waiter * waiters; // told when the sync covering their commit finishes
+    struct cached_resource cache[STORE_CACHE_SLOTS];
+} store = {.lock = PTHREAD_MUTEX_INITIALIZER, .synced = PTHREAD_COND_INITIALIZER,
+           .pending = PTHREAD_COND_INITIALIZER, .lock_fd = -1};
+
+static uint32_t hash_key(const char * key) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *key; key++) {
+        hash = (hash ^ (unsigned char)*key) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Report why the database cannot be used, once until it can be again
+ */
+static void report(const char * what) {
+    if (!store.reported) {
+        perror(what);
+        store.reported = true;
+    }
+}
+
+/**
+ * Tell the waiters whose commits a finished sync covered. Must hold the lock.
+ */
+static void notify_waiters(uint64_t target) {
+    struct store_waiter ** link = &store.waiters;
+    while (*link) {
+        struct store_waiter * waiter = *link;
+        if (waiter->commit > target) {
+            link = &waiter->next;
+            continue;
+        }
+        *link = waiter->next;
+        waiter->queued = false;
+        waiter->notify(waiter);
+    }
+}
+
+/**
+ * Sync the writes for everybody, until told to stop. Writes arriving within the commit window
+ * join the next sync, and writes arriving while the file is synced wait for the one after.
+ */
+static void * commit_writes(void * arg) {
+    (void)arg;
+    pthread_mutex_lock(&store.lock);
+    for (;;) {
+        uint64_t settled = store.durable > store.failed ? store.durable : store.failed;
+        if (settled >= store.written) {
+            if (store.stopping) {
+                break;
+            }
+            pthread_cond_wait(&store.pending, &store.lock);
+            continue;
+        }
+        if (store.commit_window_us > 0 && !store.stopping) {
+            struct timespec window = {store.commit_window_us / US_PER_SECOND,
+                                      (long)(store.commit_window_us % US_PER_SECOND) * NS_PER_US};
+            pthread_mutex_unlock(&store.lock);
+            nanosleep(&window, NULL);
+            pthread_mutex_lock(&store.lock);
+        }
+        uint64_t target = store.written;
+        int fd = dbm_pagfno(store.db);
+
+        pthread_mutex_unlock(&store.lock);
+        TRACE_BEGIN("fsync", fd);
+        int status = fsync(fd);
+        TRACE_END("fsync", fd);
+        pthread_mutex_lock(&store.lock);
+        if (status == 0) {
+            store.durable = target;
+        } else {
+            perror("store fsync");
+            store.failed = target;
+        }
+        pthread_cond_broadcast(&store.synced);
+        notify_waiters(target);
+    }
+    pthread_mutex_unlock(&store.lock);
+    return NULL;
+}
+
+/**
+ * Get the database ready for an operation. A process of its own opens it on first use and keeps
+ * it, along with the committer that syncs it; a failed open is tried again on the next request.
+ * gdbm lets only one process have it open for writing, so processes forked after store_init,
+ * such as prefork workers, open it for each operation instead, under a lock file that makes
+ * their siblings wait rather than fail.
+ * Must hold the lock, and call end_operation after an operation that could begin.
+ * @param write whether the operation stores
+ * @return 1 when the operation can go ahead, 0 when reading and nothing was ever stored,
+ * -1 when the store cannot be used
+ */
+static int begin_operation(bool write) {
+    if (!store.path) {
+        return -1;
+    }
+    if (store.owner != getpid()) {
+        // A handle opened before a fork cannot be shared, so the parent's is left alone
+        store.owner = getpid();
+        store.shared = store.owner != store.init_pid;
+        store.lock_fd = -1;
+        store.db = NULL;
+        store.written = store.durable = store.failed = 0;
+        store.committing = store.stopping = false; // threads do not survive the fork
+        store.waiters = NULL;
+    }
+    if (!store.shared) {
+        if (!store.db) {
+            store.db = dbm_open(store.path, O_RDWR | O_CREAT, 0644);
+            if (!store.db) {
+                report("store dbm_open");
+                return -1;
+            }
+        }
+        if (!store.committing) {
+            int status = pthread_create(&store.committer, NULL, commit_writes, NULL);
+            if (status != 0) {
+                errno = status;
+                report("store committer");
+                return -1;
+            }
+            store.committing = true;
+        }
+        store.reported = false;
+        return 1;
+    }
+
+    if (store.lock_fd == -1) {
+        char lock_path[PATH_MAX];
+        if (snprintf(lock_path, sizeof(lock_path), "%s.lock", store.path) >= (int)sizeof(lock_path)) {
+            errno = ENAMETOOLONG;
+            report("store lock");
+            return -1;
+        }
+        store.lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (store.lock_fd == -1) {
+            report("store lock");
+            return -1;
+        }
+    }
+    // Readers share the database and a writer has it to itself, as gdbm's own locks require
+    int status;
+    do {
+        status = flock(store.lock_fd, write ? LOCK_EX : LOCK_SH);
+    } while (status == -1 && errno == EINTR);
+    if (status == -1) {
+        report("store lock");
+        return -1;
+    }
+    store.db = dbm_open(store.path, write ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (!store.db) {
+        bool missing = !write && errno == ENOENT;
+        if (!missing) {
+            report("store dbm_open");
+        }
+        (void)flock(store.lock_fd, LOCK_UN);
+        return missing ? 0 : -1;
+    }
+    store.reported = false;
+    return 1;
+}
+
+/**
+ * Finish an operation begun with begin_operation. A shared process syncs what it stored before
+ * closing the database, so its writes are durable once this returns. Must hold the lock.
+ * @param write whether the operation stored
+ * @return false if the writes could not be made durable
+ */
+static bool end_operation(bool write) {
+    if (!store.shared) {
+        return true;
+    }
+    bool synced = true;
+    if (write) {
+        int fd = dbm_pagfno(store.db);
+        TRACE_BEGIN("fsync", fd);
+        synced = fsync(fd) == 0;
+        TRACE_END("fsync", fd);
+        if (!synced) {
+            perror("store fsync");
+        }
+    }
+    dbm_close(store.db);
+    store.db = NULL;
+    (void)flock(store.lock_fd, LOCK_UN);
+    return synced;
+}
+
+/**
+ * Store a value under a new key. Must hold the lock.
+ * @return the number of the write, or 0 on failure
+ */
+static uint64_t put(const char * key, const char * value, size_t length) {
+    datum key_datum = {(char *)(uintptr_t)key, STORE_KEY_LENGTH};
+    datum value_datum = {(char *)(uintptr_t)value, (int)length};
+    if (dbm_store(store.db, key_datum, value_datum, DBM_INSERT) != 0) {
+        return 0;
+    }
+    return ++store.written;
+}
+
+/**
+ * Read a key into its cache slot from the database. Must hold the lock.
+ * @return false if the key is not stored or the copy cannot be made
+ */
+static bool fetch(const char * key, struct cached_resource * slot) {
+    datum key_datum = {(char *)(uintptr_t)key, STORE_KEY_LENGTH};
+    datum found = dbm_fetch(store.db, key_datum);
+    if (!found.dptr) {
+        return false;
+    }
+    // The datum points into gdbm's own memory, which the next call reuses
+    char * copy = malloc(found.dsize > 0 ? (size_t)found.dsize : 1);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, found.dptr, (size_t)found.dsize);
+    free(slot->value);
+    memcpy(slot->key, key, STORE_KEY_LENGTH + 1);
+    slot->value = copy;
+    slot->length = (size_t)found.dsize;
+    return true;
+}
+
+/**
+ * Copy the value of a key into <value>, from the cache or the database. Must hold the lock.
+ * @param available set to false if the database cannot be used
+ * @return false if the key is not stored or the copy cannot be made
+ */
+static bool get(const char * key, char ** value, size_t * length, bool * available) {
+    struct cached_resource * slot = &store.cache[hash_key(key) & (STORE_CACHE_SLOTS - 1)];
+    *available = true;
+    if (strcmp(slot->key, key) != 0) {
+        int status = begin_operation(false);
+        if (status != 1) {
+            *available = status == 0; // nothing stored yet is as good as not found
+            return false;
+        }
+        bool found = fetch(key, slot);
+        (void)end_operation(false);
+        if (!found) {
+            return false;
+        }
+    }
+    *value = malloc(slot->length > 0 ? slot->length : 1);
+    if (!*value) {
+        return false;
+    }
+    memcpy(*value, slot->value, slot->length);
+    *length = slot->length;
+    return true;
+}
+
+int store_init(const char * path, uint32_t commit_window_us) {
+    char * copy = strdup(path);
+    if (!copy) {
+        return -1;
+    }
+    pthread_mutex_lock(&store.lock);
+    free(store.path);
+    store.path = copy;
+    store.commit_window_us = commit_window_us;
+    store.init_pid = getpid();
+    pthread_mutex_unlock(&store.lock);
+    return 0;
+}
+
+void store_destroy(void) {
+    pthread_mutex_lock(&store.lock);
+    if (store.owner == getpid()) {
+        if (store.committing) {
+            // The committer syncs what is left before it exits
+            store.stopping = true;
+            pthread_cond_signal(&store.pending);
+            pthread_mutex_unlock(&store.lock);
+            pthread_join(store.committer, NULL);
+            pthread_mutex_lock(&store.lock);
+            store.committing = store.stopping = false;
+        }
+        if (store.db) {
+            dbm_close(store.db);
+        }
+        if (store.lock_fd != -1) {
+            close(store.lock_fd);
+        }
+    }
+    store.db = NULL;
+    store.lock_fd = -1;
+    store.owner = 0;
+    store.waiters = NULL;
+    free(store.path);
+    store.path = NULL;
+    for (size_t i = 0; i < STORE_CACHE_SLOTS; i++) {
+        free(store.cache[i].value);
+        store.cache[i].value = NULL;
+        store.cache[i].key[0] = '\0';
+    }
+    pthread_mutex_unlock(&store.lock);
+}
+
+bool store_requested(const struct http_request * req) {
+    if (req->uri.length < STORE_PREFIX_LENGTH - 1 || memcmp(req->uri.data, STORE_URI_PREFIX, STORE_PREFIX_LENGTH - 1) != 0) {
+        return false;
+    }
+    bool below = req->uri.length >= STORE_PREFIX_LENGTH && req->uri.data[STORE_PREFIX_LENGTH - 1] == '/';
+    if (req->method == HTTP_METHOD_POST) {
+        // The collection itself, with or without its trailing slash
+        return req->uri.length == STORE_PREFIX_LENGTH - 1 || (below && req->uri.length == STORE_PREFIX_LENGTH);
+    }
+    return below && req->uri.length > STORE_PREFIX_LENGTH;
+}
+
+/**
+ * Store the body of a POST and queue its 201
+ */
+static bool create(const struct http_request * req, struct response_builder * res) {
+    if (req->known[HTTP_HEADER_TRANSFER_ENCODING]) {
+        // Only bodies with a Content-Length are read
+        return response_canned(res, RESPONSE_RESULT_BAD_REQUEST, false);
+    }
+
+    uuid_t uuid;
+    char key[STORE_KEY_LENGTH + 1];
+    uuid_generate_random(uuid);
+    uuid_unparse_lower(uuid, key);
+
+    pthread_mutex_lock(&store.lock);
+    uint64_t commit = 0;
+    if (begin_operation(true) == 1) {
+        commit = put(key, req->body.data, req->body.length);
+        if (!end_operation(true)) {
+            commit = 0;
+        } else if (store.shared) {
+            store.durable = commit; // synced already
+        } else if (commit > 0) {
+            pthread_cond_signal(&store.pending);
+        }
+    }
+    pthread_mutex_unlock(&store.lock);
+    if (commit == 0) {
+        return response_canned(res, RESPONSE_RESULT_CANNOT_HANDLE, req->keep_alive);
+    }
+
+    // Set first: the builder may send early, and nothing may go out before the write is durable
+    res->commit = commit;
+    response_status(res, RESPONSE_RESULT_CREATED);
+    response_header(res, "Location", "%s%s", STORE_URI_PREFIX, key);
+    response_end_headers(res, 0, req->keep_alive);
+    return !res->failed;
+}
+
+/**
+ * Queue the response to a GET or HEAD of a stored resource
+ */
+static bool read_back(const struct http_request * req, struct response_builder * res) {
+    char key[STORE_KEY_LENGTH + 1];
+    if (req->uri.length != STORE_PREFIX_LENGTH + STORE_KEY_LENGTH) {
+        return response_canned(res, RESPONSE_RESULT_NOT_FOUND, req->keep_alive);
+    }
+    memcpy(key, req->uri.data + STORE_PREFIX_LENGTH, STORE_KEY_LENGTH);
+    key[STORE_KEY_LENGTH] = '\0';
+
+    char * value = NULL;
+    size_t length = 0;
+    bool available;
+    pthread_mutex_lock(&store.lock);
+    bool found = get(key, &value, &length, &available);
+    pthread_mutex_unlock(&store.lock);
+    if (!found) {
+        return response_canned(res, available ? RESPONSE_RESULT_NOT_FOUND : RESPONSE_RESULT_CANNOT_HANDLE, req->keep_alive);
+    }
+
+    response_status(res, RESPONSE_RESULT_SUCCESS);
+    response_header(res, "Content-Type", "%s", content_type);
+    response_end_headers(res, length, req->keep_alive);
+    if (req->method == HTTP_METHOD_GET) {
+        response_append_owned(res, value, length);
+    } else {
+        free(value);
+    }
+    return !res->failed;
+}
+
+bool store_serve(const struct http_request * req, struct response_builder * res) {
+    return req->method == HTTP_METHOD_POST ? create(req, res) : read_back(req, res);
+}
+
+/**
+ * Where the sync covering a commit stands. Must hold the lock.
+ */
+static enum store_commit_state commit_state(uint64_t commit) {
+    if (store.durable >= commit) {
+        return STORE_COMMIT_DURABLE;
+    }
+    return store.failed >= commit ? STORE_COMMIT_FAILED : STORE_COMMIT_PENDING;
+}
+
+enum store_commit_state store_commit_state(uint64_t commit) {
+    pthread_mutex_lock(&store.lock);
+    enum store_commit_state state = commit_state(commit);
+    pthread_mutex_unlock(&store.lock);
+    return state;
+}
+
+bool store_watch(struct store_waiter * waiter, uint64_t commit) {
+    pthread_mutex_lock(&store.lock);
+    bool pending = commit_state(commit) == STORE_COMMIT_PENDING;
+    if (pending && !waiter->queued) {
+        waiter->commit = commit;
+        waiter->next = store.waiters;
+        waiter->queued = true;
+        store.waiters = waiter;
+    }
+    pthread_mutex_unlock(&store.lock);
+    return pending;
+}
+
+void store_unwatch(struct store_waiter * waiter) {
+    pthread_mutex_lock(&store.lock);
+    for (struct store_waiter ** link = &store.waiters; waiter->queued && *link; link = &(*link)->next) {
+        if (*link == waiter) {
+            *link = waiter->next;
+            waiter->queued = false;
+        }
+    }
+    pthread_mutex_unlock(&store.lock);
+}
+
+bool store_wait(uint64_t commit) {
+    pthread_mutex_lock(&store.lock);
+    while (commit_state(commit) == STORE_COMMIT_PENDING) {
+        pthread_cond_wait(&store.synced, &store.lock);
+    }
+    bool durable = store.durable >= commit;
+    pthread_mutex_unlock(&store.lock);
+    return durable;
+}
@@ -0,0 +1,127 @@
+#ifndef SCALABLE_SERVER_CONNECTION_TABLE_H
+#define SCALABLE_SERVER_CONNECTION_TABLE_H
+
+#include <core-lib/objects.h>
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * The number of connection records allocated at once. Records never move once allocated,
+ * so struct connection pointers stay valid while the table grows.
+ */
+#define CONNECTION_TABLE_CHUNK 1024
+
+/**
+ * The number of pollfds allocated on the first accept. The array doubles from there.
+ */
+#define CONNECTION_TABLE_INITIAL_CAPACITY 64
+
+/**
+ * The index of the first connection's pollfd, after the listen socket and the wakeup.
+ */
+#define CONNECTION_TABLE_FIRST 2
+
+/**
+ * poll_connection
+ * <p>
+ * Per-connection record. While the record is in use, pollfd_index is the position of the
+ * connection's pollfd; while it is on the free list, it is the next free slot.
+ * </p>
+ */
+struct poll_connection {
+    struct connection conn;
+    size_t pollfd_index;
+};
+
+/**
+ * connection_table
+ * <p>
+ * Growable table of the connections of one reactor. pollfds[0] is the listen socket, pollfds[1]
+ * the reactor's wakeup, and pollfds[CONNECTION_TABLE_FIRST, nfds) are the connections, densely packed, so the array can be handed to poll()
+ * as is. slots[i] is the record slot of pollfds[i]. Records are handed out from a free list
+ * and a closed connection's pollfd is replaced by the last one, so add and remove are O(1).
+ * </p>
+ */
+struct connection_table {
+    struct pollfd *pollfds;
+    size_t *slots;
+    nfds_t nfds;
+    size_t capacity; // length of pollfds and slots
+    struct poll_connection **chunks;
+    size_t num_chunks;
+    size_t num_slots; // records handed out at least once
+    size_t free_slot; // head of the free list, SIZE_MAX when empty
+    size_t max_connections;
+};
+
+/**
+ * connection_table_init
+ * <p>
+ * Initialize an empty table polling only the listen socket and the wakeup.
+ * </p>
+ * @param table the table
+ * @param listen_fd the listen socket
+ * @param wake_fd the file descriptor of the reactor's wakeup
+ * @param max_connections the most connections the table will hold
+ * @return 0 on success, -1 and set errno on failure
+ */
+int connection_table_init(struct connection_table *table, int listen_fd, int wake_fd, size_t max_connections);
+
+/**
+ * connection_table_add
+ * <p>
+ * Add a connection polled for POLLIN, growing the table if needed.
+ * </p>
+ * @param table the table
+ * @param fd the client socket
+ * @return the connection, or NULL and set errno on failure. errno is EMFILE when the table is full.
+ */
+struct connection *connection_table_add(struct connection_table *table, int fd);
+
+/**
+ * connection_table_get
+ * <p>
+ * Get the connection that owns a pollfd.
+ * </p>
+ * @param table the table
+ * @param pollfd_index the index of the pollfd, at least CONNECTION_TABLE_FIRST
+ * @return the connection
+ */
+struct connection *connection_table_get(const struct connection_table *table, size_t pollfd_index);
+
+/**
+ * connection_table_remove
+ * <p>
+ * Remove a connection. The last pollfd takes its place. Does not close the socket.
+ * </p>
+ * @param table the table
+ * @param pollfd_index the index of the connection's pollfd, at least CONNECTION_TABLE_FIRST
+ */
+void connection_table_remove(struct connection_table *table, size_t pollfd_index);
+
+/**
+ * connection_table_size
+ * @param table the table
+ * @return the number of connections in the table
+ */
+size_t connection_table_size(const struct connection_table *table);
+
+/**
+ * connection_table_is_full
+ * @param table the table
+ * @return whether the table holds max_connections connections
+ */
+bool connection_table_is_full(const struct connection_table *table);
+
+/**
+ * connection_table_destroy
+ * <p>
+ * Free the table's memory. Does not close any socket.
+ * </p>
+ * @param table the table
+ */
+void connection_table_destroy(struct connection_table *table);
+
+#endif //SCALABLE_SERVER_CONNECTION_TABLE_H
@@ -1,18 +1,47 @@
 #ifndef SCALABLE_SERVER_POLL_OBJECTS_H
 #define SCALABLE_SERVER_POLL_OBJECTS_H
 
+#include "connection_table.h"
+#include <core-lib/objects.h>
+#include <core-lib/timer_wheel.h>
+#include <core-lib/wakeup.h>
 #include <netinet/in.h>
+#include <pthread.h>
+
+struct state_object;
+struct access_log_ring;
 
 /**
- * The maximum number of connections that can be accepted by the poll server.
+ * poll_reactor
+ * <p>
+ * One event loop. Each reactor runs on its own thread, pinned to its own CPU,
+ * and owns its listening socket and its share of the connections.
+ * </p>
  */
-#define MAX_CONNECTIONS 5
+struct poll_reactor {
+    struct core_object *co;
+    struct state_object *so;
+    size_t index;
+    int cpu; // -1 when the reactor is not pinned
+    pthread_t thread;
+    int listen_fd;
+    size_t max_connections;
+    struct connection_table connections;
+    size_t total_connections; // connections accepted over the reactor's lifetime
+    size_t closed_connections; // connections closed over the reactor's lifetime
+    size_t accept_errors; // accepts that failed without stopping the reactor, e.g. out of fds
+    size_t accept_budget_spent; // wakeups that accepted a full batch and left the rest queued
+    struct timer accept_retry; // pending while accepting is paused for lack of fds
+    struct access_log_ring *log_ring; // NULL when the reactor does not log
+    uint64_t now_ms; // monotonic milliseconds at the reactor's last wakeup
+    struct timer_wheel timers; // the deadlines of the reactor's connections
+    struct wakeup wakeup; // where other threads post the reactor's parked connections; fd is -1 until set up
+    int status; // return value of the reactor's loop
+};
 
 struct state_object {
-    int listen_fd;
-    int client_fd[MAX_CONNECTIONS];
-    struct sockaddr_in client_addr[MAX_CONNECTIONS];
-    size_t num_connections;
+    struct poll_reactor *reactors;
+    size_t num_reactors;
 };
 
 #endif //SCALABLE_SERVER_POLL_OBJECTS_H
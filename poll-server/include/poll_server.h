@@ -7,18 +7,35 @@
 /**
  * setup_poll_state
  * <p>
- * Set up the state object for the one-to-one server. Add it to the memory manager.
+ * Set up the state object for the poll server and its reactors. Add them to the memory manager.
+ * </p>
+ * <p>
+ * The connection limit is shared evenly between the reactors and is capped by RLIMIT_NOFILE,
+ * whose soft limit is raised to the hard limit first.
  * </p>
  * @param mm the memory manager to which the state object will be added
+ * @param num_reactors the number of event loops to run, 0 for one per CPU the process may run on
+ * @param max_connections the most connections open at once, 0 for as many as RLIMIT_NOFILE allows
  * @return the state object, or NULL and set errno on failure
  */
-struct state_object *setup_poll_state(struct memory_manager *mm);
+struct state_object *setup_poll_state(struct memory_manager *mm, size_t num_reactors, size_t max_connections);
+
+/**
+ * poll_cpu_count
+ * <p>
+ * Count the CPUs the process may run on, which its affinity mask may limit to fewer than are
+ * online. Reactors are pinned to these CPUs in turn.
+ * </p>
+ * @return the number of CPUs, at least 1
+ */
+size_t poll_cpu_count(void);
 
 /**
  * open_poll_server_for_listen
  * <p>
  * Create a socket, bind, and begin listening for connections. Fill necessary fields in the
- * core object.
+ * core object. Each reactor gets its own listening socket bound with SO_REUSEPORT, so the
+ * kernel spreads incoming connections across the reactors.
  * </p>
  * @param co the core object
  * @param so the state object
@@ -34,6 +51,10 @@ int open_poll_server_for_listen(struct core_object *co, struct state_object *so,
  * is on the listen socket, accept a new connection. If activity is on any other socket,
  * handle that message.
  * </p>
+ * <p>
+ * Reactor 0 runs on the calling thread; every other reactor gets a thread of its own.
+ * Returns once every reactor has stopped and prints the connection count of each.
+ * </p>
  * @param co the core object
  * @return 0 on success, -1 and set errno on failure
  */
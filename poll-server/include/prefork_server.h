@@ -0,0 +1,58 @@
+#ifndef SCALABLE_SERVER_PREFORK_SERVER_H
+#define SCALABLE_SERVER_PREFORK_SERVER_H
+
+#include "objects.h"
+#include <core-lib/objects.h>
+
+#include <stdbool.h>
+
+/**
+ * setup_prefork_state
+ * <p>
+ * Set up the state object shared by all workers and the table of worker processes.
+ * Add them to the memory manager. Each worker runs a single poll reactor.
+ * </p>
+ * @param mm the memory manager to which the objects will be added
+ * @param count the number of worker processes, 0 for one per CPU the process may run on
+ * @param max_connections the most connections open at once across all workers, 0 for as many as
+ * RLIMIT_NOFILE allows in each worker
+ * @return the state object, or NULL and set errno on failure
+ */
+struct state_object *setup_prefork_state(struct memory_manager *mm, size_t count, size_t max_connections);
+
+/**
+ * run_prefork_server
+ * <p>
+ * Fork the workers and supervise them. A worker that exits while the server is running is
+ * respawned. SIGINT or SIGTERM stops the supervisor, which forwards SIGTERM to every worker
+ * and waits for them to exit.
+ * </p>
+ * <p>
+ * In a worker, run the poll event loop on the inherited listening socket and return when it stops.
+ * </p>
+ * @param co the core object
+ * @return 0 on success, -1 and set errno on failure
+ */
+int run_prefork_server(struct core_object *co);
+
+/**
+ * is_prefork_worker
+ * <p>
+ * Whether the calling process is a worker rather than the supervisor.
+ * </p>
+ * @return true in a worker process
+ */
+bool is_prefork_worker(void);
+
+/**
+ * destroy_prefork_state
+ * <p>
+ * In the supervisor, stop any remaining worker and close the listening socket.
+ * In a worker, close the listening socket and all connections.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ */
+void destroy_prefork_state(struct core_object *co, struct state_object *so);
+
+#endif //SCALABLE_SERVER_PREFORK_SERVER_H
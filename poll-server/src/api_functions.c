@@ -5,7 +5,7 @@ int initialize_server(struct core_object *co)
 {
     printf("INIT POLL SERVER\n");
     
-    co->so = setup_poll_state(co->mm);
+    co->so = setup_poll_state(co->mm, co->num_workers, co->max_connections);
     if (!co->so)
     {
         return ERROR;
@@ -0,0 +1,213 @@
+#include "connection_table.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * connection_table_grow
+ * <p>
+ * Double the pollfd array, and allocate another chunk of records if every record is in use.
+ * </p>
+ * @param table the table
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int connection_table_grow(struct connection_table *table);
+
+/**
+ * connection_table_record
+ * @param table the table
+ * @param slot the record slot
+ * @return the record
+ */
+static struct poll_connection *connection_table_record(const struct connection_table *table, size_t slot);
+
+int connection_table_init(struct connection_table *table, int listen_fd, int wake_fd, size_t max_connections)
+{
+    memset(table, 0, sizeof(struct connection_table));
+    table->free_slot       = SIZE_MAX;
+    table->max_connections = max_connections;
+
+    table->pollfds = (struct pollfd *) malloc(CONNECTION_TABLE_FIRST * sizeof(struct pollfd));
+    table->slots   = (size_t *) malloc(CONNECTION_TABLE_FIRST * sizeof(size_t));
+    if (!table->pollfds || !table->slots)
+    {
+        connection_table_destroy(table);
+        errno = ENOMEM;
+        return -1;
+    }
+    table->capacity = CONNECTION_TABLE_FIRST;
+
+    table->pollfds[0].fd      = listen_fd;
+    table->pollfds[0].events  = POLLIN;
+    table->pollfds[0].revents = 0;
+    table->slots[0]           = SIZE_MAX;
+    table->pollfds[1].fd      = wake_fd;
+    table->pollfds[1].events  = POLLIN;
+    table->pollfds[1].revents = 0;
+    table->slots[1]           = SIZE_MAX;
+    table->nfds               = CONNECTION_TABLE_FIRST;
+
+    return 0;
+}
+
+struct connection *connection_table_add(struct connection_table *table, int fd)
+{
+    struct poll_connection *record;
+    size_t                 slot;
+    size_t                 pollfd_index;
+
+    if (connection_table_is_full(table))
+    {
+        errno = EMFILE;
+        return NULL;
+    }
+
+    if ((table->nfds == table->capacity ||
+         (table->free_slot == SIZE_MAX && table->num_slots == table->num_chunks * CONNECTION_TABLE_CHUNK)) &&
+        connection_table_grow(table) == -1)
+    {
+        return NULL;
+    }
+
+    // Reuse the most recently freed record, or take a fresh one.
+    if (table->free_slot != SIZE_MAX)
+    {
+        slot             = table->free_slot;
+        record           = connection_table_record(table, slot);
+        table->free_slot = record->pollfd_index;
+    } else
+    {
+        slot   = table->num_slots++;
+        record = connection_table_record(table, slot);
+    }
+
+    pollfd_index = table->nfds++;
+    table->pollfds[pollfd_index].fd      = fd;
+    table->pollfds[pollfd_index].events  = POLLIN;
+    table->pollfds[pollfd_index].revents = 0;
+    table->slots[pollfd_index]           = slot;
+
+    memset(record, 0, sizeof(struct poll_connection));
+    record->conn.fd      = fd;
+    record->pollfd_index = pollfd_index;
+
+    return &record->conn;
+}
+
+struct connection *connection_table_get(const struct connection_table *table, size_t pollfd_index)
+{
+    return &connection_table_record(table, table->slots[pollfd_index])->conn;
+}
+
+void connection_table_remove(struct connection_table *table, size_t pollfd_index)
+{
+    struct poll_connection *record;
+    size_t                 slot;
+    size_t                 last;
+
+    slot   = table->slots[pollfd_index];
+    record = connection_table_record(table, slot);
+    last   = table->nfds - 1;
+
+    // Fill the hole with the last pollfd so the array stays dense.
+    if (pollfd_index != last)
+    {
+        table->pollfds[pollfd_index] = table->pollfds[last];
+        table->slots[pollfd_index]   = table->slots[last];
+        connection_table_record(table, table->slots[pollfd_index])->pollfd_index = pollfd_index;
+    }
+    --table->nfds;
+
+    record->conn.fd      = -1;
+    record->conn.data    = NULL;
+    record->pollfd_index = table->free_slot;
+    table->free_slot     = slot;
+}
+
+size_t connection_table_size(const struct connection_table *table)
+{
+    return (table->nfds > CONNECTION_TABLE_FIRST) ? (size_t) table->nfds - CONNECTION_TABLE_FIRST : 0;
+}
+
+bool connection_table_is_full(const struct connection_table *table)
+{
+    return connection_table_size(table) >= table->max_connections;
+}
+
+void connection_table_destroy(struct connection_table *table)
+{
+    for (size_t i = 0; i < table->num_chunks; ++i)
+    {
+        free(table->chunks[i]);
+    }
+    free(table->chunks);
+    free(table->slots);
+    free(table->pollfds);
+    memset(table, 0, sizeof(struct connection_table));
+}
+
+static int connection_table_grow(struct connection_table *table)
+{
+    if (table->nfds == table->capacity)
+    {
+        size_t        capacity;
+        struct pollfd *pollfds;
+        size_t        *slots;
+
+        capacity = (table->capacity < CONNECTION_TABLE_INITIAL_CAPACITY) ? CONNECTION_TABLE_INITIAL_CAPACITY
+                                                                          : table->capacity * 2;
+        if (capacity > table->max_connections + CONNECTION_TABLE_FIRST)
+        {
+            capacity = table->max_connections + CONNECTION_TABLE_FIRST; // the listen socket and the wakeup
+        }
+
+        pollfds = (struct pollfd *) realloc(table->pollfds, capacity * sizeof(struct pollfd));
+        if (!pollfds)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        table->pollfds = pollfds;
+
+        slots = (size_t *) realloc(table->slots, capacity * sizeof(size_t));
+        if (!slots)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        table->slots    = slots;
+        table->capacity = capacity;
+    }
+
+    if (table->free_slot == SIZE_MAX && table->num_slots == table->num_chunks * CONNECTION_TABLE_CHUNK)
+    {
+        struct poll_connection **chunks;
+
+        chunks = (struct poll_connection **) realloc(table->chunks,
+                                                     (table->num_chunks + 1) * sizeof(struct poll_connection *));
+        if (!chunks)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        table->chunks = chunks;
+
+        table->chunks[table->num_chunks] = (struct poll_connection *) calloc(CONNECTION_TABLE_CHUNK,
+                                                                             sizeof(struct poll_connection));
+        if (!table->chunks[table->num_chunks])
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        ++table->num_chunks;
+    }
+
+    return 0;
+}
+
+static struct poll_connection *connection_table_record(const struct connection_table *table, size_t slot)
+{
+    return &table->chunks[slot / CONNECTION_TABLE_CHUNK][slot % CONNECTION_TABLE_CHUNK];
+}
@@ -1,37 +1,116 @@
+#define _GNU_SOURCE // pthread_setaffinity_np, sched_getaffinity
 #include "poll_server.h"
 #include "objects.h"
+#include <core-lib/access_log.h>
 #include <core-lib/objects.h>
+#include <core-lib/trace.h>
+#include <core-lib/util.h>
+#include <core-lib/wakeup.h>
 
 #include <stdbool.h>
-#include <arpa/inet.h>
 #include <errno.h>
 #include <mem_manager/manager.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h> // back compatability
 #include <unistd.h>
 
 // NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables): must be non-const
 /**
- * Whether the poll loop should be running.
+ * Whether the poll loop should be running. Shared by all reactors.
  */
 volatile int GOGO_POLL = 1;
 // NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
 
+/**
+ * Signal sent by reactor 0 to wake the other reactors out of ppoll() on shutdown. Like SIGINT
+ * and SIGTERM, it is blocked everywhere but inside ppoll(), so a signal that arrives after a
+ * reactor tested GOGO_POLL stays pending and interrupts the ppoll() it is about to enter.
+ */
+#define REACTOR_WAKE_SIGNAL SIGUSR1
+
+#define MS_PER_SECOND 1000
+#define NS_PER_MS 1000000
+
+/**
+ * run_reactor
+ * <p>
+ * Run the event loop of one reactor. Pin the calling thread to the reactor's CPU first.
+ * </p>
+ * @param reactor the reactor
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int run_reactor(struct poll_reactor *reactor);
+
+/**
+ * reactor_thread
+ * <p>
+ * Thread entry point for reactors other than reactor 0.
+ * </p>
+ * @param arg the reactor
+ * @return NULL; the result is stored in the reactor's status
+ */
+static void *reactor_thread(void *arg);
+
+/**
+ * pin_to_cpu
+ * <p>
+ * Pin the calling thread to the reactor's CPU.
+ * </p>
+ * @param reactor the reactor
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int pin_to_cpu(const struct poll_reactor *reactor);
+
+/**
+ * allowed_cpus
+ * <p>
+ * Get the CPUs the process may run on. taskset, a cgroup cpuset or a container limit may
+ * narrow them down from the online ones.
+ * </p>
+ * @param cpus filled with the allowed CPUs
+ * @return the number of allowed CPUs, or 0 if they cannot be read
+ */
+static size_t allowed_cpus(cpu_set_t *cpus);
+
+/**
+ * nth_cpu
+ * @param cpus a set of CPUs
+ * @param n the position in the set, less than its count
+ * @return the number of the n-th CPU in the set
+ */
+static int nth_cpu(const cpu_set_t *cpus, size_t n);
+
+/**
+ * connection_limit
+ * <p>
+ * Raise the soft RLIMIT_NOFILE to the hard limit and work out how many connections
+ * fit under it.
+ * </p>
+ * @param max_connections the configured limit, 0 for no limit of its own
+ * @param num_reactors the number of reactors, each of which holds a listen socket
+ * @return the connection limit, or 0 and set errno on failure
+ */
+static size_t connection_limit(size_t max_connections, size_t num_reactors);
+
 /**
  * execute_poll
  * <p>
- * Execute the poll function to listen for action of pollfds. Action on the
- * listen fd will call accept; otherwise, action will call read all.
+ * Execute the ppoll function to listen for action of pollfds. Action on the
+ * connections will call the pollin handler; action on the listen fd will call accept.
+ * The shutdown signals are only let in while the reactor waits in ppoll.
  * </p>
- * @param co the core object
- * @param pollfds the pollfd array
- * @param nfds the number of fds in the array
+ * @param reactor the reactor
  * @return 0 on success, -1 and set errno on failure
  */
-static int execute_poll(struct core_object *co, struct pollfd *pollfds, nfds_t nfds);
+static int execute_poll(struct poll_reactor *reactor);
 
 /**
  * setup_signal_handler
@@ -52,53 +131,66 @@ static void end_gogo_handler(int signal);
 /**
  * poll_accept
  * <p>
- * Accept a new connection to the server. Set the value of the fd
- * increment the num connections in the state object and. Log the connection
- * in the log file.
+ * Accept the connections queued on the listen socket, up to ACCEPT_BATCH of them, and add
+ * them to the reactor's connection table. Turn off POLLIN on the listen socket once the
+ * table is full or the process runs out of fds, until a connection closes.
  * </p>
- * @param co the core object
- * @param so the state object
+ * @param reactor the reactor
  * @return the 0 on success, -1 and set errno on failure
  */
-static int poll_accept(struct core_object *co, struct state_object *so, struct pollfd *pollfds);
+static int poll_accept(struct poll_reactor *reactor);
 
 /**
- * get_conn_index
+ * poll_comm
  * <p>
- * Find an index in the file descriptor array where file descriptor == 0.
+ * Read from all connections for which POLLIN is set, and write to those for which
+ * POLLOUT is set. Remove all connections for which POLLHUP or POLLERR is set.
  * </p>
- * @param client_fds the file descriptor array
- * @return the first index where file descriptor == 0
+ * @param reactor the reactor
+ * @param num_ready the number of connections poll reported as ready
+ * @return 0 on success, -1 and set errno on failure
  */
-static int get_conn_index(const int *client_fds);
+static int poll_comm(struct poll_reactor *reactor, int num_ready);
 
 /**
- * poll_comm
+ * poll_wake
  * <p>
- * Read from all file descriptors in pollfds for which POLLIN is set.
- * Remove all file descriptors in pollfds for which POLLHUP is set.
+ * Call the wake handler on every connection posted to the reactor's wakeup, then poll each
+ * for what it waits on now.
  * </p>
- * @param co the core object
- * @param so the state object
- * @param pollfds the pollfds array
+ * @param reactor the reactor
  * @return 0 on success, -1 and set errno on failure
  */
-static int poll_comm(struct core_object *co, struct state_object *so, struct pollfd *pollfds);
+static int poll_wake(struct poll_reactor *reactor);
+
+/**
+ * poll_interest
+ * @param conn the connection
+ * @return the events to poll the connection for: none while parked, only one of POLLIN and POLLOUT otherwise
+ */
+static short poll_interest(const struct connection *conn);
 
 /**
  * poll_remove_connection
  * <p>
- * Close a connection and remove the fd from the list of pollfds.
+ * Close a connection and remove it from the connection table. The last pollfd
+ * moves into its place.
+ * </p>
+ * @param reactor the reactor
+ * @param pollfd_index the index of the connection's pollfd
+ */
+static void poll_remove_connection(struct poll_reactor *reactor, size_t pollfd_index);
+
+/**
+ * poll_connection_expired
+ * <p>
+ * Let the handler answer a connection whose deadline has passed, then close it. The accept
+ * retry of the reactor expires here too, and turns accepting back on.
  * </p>
- * @param co the core object
- * @param so the state object
- * @param pollfd the pollfd to close and clean
- * @param conn_index the index of the connection in the array of client_fds and client_addrs
- * @param listen_pollfd the listen pollfd
+ * @param timer the timer of the connection
+ * @param arg the reactor
  */
-static void
-poll_remove_connection(struct core_object *co, struct state_object *so, struct pollfd *pollfd, size_t conn_index,
-                       struct pollfd *listen_pollfd);
+static void poll_connection_expired(struct timer *timer, void *arg);
 
 /**
  * close_fd_report_undefined_error
@@ -111,119 +203,430 @@ poll_remove_connection(struct core_object *co, struct state_object *so, struct p
 static void close_fd_report_undefined_error(int fd, const char *err_msg);
 
 /**
- * The number of connections that can be queued on the listening socket.
+ * The most connections a reactor accepts per wakeup, so that a connection storm cannot
+ * starve the connections it already has. The rest stay queued for the next wakeup.
  */
-#define CONNECTION_QUEUE 100
+#define ACCEPT_BATCH 64
 
-struct state_object *setup_poll_state(struct memory_manager *mm)
+/**
+ * How long a reactor that ran out of fds waits before accepting again. Closing one of its own
+ * connections resumes accepting sooner, but a reactor may have none, or the fds may be taken
+ * elsewhere in the process.
+ */
+#define ACCEPT_RETRY_MS TIMER_WHEEL_TICK_MS
+
+/**
+ * The number of file descriptors kept back from RLIMIT_NOFILE for everything that is not a
+ * connection: the standard streams, log files and files being served.
+ */
+#define RESERVED_FDS 32
+
+struct state_object *setup_poll_state(struct memory_manager *mm, size_t num_reactors, size_t max_connections)
 {
     struct state_object *so;
-    
+    cpu_set_t           cpus;
+    size_t              num_cpus;
+    size_t              limit;
+
     so = (struct state_object *) Mmm_calloc(1, sizeof(struct state_object), mm);
     if (!so) // Depending on whether more is added to this state object, this if clause may go.
     {
         return NULL;
     }
-    
+
+    num_cpus = allowed_cpus(&cpus);
+    if (num_reactors == 0)
+    {
+        num_reactors = poll_cpu_count();
+    }
+
+    so->reactors = (struct poll_reactor *) Mmm_calloc(num_reactors, sizeof(struct poll_reactor), mm);
+    if (!so->reactors)
+    {
+        return NULL;
+    }
+    so->num_reactors = num_reactors;
+
+    limit = connection_limit(max_connections, num_reactors);
+    if (limit == 0)
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < num_reactors; ++i)
+    {
+        struct poll_reactor *reactor = &so->reactors[i];
+
+        reactor->so        = so;
+        reactor->index     = i;
+        reactor->cpu       = (num_reactors > 1 && num_cpus > 0) ? nth_cpu(&cpus, i % num_cpus) : -1;
+        reactor->listen_fd = -1;
+        reactor->wakeup.fd = -1;
+        // Any remainder goes to the first reactors; every reactor takes at least one connection.
+        reactor->max_connections = limit / num_reactors + ((i < limit % num_reactors) ? 1 : 0);
+        if (reactor->max_connections == 0)
+        {
+            reactor->max_connections = 1;
+        }
+    }
+
     return so;
 }
 
+size_t poll_cpu_count(void)
+{
+    cpu_set_t cpus;
+    size_t    num_cpus;
+    long      num_online;
+
+    num_cpus = allowed_cpus(&cpus);
+    if (num_cpus > 0)
+    {
+        return num_cpus;
+    }
+
+    num_online = sysconf(_SC_NPROCESSORS_ONLN);
+    return (num_online > 0) ? (size_t) num_online : 1;
+}
+
+static size_t allowed_cpus(cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), cpus) == -1)
+    {
+        return 0; // e.g. more CPUs than a cpu_set_t holds
+    }
+
+    return (size_t) CPU_COUNT(cpus);
+}
+
+static int nth_cpu(const cpu_set_t *cpus, size_t n)
+{
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET((size_t) cpu, cpus) && n-- == 0)
+        {
+            return cpu;
+        }
+    }
+
+    return -1;
+}
+
+static size_t connection_limit(size_t max_connections, size_t num_reactors)
+{
+    struct rlimit limit;
+    size_t        available;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+    {
+        return 0;
+    }
+
+    if (limit.rlim_cur != RLIM_INFINITY && (limit.rlim_max == RLIM_INFINITY || limit.rlim_cur < limit.rlim_max))
+    {
+        struct rlimit raised = {limit.rlim_max, limit.rlim_max};
+
+        // Keep the soft limit if it cannot be raised.
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0)
+        {
+            limit = raised;
+        }
+    }
+
+    if (limit.rlim_cur == RLIM_INFINITY)
+    {
+        return (max_connections > 0) ? max_connections : SIZE_MAX / 2;
+    }
+
+    available = (limit.rlim_cur > RESERVED_FDS + num_reactors) ? (size_t) limit.rlim_cur - RESERVED_FDS - num_reactors
+                                                               : 1;
+    if (max_connections == 0 || max_connections > available)
+    {
+        if (max_connections > available)
+        {
+            (void) fprintf(stderr, "Warning: max connections lowered from %zu to %zu by RLIMIT_NOFILE\n",
+                           max_connections, available);
+        }
+        max_connections = available;
+    }
+
+    return max_connections;
+}
+
 int open_poll_server_for_listen(struct core_object *co, struct state_object *so, struct sockaddr_in *listen_addr)
 {
-    int fd;
-    
-    fd = socket(PF_INET, SOCK_STREAM, 0); // NOLINT(android-cloexec-socket): SOCK_CLOEXEC dne
-    if (fd == -1)
+    for (size_t i = 0; i < so->num_reactors; ++i)
+    {
+        int fd;
+        int reuse = 1;
+
+        // Non-blocking, so accept can drain the queue, and so a prefork worker that loses the race
+        // for a connection to another worker does not block in accept
+        fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+        {
+            return -1;
+        }
+
+        // Every reactor binds the same address; the kernel balances new connections between them.
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1)
+        {
+            (void) close(fd);
+            return -1;
+        }
+
+        if (bind(fd, (struct sockaddr *) listen_addr, sizeof(struct sockaddr_in)) == -1)
+        {
+            (void) close(fd);
+            return -1;
+        }
+
+        if (listen_with_options(co, fd) == -1)
+        {
+            (void) close(fd);
+            return -1;
+        }
+
+        /* Only assign if absolute success. listen_fd == -1 can be used during teardown
+         * to determine whether there is a socket to close. */
+        so->reactors[i].co        = co;
+        so->reactors[i].listen_fd = fd;
+    }
+
+    return 0;
+}
+
+int run_poll_server(struct core_object *co)
+{
+    struct state_object *so = co->so;
+    struct sigaction    sa;
+    sigset_t            block_set;
+    sigset_t            old_set;
+    size_t              num_started;
+    int                 ret_val;
+
+    /* Every thread started from here on, reactor 0 included, runs with the shutdown signals
+     * blocked. A reactor lets them in only inside ppoll(), and SIGINT and SIGTERM only on
+     * reactor 0, so they land there; the log threads never take them. */
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGTERM);
+    sigaddset(&block_set, REACTOR_WAKE_SIGNAL);
+    if (pthread_sigmask(SIG_BLOCK, &block_set, &old_set) != 0)
     {
         return -1;
     }
-    
-    if (bind(fd, (struct sockaddr *) listen_addr, sizeof(struct sockaddr_in)) == -1)
+
+    // Started here rather than in the core, so a prefork worker gets a writer thread of its own.
+    if (access_log_start(co->access_log, co->log_file) == -1 || trace_start(co->trace) == -1 ||
+        setup_signal_handler(&sa, SIGINT) == -1 || setup_signal_handler(&sa, SIGTERM) == -1 ||
+        setup_signal_handler(&sa, REACTOR_WAKE_SIGNAL) == -1)
+    {
+        (void) pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+        return -1;
+    }
+
+    ret_val = 0;
+    for (num_started = 1; num_started < so->num_reactors; ++num_started)
+    {
+        int status = pthread_create(&so->reactors[num_started].thread, NULL, reactor_thread,
+                                    &so->reactors[num_started]);
+        if (status != 0)
+        {
+            errno   = status;
+            ret_val = -1;
+            break;
+        }
+    }
+
+    if (ret_val == 0)
+    {
+        ret_val = run_reactor(&so->reactors[0]);
+    }
+
+    // Whatever stopped reactor 0 stops the others.
+    GOGO_POLL = 0;
+    for (size_t i = 1; i < num_started; ++i)
+    {
+        (void) pthread_kill(so->reactors[i].thread, REACTOR_WAKE_SIGNAL);
+    }
+    for (size_t i = 1; i < num_started; ++i)
+    {
+        (void) pthread_join(so->reactors[i].thread, NULL);
+        if (so->reactors[i].status == -1)
+        {
+            ret_val = -1;
+        }
+    }
+    (void) pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    for (size_t i = 0; i < so->num_reactors; ++i)
+    {
+        (void) fprintf(stdout,
+                       "Reactor %zu (cpu %d): %zu connections accepted, %zu closed, %zu open; "
+                       "%zu accept errors, %zu full accept batches\n",
+                       i, so->reactors[i].cpu, so->reactors[i].total_connections, so->reactors[i].closed_connections,
+                       connection_table_size(&so->reactors[i].connections), so->reactors[i].accept_errors,
+                       so->reactors[i].accept_budget_spent);
+    }
+
+    return ret_val;
+}
+
+static void *reactor_thread(void *arg)
+{
+    struct poll_reactor *reactor = (struct poll_reactor *) arg;
+
+    reactor->status = run_reactor(reactor);
+    if (reactor->status == -1)
+    {
+        (void) fprintf(stderr, "Error: reactor %zu stopped: %s\n", reactor->index, strerror(errno));
+
+        // Take the whole server down, the same way a failure on reactor 0 does.
+        GOGO_POLL = 0;
+        (void) kill(getpid(), SIGTERM);
+    }
+
+    return NULL;
+}
+
+static int run_reactor(struct poll_reactor *reactor)
+{
+    // Unpinned, the reactor still works; it only loses its cache locality
+    if (pin_to_cpu(reactor) == -1)
+    {
+        (void) fprintf(stderr, "Warning: reactor %zu runs unpinned, it cannot be pinned to cpu %d: %s\n",
+                       reactor->index, reactor->cpu, strerror(errno));
+        reactor->cpu = -1;
+    }
+
+    if (wakeup_init(&reactor->wakeup) == -1)
     {
-        (void) close(fd);
         return -1;
     }
-    
-    if (listen(fd, CONNECTION_QUEUE) == -1)
+
+    // Allocated after pinning, so the table lands in memory local to the reactor's CPU.
+    if (connection_table_init(&reactor->connections, reactor->listen_fd, reactor->wakeup.fd,
+                              reactor->max_connections) == -1)
     {
-        (void) close(fd);
         return -1;
     }
-    
-    /* Only assign if absolute success. listen_fd == 0 can be used during teardown
-     * to determine whether there is a socket to close. */
-    so->listen_fd = fd;
-    
-    return 0;
+
+    reactor->now_ms = monotonic_ms();
+    timer_wheel_init(&reactor->timers, reactor->now_ms);
+
+    reactor->log_ring = access_log_register(reactor->co->access_log);
+    if (!reactor->log_ring)
+    {
+        (void) fprintf(stderr, "Reactor %zu runs without an access log: %s\n", reactor->index, strerror(errno));
+    }
+
+    return execute_poll(reactor);
 }
 
-int run_poll_server(struct core_object *co)
+static int pin_to_cpu(const struct poll_reactor *reactor)
 {
-    struct pollfd pollfds[MAX_CONNECTIONS + 1]; // +1 for the listen socket.
-    struct pollfd listen_pollfd;
-    size_t        pollfds_len;
-    
-    // Set up the listen socket pollfd
-    listen_pollfd.fd      = co->so->listen_fd;
-    listen_pollfd.events  = POLLIN;
-    listen_pollfd.revents = 0;
-    pollfds_len = sizeof(pollfds) / sizeof(*pollfds);
-    
-    memset(pollfds, -1, sizeof(pollfds));
-    
-    pollfds[0] = listen_pollfd;
-    
-    // Set up the headers for the log file.
-    (void) fprintf(co->log_file,
-                   "connection index,file descriptor,ipv4 address,port number,bytes read,start timestamp,end timestamp,elapsed time (s)\n");
-    
-    if (execute_poll(co, pollfds, pollfds_len) == -1)
+    cpu_set_t cpus;
+    int       status;
+
+    if (reactor->cpu < 0)
     {
+        return 0;
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET((size_t) reactor->cpu, &cpus);
+    status = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (status != 0)
+    {
+        errno = status;
         return -1;
     }
-    
+
     return 0;
 }
 
-static int execute_poll(struct core_object *co, struct pollfd *pollfds, nfds_t nfds)
+static int execute_poll(struct poll_reactor *reactor)
 {
-    int              poll_status;
-    struct sigaction sigint;
-    
-    if (setup_signal_handler(&sigint, SIGINT) == -1)
+    struct connection_table *table = &reactor->connections;
+    sigset_t                wait_mask;
+    struct timespec         wait_time;
+    int                     timeout;
+    int                     poll_status;
+    bool                    accept_ready;
+    bool                    wake_ready;
+
+    // The signals ppoll lets in: the wake signal, and on reactor 0 SIGINT and SIGTERM as well
+    if (pthread_sigmask(SIG_BLOCK, NULL, &wait_mask) != 0)
     {
         return -1;
     }
-    if (setup_signal_handler(&sigint, SIGTERM) == -1)
+    sigdelset(&wait_mask, REACTOR_WAKE_SIGNAL);
+    if (reactor->index == 0)
     {
-        return -1;
+        sigdelset(&wait_mask, SIGINT);
+        sigdelset(&wait_mask, SIGTERM);
     }
-    
+
     while (GOGO_POLL)
     {
-        poll_status = poll(pollfds, nfds, -1);
+        // The table may have grown since the last iteration, so always pass the current array.
+        // Without a pending deadline there is nothing to do until a socket is ready.
+        timeout = timer_wheel_timeout(&reactor->timers, reactor->now_ms);
+        wait_time.tv_sec  = timeout / MS_PER_SECOND;
+        wait_time.tv_nsec = (long) (timeout % MS_PER_SECOND) * NS_PER_MS;
+        TRACE_BEGIN("poll", (int32_t) table->nfds);
+        poll_status = ppoll(table->pollfds, table->nfds, (timeout == -1) ? NULL : &wait_time, &wait_mask);
+        TRACE_END("poll", poll_status);
         if (poll_status == -1)
         {
             return (errno == EINTR) ? 0 : -1;
         }
-        
-        // If action on the listen socket.
-        if ((*pollfds).revents == POLLIN)
+        reactor->now_ms = monotonic_ms();
+
+        accept_ready = table->pollfds[0].revents == POLLIN;
+        if (accept_ready)
+        {
+            --poll_status;
+        }
+        wake_ready = (table->pollfds[1].revents & POLLIN) != 0;
+        if (wake_ready)
+        {
+            --poll_status;
+        }
+
+        // Connections first, so slots freed by disconnects are available to accept.
+        if (poll_status > 0)
         {
-            if (poll_accept(co, co->so, pollfds) == -1)
+            TRACE_BEGIN("poll_comm", poll_status);
+            if (poll_comm(reactor, poll_status) == -1)
             {
                 return -1;
             }
-        } else
+            TRACE_END("poll_comm", poll_status);
+        }
+
+        if (wake_ready && poll_wake(reactor) == -1)
         {
-            printf("Accepted new connection\n");
-            if (poll_comm(co, co->so, pollfds) == -1)
+            return -1;
+        }
+
+        // If action on the listen socket.
+        if (accept_ready)
+        {
+            TRACE_BEGIN("poll_accept", reactor->listen_fd);
+            if (poll_accept(reactor) == -1)
             {
                 return -1;
             }
+            TRACE_END("poll_accept", reactor->listen_fd);
         }
+
+        // After the events, so a connection that just became active has had its deadline moved.
+        timer_wheel_advance(&reactor->timers, reactor->now_ms, poll_connection_expired, reactor);
     }
-    
+
     return 0;
 }
 
@@ -249,112 +652,260 @@ static void end_gogo_handler(int signal)
 
 #pragma GCC diagnostic pop
 
-static int poll_accept(struct core_object *co, struct state_object *so, struct pollfd *pollfds)
+static int poll_accept(struct poll_reactor *reactor)
 {
-    int       new_cfd;
-    size_t    conn_index;
-    socklen_t sockaddr_size;
-    
-    conn_index    = get_conn_index(so->client_fd);
-    sockaddr_size = sizeof(struct sockaddr_in);
-    
-    new_cfd = accept(so->listen_fd, (struct sockaddr *) &so->client_addr[conn_index], &sockaddr_size);
-    if (new_cfd == -1)
+    struct connection_table *table = &reactor->connections;
+    int                     new_cfd;
+    socklen_t               sockaddr_size;
+    struct sockaddr_in      client_addr;
+    struct connection       *conn;
+
+    for (size_t accepted = 0; accepted < ACCEPT_BATCH; ++accepted)
     {
-        return -1;
+        if (connection_table_is_full(table))
+        {
+            table->pollfds[0].events = 0; // Turn off POLLIN on the listening socket when max connections reached.
+            return 0;
+        }
+
+        // Handlers never block on a client socket.
+        sockaddr_size = sizeof(struct sockaddr_in);
+        new_cfd = accept4(reactor->listen_fd, (struct sockaddr *) &client_addr, &sockaddr_size,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_cfd == -1)
+        {
+            switch (errno)
+            {
+                case EAGAIN: // Accept queue drained, or another prefork worker took the connection.
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                {
+                    errno = 0;
+                    return 0;
+                }
+                case ECONNABORTED: // The client gave up while queued.
+                case EINTR:
+                {
+                    ++reactor->accept_errors;
+                    continue;
+                }
+                case EMFILE: // Out of fds; leave the rest queued until a connection closes or the retry.
+                case ENFILE:
+                {
+                    ++reactor->accept_errors;
+                    table->pollfds[0].events = 0;
+                    timer_wheel_add(&reactor->timers, &reactor->accept_retry, reactor->now_ms + ACCEPT_RETRY_MS);
+                    return 0;
+                }
+                default:
+                {
+                    return -1;
+                }
+            }
+        }
+
+        conn = connection_table_add(table, new_cfd); // Only save in the table if valid.
+        if (!conn)
+        {
+            close_fd_report_undefined_error(new_cfd, "state of client socket is undefined.");
+            return -1;
+        }
+        conn->addr   = client_addr;
+        conn->wakeup = reactor->co->wake_handler ? &reactor->wakeup : NULL;
+        connection_deadline_start(&reactor->timers, reactor->co, conn, reactor->now_ms);
+        access_log_accept(reactor->co->access_log, conn);
+        ++reactor->total_connections;
     }
-    
-    so->client_fd[conn_index] = new_cfd; // Only save in array if valid.
-    pollfds[conn_index + 1].fd     = new_cfd; // Plus one because listen_fd.
-    pollfds[conn_index + 1].events = POLLIN;
-    ++so->num_connections;
-    
-    if (so->num_connections >= MAX_CONNECTIONS)
-    {
-        pollfds->events = 0; // Turn off POLLIN on the listening socket when max connections reached.
-    }
-    
-    // NOLINTNEXTLINE(concurrency-mt-unsafe): No threads here
-    (void) fprintf(stdout, "Client connected from %s:%d\n", inet_ntoa(so->client_addr[conn_index].sin_addr),
-                   ntohs(so->client_addr[conn_index].sin_port));
-    
+
+    // Poll reports the listen socket again right away if anything is still queued.
+    ++reactor->accept_budget_spent;
     return 0;
 }
 
-static int get_conn_index(const int *client_fds)
+static int poll_comm(struct poll_reactor *reactor, int num_ready)
 {
-    int conn_index = 0;
-    
-    for (int i = 0; i < MAX_CONNECTIONS; ++i)
+    struct core_object      *co   = reactor->co;
+    struct connection_table *table = &reactor->connections;
+
+    /* Walk from the end: a removal moves the last pollfd into the hole, and that pollfd has
+     * already been visited. Stop as soon as every ready connection has been handled. */
+    for (size_t pollfd_index = table->nfds - 1; pollfd_index >= CONNECTION_TABLE_FIRST && num_ready > 0; --pollfd_index)
     {
-        if (*(client_fds + i) == -1)
+        struct pollfd *pollfd = &table->pollfds[pollfd_index];
+        bool          remove_connection = false;
+
+        if (pollfd->revents == 0)
         {
-            conn_index = i;
-            break;
+            continue;
         }
-    }
-    return conn_index;
-}
+        --num_ready;
 
-static int poll_comm(struct core_object *co, struct state_object *so, struct pollfd *pollfds)
-{
-    struct pollfd *pollfd;
-    
-    for (size_t fd_num = 1; fd_num <= MAX_CONNECTIONS; ++fd_num)
-    {
-        pollfd = pollfds + fd_num;
-        bool remove_connection = false;
         if (pollfd->revents == POLLIN)
         {
-            const enum pollin_handle_result pollin_result = co->pollin_handler(co, so, pollfd->fd);
+            TRACE_BEGIN("pollin_handler", pollfd->fd);
+            const enum pollin_handle_result pollin_result = co->pollin_handler(co, reactor->so,
+                                                                                connection_table_get(table, pollfd_index));
+            TRACE_END("pollin_handler", pollfd->fd);
             if (pollin_result == POLLIN_HANDLE_RESULT_FATAL) {
                 return -1;
             }
             remove_connection = pollin_result == POLLIN_HANDLE_RESULT_EOF;
+        } else if (pollfd->revents == POLLOUT)
+        {
+            TRACE_BEGIN("pollout_handler", pollfd->fd);
+            const enum pollin_handle_result pollout_result = co->pollout_handler(co, reactor->so,
+                                                                                  connection_table_get(table, pollfd_index));
+            TRACE_END("pollout_handler", pollfd->fd);
+            if (pollout_result == POLLIN_HANDLE_RESULT_FATAL) {
+                return -1;
+            }
+            remove_connection = pollout_result == POLLIN_HANDLE_RESULT_EOF;
         }
         if (remove_connection || (pollfd->revents & POLLHUP) || (pollfd->revents & POLLERR))
             // Client has closed other end of socket.
             // On MacOS, POLLHUP will be set; on Linux, POLLERR will be set.
         {
-            (poll_remove_connection(co, so, pollfd, fd_num - 1, pollfds));
+            poll_remove_connection(reactor, pollfd_index);
+        } else
+        {
+            struct connection *conn = connection_table_get(table, pollfd_index);
+
+            pollfd->events  = poll_interest(conn);
+            pollfd->revents = 0;
+            connection_deadline_update(&reactor->timers, co, conn, reactor->now_ms);
+        }
+    }
+
+    return 0;
+}
+
+static int poll_wake(struct poll_reactor *reactor)
+{
+    struct core_object      *co    = reactor->co;
+    struct connection_table *table = &reactor->connections;
+    struct connection       *conn;
+
+    // Cleared first, so a post made while the connections are handled is seen on the next poll
+    wakeup_clear(&reactor->wakeup);
+    while ((conn = wakeup_take(&reactor->wakeup)) != NULL)
+    {
+        // The connection is the first member of its record
+        const size_t              pollfd_index = ((struct poll_connection *) (void *) conn)->pollfd_index;
+        enum pollin_handle_result wake_result;
+
+        TRACE_BEGIN("wake_handler", conn->fd);
+        wake_result = co->wake_handler(co, reactor->so, conn);
+        TRACE_END("wake_handler", conn->fd);
+        if (wake_result == POLLIN_HANDLE_RESULT_FATAL)
+        {
+            return -1;
+        }
+        if (wake_result == POLLIN_HANDLE_RESULT_EOF)
+        {
+            poll_remove_connection(reactor, pollfd_index);
+        } else
+        {
+            table->pollfds[pollfd_index].events = poll_interest(conn);
+            connection_deadline_update(&reactor->timers, co, conn, reactor->now_ms);
         }
-        pollfd->revents = 0;
     }
-    
+
     return 0;
 }
 
-static void
-poll_remove_connection(struct core_object *co, struct state_object *so, struct pollfd *pollfd, size_t conn_index,
-                       struct pollfd *listen_pollfd)
+static short poll_interest(const struct connection *conn)
 {
-    
-    // close the fd
-    close_fd_report_undefined_error(pollfd->fd, "state of client socket is undefined.");
-    
-    // NOLINTNEXTLINE(concurrency-mt-unsafe): No threads here
-    (void) fprintf(stdout, "Client from %s:%d disconnected\n", inet_ntoa(so->client_addr[conn_index].sin_addr),
-                   ntohs(so->client_addr[conn_index].sin_port));
-    
-    // zero the pollfd struct, the fd in the state object, and the client_addr in the state object.
-    memset(pollfd, -1, sizeof(struct pollfd));
-    memset(&so->client_addr[conn_index], 0, sizeof(struct sockaddr_in));
-    so->client_fd[conn_index] = -1;
-    --so->num_connections;
-    
-    if (listen_pollfd->events != POLLIN && so->num_connections < MAX_CONNECTIONS)
-    {
-        listen_pollfd->events = POLLIN; // Turn on POLLIN on the listening socket when less than max connections.
+    if (conn->parked)
+    {
+        return 0; // POLLHUP and POLLERR are reported all the same
     }
+
+    // Only one of the two at a time: a connection with output queued reads no more requests
+    return conn->want_write ? POLLOUT : POLLIN;
+}
+
+static void poll_remove_connection(struct poll_reactor *reactor, size_t pollfd_index)
+{
+    struct connection_table *table = &reactor->connections;
+    struct connection       *conn  = connection_table_get(table, pollfd_index);
+
+    // Let the handler release its per-connection state, then close the fd
+    if (reactor->co->close_handler)
+    {
+        reactor->co->close_handler(reactor->co, conn);
+    }
+    if (conn->wakeup)
+    {
+        wakeup_cancel(conn->wakeup, conn);
+    }
+    close_fd_report_undefined_error(conn->fd, "state of client socket is undefined.");
+    (void) access_log_close(reactor->log_ring, conn);
+    timer_wheel_cancel(&reactor->timers, &conn->timer);
+    ++reactor->closed_connections;
+
+    connection_table_remove(table, pollfd_index);
+
+    if (table->pollfds[0].events != POLLIN && !connection_table_is_full(table))
+    {
+        table->pollfds[0].events = POLLIN; // Turn on POLLIN on the listening socket when less than max connections.
+    }
+}
+
+static void poll_connection_expired(struct timer *timer, void *arg)
+{
+    struct poll_reactor    *reactor = (struct poll_reactor *) arg;
+    struct poll_connection *record;
+
+    if (timer == &reactor->accept_retry)
+    {
+        if (!connection_table_is_full(&reactor->connections))
+        {
+            reactor->connections.pollfds[0].events = POLLIN;
+        }
+        return;
+    }
+
+    // The timer is embedded in the connection, which is the first member of its record
+    record = (struct poll_connection *) (void *) ((char *) timer - offsetof(struct connection, timer));
+    if (reactor->co->timeout_handler)
+    {
+        reactor->co->timeout_handler(reactor->co, &record->conn);
+    }
+    poll_remove_connection(reactor, record->pollfd_index);
 }
 
 void destroy_poll_state(struct core_object *co, struct state_object *so)
 {
-    close_fd_report_undefined_error(so->listen_fd, "state of listen socket is undefined.");
-    
-    for (size_t sfd_num = 0; sfd_num < MAX_CONNECTIONS; ++sfd_num)
+    for (size_t i = 0; i < so->num_reactors; ++i)
     {
-        close_fd_report_undefined_error(*(so->client_fd + sfd_num), "state of client socket is undefined.");
+        struct poll_reactor *reactor = &so->reactors[i];
+
+        if (reactor->listen_fd != -1)
+        {
+            close_fd_report_undefined_error(reactor->listen_fd, "state of listen socket is undefined.");
+        }
+
+        for (size_t pollfd_index = CONNECTION_TABLE_FIRST; pollfd_index < reactor->connections.nfds; ++pollfd_index)
+        {
+            struct connection *conn = connection_table_get(&reactor->connections, pollfd_index);
+
+            if (co->close_handler)
+            {
+                co->close_handler(co, conn);
+            }
+            close_fd_report_undefined_error(conn->fd, "state of client socket is undefined.");
+            // The reactor threads are gone, so the main thread may push to their rings
+            (void) access_log_close(reactor->log_ring, conn);
+        }
+        connection_table_destroy(&reactor->connections);
+
+        // After the close handler, which stops other threads from posting the connections
+        if (reactor->wakeup.fd != -1)
+        {
+            wakeup_destroy(&reactor->wakeup);
+            reactor->wakeup.fd = -1;
+        }
     }
 }
 
@@ -371,7 +922,7 @@ static void close_fd_report_undefined_error(int fd, const char *err_msg)
             }
             default:
             {
-                // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                // NOLINTNEXTLINE(concurrency-mt-unsafe) : strerror is only reached on teardown paths
                 (void) fprintf(stderr, "Error: %s; %s\n", strerror(errno), err_msg);
             }
         }
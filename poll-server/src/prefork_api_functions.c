@@ -0,0 +1,45 @@
+#include <core-lib/api_functions.h>
+#include "poll_server.h"
+#include "prefork_server.h"
+
+#include <stdio.h>
+
+int initialize_server(struct core_object *co)
+{
+    printf("INIT PREFORK SERVER\n");
+    
+    co->so = setup_prefork_state(co->mm, co->num_workers, co->max_connections);
+    if (!co->so)
+    {
+        return ERROR;
+    }
+
+    // The listening socket is opened once, before fork, and inherited by every worker.
+    if (open_poll_server_for_listen(co, co->so, &co->listen_addr) == -1)
+    {
+        return ERROR;
+    }
+    
+    return RUN_SERVER;
+}
+
+int run_server(struct core_object *co)
+{
+    printf("RUN PREFORK SERVER\n");
+    
+    if (run_prefork_server(co) == -1)
+    {
+        return ERROR;
+    }
+    
+    return CLOSE_SERVER;
+}
+
+int close_server(struct core_object *co)
+{
+    printf(is_prefork_worker() ? "CLOSE PREFORK WORKER\n" : "CLOSE PREFORK SERVER\n");
+
+    destroy_prefork_state(co, co->so);
+    
+    return EXIT;
+}
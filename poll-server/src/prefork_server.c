@@ -0,0 +1,344 @@
+#include "prefork_server.h"
+#include "poll_server.h"
+#include "objects.h"
+#include <core-lib/objects.h>
+#include <core-lib/util.h>
+
+#include <errno.h>
+#include <mem_manager/manager.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * A worker that exits sooner than this after being spawned is respawned only after this delay,
+ * so a worker that crashes on startup does not turn the supervisor into a fork loop.
+ */
+#define RESPAWN_BACKOFF_SECONDS 1
+
+/**
+ * prefork_worker
+ * <p>
+ * Supervisor-side record of a worker process. pid is 0 while the worker is not running.
+ * </p>
+ */
+struct prefork_worker {
+    pid_t pid;
+    time_t started;
+    size_t restarts;
+};
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables): must be non-const
+/**
+ * Whether the supervisor should keep respawning workers.
+ */
+volatile int GOGO_PREFORK = 1;
+
+/**
+ * The poll loop flag, set from the prefork signal handler so that a signal that reaches a
+ * worker before the poll loop has installed its own handlers still stops it.
+ */
+extern volatile int GOGO_POLL;
+
+/**
+ * The worker table, owned by the supervisor. Workers only use their own index.
+ */
+static struct prefork_worker *workers;
+static size_t num_workers;
+static size_t worker_index;
+static bool is_worker;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+/**
+ * setup_signal_handler
+ * @param sa sigaction struct to fill
+ * @param signal the signal to handle
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int setup_signal_handler(struct sigaction *sa, int signal);
+
+/**
+ * end_gogo_handler
+ * <p>
+ * Handler for signal. Set the running loop conditionals to 0.
+ * </p>
+ * @param signal the signal received
+ */
+static void end_gogo_handler(int signal);
+
+/**
+ * spawn_worker
+ * <p>
+ * Fork a worker. In the supervisor, record its pid. In the worker, set is_worker and open
+ * the worker's own log file.
+ * </p>
+ * @param co the core object
+ * @param index the index of the worker in the worker table
+ * @return 0 in the supervisor on success, 1 in the worker, -1 and set errno on failure
+ */
+static int spawn_worker(struct core_object *co, size_t index);
+
+/**
+ * supervise_workers
+ * <p>
+ * Wait for workers to exit and respawn them until the supervisor is signalled to stop.
+ * </p>
+ * @param co the core object
+ * @return 0 on a clean stop, 1 in a respawned worker, -1 and set errno on failure
+ */
+static int supervise_workers(struct core_object *co);
+
+/**
+ * stop_workers
+ * <p>
+ * Forward SIGTERM to every running worker and reap them all.
+ * </p>
+ */
+static void stop_workers(void);
+
+/**
+ * find_worker
+ * <p>
+ * Find the worker with a given pid.
+ * </p>
+ * @param pid the pid
+ * @return the worker's index, or num_workers if it is not in the table
+ */
+static size_t find_worker(pid_t pid);
+
+struct state_object *setup_prefork_state(struct memory_manager *mm, size_t count, size_t max_connections)
+{
+    struct state_object *so;
+
+    if (count == 0)
+    {
+        count = poll_cpu_count();
+    }
+
+    // Each worker is a single-threaded process with one reactor and its share of the connections.
+    so = setup_poll_state(mm, 1, (max_connections > 0) ? (max_connections + count - 1) / count : 0);
+    if (!so)
+    {
+        return NULL;
+    }
+
+    workers = (struct prefork_worker *) Mmm_calloc(count, sizeof(struct prefork_worker), mm);
+    if (!workers)
+    {
+        return NULL;
+    }
+    num_workers = count;
+
+    return so;
+}
+
+bool is_prefork_worker(void)
+{
+    return is_worker;
+}
+
+int run_prefork_server(struct core_object *co)
+{
+    struct sigaction sa;
+    int              status;
+
+    if (setup_signal_handler(&sa, SIGINT) == -1 || setup_signal_handler(&sa, SIGTERM) == -1)
+    {
+        return -1;
+    }
+
+    status = 0;
+    for (size_t i = 0; i < num_workers && status == 0; ++i)
+    {
+        status = spawn_worker(co, i);
+    }
+
+    if (status == 0)
+    {
+        status = supervise_workers(co);
+    }
+
+    if (status == 1) // In a worker.
+    {
+        (void) fprintf(stdout, "Worker %zu (pid %d) started\n", worker_index, (int) getpid());
+        return run_poll_server(co);
+    }
+
+    stop_workers();
+
+    return status;
+}
+
+static int setup_signal_handler(struct sigaction *sa, int signal)
+{
+    sigemptyset(&sa->sa_mask);
+    sa->sa_flags   = 0; // No SA_RESTART: the supervisor relies on waitpid returning EINTR.
+    sa->sa_handler = end_gogo_handler;
+    if (sigaction(signal, sa, 0) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+static void end_gogo_handler(int signal)
+{
+    GOGO_PREFORK = 0;
+    GOGO_POLL    = 0;
+}
+
+#pragma GCC diagnostic pop
+
+static int spawn_worker(struct core_object *co, size_t index)
+{
+    pid_t pid;
+
+    // Anything still buffered would otherwise be written once by every process.
+    (void) fflush(stdout);
+    (void) fflush(co->log_file);
+
+    pid = fork();
+    if (pid == -1)
+    {
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        is_worker    = true;
+        worker_index = index;
+        if (open_worker_log(co, index, workers[index].restarts == 0) == -1)
+        {
+            _exit(EXIT_FAILURE);
+        }
+        return 1;
+    }
+
+    workers[index].pid     = pid;
+    workers[index].started = time(NULL);
+
+    return 0;
+}
+
+static int supervise_workers(struct core_object *co)
+{
+    pid_t  pid;
+    int    wstatus;
+    size_t index;
+
+    while (GOGO_PREFORK)
+    {
+        pid = waitpid(-1, &wstatus, 0);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        index = find_worker(pid);
+        if (index == num_workers)
+        {
+            continue;
+        }
+        workers[index].pid = 0;
+
+        if (WIFSIGNALED(wstatus))
+        {
+            (void) fprintf(stderr, "Worker %zu (pid %d) killed by signal %d\n", index, (int) pid, WTERMSIG(wstatus));
+        } else
+        {
+            (void) fprintf(stderr, "Worker %zu (pid %d) exited with status %d\n", index, (int) pid,
+                           WEXITSTATUS(wstatus));
+        }
+
+        if (!GOGO_PREFORK)
+        {
+            break;
+        }
+
+        if (time(NULL) - workers[index].started < RESPAWN_BACKOFF_SECONDS)
+        {
+            (void) sleep(RESPAWN_BACKOFF_SECONDS);
+            if (!GOGO_PREFORK)
+            {
+                break;
+            }
+        }
+
+        ++workers[index].restarts;
+        switch (spawn_worker(co, index))
+        {
+            case 0:
+            {
+                break;
+            }
+            case 1:
+            {
+                return 1;
+            }
+            default:
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void stop_workers(void)
+{
+    for (size_t i = 0; i < num_workers; ++i)
+    {
+        if (workers[i].pid > 0)
+        {
+            (void) kill(workers[i].pid, SIGTERM);
+        }
+    }
+
+    for (size_t i = 0; i < num_workers; ++i)
+    {
+        while (workers[i].pid > 0)
+        {
+            if (waitpid(workers[i].pid, NULL, 0) != -1 || errno != EINTR)
+            {
+                workers[i].pid = 0;
+            }
+        }
+    }
+}
+
+static size_t find_worker(pid_t pid)
+{
+    size_t index;
+
+    for (index = 0; index < num_workers; ++index)
+    {
+        if (workers[index].pid == pid)
+        {
+            break;
+        }
+    }
+
+    return index;
+}
+
+void destroy_prefork_state(struct core_object *co, struct state_object *so)
+{
+    if (!is_worker)
+    {
+        stop_workers();
+    }
+
+    destroy_poll_state(co, so);
+}
@@ -0,0 +1,37 @@
+#ifndef SCALABLE_SERVER_URING_OBJECTS_H
+#define SCALABLE_SERVER_URING_OBJECTS_H
+
+#include <liburing.h>
+#include <core-lib/objects.h>
+#include <core-lib/timer_wheel.h>
+#include <core-lib/wakeup.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+
+/**
+ * The number of entries in the submission queue.
+ */
+#define URING_QUEUE_DEPTH 4096
+
+/**
+ * The number of fds tracked when RLIMIT_NOFILE is unlimited.
+ */
+#define URING_DEFAULT_MAX_FDS 65536
+
+struct access_log_ring;
+
+struct state_object {
+    struct io_uring ring;
+    bool ring_initialized;
+    int listen_fd;
+    struct connection *connections; // indexed by fd, fd == -1 marks a free slot
+    size_t max_fds;
+    size_t num_connections;
+    uint64_t now_ms; // monotonic milliseconds at the last wakeup
+    struct timer_wheel timers; // the deadlines of the connections
+    struct timer accept_retry; // pending while no accept is queued after one failed
+    struct wakeup wakeup; // where other threads post parked connections; fd is -1 until set up
+    struct access_log_ring *log_ring; // NULL when the server does not log
+};
+
+#endif //SCALABLE_SERVER_URING_OBJECTS_H
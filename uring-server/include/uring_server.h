@@ -0,0 +1,63 @@
+#ifndef SCALABLE_SERVER_URING_SERVER_H
+#define SCALABLE_SERVER_URING_SERVER_H
+
+#include "objects.h"
+#include <core-lib/objects.h>
+
+/*
+ * An io_uring readiness backend. io_uring replaces epoll for the notifications only: a multishot
+ * accept takes the new connections and one-shot poll requests report when a client socket is
+ * readable or writable. The handlers still recv, sendmsg and sendfile on the socket themselves,
+ * one system call each, exactly as under the poll and epoll backends; receives into provided
+ * buffer rings and linked send and close requests would need a completion-based handler contract.
+ */
+
+/**
+ * setup_uring_state
+ * <p>
+ * Set up the state object for the io_uring server and create the ring. Add the state
+ * object to the memory manager.
+ * </p>
+ * @param mm the memory manager to which the state object will be added
+ * @return the state object, or NULL and set errno on failure. errno is ENOSYS when
+ * the kernel does not support io_uring.
+ */
+struct state_object *setup_uring_state(struct memory_manager *mm);
+
+/**
+ * open_uring_server_for_listen
+ * <p>
+ * Create a socket, bind, and begin listening for connections. Queue a multishot
+ * accept on the listening socket, and fail with EINVAL, after saying so, when the
+ * kernel does not support it.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param listen_addr the address on which to listen
+ * @return 0 on success, -1 and set errno on failure
+ */
+int open_uring_server_for_listen(struct core_object *co, struct state_object *so, struct sockaddr_in *listen_addr);
+
+/**
+ * run_uring_server
+ * <p>
+ * Run the io_uring server. Submit the accept and poll requests queued by the last batch and
+ * wait for completions with a single system call per loop iteration, then handle the whole
+ * batch. The handlers' own reads and writes are not batched.
+ * </p>
+ * @param co the core object
+ * @return 0 on success, -1 and set errno on failure
+ */
+int run_uring_server(struct core_object *co);
+
+/**
+ * destroy_uring_state
+ * <p>
+ * Close all connections and the listen socket, and tear down the ring.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ */
+void destroy_uring_state(struct core_object *co, struct state_object *so);
+
+#endif //SCALABLE_SERVER_URING_SERVER_H
@@ -0,0 +1,47 @@
+#include <core-lib/api_functions.h>
+#include "uring_server.h"
+
+#include <stdio.h>
+
+int initialize_server(struct core_object *co)
+{
+    printf("INIT URING SERVER\n");
+    
+    co->so = setup_uring_state(co->mm);
+    if (!co->so)
+    {
+        return ERROR;
+    }
+
+    if (open_uring_server_for_listen(co, co->so, &co->listen_addr) == -1)
+    {
+        return ERROR;
+    }
+    
+    return RUN_SERVER;
+}
+
+int run_server(struct core_object *co)
+{
+    printf("RUN URING SERVER\n");
+    
+    if (run_uring_server(co) == -1)
+    {
+        return ERROR;
+    }
+    
+    return CLOSE_SERVER;
+}
+
+int close_server(struct core_object *co)
+{
+    printf("CLOSE URING SERVER\n");
+
+    // The state object is missing when the ring could not be created.
+    if (co->so)
+    {
+        destroy_uring_state(co, co->so);
+    }
+    
+    return EXIT;
+}
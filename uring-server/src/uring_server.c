@@ -0,0 +1,749 @@
+#include "uring_server.h"
+#include "objects.h"
+#include <core-lib/access_log.h>
+#include <core-lib/trace.h>
+#include <core-lib/objects.h>
+#include <core-lib/util.h>
+#include <core-lib/wakeup.h>
+
+#include <stdbool.h>
+#include <errno.h>
+#include <liburing.h>
+#include <mem_manager/manager.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables): must be non-const
+/**
+ * Whether the io_uring loop should be running.
+ */
+volatile int GOGO_URING = 1;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+/**
+ * The operation a completion belongs to. Stored in the low byte of the user data,
+ * the fd is stored in the bits above it.
+ */
+enum uring_op {
+    URING_OP_ACCEPT = 1,
+    URING_OP_POLL,
+    URING_OP_WAKE,
+};
+
+#define MS_PER_SECOND 1000
+#define NS_PER_MS 1000000
+
+/**
+ * How long the server waits to queue another accept after one failed and ended the multishot
+ * request. Queued at once, it would fail again on the next submit for as long as the fds are gone.
+ */
+#define ACCEPT_RETRY_MS TIMER_WHEEL_TICK_MS
+
+#define URING_OP_BITS 8
+#define URING_OP_MASK ((1U << URING_OP_BITS) - 1)
+
+/**
+ * execute_uring
+ * <p>
+ * Submit queued requests and reap completions until the loop is stopped.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int execute_uring(struct core_object *co, struct state_object *so);
+
+/**
+ * setup_signal_handler
+ * @param sa sigaction struct to fill
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int setup_signal_handler(struct sigaction *sa, int signal);
+
+/**
+ * end_gogo_handler
+ * <p>
+ * Handler for signal. Set the running loop conditional to 0.
+ * </p>
+ * @param signal the signal received
+ */
+static void end_gogo_handler(int signal);
+
+/**
+ * get_sqe
+ * <p>
+ * Get a free submission queue entry. If the queue is full, submit it first.
+ * </p>
+ * @param so the state object
+ * @return the entry, or NULL and set errno on failure
+ */
+static struct io_uring_sqe *get_sqe(struct state_object *so);
+
+/**
+ * queue_accept
+ * <p>
+ * Queue a multishot accept on the listen socket. One request keeps producing a
+ * completion per accepted connection until the kernel drops it.
+ * </p>
+ * @param so the state object
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int queue_accept(struct state_object *so);
+
+/**
+ * probe_multishot_accept
+ * <p>
+ * Submit the accept queued on the listen socket right away. A kernel without multishot
+ * accept (before Linux 5.19) rejects it while it is submitted, so its completion is already
+ * there; a kernel with it only completes it once a client connects.
+ * </p>
+ * @param so the state object
+ * @return 0 when multishot accept is supported, -1 and set errno otherwise
+ */
+static int probe_multishot_accept(struct state_object *so);
+
+/**
+ * queue_poll
+ * <p>
+ * Queue a one-shot poll request on a client socket. It is armed again after the
+ * handler runs, so no poll request is in flight when the connection is closed.
+ * </p>
+ * @param so the state object
+ * @param fd the client fd
+ * @param mask POLLIN, or POLLOUT while the connection has output queued
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int queue_poll(struct state_object *so, int fd, unsigned mask);
+
+/**
+ * queue_wake
+ * <p>
+ * Queue a one-shot poll request on the wakeup. It is armed again after every completion.
+ * </p>
+ * @param so the state object
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int queue_wake(struct state_object *so);
+
+/**
+ * uring_accept
+ * <p>
+ * Handle an accept completion. Register the new connection and queue a poll on it. A failure
+ * that ends the multishot request queues the next one only when the accept retry expires.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param cqe the completion
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int uring_accept(struct core_object *co, struct state_object *so, const struct io_uring_cqe *cqe);
+
+/**
+ * uring_comm
+ * <p>
+ * Handle a poll completion. Call the pollin handler if the fd is readable, or the
+ * pollout handler if it is writable, and remove the connection on EOF, hang up or error.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param fd the client fd
+ * @param cqe the completion
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int uring_comm(struct core_object *co, struct state_object *so, int fd, const struct io_uring_cqe *cqe);
+
+/**
+ * uring_wake
+ * <p>
+ * Handle a completion on the wakeup. Call the wake handler on every connection posted to it,
+ * and remove it on EOF.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int uring_wake(struct core_object *co, struct state_object *so);
+
+/**
+ * uring_rearm
+ * <p>
+ * Rearm the deadline of a connection after a handler ran, and queue a poll for what it waits
+ * on now. A parked connection gets no poll until it is woken.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param fd the client fd
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int uring_rearm(struct core_object *co, struct state_object *so, int fd);
+
+/**
+ * uring_remove_connection
+ * <p>
+ * Close a connection.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param fd the client fd to close
+ */
+static void uring_remove_connection(struct core_object *co, struct state_object *so, int fd);
+
+/**
+ * uring_connection_expired
+ * <p>
+ * Let the handler answer a connection whose deadline has passed, then shut it down. Its
+ * poll request is in flight, so the socket is only shut down here; the hang up completes
+ * the poll and the connection is removed as usual. A parked connection has no poll in
+ * flight, and is removed right away. The accept retry expires here too, and queues an accept.
+ * </p>
+ * @param timer the timer of the connection
+ * @param arg the core object
+ */
+static void uring_connection_expired(struct timer *timer, void *arg);
+
+/**
+ * close_fd_report_undefined_error
+ * <p>
+ * Close a file descriptor and report an error which would make the file descriptor undefined.
+ * </p>
+ * @param fd the fd to close
+ * @param err_msg the error message to print
+ */
+static void close_fd_report_undefined_error(int fd, const char *err_msg);
+
+struct state_object *setup_uring_state(struct memory_manager *mm)
+{
+    struct state_object *so;
+    struct rlimit       limit;
+    int                 status;
+
+    so = (struct state_object *) Mmm_calloc(1, sizeof(struct state_object), mm);
+    if (!so)
+    {
+        return NULL;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+    {
+        return NULL;
+    }
+
+    so->max_fds   = (limit.rlim_cur == RLIM_INFINITY) ? URING_DEFAULT_MAX_FDS : (size_t) limit.rlim_cur;
+    so->connections = (struct connection *) Mmm_calloc(so->max_fds, sizeof(struct connection), mm);
+    if (!so->connections)
+    {
+        return NULL;
+    }
+    for (size_t fd = 0; fd < so->max_fds; ++fd)
+    {
+        so->connections[fd].fd = -1;
+    }
+    so->listen_fd = -1;
+    so->wakeup.fd = -1;
+
+    status = io_uring_queue_init(URING_QUEUE_DEPTH, &so->ring, 0);
+    if (status < 0)
+    {
+        errno = -status;
+        // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+        (void) fprintf(stderr, "Fatal: io_uring is not available on this kernel (%s). "
+                               "Run with --library pointing at libpoll-server or libepoll-server instead.\n",
+                       strerror(errno));
+        return NULL;
+    }
+    so->ring_initialized = true;
+
+    return so;
+}
+
+int open_uring_server_for_listen(struct core_object *co, struct state_object *so, struct sockaddr_in *listen_addr)
+{
+    int fd;
+
+    fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *) listen_addr, sizeof(struct sockaddr_in)) == -1)
+    {
+        (void) close(fd);
+        return -1;
+    }
+
+    if (listen_with_options(co, fd) == -1)
+    {
+        (void) close(fd);
+        return -1;
+    }
+
+    // Only assign if absolute success. -1 is used during teardown to determine whether there is a socket to close.
+    so->listen_fd = fd;
+
+    if (wakeup_init(&so->wakeup) == -1 || queue_wake(so) == -1 || queue_accept(so) == -1)
+    {
+        return -1;
+    }
+
+    return probe_multishot_accept(so);
+}
+
+int run_uring_server(struct core_object *co)
+{
+    if (access_log_start(co->access_log, co->log_file) == -1 || trace_start(co->trace) == -1)
+    {
+        return -1;
+    }
+    co->so->log_ring = access_log_register(co->access_log);
+
+    if (execute_uring(co, co->so) == -1)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int execute_uring(struct core_object *co, struct state_object *so)
+{
+    struct io_uring_cqe      *cqe;
+    struct sigaction         sigint;
+    struct __kernel_timespec wait_time;
+    unsigned                 head;
+    unsigned                 num_reaped;
+    int                      status;
+    int                      timeout;
+
+    if (setup_signal_handler(&sigint, SIGINT) == -1)
+    {
+        return -1;
+    }
+    if (setup_signal_handler(&sigint, SIGTERM) == -1)
+    {
+        return -1;
+    }
+
+    so->now_ms = monotonic_ms();
+    timer_wheel_init(&so->timers, so->now_ms);
+
+    while (GOGO_URING)
+    {
+        // One system call submits the accept and poll requests queued by the previous batch and waits for the next one.
+        timeout = timer_wheel_timeout(&so->timers, so->now_ms);
+        if (timeout != -1)
+        {
+            // Wake up by the next deadline; ETIME only means nothing completed.
+            wait_time.tv_sec  = timeout / MS_PER_SECOND;
+            wait_time.tv_nsec = (long long) (timeout % MS_PER_SECOND) * NS_PER_MS;
+            status = io_uring_submit_and_wait_timeout(&so->ring, &cqe, 1, &wait_time, NULL);
+            if (status == -ETIME)
+            {
+                status = 0;
+            }
+        } else
+        {
+            status = io_uring_submit_and_wait(&so->ring, 1);
+        }
+        if (status < 0)
+        {
+            errno = -status;
+            return (errno == EINTR) ? 0 : -1;
+        }
+        so->now_ms = monotonic_ms();
+
+        num_reaped = 0;
+        io_uring_for_each_cqe(&so->ring, head, cqe)
+        {
+            const enum uring_op op = (enum uring_op) (cqe->user_data & URING_OP_MASK);
+            const int           fd = (int) (cqe->user_data >> URING_OP_BITS);
+
+            ++num_reaped;
+            switch (op)
+            {
+                case URING_OP_ACCEPT:
+                {
+                    status = uring_accept(co, so, cqe);
+                    break;
+                }
+                case URING_OP_POLL:
+                {
+                    status = uring_comm(co, so, fd, cqe);
+                    break;
+                }
+                case URING_OP_WAKE:
+                {
+                    status = uring_wake(co, so);
+                    break;
+                }
+                default:
+                {
+                    status = 0;
+                }
+            }
+            if (status == -1)
+            {
+                io_uring_cq_advance(&so->ring, num_reaped);
+                return -1;
+            }
+        }
+        io_uring_cq_advance(&so->ring, num_reaped);
+
+        // After the events, so a connection that just became active has had its deadline moved.
+        timer_wheel_advance(&so->timers, so->now_ms, uring_connection_expired, co);
+    }
+
+    return 0;
+}
+
+static int setup_signal_handler(struct sigaction *sa, int signal)
+{
+    sigemptyset(&sa->sa_mask);
+    sa->sa_flags   = 0;
+    sa->sa_handler = end_gogo_handler;
+    if (sigaction(signal, sa, 0) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+static void end_gogo_handler(int signal)
+{
+    GOGO_URING = 0;
+}
+
+#pragma GCC diagnostic pop
+
+static struct io_uring_sqe *get_sqe(struct state_object *so)
+{
+    struct io_uring_sqe *sqe;
+    int                 status;
+
+    sqe = io_uring_get_sqe(&so->ring);
+    if (sqe == NULL)
+    {
+        status = io_uring_submit(&so->ring);
+        if (status < 0)
+        {
+            errno = -status;
+            return NULL;
+        }
+        sqe = io_uring_get_sqe(&so->ring);
+    }
+
+    return sqe;
+}
+
+static int queue_accept(struct state_object *so)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe(so);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    // Accepted sockets are non-blocking so handlers never block on them.
+    io_uring_prep_multishot_accept(sqe, so->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    io_uring_sqe_set_data64(sqe, ((uint64_t) so->listen_fd << URING_OP_BITS) | URING_OP_ACCEPT);
+
+    return 0;
+}
+
+static int probe_multishot_accept(struct state_object *so)
+{
+    struct io_uring_cqe *cqe;
+    int                 status;
+
+    status = io_uring_submit(&so->ring);
+    if (status < 0)
+    {
+        errno = -status;
+        return -1;
+    }
+
+    // Anything else that completed already is left for the loop.
+    if (io_uring_peek_cqe(&so->ring, &cqe) == 0 && cqe->res == -EINVAL &&
+        (cqe->user_data & URING_OP_MASK) == URING_OP_ACCEPT)
+    {
+        io_uring_cqe_seen(&so->ring, cqe);
+        // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+        (void) fprintf(stderr, "Fatal: this kernel does not support multishot accept. "
+                               "Run with --library pointing at libpoll-server or libepoll-server instead.\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int queue_poll(struct state_object *so, int fd, unsigned mask)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe(so);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    io_uring_prep_poll_add(sqe, fd, mask);
+    io_uring_sqe_set_data64(sqe, ((uint64_t) fd << URING_OP_BITS) | URING_OP_POLL);
+
+    return 0;
+}
+
+static int queue_wake(struct state_object *so)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe(so);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    io_uring_prep_poll_add(sqe, so->wakeup.fd, POLLIN);
+    io_uring_sqe_set_data64(sqe, ((uint64_t) so->wakeup.fd << URING_OP_BITS) | URING_OP_WAKE);
+
+    return 0;
+}
+
+static int uring_accept(struct core_object *co, struct state_object *so, const struct io_uring_cqe *cqe)
+{
+    const int new_cfd = cqe->res;
+    socklen_t addr_size;
+
+    if (new_cfd < 0)
+    {
+        switch (-new_cfd)
+        {
+            case ECONNABORTED:
+            case EMFILE: // Out of fds; the connections stay queued until the retry.
+            case ENFILE:
+            case ENOBUFS:
+            case ENOMEM:
+            case EINTR:
+            {
+                // A failure that ends the multishot request would fail again if requeued right away
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                {
+                    timer_wheel_add(&so->timers, &so->accept_retry, so->now_ms + ACCEPT_RETRY_MS);
+                }
+                return 0;
+            }
+            default:
+            {
+                errno = -new_cfd;
+                return -1;
+            }
+        }
+    }
+
+    // The multishot request also ends when the kernel runs out of resources; start another one.
+    if (!(cqe->flags & IORING_CQE_F_MORE) && queue_accept(so) == -1)
+    {
+        close_fd_report_undefined_error(new_cfd, "state of client socket is undefined.");
+        return -1;
+    }
+
+    if ((size_t) new_cfd >= so->max_fds)
+    {
+        close_fd_report_undefined_error(new_cfd, "state of client socket is undefined.");
+        return 0;
+    }
+
+    if (queue_poll(so, new_cfd, POLLIN) == -1)
+    {
+        close_fd_report_undefined_error(new_cfd, "state of client socket is undefined.");
+        return -1;
+    }
+    // The multishot accept does not return the client address, which only the access log needs.
+    addr_size = sizeof(so->connections[new_cfd].addr);
+    if (getpeername(new_cfd, (struct sockaddr *) &so->connections[new_cfd].addr, &addr_size) == -1)
+    {
+        memset(&so->connections[new_cfd].addr, 0, sizeof(so->connections[new_cfd].addr));
+    }
+    so->connections[new_cfd].fd     = new_cfd;
+    so->connections[new_cfd].data   = NULL;
+    so->connections[new_cfd].parked = false;
+    so->connections[new_cfd].wakeup = co->wake_handler ? &so->wakeup : NULL;
+    connection_deadline_start(&so->timers, co, &so->connections[new_cfd], so->now_ms);
+    access_log_accept(co->access_log, &so->connections[new_cfd]);
+    ++so->num_connections;
+
+    return 0;
+}
+
+static int uring_comm(struct core_object *co, struct state_object *so, int fd, const struct io_uring_cqe *cqe)
+{
+    bool remove_connection = cqe->res < 0;
+
+    if (!remove_connection && (cqe->res & (POLLIN | POLLOUT)))
+    {
+        const enum pollin_handle_result result = (cqe->res & POLLOUT) ? co->pollout_handler(co, so, &so->connections[fd])
+                                                                      : co->pollin_handler(co, so, &so->connections[fd]);
+        if (result == POLLIN_HANDLE_RESULT_FATAL)
+        {
+            return -1;
+        }
+        remove_connection = result == POLLIN_HANDLE_RESULT_EOF;
+    }
+    if (remove_connection || (cqe->res & (POLLHUP | POLLERR)))
+    {
+        uring_remove_connection(co, so, fd);
+        return 0;
+    }
+
+    return uring_rearm(co, so, fd);
+}
+
+static int uring_wake(struct core_object *co, struct state_object *so)
+{
+    struct connection *conn;
+
+    // Cleared first, so a post made while the connections are handled completes the next poll
+    wakeup_clear(&so->wakeup);
+    if (queue_wake(so) == -1)
+    {
+        return -1;
+    }
+    while ((conn = wakeup_take(&so->wakeup)) != NULL)
+    {
+        const int                       fd     = conn->fd;
+        const enum pollin_handle_result result = co->wake_handler(co, so, conn);
+
+        if (result == POLLIN_HANDLE_RESULT_FATAL)
+        {
+            return -1;
+        }
+        // The connection was parked, so no poll request of its own is in flight
+        if (result == POLLIN_HANDLE_RESULT_EOF)
+        {
+            uring_remove_connection(co, so, fd);
+        } else if (uring_rearm(co, so, fd) == -1)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int uring_rearm(struct core_object *co, struct state_object *so, int fd)
+{
+    connection_deadline_update(&so->timers, co, &so->connections[fd], so->now_ms);
+    if (so->connections[fd].parked)
+    {
+        return 0;
+    }
+
+    // Only one of the two at a time: a connection with output queued reads no more requests
+    return queue_poll(so, fd, so->connections[fd].want_write ? POLLOUT : POLLIN);
+}
+
+static void uring_remove_connection(struct core_object *co, struct state_object *so, int fd)
+{
+    // Let the handler release its per-connection state, then close the fd
+    if (co->close_handler)
+    {
+        co->close_handler(co, &so->connections[fd]);
+    }
+    if (so->connections[fd].wakeup)
+    {
+        wakeup_cancel(so->connections[fd].wakeup, &so->connections[fd]);
+    }
+    close_fd_report_undefined_error(fd, "state of client socket is undefined.");
+    (void) access_log_close(so->log_ring, &so->connections[fd]);
+    timer_wheel_cancel(&so->timers, &so->connections[fd].timer);
+
+    so->connections[fd].fd   = -1;
+    so->connections[fd].data = NULL;
+    --so->num_connections;
+}
+
+static void uring_connection_expired(struct timer *timer, void *arg)
+{
+    struct core_object  *co = (struct core_object *) arg;
+    struct state_object *so = co->so;
+    struct connection   *conn;
+
+    if (timer == &so->accept_retry)
+    {
+        if (queue_accept(so) == -1)
+        {
+            timer_wheel_add(&so->timers, &so->accept_retry, so->now_ms + ACCEPT_RETRY_MS);
+        }
+        return;
+    }
+
+    conn = (struct connection *) (void *) ((char *) timer - offsetof(struct connection, timer));
+    if (co->timeout_handler)
+    {
+        co->timeout_handler(co, conn);
+    }
+    if (conn->parked)
+    {
+        uring_remove_connection(co, so, conn->fd);
+        return;
+    }
+    (void) shutdown(conn->fd, SHUT_RDWR);
+}
+
+void destroy_uring_state(struct core_object *co, struct state_object *so)
+{
+    if (so->ring_initialized)
+    {
+        io_uring_queue_exit(&so->ring);
+        so->ring_initialized = false;
+    }
+    if (so->listen_fd != -1)
+    {
+        close_fd_report_undefined_error(so->listen_fd, "state of listen socket is undefined.");
+    }
+
+    for (size_t fd = 0; fd < so->max_fds && so->num_connections > 0; ++fd)
+    {
+        if (so->connections[fd].fd != -1)
+        {
+            uring_remove_connection(co, so, (int) fd);
+        }
+    }
+
+    // After the close handler, which stops other threads from posting the connections
+    if (so->wakeup.fd != -1)
+    {
+        wakeup_destroy(&so->wakeup);
+        so->wakeup.fd = -1;
+    }
+}
+
+static void close_fd_report_undefined_error(int fd, const char *err_msg)
+{
+    if (close(fd) == -1)
+    {
+        switch (errno)
+        {
+            case EBADF: // Not a problem.
+            {
+                errno = 0;
+                break;
+            }
+            default:
+            {
+                // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                (void) fprintf(stderr, "Error: %s; %s\n", strerror(errno), err_msg);
+            }
+        }
+    }
+}